@@ -0,0 +1,140 @@
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "trace.h"
+#include "arena.h"
+
+
+struct arena_blk_t {
+  struct arena_blk_t* next;
+  size_t used;
+  size_t cap;
+  void* adopted;    // malloc'd memory handed to us, or NULL
+  intptr_t data[];  // keeps what we hand out pointer-aligned
+};
+
+#define ARENA_ALIGN (sizeof(intptr_t))
+
+
+struct arena_t* arena_alloc(size_t blksize)
+{
+  TRACE_ENTER;
+  struct arena_t* a = (struct arena_t*)malloc(sizeof(struct arena_t));
+  arena_init(a, blksize);
+  TRACE_RETURN(a);
+}
+
+
+void arena_init(struct arena_t* a, size_t blksize)
+{
+  TRACE_ENTER;
+  a->blks = NULL;
+  a->blksize = blksize;
+  TRACE_EXIT;
+}
+
+
+void arena_free(struct arena_t* a)
+{
+  TRACE_ENTER;
+  arena_destroy(a);
+  free(a);
+  TRACE_EXIT;
+}
+
+
+void arena_destroy(struct arena_t* a)
+{
+  TRACE_ENTER;
+  while (a->blks != NULL) {
+    struct arena_blk_t* next = a->blks->next;
+    free(a->blks->adopted);
+    free(a->blks);
+    a->blks = next;
+  }
+  TRACE_EXIT;
+}
+
+
+void* arena_get(struct arena_t* a, size_t n)
+{
+  TRACE_ENTER;
+  n = (n + ARENA_ALIGN - 1) & ~(ARENA_ALIGN - 1);
+  struct arena_blk_t* blk = a->blks;
+  if (blk == NULL || blk->cap - blk->used < n) {
+    size_t cap = n > a->blksize ? n : a->blksize;
+    blk = (struct arena_blk_t*)malloc(sizeof(struct arena_blk_t) + cap);
+    blk->used = 0;
+    blk->cap = cap;
+    blk->adopted = NULL;
+    // An oversized block goes behind the current one, so what's left
+    // of the current one can still be used.
+    if (n > a->blksize && a->blks != NULL) {
+      blk->next = a->blks->next;
+      a->blks->next = blk;
+    }
+    else {
+      blk->next = a->blks;
+      a->blks = blk;
+    }
+  }
+  void* p = (char*)blk->data + blk->used;
+  blk->used += n;
+  TRACE_RETURN(p);
+}
+
+
+char* arena_strsave(struct arena_t* a, const char* s)
+{
+  TRACE_ENTER;
+  size_t n = strlen(s) + 1;
+  char* p = (char*)arena_get(a, n);
+  memcpy(p, s, n);
+  TRACE_RETURN(p);
+}
+
+
+// Makes memory from malloc part of the arena, to be freed with the
+// rest of it.  Nothing more is handed out of it.
+void arena_adopt(struct arena_t* a, void* p)
+{
+  TRACE_ENTER;
+  struct arena_blk_t* blk = (struct arena_blk_t*)malloc(sizeof(struct arena_blk_t));
+  blk->used = 0;
+  blk->cap = 0;
+  blk->adopted = p;
+  // behind the current block, which may still have room
+  if (a->blks != NULL) {
+    blk->next = a->blks->next;
+    a->blks->next = blk;
+  }
+  else {
+    blk->next = NULL;
+    a->blks = blk;
+  }
+  TRACE_EXIT;
+}
+
+
+// Moves all of src's memory into dst, leaving src empty.  Anything
+// handed out of either stays where it is.
+void arena_merge(struct arena_t* dst, struct arena_t* src)
+{
+  TRACE_ENTER;
+  if (src->blks == NULL)
+    TRACE_EXIT;
+  struct arena_blk_t* last = src->blks;
+  while (last->next != NULL)
+    last = last->next;
+  // behind dst's current block, which may still have room
+  if (dst->blks != NULL) {
+    last->next = dst->blks->next;
+    dst->blks->next = src->blks;
+  }
+  else {
+    dst->blks = src->blks;
+  }
+  src->blks = NULL;
+  TRACE_EXIT;
+}
@@ -0,0 +1,23 @@
+//
+// An arena hands out memory from a few large blocks and gives it all
+// back at once, for lots of small things that live and die together,
+// like the tokens of a parsed command line.  Nothing is allocated
+// until the first request, and a request too big for a block gets a
+// block of its own.
+//
+struct arena_blk_t;
+
+struct arena_t {
+  struct arena_blk_t* blks;
+  size_t blksize;
+};
+typedef struct arena_t arena;
+
+struct arena_t* arena_alloc(size_t blksize);
+void arena_init(struct arena_t* a, size_t blksize);
+void arena_free(struct arena_t* a);
+void arena_destroy(struct arena_t* a);
+void* arena_get(struct arena_t* a, size_t n);
+char* arena_strsave(struct arena_t* a, const char* s);
+void arena_adopt(struct arena_t* a, void* p);
+void arena_merge(struct arena_t* dst, struct arena_t* src);
@@ -0,0 +1,290 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <limits.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+
+#include "trace.h"
+#include "logging.h"
+#include "poe_err.h"
+#include "utils.h"
+#include "vec.h"
+#include "cstr.h"
+#include "arena.h"
+#include "bufid.h"
+#include "tabstops.h"
+#include "margins.h"
+#include "mark.h"
+#include "markstack.h"
+#include "key_interp.h"
+#include "buffer.h"
+#include "journal.h"
+#include "view.h"
+#include "window.h"
+#include "commands.h"
+#include "cmd_interp.h"
+#include "parser.h"
+#include "workpool.h"
+#include "editor_globals.h"
+#include "batch.h"
+
+
+// One parsed line of the script
+struct batchcmd_t {
+  int lineno;
+  pivec tokens;
+};
+
+// A file whose worker died before it got through it
+#define BATCH_UNFINISHED (-1)
+
+
+POE_ERR _batch_parse_script(const char* scriptname, vec* cmds, arena* strs);
+void _batch_free_script(vec* cmds, arena* strs);
+void _batch_worker(const char* scriptname, const vec* cmds, const char* dirname,
+                   const pivec* files, int* shared);
+POE_ERR _batch_file(const char* scriptname, const vec* cmds, const char* dirname, cstr* filename);
+void _batch_close_files(void);
+
+
+int batch_run(const char* scriptname, const pivec* files, int njobs)
+{
+  TRACE_ENTER;
+  vec cmds;
+  arena strs;
+  vec_init(&cmds, 16, sizeof(struct batchcmd_t));
+  arena_init(&strs, 4096);
+  POE_ERR err = _batch_parse_script(scriptname, &cmds, &strs);
+  if (err != POE_ERR_OK) {
+    _batch_free_script(&cmds, &strs);
+    TRACE_RETURN(err);
+  }
+
+  // Loading a file moves us to its directory, so relative names have
+  // to be looked up from where we started.
+  char dirname[PATH_MAX+1];
+  if (getcwd(dirname, sizeof(dirname)) == NULL) {
+    fprintf(stderr, "pe: can't get the current directory\n");
+    _batch_free_script(&cmds, &strs);
+    TRACE_RETURN(POE_ERR_FILE_NOT_FOUND);
+  }
+
+  // shared[0] is the next file nobody has claimed, shared[i+1] the
+  // result for file i.
+  int i, nfiles = pivec_count(files);
+  size_t shared_len = (nfiles+1) * sizeof(int);
+  int* shared = (int*)mmap(NULL, shared_len, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_ANON, -1, 0);
+  if (shared == MAP_FAILED) {
+    fprintf(stderr, "pe: can't map memory for the batch workers\n");
+    _batch_free_script(&cmds, &strs);
+    TRACE_RETURN(POE_ERR_MEM_FULL);
+  }
+  shared[0] = 0;
+  for (i = 0; i < nfiles; i++)
+    shared[i+1] = BATCH_UNFINISHED;
+
+  // Start from a clean slate, with nothing but the files on view.
+  _batch_close_files();
+
+  int died = 0;
+  if (njobs <= 0)
+    njobs = (int)sysconf(_SC_NPROCESSORS_ONLN);
+  njobs = max(1, min(njobs, nfiles));
+  if (njobs == 1) {
+    _batch_worker(scriptname, &cmds, dirname, files, shared);
+  }
+  else {
+    // Every process is already busy with a file of its own, so don't
+    // let searches split themselves across threads too.
+    fflush(stdout);
+    fflush(stderr);
+    int started = 0;
+    for (i = 0; i < njobs; i++) {
+      pid_t pid = fork();
+      if (pid == 0) {
+        init_workpool(1);
+        _batch_worker(scriptname, &cmds, dirname, files, shared);
+        _exit(0);
+      }
+      if (pid < 0) {
+        logerr("batch: only started %d of %d workers", started, njobs);
+        break;
+      }
+      ++started;
+    }
+    if (started == 0)
+      _batch_worker(scriptname, &cmds, dirname, files, shared);
+    while (started > 0) {
+      int status;
+      if (wait(&status) < 0)
+        break;
+      --started;
+      if (WIFSIGNALED(status))
+        died = 128 + WTERMSIG(status);
+      else if (WIFEXITED(status) && WEXITSTATUS(status) != 0)
+        died = WEXITSTATUS(status);
+    }
+  }
+
+  // Report the first failure in the order the files were given.
+  int rc = 0;
+  for (i = 0; i < nfiles; i++) {
+    int result = shared[i+1];
+    if (result == BATCH_UNFINISHED) {
+      cstr* filename = (cstr*)pivec_get(files, i);
+      fprintf(stderr, "pe: %s: not finished\n", cstr_getbufptr(filename));
+      result = died != 0 ? died : 1;
+    }
+    if (rc == 0)
+      rc = result;
+  }
+
+  munmap(shared, shared_len);
+  _batch_free_script(&cmds, &strs);
+  TRACE_RETURN(rc);
+}
+
+
+// Parses every command in the script, so a typo is caught before any
+// file has been touched.
+POE_ERR _batch_parse_script(const char* scriptname, vec* cmds, arena* strs)
+{
+  TRACE_ENTER;
+  FILE* f = fopen(scriptname, "r");
+  if (f == NULL) {
+    fprintf(stderr, "pe: %s: %s\n", scriptname, poe_err_message(POE_ERR_CMD_FILE_NOT_FOUND));
+    TRACE_RETURN(POE_ERR_CMD_FILE_NOT_FOUND);
+  }
+
+  POE_ERR err = POE_ERR_OK;
+  char* line = NULL;
+  size_t linecap = 0;
+  ssize_t len;
+  int lineno = 0;
+  cstr text;
+  cstr_init(&text, 256);
+  while (err == POE_ERR_OK && (len = getline(&line, &linecap, f)) >= 0) {
+    ++lineno;
+    while (len > 0 && (line[len-1] == '\n' || line[len-1] == '\r'))
+      --len;
+    cstr_assignstrn(&text, line, len);
+    cstr_trimleft(&text, poe_iswhitespace);
+    cstr_trimright(&text, poe_iswhitespace);
+    if (cstr_count(&text) == 0 || cstr_get(&text, 0) == '#')
+      continue;
+
+    struct batchcmd_t cmd;
+    cmd.lineno = lineno;
+    pivec_init(&cmd.tokens, 10);
+    int parse_pos = 0;
+    err = parse_cmdline(&text, &cmd.tokens, &parse_pos, strs);
+    if (err != POE_ERR_OK) {
+      fprintf(stderr, "pe: %s:%d:%d: %s\n", scriptname, lineno, parse_pos+1, poe_err_message(err));
+      pivec_destroy(&cmd.tokens);
+      break;
+    }
+    pivec_append(&cmd.tokens, CMD_SEP);
+    pivec_append(&cmd.tokens, CMD_NULL);
+    vec_append(cmds, &cmd);
+  }
+  cstr_destroy(&text);
+  free(line);
+  fclose(f);
+  TRACE_RETURN(err);
+}
+
+
+void _batch_free_script(vec* cmds, arena* strs)
+{
+  TRACE_ENTER;
+  int i, n = vec_count(cmds);
+  for (i = 0; i < n; i++) {
+    struct batchcmd_t* cmd = (struct batchcmd_t*)vec_get(cmds, i);
+    pivec_destroy(&cmd->tokens);
+  }
+  vec_destroy(cmds);
+  arena_destroy(strs);
+  TRACE_EXIT;
+}
+
+
+// Claims files one at a time until there are none left.
+void _batch_worker(const char* scriptname, const vec* cmds, const char* dirname,
+                   const pivec* files, int* shared)
+{
+  TRACE_ENTER;
+  int nfiles = pivec_count(files);
+  int i;
+  while ((i = __atomic_fetch_add(&shared[0], 1, __ATOMIC_RELAXED)) < nfiles) {
+    cstr* filename = (cstr*)pivec_get(files, i);
+    shared[i+1] = _batch_file(scriptname, cmds, dirname, filename);
+  }
+  TRACE_EXIT;
+}
+
+
+// Loads one file and runs the script against it, stopping at the
+// first command that fails.
+POE_ERR _batch_file(const char* scriptname, const vec* cmds, const char* dirname, cstr* filename)
+{
+  TRACE_ENTER;
+  chdir(dirname);
+  BUFFER buf = buffer_alloc("", BUF_FLG_VISIBLE, 0, default_profile);
+  POE_ERR err = buffer_load(buf, filename, default_profile->tabexpand);
+  if (err != POE_ERR_OK) {
+    fprintf(stderr, "pe: %s: %s\n", cstr_getbufptr(filename), poe_err_message(err));
+    buffer_free(buf);
+    TRACE_RETURN(err);
+  }
+  wins_cur_switchbuffer(buf);
+
+  int i, n = vec_count(cmds);
+  for (i = 0; i < n && err == POE_ERR_OK; i++) {
+    const struct batchcmd_t* cmd = (const struct batchcmd_t*)vec_get(cmds, i);
+    // each line of the script is undone on its own, as if typed
+    markstack_cur_seal();
+    journal_next_group();
+    cmd_error = POE_ERR_OK;
+    cmd_ctx ctx;
+    ctx.src_is_commandline = true;
+    ctx.save_commandline = false;
+    update_context(&ctx);
+    ctx.cmdseq = &cmd->tokens;
+    ctx.pc = 0;
+    err = interpret_command_seq(&ctx);
+    if (err != POE_ERR_OK) {
+      fprintf(stderr, "pe: %s: %s:%d: %s\n", cstr_getbufptr(filename),
+              scriptname, cmd->lineno, poe_err_message(err));
+    }
+    // Nothing left to work on once the script has quit the file.
+    if (visible_buffers_count() == 0)
+      break;
+  }
+
+  _batch_close_files();
+  TRACE_RETURN(err);
+}
+
+
+// Throws away whatever the script left open, without saving it.
+void _batch_close_files(void)
+{
+  TRACE_ENTER;
+  while (visible_buffers_count() > 0) {
+    BUFFER buf = buffers_next(BUFFER_NULL);
+    if (buffer_tstflags(buf, BUF_FLG_INTERNAL)) {
+      buffer_clrflags(buf, BUF_FLG_VISIBLE);
+      wins_hidebuffer(buf);
+    }
+    else {
+      wins_hidebuffer(buf);
+      buffer_free(buf);
+    }
+  }
+  TRACE_EXIT;
+}
@@ -0,0 +1,12 @@
+//
+// Batch mode runs a file of commands against each of a list of files,
+// with no screen or keyboard, as if each line had been typed on the
+// command line.  The script is parsed once up front.  The files are
+// shared out among a number of worker processes, each of which takes
+// the next unclaimed file as it finishes the last one.  njobs of 0
+// starts one worker per cpu.
+//
+// The exit status is the error code of the first file, in the order
+// given, whose script failed; zero if they all ran cleanly.
+//
+int batch_run(const char* scriptname, const struct pivec_t* files, int njobs);
@@ -18,6 +18,14 @@
 #include <unistd.h>
 #include <dirent.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#if defined(__linux__)
+#include <sys/xattr.h>
+#endif
 
 #include "trace.h"
 #include "logging.h"
@@ -25,6 +33,7 @@
 #include "poe_exit.h"
 #include "utils.h"
 #include "vec.h"
+#include "arena.h"
 #include "cstr.h"
 #include "bufid.h"
 #include "tabstops.h"
@@ -33,6 +42,12 @@
 #include "markstack.h"
 #include "key_interp.h"
 #include "buffer.h"
+#include "linetree.h"
+#include "srchpat.h"
+#include "rx.h"
+#include "workpool.h"
+#include "journal.h"
+#include "events.h"
 #include "editor_globals.h"
 
 
@@ -41,10 +56,104 @@
 
 #define LINE_INITIAL_FLAGS (0|LINE_FLG_VISIBLE)
 
+// Lines whose text belongs to the buffer rather than to the line
+#define LINE_FLG_BORROWED (LINE_FLG_MAPPED|LINE_FLG_POOLED)
+
+// Most of a loaded file's text is the block it was read into, so the
+// blocks for everything else can be small.
+#define LINE_TEXT_BLKSIZE (16*1024)
+
+// Lines are added to the buffer this many at a time
+#define LOAD_BATCH_LINES (4096)
+
+// Files this big are read by a thread of their own, so the first
+// screenful can be shown while the rest is still coming in.  The
+// first read is small so it comes back quickly; after that they
+// double up to the most a chunk will hold.
+#define LOAD_ASYNC_MIN   (4*1024*1024)
+#define LOAD_CHUNK_FIRST (64*1024)
+#define LOAD_CHUNK_MAX   (8*1024*1024)
+// Most lines added to the buffer between looks at the keyboard
+#define LOAD_POLL_LINES  (32*1024)
+// Files loaded together are split into lines up front if they're no
+// bigger than this, so their lines don't all have to be held at once
+#define LOAD_SPLIT_MAX   (64*1024*1024)
+// Most file mappings open at once; files past that are read instead
+#define MAP_GUARD_MAX    (64)
+
+// A piece of the file the loader thread has split into lines, waiting
+// for the main thread to add it to the buffer.
+struct loadchunk_t {
+  struct loadchunk_t* next;
+  char* data;         // block the borrowed lines point into, or NULL
+  arena text;         // text of the lines that couldn't borrow
+  vec lines;          // struct line_t
+  int taken;          // lines the buffer has taken so far
+  int64_t end;        // offset in the file just past the last line
+};
+
+// Only the main thread touches the buffer.  The thread reads the file
+// and queues up chunks, and the main thread adds them when it's idle.
+struct loader_t {
+  pthread_t thread;
+  FILE* f;
+  int64_t size;       // of the file when the load started
+  bool tabexpand;
+  tabstops tabs;
+  // the rest is shared, under lock
+  pthread_mutex_t lock;
+  pthread_cond_t ready;
+  struct loadchunk_t* head;
+  struct loadchunk_t** tail;
+  bool stop, done;
+  POE_ERR err;
+  // chunks the main thread is part way through, and how much of the
+  // file it has taken
+  struct loadchunk_t* pending;
+  int64_t taken;
+};
+
+// One file being loaded by buffer_load or buffers_load_many.  The
+// reading and splitting can happen on a worker, but only the main
+// thread touches the buffer.
+struct loadfile_t {
+  cstr name;          // as given, with ~ expanded
+  char path[PATH_MAX+1];
+  bool found;         // path is good
+  bool opened;
+  bool want_map;
+  bool split;         // split into lines while reading
+  bool tabexpand;
+  tabstops tabs;
+  FILE* f;            // still open for a loader thread, or NULL
+  int open_errno;
+  int read_errno;
+  int flg_rdonly;
+  char* data;
+  size_t datalen;
+  bool mapped;
+  bool split_done;
+  arena text;
+  vec lines;          // struct line_t
+  int nborrowed;
+};
+
+struct loadmany_t {
+  struct loadfile_t* files;
+  int n;
+  int next;           // next file nobody has claimed
+};
+
+enum loadwait_t {
+  LOADWAIT_NONE,
+  LOADWAIT_FIRST,     // until there's something to show
+  LOADWAIT_DONE,      // until the thread has finished
+};
+
 struct buffer_t {
   int _sig;
   int bufnum;
-  struct vec_t lines;
+  struct linetree_t lines;
   int flags;
   cstr orig_filename;
   cstr curr_filename;
@@ -60,6 +169,17 @@ struct buffer_t {
   int longest_line;
   // key -> command map
   PROFILEPTR profile;
+  // private mapping of the file that LINE_FLG_MAPPED lines point into
+  char* map;
+  size_t maplen;
+  // text of the LINE_FLG_POOLED lines, freed all at once
+  arena text;
+  // lines changed since the screen was last painted
+  int dmg_first, dmg_last;
+  // undo/redo log, allocated on the first edit
+  struct journal_t* journal;
+  // reads the rest of the file, while it's still loading
+  struct loader_t* loader;
 };
 
 
@@ -80,23 +200,129 @@ bool _buffer_wrap_single_line(BUFFER buf, int row, int leftmargin, int rightmarg
 cstr _buffer_make_unique_name(cstr* name);
 int _buffer_name_exists(cstr* name);
 void _buffer_updatefilename(BUFFER buf);
+void _buffer_release_text(BUFFER buf);
+int _buffer_appendline_nocopy(BUFFER buf, struct line_t* a);
+bool _buffer_load_start(BUFFER buf, FILE* f, bool tabexpand);
+bool _buffer_load_take(BUFFER buf, enum loadwait_t wait, int maxlines);
+void _buffer_load_end(BUFFER buf);
+void* __loader_main(void* arg);
+void __loadchunk_free(struct loadchunk_t* chunk);
+void __loadfile_init(struct loadfile_t* lf, BUFFER buf, cstr* filename, bool tabexpand, bool split);
+void __loadfile_destroy(struct loadfile_t* lf);
+void __loadfile_read(struct loadfile_t* lf);
+void __loadfile_readdata(struct loadfile_t* lf);
+POE_ERR __loadfile_attach(BUFFER buf, struct loadfile_t* lf);
+void __loadmany_job(void* arg, int worker);
+bool __map_guard_add(char* base, size_t len);
+void __map_guard_remove(char* base);
+void __map_guard_sigbus(int sig, siginfo_t* si, void* ctx);
 
 struct line_t* _line(BUFFER buf, int line);
+struct line_t* _wline(BUFFER buf, int line);
+void _buffer_damage(BUFFER buf, int first, int last);
+struct journal_t* _buffer_journal(BUFFER buf);
 void __check_line_exists(const char* dbgname, BUFFER buf, int line);
 void __check_line_col_exists(const char* dbgname, BUFFER buf, int line, int col);
 void __check_line_lim(const char* dbgname, BUFFER buf, int line);
 void __check_lines_exist(const char* dbgname, BUFFER buf, int startline, int nlines);
 int __find_buffer(BUFFER buf);
 
+void _buffer_damage(BUFFER buf, int first, int last)
+{
+  TRACE_ENTER;
+  buf->dmg_first = min(buf->dmg_first, first);
+  buf->dmg_last = max(buf->dmg_last, last);
+  TRACE_EXIT;
+}
+
+
 void _expand_to_line(BUFFER buf, int line);
 void _expand_to_col(BUFFER buf, int line, int col);
 
 
+// Text of up to this many chars lives in the line descriptor, with
+// its NUL, instead of on the heap.
+#define LINE_INLINE_MAX ((int)sizeof(char*) - 1)
+
+#define LINE_HEAP_MINCAP 16
+
+
+bool __line_isinline(const struct line_t* l)
+{
+  TRACE_ENTER;
+  bool rval = !(l->flags & LINE_FLG_BORROWED) && l->ct <= LINE_INLINE_MAX;
+  TRACE_RETURN(rval);
+}
+
+
+char* __line_text(struct line_t* l)
+{
+  TRACE_ENTER;
+  char* rval = __line_isinline(l) ? l->u.inl : l->u.s;
+  TRACE_RETURN(rval);
+}
+
+
+// Owned heap text is always allocated to the next power of two, so
+// its capacity needn't be stored.
+int __line_heapcap(int n)
+{
+  TRACE_ENTER;
+  int cap = LINE_HEAP_MINCAP;
+  while (cap < n+1)
+    cap <<= 1;
+  TRACE_RETURN(cap);
+}
+
+
 void __line_init(struct line_t* l)
 {
   TRACE_ENTER;
-  cstr_init(&l->txt, 1);
+  l->u.inl[0] = '\0';
+  l->ct = 0;
+  l->flags = LINE_INITIAL_FLAGS;
+  l->expanded = 0;
+  TRACE_EXIT;
+}
+
+
+void __line_initstrn(struct line_t* l, const char* s, int n)
+{
+  TRACE_ENTER;
+  l->ct = n;
   l->flags = LINE_INITIAL_FLAGS;
+  l->expanded = 0;
+  char* t = l->u.inl;
+  if (n > LINE_INLINE_MAX)
+    t = l->u.s = malloc(__line_heapcap(n));
+  memcpy(t, s, n);
+  t[n] = '\0';
+  TRACE_EXIT;
+}
+
+
+// A mapped line borrows its text from the buffer's file mapping.
+// The text is not owned, and is only NUL terminated on demand.
+void __line_initmapped(struct line_t* l, char* s, int n)
+{
+  TRACE_ENTER;
+  l->u.s = s;
+  l->ct = n;
+  l->flags = LINE_INITIAL_FLAGS | LINE_FLG_MAPPED;
+  l->expanded = 0;
+  TRACE_EXIT;
+}
+
+
+// A pooled line's text was allocated from the buffer's arena, and is
+// already NUL terminated.
+void __line_initpooled(struct line_t* l, char* s, int n)
+{
+  TRACE_ENTER;
+  l->u.s = s;
+  l->ct = n;
+  l->flags = LINE_INITIAL_FLAGS | LINE_FLG_POOLED;
+  l->expanded = 0;
   TRACE_EXIT;
 }
 
@@ -104,8 +330,23 @@ void __line_init(struct line_t* l)
 void __line_initfrom(struct line_t* l, struct line_t* src)
 {
   TRACE_ENTER;
-  cstr_initfrom(&l->txt, &src->txt);
-  l->flags = src->flags;
+  __line_initstrn(l, __line_text(src), src->ct);
+  l->flags = src->flags & ~LINE_FLG_BORROWED;
+  TRACE_EXIT;
+}
+
+
+// Copy a mapped or pooled line's text into the line itself, so it can
+// be edited.
+void __line_own(struct line_t* l)
+{
+  TRACE_ENTER;
+  if (l->flags & LINE_FLG_BORROWED) {
+    struct line_t tmp;
+    __line_initfrom(&tmp, l);
+    tmp.expanded = l->expanded;
+    *l = tmp;
+  }
   TRACE_EXIT;
 }
 
@@ -113,12 +354,123 @@ void __line_initfrom(struct line_t* l, struct line_t* src)
 void __line_destroy(struct line_t* l)
 {
   TRACE_ENTER;
-  cstr_destroy(&l->txt);
-  l->flags = LINE_INITIAL_FLAGS;
+  if (!(l->flags & LINE_FLG_BORROWED) && l->ct > LINE_INLINE_MAX)
+    free(l->u.s);
+  __line_init(l);
   TRACE_EXIT;
 }
 
 
+// Replaces ndel chars at col of an owned line with a gap of nins
+// chars, moving the text in or out of the descriptor as its length
+// crosses LINE_INLINE_MAX, and returns the gap.  The text stays NUL
+// terminated.
+char* __line_splice(struct line_t* l, int col, int ndel, int nins)
+{
+  TRACE_ENTER;
+  int oldct = l->ct, newct = oldct - ndel + nins;
+  int tail = oldct - col - ndel;
+  char* old = __line_text(l);
+  char* t;
+  if (newct <= LINE_INLINE_MAX) {
+    if (oldct <= LINE_INLINE_MAX) {
+      t = l->u.inl;
+      memmove(t+col+nins, t+col+ndel, tail);
+    }
+    else {
+      char tmp[LINE_INLINE_MAX+1];
+      memcpy(tmp, old, col);
+      memcpy(tmp+col+nins, old+col+ndel, tail);
+      free(old);
+      t = l->u.inl;
+      memcpy(t, tmp, newct);
+    }
+  }
+  else if (oldct <= LINE_INLINE_MAX) {
+    t = malloc(__line_heapcap(newct));
+    memcpy(t, old, col);
+    memcpy(t+col+nins, old+col+ndel, tail);
+    l->u.s = t;
+  }
+  else {
+    t = old;
+    int oldcap = __line_heapcap(oldct), newcap = __line_heapcap(newct);
+    if (newcap > oldcap)
+      t = realloc(t, newcap);
+    memmove(t+col+nins, t+col+ndel, tail);
+    if (newcap < oldcap)
+      t = realloc(t, newcap);
+    l->u.s = t;
+  }
+  l->ct = newct;
+  t[newct] = '\0';
+  TRACE_RETURN(t+col);
+}
+
+
+// Whether s points into the line's own text.
+bool __line_holds(struct line_t* l, const char* s)
+{
+  TRACE_ENTER;
+  const char* t = __line_text(l);
+  bool rval = s >= t && s <= t + l->ct;
+  TRACE_RETURN(rval);
+}
+
+
+// public, for lines built outside of a buffer
+
+void line_initstr(struct line_t* l, const char* s)
+{
+  TRACE_ENTER;
+  __line_initstrn(l, s, strlen(s));
+  TRACE_EXIT;
+}
+
+
+void line_initstrn(struct line_t* l, const char* s, int n)
+{
+  TRACE_ENTER;
+  __line_initstrn(l, s, n);
+  TRACE_EXIT;
+}
+
+
+void line_assignstr(struct line_t* l, const char* s)
+{
+  TRACE_ENTER;
+  int n = strlen(s);
+  memcpy(__line_splice(l, 0, l->ct, n), s, n);
+  TRACE_EXIT;
+}
+
+
+void line_destroy(struct line_t* l)
+{
+  TRACE_ENTER;
+  __line_destroy(l);
+  TRACE_EXIT;
+}
+
+
+int line_count(const struct line_t* l)
+{
+  TRACE_ENTER;
+  TRACE_RETURN(l->ct);
+}
+
+
+// Bytes of heap the line's text takes, beyond its descriptor.
+size_t line_heapsize(const struct line_t* l)
+{
+  TRACE_ENTER;
+  size_t rval = 0;
+  if (!(l->flags & LINE_FLG_BORROWED) && l->ct > LINE_INLINE_MAX)
+    rval = __line_heapcap(l->ct);
+  TRACE_RETURN(rval);
+}
+
+
 
 
 //
@@ -287,7 +639,7 @@ void _buffer_init(BUFFER buf, const char* buffer_name, int flags, int capacity,
 {
   TRACE_ENTER;
   capacity = max(capacity, 0);
-  vec_init(&buf->lines, capacity, sizeof(struct line_t));
+  linetree_init(&buf->lines, capacity);
   buf->_sig = BUF_SIG;
   buf->bufnum = _next_bufnum++;
   buf->flags = flags;
@@ -308,6 +660,13 @@ void _buffer_init(BUFFER buf, const char* buffer_name, int flags, int capacity,
     tabs_initfrom(&buf->tabstops, &profile->default_tabstops);
   }
   buf->longest_line = 0;
+  buf->map = NULL;
+  buf->maplen = 0;
+  arena_init(&buf->text, LINE_TEXT_BLKSIZE);
+  buf->dmg_first = 0;
+  buf->dmg_last = INT_MAX;
+  buf->journal = NULL;
+  buf->loader = NULL;
   /* if (flags & BUF_FLG_CMDLINE) */
   /*   buf->profile = dflt_cmd_profile; */
   /* else */
@@ -321,13 +680,17 @@ void _buffer_destroy(BUFFER buf)
 {
   TRACE_ENTER;
   VALIDATEBUFFER(buf);
+  buffer_load_cancel(buf);
   markstack_pop_marks_in_buffer(buf);
   mark_free_marks_in_buffer(buf);
-  int i ,n = vec_count(&buf->lines);
+  journal_free(buf->journal);
+  buf->journal = NULL;
+  int i ,n = linetree_count(&buf->lines);
   for (i = 0; i < n; i++) {
     __line_destroy(_line(buf, i));
   }
-  vec_destroy(&buf->lines);
+  _buffer_release_text(buf);
+  linetree_destroy(&buf->lines);
   cstr_destroy(&buf->orig_filename);
   cstr_destroy(&buf->curr_filename);
   cstr_destroy(&buf->base_buffername);
@@ -342,7 +705,7 @@ int buffer_count(BUFFER buf)
 {
   TRACE_ENTER;
   VALIDATEBUFFER(buf);
-  int rval = vec_count(&buf->lines);
+  int rval = linetree_count(&buf->lines);
   TRACE_RETURN(rval); 
 }
 
@@ -351,7 +714,7 @@ int buffer_capacity(BUFFER buf)
 {
   TRACE_ENTER;
   VALIDATEBUFFER(buf);
-  int rval = vec_capacity(&buf->lines);
+  int rval = linetree_capacity(&buf->lines);
   TRACE_RETURN(rval);
 }
 
@@ -459,6 +822,39 @@ bool buffer_tstflags(BUFFER buf, int flags)
 }
 
 
+// Returns the range of lines changed since the last
+// buffer_clear_damage.  Lines inserted or removed damage everything
+// after them, since they all move.
+bool buffer_get_damage(BUFFER buf, int* first, int* last)
+{
+  TRACE_ENTER;
+  VALIDATEBUFFER(buf);
+  *first = buf->dmg_first;
+  *last = buf->dmg_last;
+  bool rval = buf->dmg_first <= buf->dmg_last;
+  TRACE_RETURN(rval);
+}
+
+
+void buffer_clear_damage(BUFFER buf)
+{
+  TRACE_ENTER;
+  VALIDATEBUFFER(buf);
+  buf->dmg_first = INT_MAX;
+  buf->dmg_last = -1;
+  TRACE_EXIT;
+}
+
+
+// NULL until the buffer's first journaled edit
+struct journal_t* buffer_journal(BUFFER buf)
+{
+  TRACE_ENTER;
+  VALIDATEBUFFER(buf);
+  TRACE_RETURN(buf->journal);
+}
+
+
 POE_ERR buffer_setmargins(BUFFER buf, int leftmargin, int rightmargin, int paragraph)
 {
   TRACE_ENTER;
@@ -537,6 +933,8 @@ void buffer_setlineflags(BUFFER buf, int line, int flags)
   VALIDATEBUFFER(buf);
   __check_line_exists(__func__, buf, line);
   _line(buf, line)->flags |= flags;
+  if (flags & (LINE_FLG_CR|LINE_FLG_LF))
+    linetree_touch(&buf->lines, line);
   if (flags & LINE_FLG_DIRTY)
     buffer_setflags(buf, BUF_FLG_DIRTY);
   TRACE_EXIT;
@@ -563,6 +961,8 @@ void buffer_clrlineflags(BUFFER buf, int line, int flags)
   VALIDATEBUFFER(buf);
   __check_line_exists(__func__, buf, line);
   _line(buf, line)->flags &= ~flags;
+  if (flags & (LINE_FLG_CR|LINE_FLG_LF))
+    linetree_touch(&buf->lines, line);
   TRACE_EXIT;
 }
 
@@ -583,11 +983,69 @@ int buffer_line_length(BUFFER buf, int line)
   VALIDATEBUFFER(buf);
   __check_line_exists(__func__, buf, line);
   struct line_t* pline = _line(buf, line);
-  int rval = cstr_count(&pline->txt);
+  int rval = pline->ct;
+  TRACE_RETURN(rval);
+}
+
+
+// The size of the buffer as it would be saved, less any blank
+// compression.
+int64_t buffer_size(BUFFER buf)
+{
+  TRACE_ENTER;
+  VALIDATEBUFFER(buf);
+  int64_t rval = linetree_bytes(&buf->lines);
+  TRACE_RETURN(rval);
+}
+
+
+// The byte offset of the start of line, counting each line's CR/LF.
+int64_t buffer_line_offset(BUFFER buf, int line)
+{
+  TRACE_ENTER;
+  VALIDATEBUFFER(buf);
+  __check_line_lim(__func__, buf, line);
+  int64_t rval = linetree_offset(&buf->lines, line);
+  TRACE_RETURN(rval);
+}
+
+
+// The byte offset of line and col, which is the end of the buffer
+// past its last line.  A column past the end of the line's text as
+// it was read is at its CR/LF.
+int64_t buffer_char_offset(BUFFER buf, int line, int col)
+{
+  TRACE_ENTER;
+  VALIDATEBUFFER(buf);
+  if (line >= linetree_count(&buf->lines))
+    TRACE_RETURN(linetree_bytes(&buf->lines));
+  struct line_t* l = _line(buf, line);
+  int64_t rval = linetree_offset(&buf->lines, line) + min(max(col, 0), l->ct - l->expanded);
   TRACE_RETURN(rval);
 }
 
 
+// The line and column of byte offset off.  An offset in a line's
+// CR/LF is at the end of the line, and one past the end of the buffer
+// is at the end of its last line.  In a line whose tabs were expanded
+// the column is the count of bytes, not where they were expanded to.
+int buffer_find_offset(BUFFER buf, int64_t off, int* pcol)
+{
+  TRACE_ENTER;
+  VALIDATEBUFFER(buf);
+  if (linetree_count(&buf->lines) == 0) {
+    *pcol = 0;
+    TRACE_RETURN(0);
+  }
+  int64_t lineoff;
+  int line = linetree_find_offset(&buf->lines, max(off, 0), &lineoff);
+  int64_t col = max(off, 0) - lineoff;
+  struct line_t* l = _line(buf, line);
+  *pcol = col < l->ct - l->expanded ? (int)col : l->ct;
+  TRACE_RETURN(line);
+}
+
+
 struct line_t* buffer_get(BUFFER buf, int line)
 {
   TRACE_ENTER;
@@ -696,8 +1154,8 @@ int buffer_scantill_nowrap(BUFFER buf, int line, int col, int direction, char_te
   VALIDATEBUFFER(buf);
   __check_line_exists(__func__, buf, line);
   struct line_t* pline = _line(buf, line);
-  int len = cstr_count(&pline->txt);
-  const char* s = cstr_getbufptr(&pline->txt);
+  int len = pline->ct;
+  const char* s = __line_text(pline);
   int i = 0;
   if (direction == -1) {
     if (col < 0)
@@ -787,10 +1245,13 @@ bool buffer_trimleft(BUFFER buf, int row, bool upd_marks)
   TRACE_ENTER;
   VALIDATEBUFFER(buf);
   __check_line_exists(__func__, buf, row);
-  struct line_t* line = buffer_get(buf, row);
-  int nchars = cstr_trimleft(&line->txt, poe_iswhitespace);
-  if (upd_marks && nchars > 0)
-    marks_upd_removedchars(buf, row, 0, nchars);
+  struct line_t* line = _line(buf, row);
+  const char* s = __line_text(line);
+  int nchars = 0, len = line->ct;
+  while (nchars < len && poe_iswhitespace(s[nchars]))
+    nchars++;
+  if (nchars > 0)
+    buffer_removechars(buf, row, 0, nchars, upd_marks);
   buffer_setlineflags(buf, row, LINE_FLG_DIRTY);
   TRACE_RETURN(nchars > 0);
 }
@@ -801,10 +1262,14 @@ bool buffer_trimright(BUFFER buf, int row, bool upd_marks)
   TRACE_ENTER;
   VALIDATEBUFFER(buf);
   __check_line_exists(__func__, buf, row);
-  struct line_t* line = buffer_get(buf, row);
-  int nchars = cstr_trimright(&line->txt, poe_iswhitespace);
-  if (upd_marks && nchars > 0)
-    marks_upd_removedchars(buf, row, cstr_count(&line->txt), nchars);
+  struct line_t* line = _line(buf, row);
+  const char* s = __line_text(line);
+  int len = line->ct, keep = len;
+  while (keep > 0 && poe_iswhitespace(s[keep-1]))
+    keep--;
+  int nchars = len - keep;
+  if (nchars > 0)
+    buffer_removechars(buf, row, keep, nchars, upd_marks);
   buffer_setlineflags(buf, row, LINE_FLG_DIRTY);
   TRACE_RETURN(nchars > 0);
 }
@@ -815,7 +1280,13 @@ void buffer_setcstr(BUFFER buf, int line, struct cstr_t* a)
   TRACE_ENTER;
   VALIDATEBUFFER(buf);
   __check_line_exists(__func__, buf, line);
-  cstr_assign(&(_line(buf, line)->txt), a);
+  struct line_t* l = _wline(buf, line);
+  struct journal_t* j = _buffer_journal(buf);
+  if (j != NULL)
+    journal_delchars(j, line, 0, __line_text(l), l->ct);
+  memcpy(__line_splice(l, 0, l->ct, cstr_count(a)), cstr_getbufptr(a), cstr_count(a));
+  if (j != NULL)
+    journal_inschars(j, line, 0, __line_text(l), l->ct);
   buf->longest_line = max(buf->longest_line, cstr_count(a));
   buffer_setlineflags(buf, line, LINE_FLG_DIRTY);
   TRACE_EXIT;
@@ -826,7 +1297,13 @@ void buffer_ensure_min_lines(BUFFER buf, bool upd_dirty)
 {
   if (buffer_count(buf) == 0) {
     bool wasdirty = buffer_tstflags(buf, BUF_FLG_DIRTY);
+    // housekeeping rather than an edit, so there's nothing to undo
+    struct journal_t* j = upd_dirty ? NULL : _buffer_journal(buf);
+    if (j != NULL)
+      journal_hold(j);
     _expand_to_line(buf, 0);
+    if (j != NULL)
+      journal_release(j);
     if (!upd_dirty && !wasdirty)
       buffer_clrflags(buf, BUF_FLG_DIRTY);
     else
@@ -841,14 +1318,32 @@ int buffer_appendline(BUFFER buf, struct line_t* a)
   VALIDATEBUFFER(buf);
   struct line_t tmp;
   __line_initfrom(&tmp, a);
-  int line = vec_append(&buf->lines, &tmp);
-  buf->longest_line = max(buf->longest_line, cstr_count(&tmp.txt));
+  int line = linetree_append(&buf->lines, &tmp);
+  _buffer_damage(buf, line, INT_MAX);
+  buf->longest_line = max(buf->longest_line, tmp.ct);
+  struct journal_t* j = _buffer_journal(buf);
+  if (j != NULL)
+    journal_inslines(j, line, 1);
   // ownership of tmp's data moves to buffer
   buffer_setlineflags(buf, line, LINE_FLG_DIRTY);
   TRACE_RETURN(line);
 }
 
 
+// Like buffer_appendline, but takes ownership of a's text rather
+// than copying it.
+int _buffer_appendline_nocopy(BUFFER buf, struct line_t* a)
+{
+  TRACE_ENTER;
+  int line = linetree_append(&buf->lines, a);
+  _buffer_damage(buf, line, INT_MAX);
+  buf->longest_line = max(buf->longest_line, a->ct);
+  if (a->flags & LINE_FLG_DIRTY)
+    buffer_setflags(buf, BUF_FLG_DIRTY);
+  TRACE_RETURN(line);
+}
+
+
 int buffer_appendblanklines(BUFFER buf, int n)
 {
   TRACE_ENTER;
@@ -867,7 +1362,11 @@ void buffer_insertline(BUFFER buf, int line, struct line_t* a)
   __check_line_lim("_buffer_insertline", buf, line);
   struct line_t tmp;
   __line_initfrom(&tmp, a);
-  vec_insert(&buf->lines, line, &tmp);
+  linetree_insert(&buf->lines, line, &tmp);
+  _buffer_damage(buf, line, INT_MAX);
+  struct journal_t* j = _buffer_journal(buf);
+  if (j != NULL)
+    journal_inslines(j, line, 1);
   // ownership of tmp's data moves to buffer
   buffer_setlineflags(buf, line, LINE_FLG_DIRTY);
   TRACE_EXIT;
@@ -888,7 +1387,11 @@ void buffer_insertblanklines(BUFFER buf, int line, int nlines, bool upd_marks)
     int i;
     for (i = 0; i < nlines; i++)
       __line_init(lines+i);
-    vec_insertm(&buf->lines, line, nlines, lines);
+    linetree_insertm(&buf->lines, line, nlines, lines);
+    _buffer_damage(buf, line, INT_MAX);
+    struct journal_t* j = _buffer_journal(buf);
+    if (j != NULL)
+      journal_inslines(j, line, nlines);
     if (upd_marks)
       marks_upd_insertedlines(buf, line, nlines);
     buffer_setflags(buf, BUF_FLG_DIRTY); 
@@ -903,8 +1406,16 @@ void buffer_removeline(BUFFER buf, int line)
   TRACE_ENTER;
   VALIDATEBUFFER(buf);
   __check_line_exists(__func__, buf, line);
+  struct journal_t* j = _buffer_journal(buf);
+  if (j != NULL) {
+    struct line_t* taken = calloc(1, sizeof(struct line_t));
+    buffer_takelines(buf, line, 1, taken, false);
+    journal_dellines(j, line, 1, taken);
+    TRACE_EXIT;
+  }
   __line_destroy(_line(buf, line));
-  vec_remove(&buf->lines, line);
+  linetree_remove(&buf->lines, line);
+  _buffer_damage(buf, line, INT_MAX);
   buffer_setflags(buf, LINE_FLG_DIRTY);
   TRACE_EXIT;
 }
@@ -916,26 +1427,80 @@ void buffer_removelines(BUFFER buf, int line, int n, bool upd_marks)
   VALIDATEBUFFER(buf);
   int j;
   __check_lines_exist(__func__, buf, line, n);
+  struct journal_t* jr = _buffer_journal(buf);
+  if (jr != NULL) {
+    // the journal keeps the lines themselves, rather than copies
+    struct line_t* taken = calloc(max(n, 1), sizeof(struct line_t));
+    buffer_takelines(buf, line, n, taken, upd_marks);
+    journal_dellines(jr, line, n, taken);
+    TRACE_EXIT;
+  }
   if (upd_marks)
     marks_upd_removedlines(buf, line, n);
   for (j = 0; j < n; j++) {
     __line_destroy(_line(buf, line+j));
   }
-  vec_removem(&buf->lines, line, n);
+  linetree_removem(&buf->lines, line, n);
+  _buffer_damage(buf, line, INT_MAX);
   buffer_setflags(buf, LINE_FLG_DIRTY);
   TRACE_EXIT;
 }
 
 
+// Removes n lines and hands them to the caller, which then owns
+// their text.  Not journaled; this is how the journal takes lines.
+void buffer_takelines(BUFFER buf, int line, int n, struct line_t* out, bool upd_marks)
+{
+  TRACE_ENTER;
+  VALIDATEBUFFER(buf);
+  int j;
+  __check_lines_exist(__func__, buf, line, n);
+  if (upd_marks)
+    marks_upd_removedlines(buf, line, n);
+  for (j = 0; j < n; j++) {
+    out[j] = *_line(buf, line+j);
+    __line_own(&out[j]);
+  }
+  linetree_removem(&buf->lines, line, n);
+  _buffer_damage(buf, line, INT_MAX);
+  buffer_setflags(buf, BUF_FLG_DIRTY);
+  TRACE_EXIT;
+}
+
+
+// Inserts n lines whose text the buffer takes over.  Not journaled;
+// this is how the journal gives lines back.
+void buffer_insertlines_owned(BUFFER buf, int line, int n, struct line_t* lines, bool upd_marks)
+{
+  TRACE_ENTER;
+  VALIDATEBUFFER(buf);
+  __check_line_lim(__func__, buf, line);
+  int j;
+  for (j = 0; j < n; j++) {
+    lines[j].flags |= LINE_FLG_DIRTY;
+    buf->longest_line = max(buf->longest_line, lines[j].ct);
+  }
+  linetree_insertm(&buf->lines, line, n, lines);
+  _buffer_damage(buf, line, INT_MAX);
+  if (upd_marks)
+    marks_upd_insertedlines(buf, line, n);
+  buffer_setflags(buf, BUF_FLG_DIRTY);
+  TRACE_EXIT;
+}
+
+
 void buffer_insert(BUFFER buf, int line, int col, char c, bool upd_marks)
 {
   TRACE_ENTER;
   VALIDATEBUFFER(buf);
   __check_line_exists(__func__, buf, line);
-  struct line_t* l = _line(buf, line);
+  struct line_t* l = _wline(buf, line);
   _expand_to_col(buf, line, col-1);
-  cstr_insert(&l->txt, col, c);
-  buf->longest_line = max(buf->longest_line, cstr_count(&l->txt));
+  *__line_splice(l, col, 0, 1) = c;
+  buf->longest_line = max(buf->longest_line, l->ct);
+  struct journal_t* j = _buffer_journal(buf);
+  if (j != NULL)
+    journal_inschars(j, line, col, __line_text(l)+col, 1);
   buffer_setlineflags(buf, line, LINE_FLG_DIRTY);
   if (upd_marks)
     marks_upd_insertedchars(buf, line, col, 1);
@@ -948,10 +1513,13 @@ void buffer_insertct(BUFFER buf, int line, int col, char c, int ct, bool upd_mar
   TRACE_ENTER;
   VALIDATEBUFFER(buf);
   __check_line_exists(__func__, buf, line);
-  struct line_t* l = _line(buf, line);
+  struct line_t* l = _wline(buf, line);
   _expand_to_col(buf, line, col-1);
-  cstr_insertct(&l->txt, col, c, ct);
-  buf->longest_line = max(buf->longest_line, cstr_count(&l->txt));
+  memset(__line_splice(l, col, 0, ct), c, ct);
+  buf->longest_line = max(buf->longest_line, l->ct);
+  struct journal_t* j = _buffer_journal(buf);
+  if (j != NULL)
+    journal_inschars(j, line, col, __line_text(l)+col, ct);
   buffer_setlineflags(buf, line, LINE_FLG_DIRTY);
   if (upd_marks)
     marks_upd_insertedchars(buf, line, col, ct);
@@ -964,11 +1532,17 @@ void buffer_insertstrn(BUFFER buf, int line, int col, const char* s, int n, bool
   TRACE_ENTER;
   VALIDATEBUFFER(buf);
   __check_line_exists(__func__, buf, line);
-  struct line_t* l = _line(buf, line);
+  struct line_t* l = _wline(buf, line);
   int len = strnlen(s, n);
   _expand_to_col(buf, line, col-1);
-  cstr_insertm(&l->txt, col, len, s);
-  buf->longest_line = max(buf->longest_line, cstr_count(&l->txt));
+  // s may be in this line, which the insert moves
+  char* tmp = __line_holds(l, s) ? strlsave(s, len) : NULL;
+  memcpy(__line_splice(l, col, 0, len), tmp != NULL ? tmp : s, len);
+  free(tmp);
+  buf->longest_line = max(buf->longest_line, l->ct);
+  struct journal_t* j = _buffer_journal(buf);
+  if (j != NULL)
+    journal_inschars(j, line, col, __line_text(l)+col, len);
   buffer_setlineflags(buf, line, LINE_FLG_DIRTY);
   if (upd_marks)
     marks_upd_insertedchars(buf, line, col, len);
@@ -983,10 +1557,10 @@ char buffer_getchar(BUFFER buf, int line, int col)
   __check_line_exists(__func__, buf, line);
   struct line_t* l = _line(buf, line);
   char c;
-  if (col >= cstr_count(&l->txt))
+  if (col >= l->ct)
     c = ' ';
   else
-    c = cstr_get(&l->txt, col);
+    c = __line_text(l)[col];
   TRACE_RETURN(c);
 }
 
@@ -997,8 +1571,11 @@ void buffer_setchar(BUFFER buf, int line, int col, char c)
   VALIDATEBUFFER(buf);
   __check_line_exists(__func__, buf, line);
   _expand_to_col(buf, line, col);
-  struct line_t* l = _line(buf, line);
-  cstr_set(&l->txt, col, c);
+  struct line_t* l = _wline(buf, line);
+  struct journal_t* j = _buffer_journal(buf);
+  if (j != NULL)
+    journal_setchars(j, line, col, __line_text(l)+col, &c, 1);
+  __line_text(l)[col] = c;
   buffer_setlineflags(buf, line, LINE_FLG_DIRTY);
   TRACE_EXIT;
 }
@@ -1008,18 +1585,25 @@ void buffer_setcharct(BUFFER buf, int line, int col, char c, int ct)
 {
   TRACE_ENTER;
   __check_line_exists(__func__, buf, line);
-  struct line_t* pline = _line(buf, line);
-  int linelen = cstr_count(&pline->txt);
+  struct line_t* pline = _wline(buf, line);
+  int linelen = pline->ct;
   if (col > linelen) {
     _expand_to_col(buf, line, col-1);
-    cstr_appendct(&pline->txt, c, ct);
-  }
-  else if (col+ct > linelen) {
-    cstr_setct(&pline->txt, col, c, linelen-col);
-    cstr_appendct(&pline->txt, c, col+ct-linelen);
-  }
-  else {
-    cstr_setct(&pline->txt, col, c, ct);
+    linelen = col;
+  }
+  // overwrite what's there, then append the rest
+  int nset = max(0, min(ct, linelen-col));
+  struct journal_t* j = _buffer_journal(buf);
+  char* olds = (j != NULL && nset > 0) ? strlsave(__line_text(pline)+col, nset) : NULL;
+  memset(__line_text(pline)+col, c, nset);
+  if (ct > nset)
+    memset(__line_splice(pline, pline->ct, 0, ct-nset), c, ct-nset);
+  if (j != NULL) {
+    if (nset > 0)
+      journal_setchars(j, line, col, olds, __line_text(pline)+col, nset);
+    if (ct > nset)
+      journal_inschars(j, line, col+nset, __line_text(pline)+col+nset, ct-nset);
+    free(olds);
   }
   TRACE_EXIT;
 }
@@ -1030,11 +1614,21 @@ void buffer_setstrn(BUFFER buf, int line, int col, const char* s, int n, bool up
   TRACE_ENTER;
   VALIDATEBUFFER(buf);
   __check_line_exists(__func__, buf, line);
-  struct line_t* l = _line(buf, line);
+  struct line_t* l = _wline(buf, line);
   int len = strnlen(s, n);
+  char* tmp = __line_holds(l, s) ? strlsave(s, len) : NULL;
+  if (tmp != NULL)
+    s = tmp;
   _expand_to_col(buf, line, col+len);
-  cstr_setstrn(&l->txt, col, s, len);
-  buf->longest_line = max(buf->longest_line, cstr_count(&l->txt));
+  struct journal_t* j = _buffer_journal(buf);
+  char* olds = (j != NULL) ? strlsave(__line_text(l)+col, len) : NULL;
+  memmove(__line_text(l)+col, s, len);
+  free(tmp);
+  if (j != NULL) {
+    journal_setchars(j, line, col, olds, __line_text(l)+col, len);
+    free(olds);
+  }
+  buf->longest_line = max(buf->longest_line, l->ct);
   buffer_setlineflags(buf, line, LINE_FLG_DIRTY);
   TRACE_EXIT;
 }
@@ -1045,14 +1639,17 @@ void buffer_removechar(BUFFER buf, int line, int col, bool upd_marks)
   TRACE_ENTER;
   VALIDATEBUFFER(buf);
   __check_line_exists(__func__, buf, line);
-  struct line_t* l = _line(buf, line);
-  if (cstr_count(&l->txt) <= col) {
+  struct line_t* l = _wline(buf, line);
+  if (l->ct <= col) {
     TRACE_EXIT;
   }
   else {
     if (upd_marks)
       marks_upd_removedchars(buf, line, col, 1);
-    cstr_remove(&l->txt, col);
+    struct journal_t* j = _buffer_journal(buf);
+    if (j != NULL)
+      journal_delchars(j, line, col, __line_text(l)+col, 1);
+    __line_splice(l, col, 1, 0);
     buffer_setlineflags(buf, line, LINE_FLG_DIRTY);
   }
   TRACE_EXIT;
@@ -1064,28 +1661,104 @@ void buffer_removechars(BUFFER buf, int line, int col, int n, bool upd_marks)
   TRACE_ENTER;
   VALIDATEBUFFER(buf);
   __check_line_exists(__func__, buf, line);
-  struct line_t* l = _line(buf, line);
-  int len = cstr_count(&l->txt);
+  struct line_t* l = _wline(buf, line);
+  int len = l->ct;
   if (col >= len) {
     TRACE_EXIT;
   }
   else {
     if (upd_marks)
       marks_upd_removedchars(buf, line, col, n);
-    cstr_removem(&l->txt, col, min(len-col, n));
+    struct journal_t* j = _buffer_journal(buf);
+    if (j != NULL)
+      journal_delchars(j, line, col, __line_text(l)+col, min(len-col, n));
+    __line_splice(l, col, min(len-col, n), 0);
     buffer_setlineflags(buf, line, LINE_FLG_DIRTY);
   }
   TRACE_EXIT;
 }
 
 
+// Makes several replacements in a line, which must be in order and
+// mustn't overlap, rebuilding the line once.  The marks are updated in
+// a single batch.
+void buffer_replacechars(BUFFER buf, int line, const struct bufedit_t* edits, int nedits, bool upd_marks)
+{
+  TRACE_ENTER;
+  VALIDATEBUFFER(buf);
+  __check_line_exists(__func__, buf, line);
+  if (nedits <= 0)
+    TRACE_EXIT;
+  struct line_t* l = _wline(buf, line);
+  const char* old = __line_text(l);
+  int i, at = 0, oldlen = l->ct, newlen = oldlen;
+  for (i = 0; i < nedits; i++)
+    newlen += edits[i].len - edits[i].n;
+  struct line_t txt;
+  txt.u.s = NULL;
+  txt.ct = 0;
+  txt.flags = l->flags;
+  txt.expanded = 0;
+  char* t = __line_splice(&txt, 0, 0, newlen);
+  for (i = 0; i < nedits; i++) {
+    memcpy(t, old + at, edits[i].col - at);
+    t += edits[i].col - at;
+    memcpy(t, edits[i].s, edits[i].len);
+    t += edits[i].len;
+    at = edits[i].col + edits[i].n;
+  }
+  memcpy(t, old + at, oldlen - at);
+  struct journal_t* j = _buffer_journal(buf);
+  if (j != NULL && oldlen > 0)
+    journal_delchars(j, line, 0, old, oldlen);
+  if (j != NULL && newlen > 0)
+    journal_inschars(j, line, 0, __line_text(&txt), newlen);
+  __line_destroy(l);
+  *l = txt;
+  buf->longest_line = max(buf->longest_line, newlen);
+  buffer_setlineflags(buf, line, LINE_FLG_DIRTY);
+  if (upd_marks) {
+    marks_begin_batch(buf);
+    // right to left, so each edit's column is still where it was
+    for (i = nedits-1; i >= 0; i--) {
+      if (edits[i].n > 0)
+        marks_upd_removedchars(buf, line, edits[i].col, edits[i].n);
+      if (edits[i].len > 0)
+        marks_upd_insertedchars(buf, line, edits[i].col, edits[i].len);
+    }
+    marks_end_batch(buf);
+  }
+  TRACE_EXIT;
+}
+
+
+// A line's text and length.  Mapped lines aren't NUL terminated, so
+// nothing past the length may be looked at.
+const char* buffer_getlineptr(BUFFER buf, int line, int* plen)
+{
+  TRACE_ENTER;
+  VALIDATEBUFFER(buf);
+  __check_line_exists(__func__, buf, line);
+  struct line_t* l = buffer_get(buf, line);
+  *plen = l->ct;
+  const char* rval = __line_text(l);
+  TRACE_RETURN(rval);
+}
+
+
+// A line's text as a C string.  Mapped lines have nowhere to put a
+// NUL without writing to the file's pages, so they get copied out for
+// good; anything that can work to a length should use
+// buffer_getlineptr, which leaves them mapped.
 const char* buffer_getbufptr(BUFFER buf, int line)
 {
   TRACE_ENTER;
   VALIDATEBUFFER(buf);
   __check_line_exists(__func__, buf, line);
   struct line_t* l = buffer_get(buf, line);
-  const char* rval = cstr_getbufptr(&l->txt);
+  if (l->flags & LINE_FLG_MAPPED)
+    __line_own(l);
+  const char* rval = __line_text(l);
   TRACE_RETURN(rval);
 }
 
@@ -1094,10 +1767,12 @@ const char* buffer_getcharptr(BUFFER buf, int line, int col)
 {
   __check_line_exists(__func__, buf, line);
   struct line_t* l = buffer_get(buf, line);
-  if (col >= cstr_count(&l->txt))
+  if (l->flags & LINE_FLG_MAPPED)
+    __line_own(l);
+  if (col >= l->ct)
     return "";
   else
-    return cstr_getcharptr(&l->txt, col);
+    return __line_text(l)+col;
 }
 
 
@@ -1107,8 +1782,20 @@ void buffer_upperchars(BUFFER buf, int line, int col, int n)
   VALIDATEBUFFER(buf);
   if (line >= buffer_count(buf))
     TRACE_EXIT;
-  struct line_t* l = _line(buf, line);
-  cstr_upper(&l->txt, col, n);
+  struct line_t* l = _wline(buf, line);
+  struct journal_t* j = _buffer_journal(buf);
+  int i, len = l->ct;
+  n = (col < len) ? min(n, len-col) : 0;
+  if (n == 0)
+    j = NULL;
+  char* olds = (j != NULL) ? strlsave(__line_text(l)+col, n) : NULL;
+  char* t = __line_text(l);
+  for (i = col; i < col+n; i++)
+    t[i] = toupper((unsigned char)t[i]);
+  if (j != NULL) {
+    journal_setchars(j, line, col, olds, __line_text(l)+col, n);
+    free(olds);
+  }
   buffer_setlineflags(buf, line, LINE_FLG_DIRTY);
   TRACE_EXIT;
 }
@@ -1120,8 +1807,20 @@ void buffer_lowerchars(BUFFER buf, int line, int col, int n)
   VALIDATEBUFFER(buf);
   if (line >= buffer_count(buf))
     TRACE_EXIT;
-  struct line_t* l = _line(buf, line);
-  cstr_lower(&l->txt, col, n);
+  struct line_t* l = _wline(buf, line);
+  struct journal_t* j = _buffer_journal(buf);
+  int i, len = l->ct;
+  n = (col < len) ? min(n, len-col) : 0;
+  if (n == 0)
+    j = NULL;
+  char* olds = (j != NULL) ? strlsave(__line_text(l)+col, n) : NULL;
+  char* t = __line_text(l);
+  for (i = col; i < col+n; i++)
+    t[i] = tolower((unsigned char)t[i]);
+  if (j != NULL) {
+    journal_setchars(j, line, col, olds, __line_text(l)+col, n);
+    free(olds);
+  }
   buffer_setlineflags(buf, line, LINE_FLG_DIRTY);
   TRACE_EXIT;
 }
@@ -1141,8 +1840,8 @@ POE_ERR buffer_copyinsertchars(BUFFER dstbuf, int dstline, int dstcol,
   VALIDATEBUFFER(srcbuf);
   __check_line_exists("buffer_copyinsertchars/src", srcbuf, srcline);
   _expand_to_line(dstbuf, dstline);
-  int srclinelen = buffer_line_length(srcbuf, srcline);
-  const char* srctxt = buffer_getbufptr(srcbuf, srcline);
+  int srclinelen;
+  const char* srctxt = buffer_getlineptr(srcbuf, srcline, &srclinelen);
 	int clipped_srccol = min(srccol, srclinelen);
 	int clipped_nchars = min(n, srclinelen-srccol);
 	if (dstbuf == srcbuf && dstline == srcline) {
@@ -1218,9 +1917,13 @@ void __buffer_copyinsertlines(BUFFER dstbuf, int di,
   for (j = 0; j < n; j++) {
     __line_initfrom(&tmplines[j], _line(srcbuf, si+j));
     tmplines[j].flags |= LINE_FLG_DIRTY;
-    dstbuf->longest_line = max(dstbuf->longest_line, cstr_count(&tmplines[j].txt));
+    dstbuf->longest_line = max(dstbuf->longest_line, tmplines[j].ct);
   }
-  vec_insertm(&dstbuf->lines, di, n, tmplines);
+  linetree_insertm(&dstbuf->lines, di, n, tmplines);
+  _buffer_damage(dstbuf, di, INT_MAX);
+  struct journal_t* jr = _buffer_journal(dstbuf);
+  if (jr != NULL)
+    journal_inslines(jr, di, n);
   buffer_setflags(dstbuf, BUF_FLG_DIRTY);
   // Ownership of line_t data in tmplines goes to buffer, but not tmplines itself.
   PE_FREE_TMP(tmplines, n);
@@ -1243,11 +1946,11 @@ POE_ERR buffer_copyoverlaychars(BUFFER dstbuf, int dstline, int dstcol,
     // Nothing to do
   }
   else if (srccol + nchars >= srclinelen) {
-    const char* srctxt = buffer_getcharptr(srcbuf, srcline, srccol);
+    const char* srctxt = buffer_getlineptr(srcbuf, srcline, &srclinelen) + srccol;
     buffer_setstrn(dstbuf, dstline, dstcol, srctxt, srclinelen-srccol, upd_marks);
   }
   else {
-    const char* srctxt = buffer_getcharptr(srcbuf, srcline, srccol);
+    const char* srctxt = buffer_getlineptr(srcbuf, srcline, &srclinelen) + srccol;
     buffer_setstrn(dstbuf, dstline, dstcol, srctxt, nchars, upd_marks);
   }
   TRACE_RETURN(err);
@@ -1265,9 +1968,9 @@ POE_ERR buffer_copyoverlaylines(BUFFER dstbuf, int dstline,
   _expand_to_line(dstbuf, dstline+nlines);
   int i;
   for (i = 0; i < nlines; i++) {
-    int srclinelen = buffer_line_length(srcbuf, srcline+i);
+    int srclinelen;
     int dstlinelen = buffer_line_length(dstbuf, dstline+i);
-    const char* srctxt = buffer_getbufptr(srcbuf, srcline);
+    const char* srctxt = buffer_getlineptr(srcbuf, srcline+i, &srclinelen);
     buffer_setstrn(dstbuf, dstline+i, 0, srctxt, srclinelen, upd_marks);
     if (dstlinelen > srclinelen)
       buffer_removechars(dstbuf, dstline+i, srclinelen, dstlinelen-srclinelen, upd_marks);
@@ -1282,11 +1985,24 @@ POE_ERR buffer_splitline(BUFFER buf, int row, int col, bool upd_marks)
   VALIDATEBUFFER(buf);
   if (upd_marks)
     marks_upd_split(buf, row, col);
-  const char* tail = buffer_getcharptr(buf, row, col);
-  int taillen = strlen(tail);
+  struct journal_t* j = _buffer_journal(buf);
+  if (j != NULL)
+    journal_hold(j);
+  // a short line's text moves with it when lines are inserted
+  int linelen;
+  const char* txt = buffer_getlineptr(buf, row, &linelen);
+  int taillen = max(0, linelen - col);
+  char* tail = malloc(taillen+1);
+  memcpy(tail, txt + min(col, linelen), taillen);
+  tail[taillen] = '\0';
   buffer_insertblanklines(buf, row+1, 1, false); // updates handled by upd_split
   buffer_insertstrn(buf, row+1, 0, tail, taillen, false);
   buffer_removechars(buf, row, col, taillen, false);
+  free(tail);
+  if (j != NULL) {
+    journal_release(j);
+    journal_split(j, row, col);
+  }
   TRACE_RETURN(POE_ERR_OK);
 }
 
@@ -1298,182 +2014,1132 @@ POE_ERR buffer_joinline(BUFFER buf, int row, bool upd_marks)
   int nrows = buffer_count(buf);
   if (row >= nrows-1)
     TRACE_RETURN(POE_ERR_OK);
-  const char* tail = buffer_getbufptr(buf, row+1);
+  int taillen;
+  const char* tail = buffer_getlineptr(buf, row+1, &taillen);
   int linelen = buffer_line_length(buf, row);
-  int taillen = buffer_line_length(buf, row+1);
   if (upd_marks) {
     marks_upd_join(buf, row, linelen);
   }
+  struct journal_t* j = _buffer_journal(buf);
+  if (j != NULL)
+    journal_hold(j);
   buffer_insertstrn(buf, row, linelen, tail, taillen, false); // mark updates handled above
   buffer_removelines(buf, row+1, 1, false);
+  if (j != NULL) {
+    journal_release(j);
+    journal_join(j, row, linelen);
+  }
   TRACE_RETURN(POE_ERR_OK);
 }
 
 
-POE_ERR buffer_load(BUFFER buf, cstr* filename, bool tabexpand)
+// Reads the whole of f in large blocks.  The size of the file is
+// only a hint, so this works on pipes and special files as well.
+char* __load_slurp(FILE* f, size_t* plen)
 {
   TRACE_ENTER;
-  VALIDATEBUFFER(buf);
-  
-  tabstops load_tabs;
-  tabs_init(&load_tabs, 0, buf->profile->tabexpand_size, NULL);
-  
-  POE_ERR err = POE_ERR_OK;
-  cstr cpy_filename;
-  cstr_initfrom(&cpy_filename, filename);
-  cstr_trimleft(&cpy_filename, poe_iswhitespace);
-  cstr_trimright(&cpy_filename, poe_iswhitespace);
-  if (cstr_count(&cpy_filename) >= 2 && cstr_get(&cpy_filename, 0) == '~' && cstr_get(&cpy_filename, 1) == '/') {
-    cstr_remove(&cpy_filename, 0);
-    const char* home = getenv("HOME");
-    if (home != NULL) {
-      int homelen = strlen(home);
-      cstr_insertm(&cpy_filename, 0, homelen, home);
+  struct stat st;
+  size_t cap = 64*1024;
+  if (fstat(fileno(f), &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0)
+    cap = (size_t)st.st_size + 1;
+  size_t len = 0;
+  char* data = malloc(cap);
+  while (data != NULL) {
+    size_t nread = fread(data+len, 1, cap-len, f);
+    len += nread;
+    if (nread == 0 || ferror(f) || feof(f))
+      break;
+    if (len == cap) {
+      cap <<= 1;
+      char* tmp = realloc(data, cap);
+      if (tmp == NULL)
+        free(data);
+      data = tmp;
     }
   }
-  int flg_rdonly = 0;
-  char expanded_filename[PATH_MAX+1];
-  if (NULL == realpath(cstr_getbufptr(&cpy_filename), expanded_filename))
+  if (data != NULL && ferror(f)) {
+    free(data);
+    data = NULL;
+  }
+  *plen = len;
+  TRACE_RETURN(data);
+}
+
+
+// Another program can cut a mapped file short while it's open, and
+// touching a page past its new end raises SIGBUS.  The handler puts
+// zeroed pages over the rest of the mapping and marks it cut, and
+// buffers_check_maps tells the buffer about it later on the main
+// thread.  Faults anywhere else go to whatever handler was there.
+struct mapguard_t {
+  char* volatile base;
+  size_t len;
+  volatile sig_atomic_t cut;
+};
+static struct mapguard_t __map_guards[MAP_GUARD_MAX];
+static volatile sig_atomic_t __map_guard_cut = 0;
+static struct sigaction __map_guard_prev;
+static long __map_guard_pgsize = 0;
+static pthread_mutex_t __map_guard_lock = PTHREAD_MUTEX_INITIALIZER;
+
+
+// POSIX doesn't list mmap as async-signal-safe, and there's no safe
+// call that can make the faulting page readable again, so this relies
+// on the platforms poe is built for.  On Linux (glibc and musl) and
+// the BSDs mmap is a bare system call wrapper that takes no locks and
+// allocates nothing, and the fault is synchronous, raised by the
+// thread that touched the page, so nothing it could interrupt is
+// half done.  Everything else here is async-signal-safe.
+void __map_guard_sigbus(int sig, siginfo_t* si, void* ctx)
+{
+  char* addr = (char*)si->si_addr;
+  int i;
+  for (i = 0; i < MAP_GUARD_MAX; i++) {
+    char* base = __map_guards[i].base;
+    if (base == NULL || addr < base || addr >= base + __map_guards[i].len)
+      continue;
+    char* from = base + (addr - base) / __map_guard_pgsize * __map_guard_pgsize;
+    if (mmap(from, base + __map_guards[i].len - from, PROT_READ,
+             MAP_PRIVATE|MAP_ANONYMOUS|MAP_FIXED, -1, 0) == MAP_FAILED)
+      break;
+    __map_guards[i].cut = 1;
+    __map_guard_cut = 1;
+    return;
+  }
+  if (__map_guard_prev.sa_flags & SA_SIGINFO)
+    __map_guard_prev.sa_sigaction(sig, si, ctx);
+  else if (__map_guard_prev.sa_handler != SIG_DFL && __map_guard_prev.sa_handler != SIG_IGN)
+    __map_guard_prev.sa_handler(sig);
+  else {
+    struct sigaction dfl;
+    memset(&dfl, 0, sizeof dfl);
+    dfl.sa_handler = SIG_DFL;
+    sigaction(sig, &dfl, NULL); // the fault happens again on return
+  }
+}
+
+
+// Starts guarding a mapping.  The handler is put back each time in
+// case someone else has taken SIGBUS over since.  Returns false if
+// there's no room to guard another one.
+bool __map_guard_add(char* base, size_t len)
+{
+  TRACE_ENTER;
+  bool added = false;
+  pthread_mutex_lock(&__map_guard_lock);
+  struct sigaction cur;
+  sigaction(SIGBUS, NULL, &cur);
+  if (!(cur.sa_flags & SA_SIGINFO) || cur.sa_sigaction != __map_guard_sigbus) {
+    struct sigaction sa;
+    memset(&sa, 0, sizeof sa);
+    sa.sa_sigaction = __map_guard_sigbus;
+    sa.sa_flags = SA_SIGINFO;
+    sigemptyset(&sa.sa_mask);
+    __map_guard_pgsize = sysconf(_SC_PAGESIZE);
+    sigaction(SIGBUS, &sa, &__map_guard_prev);
+  }
+  int i;
+  for (i = 0; i < MAP_GUARD_MAX && !added; i++) {
+    if (__map_guards[i].base == NULL) {
+      __map_guards[i].len = len;
+      __map_guards[i].cut = 0;
+      __map_guards[i].base = base;
+      added = true;
+    }
+  }
+  pthread_mutex_unlock(&__map_guard_lock);
+  TRACE_RETURN(added);
+}
+
+
+// Stops guarding a mapping, which should be unmapped right after.
+void __map_guard_remove(char* base)
+{
+  TRACE_ENTER;
+  pthread_mutex_lock(&__map_guard_lock);
+  int i;
+  for (i = 0; i < MAP_GUARD_MAX; i++) {
+    if (__map_guards[i].base == base)
+      __map_guards[i].base = NULL;
+  }
+  pthread_mutex_unlock(&__map_guard_lock);
+  TRACE_EXIT;
+}
+
+
+// Looks for mapped files that were cut short since the last look.
+// Their buffers are marked partial, since what's past the cut is
+// gone, and can't be saved back over the file.  Returns true if any
+// were found.
+bool buffers_check_maps(void)
+{
+  TRACE_ENTER;
+  if (!__map_guard_cut)
+    TRACE_RETURN(false);
+  __map_guard_cut = 0;
+  bool found = false;
+  int i, j, n = pivec_count(&_all_buffers);
+  for (i = 0; i < MAP_GUARD_MAX; i++) {
+    if (__map_guards[i].base == NULL || !__map_guards[i].cut)
+      continue;
+    __map_guards[i].cut = 0;
+    for (j = 0; j < n; j++) {
+      BUFFER buf = (BUFFER)pivec_get(&_all_buffers, j);
+      if (buf->map == __map_guards[i].base) {
+        logerr("'%s' was cut short while it was open", cstr_getbufptr(&buf->orig_filename));
+        buffer_setflags(buf, BUF_FLG_PARTIAL);
+        found = true;
+      }
+    }
+  }
+  TRACE_RETURN(found);
+}
+
+
+// Maps a regular file privately.  Returns NULL if it can't (empty
+// files, pipes, etc), in which case the caller should read it.
+char* __load_map(FILE* f, size_t* plen)
+{
+  TRACE_ENTER;
+  struct stat st;
+  if (fstat(fileno(f), &st) != 0 || !S_ISREG(st.st_mode) || st.st_size <= 0)
+    TRACE_RETURN(NULL);
+  void* data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fileno(f), 0);
+  if (data == MAP_FAILED)
+    TRACE_RETURN(NULL);
+  if (!__map_guard_add(data, st.st_size)) {
+    munmap(data, st.st_size);
+    TRACE_RETURN(NULL);
+  }
+  *plen = st.st_size;
+  TRACE_RETURN((char*)data);
+}
+
+
+// Width of s once its tabs are expanded.  Tabs inside quotes are
+// left alone.
+int __load_expanded_length(const char* s, int n, tabstops* tabs)
+{
+  TRACE_ENTER;
+  int i, col = 0, seenquotes = 0;
+  for (i = 0; i < n; i++) {
+    char c = s[i];
+    if (c == '"' || c == '\'')
+      seenquotes++;
+    if (c == '\t' && ((seenquotes&1) == 0))
+      col = tabs_next(tabs, col);
+    else
+      col++;
+  }
+  TRACE_RETURN(col);
+}
+
+
+// Builds a line from n raw bytes of file data, in text taken from
+// the arena.
+void __load_line(arena* text, struct line_t* l, const char* s, int n, tabstops* tabs, bool tabexpand)
+{
+  TRACE_ENTER;
+  if (!tabexpand || memchr(s, '\t', n) == NULL) {
+    char* txt = arena_get(text, n+1);
+    memcpy(txt, s, n);
+    txt[n] = '\0';
+    __line_initpooled(l, txt, n);
+    TRACE_EXIT;
+  }
+  int len = __load_expanded_length(s, n, tabs);
+  char* txt = arena_get(text, len+1);
+  int i, start = 0, col = 0, seenquotes = 0;
+  for (i = 0; i < n; i++) {
+    char c = s[i];
+    if (c == '"' || c == '\'') {
+      seenquotes++;
+    }
+    else if (c == '\t' && ((seenquotes&1) == 0)) {
+      memcpy(txt+col, s+start, i-start);
+      col += i-start;
+      int nextcol = tabs_next(tabs, col);
+      memset(txt+col, ' ', nextcol-col);
+      col = nextcol;
+      start = i+1;
+    }
+  }
+  memcpy(txt+col, s+start, n-start);
+  txt[len] = '\0';
+  __line_initpooled(l, txt, len);
+  l->expanded = (unsigned short int)min(len-n, USHRT_MAX);
+  TRACE_EXIT;
+}
+
+
+// Splits the file data at p into at most maxlines lines, appends
+// them to lines, and returns where it stopped.  Lines are left where
+// they were read whenever they can be.  Unless the data runs to the
+// end of the file, a line at the end with nothing to end it yet is
+// left for next time.
+char* __load_split(char* p, char* end, bool ateof, bool mapped, bool tabexpand, tabstops* tabs,
+                   arena* text, vec* lines, int maxlines, int* pnborrowed)
+{
+  TRACE_ENTER;
+  int nlines = 0;
+  while (p < end && nlines < maxlines) {
+    // A line ends at the first CR or LF, whichever comes first.
+    char* eol = memchr(p, '\n', end-p);
+    if (eol == NULL)
+      eol = end;
+    char* cr = memchr(p, '\r', eol-p);
+    if (cr != NULL)
+      eol = cr;
+    // a CR at the very end may have its LF in the next read
+    if (!ateof && (eol == end || (eol+1 == end && *eol == '\r')))
+      break;
+    char* next = eol;
+    int flags = LINE_INITIAL_FLAGS | LINE_FLG_DIRTY;
+    if (eol < end && *eol == '\r') {
+      flags |= LINE_FLG_CR;
+      next++;
+      if (next < end && *next == '\n') {
+        flags |= LINE_FLG_LF;
+        next++;
+      }
+    }
+    else if (eol < end) {
+      flags |= LINE_FLG_LF;
+      next++;
+    }
+    // if we are at eof, then we only keep the line if it has
+    // something (i.e. we have an unterminated last line)
+    if (next < end || (flags & LINE_FLG_LF) || eol > p) {
+      struct line_t line;
+      // An unterminated last line has nowhere to put its NUL, so it
+      // always gets a copy.  Other lines are left where they were
+      // read, and their CR or LF becomes the NUL.
+      if (eol < end && !(tabexpand && memchr(p, '\t', eol-p) != NULL)) {
+        if (mapped) {
+          __line_initmapped(&line, p, eol-p);
+          flags |= LINE_FLG_MAPPED;
+        }
+        else {
+          *eol = '\0';
+          __line_initpooled(&line, p, eol-p);
+          flags |= LINE_FLG_POOLED;
+        }
+        (*pnborrowed)++;
+      }
+      else {
+        __load_line(text, &line, p, eol-p, tabs, tabexpand);
+        flags |= LINE_FLG_POOLED;
+      }
+      line.flags = flags;
+      vec_append(lines, &line);
+      nlines++;
+    }
+    p = next;
+  }
+  TRACE_RETURN(p);
+}
+
+
+// Adds lines to the end of the buffer, which takes over their text,
+// and empties lines.
+void __load_append(BUFFER buf, vec* lines)
+{
+  TRACE_ENTER;
+  int i, n = vec_count(lines);
+  for (i = 0; i < n; i++)
+    _buffer_appendline_nocopy(buf, (struct line_t*)vec_get(lines, i));
+  vec_clear(lines);
+  TRACE_EXIT;
+}
+
+
+bool __load_async = false;
+
+// Lets big files load in the background.  Off unless there's a screen
+// to show them on while they load.
+void buffer_set_load_async(bool async)
+{
+  TRACE_ENTER;
+  __load_async = async;
+  TRACE_EXIT;
+}
+
+
+// Hands f to a thread to read, if it's big enough to be worth it, and
+// waits for the first of it.  Returns false, with f untouched, if the
+// caller should read it instead.
+bool _buffer_load_start(BUFFER buf, FILE* f, bool tabexpand)
+{
+  TRACE_ENTER;
+  struct stat st;
+  if (fstat(fileno(f), &st) != 0 || !S_ISREG(st.st_mode) || st.st_size < LOAD_ASYNC_MIN)
+    TRACE_RETURN(false);
+  struct loader_t* ld = (struct loader_t*)calloc(1, sizeof(struct loader_t));
+  ld->f = f;
+  ld->size = st.st_size;
+  ld->tabexpand = tabexpand;
+  tabs_init(&ld->tabs, 0, buf->profile->tabexpand_size, NULL);
+  pthread_mutex_init(&ld->lock, NULL);
+  pthread_cond_init(&ld->ready, NULL);
+  ld->tail = &ld->head;
+  ld->err = POE_ERR_OK;
+  if (pthread_create(&ld->thread, NULL, __loader_main, ld) != 0) {
+    logerr("can't start a thread to load '%s'", cstr_getbufptr(&buf->orig_filename));
+    pthread_cond_destroy(&ld->ready);
+    pthread_mutex_destroy(&ld->lock);
+    tabs_destroy(&ld->tabs);
+    free(ld);
+    TRACE_RETURN(false);
+  }
+  buf->loader = ld;
+  _buffer_load_take(buf, LOADWAIT_FIRST, INT_MAX);
+  TRACE_RETURN(true);
+}
+
+
+// The loader thread.  Each block read is split into lines, apart from
+// a partial line at the end, which is carried into the next block.
+void* __loader_main(void* arg)
+{
+  TRACE_ENTER;
+  struct loader_t* ld = (struct loader_t*)arg;
+  size_t want = LOAD_CHUNK_FIRST;
+  size_t carry = 0;
+  int64_t off = 0;
+  char* data = (char*)malloc(want);
+  POE_ERR err = POE_ERR_OK;
+  bool eof = false;
+  while (!eof) {
+    if (data == NULL) {
+      err = POE_ERR_MEM_FULL;
+      break;
+    }
+    size_t nread = fread(data+carry, 1, want, ld->f);
+    if (ferror(ld->f)) {
+      err = POE_ERR_READING_FILE;
+      break;
+    }
+    eof = nread < want;
+    off += nread;
+    char* end = data + carry + nread;
+    struct loadchunk_t* chunk = (struct loadchunk_t*)calloc(1, sizeof(struct loadchunk_t));
+    arena_init(&chunk->text, LINE_TEXT_BLKSIZE);
+    vec_init(&chunk->lines, 1024, sizeof(struct line_t));
+    int nborrowed = 0;
+    char* rest = __load_split(data, end, eof, false, ld->tabexpand, &ld->tabs,
+                              &chunk->text, &chunk->lines, INT_MAX, &nborrowed);
+    char* next = NULL;
+    chunk->end = off - (end - rest);
+    if (!eof) {
+      carry = end - rest;
+      want = min(want * 2, LOAD_CHUNK_MAX);
+      next = (char*)malloc(carry + want);
+      if (next != NULL)
+        memcpy(next, rest, carry);
+    }
+    if (nborrowed > 0)
+      chunk->data = data;
+    else
+      free(data);
+    data = next;
+    // A line too long for the block just makes the next one bigger
+    if (vec_count(&chunk->lines) == 0) {
+      __loadchunk_free(chunk);
+      chunk = NULL;
+    }
+    pthread_mutex_lock(&ld->lock);
+    if (chunk != NULL) {
+      *ld->tail = chunk;
+      ld->tail = &chunk->next;
+      pthread_cond_signal(&ld->ready);
+    }
+    bool stop = ld->stop;
+    pthread_mutex_unlock(&ld->lock);
+    if (chunk != NULL)
+      events_wake();
+    if (stop && !eof) {
+      err = POE_ERR_CANCELLED;
+      break;
+    }
+  }
+  free(data);
+  pthread_mutex_lock(&ld->lock);
+  ld->err = err;
+  ld->done = true;
+  pthread_cond_signal(&ld->ready);
+  pthread_mutex_unlock(&ld->lock);
+  events_wake();
+  TRACE_RETURN(NULL);
+}
+
+
+void __loadchunk_free(struct loadchunk_t* chunk)
+{
+  TRACE_ENTER;
+  int i, n = vec_count(&chunk->lines);
+  for (i = chunk->taken; i < n; i++)
+    __line_destroy((struct line_t*)vec_get(&chunk->lines, i));
+  vec_destroy(&chunk->lines);
+  arena_destroy(&chunk->text);
+  free(chunk->data);
+  free(chunk);
+  TRACE_EXIT;
+}
+
+
+// Adds up to maxlines of what the loader has finished to the end of
+// the buffer.  If asked to, waits until there's something to add, or
+// until the loader is done.  Returns true if the buffer changed.
+bool _buffer_load_take(BUFFER buf, enum loadwait_t wait, int maxlines)
+{
+  TRACE_ENTER;
+  struct loader_t* ld = buf->loader;
+  bool done = false;
+  int n = 0;
+  while (n < maxlines) {
+    if (ld->pending == NULL) {
+      pthread_mutex_lock(&ld->lock);
+      while (!ld->done && ld->head == NULL
+             && (wait == LOADWAIT_DONE || (wait == LOADWAIT_FIRST && n == 0)))
+        pthread_cond_wait(&ld->ready, &ld->lock);
+      ld->pending = ld->head;
+      ld->head = NULL;
+      ld->tail = &ld->head;
+      done = ld->done;
+      pthread_mutex_unlock(&ld->lock);
+      if (ld->pending == NULL)
+        break;
+    }
+    // The buffer takes the chunk's text as soon as it takes any of
+    // its lines.
+    struct loadchunk_t* chunk = ld->pending;
+    if (chunk->data != NULL)
+      arena_adopt(&buf->text, chunk->data);
+    chunk->data = NULL;
+    arena_merge(&buf->text, &chunk->text);
+    int i, count = vec_count(&chunk->lines);
+    int k = min(count - chunk->taken, maxlines - n);
+    for (i = 0; i < k; i++)
+      _buffer_appendline_nocopy(buf, (struct line_t*)vec_get(&chunk->lines, chunk->taken + i));
+    chunk->taken += k;
+    n += k;
+    if (chunk->taken == count) {
+      ld->taken = chunk->end;
+      ld->pending = chunk->next;
+      __loadchunk_free(chunk);
+    }
+  }
+  // no more changed than the file is
+  buffer_clrflags(buf, BUF_FLG_DIRTY);
+  bool changed = (n > 0);
+  if (done && ld->pending == NULL) {
+    _buffer_load_end(buf);
+    changed = true;
+  }
+  TRACE_RETURN(changed);
+}
+
+
+// Cleans up after a loader that has finished.  If it didn't get to the
+// end of the file, the buffer is marked as holding only part of it.
+void _buffer_load_end(BUFFER buf)
+{
+  TRACE_ENTER;
+  struct loader_t* ld = buf->loader;
+  pthread_join(ld->thread, NULL);
+  if (ld->err != POE_ERR_OK) {
+    if (ld->err != POE_ERR_CANCELLED)
+      logerr("error %d loading file '%s'", ld->err, cstr_getbufptr(&buf->orig_filename));
+    buffer_setflags(buf, BUF_FLG_PARTIAL);
+  }
+  fclose(ld->f);
+  tabs_destroy(&ld->tabs);
+  pthread_cond_destroy(&ld->ready);
+  pthread_mutex_destroy(&ld->lock);
+  free(ld);
+  buf->loader = NULL;
+  buffer_ensure_min_lines(buf, false);
+  TRACE_EXIT;
+}
+
+
+bool buffer_loading(BUFFER buf)
+{
+  TRACE_ENTER;
+  VALIDATEBUFFER(buf);
+  TRACE_RETURN(buf->loader != NULL);
+}
+
+
+// How much of its file a buffer has taken in, as a percentage, or -1
+// if it isn't loading.
+int buffer_load_progress(BUFFER buf)
+{
+  TRACE_ENTER;
+  VALIDATEBUFFER(buf);
+  struct loader_t* ld = buf->loader;
+  if (ld == NULL)
+    TRACE_RETURN(-1);
+  // the file may have grown since we looked
+  int pct = ld->size > 0 ? (int)min(ld->taken * 100 / ld->size, 99) : 0;
+  TRACE_RETURN(pct);
+}
+
+
+// Stops loading, keeping the lines read so far.
+void buffer_load_cancel(BUFFER buf)
+{
+  TRACE_ENTER;
+  VALIDATEBUFFER(buf);
+  struct loader_t* ld = buf->loader;
+  if (ld == NULL)
+    TRACE_EXIT;
+  pthread_mutex_lock(&ld->lock);
+  ld->stop = true;
+  pthread_mutex_unlock(&ld->lock);
+  _buffer_load_take(buf, LOADWAIT_DONE, INT_MAX);
+  TRACE_EXIT;
+}
+
+
+// Waits for the rest of the file to load.
+void buffer_load_wait(BUFFER buf)
+{
+  TRACE_ENTER;
+  VALIDATEBUFFER(buf);
+  if (buf->loader != NULL)
+    _buffer_load_take(buf, LOADWAIT_DONE, INT_MAX);
+  TRACE_EXIT;
+}
+
+
+// Adds some of what the loaders have read to their buffers, a few
+// lines at a time so the keyboard isn't kept waiting.  Returns how
+// many lines were added, or -1 if no buffer is loading.
+int buffers_load_poll(void)
+{
+  TRACE_ENTER;
+  int added = -1;
+  int i, n = pivec_count(&_all_buffers);
+  for (i = 0; i < n; i++) {
+    BUFFER buf = (BUFFER)pivec_get(&_all_buffers, i);
+    if (buf->loader != NULL) {
+      int before = linetree_count(&buf->lines);
+      _buffer_load_take(buf, LOADWAIT_NONE, LOAD_POLL_LINES);
+      added = max(added, 0) + linetree_count(&buf->lines) - before;
+    }
+  }
+  TRACE_RETURN(added);
+}
+
+
+// Buffers can't be changed until they've finished loading.  The
+// commands that change them check first; this takes back anything the
+// current undo group did to one anyway.  Returns true if there was
+// anything to take back.
+bool buffers_load_revoke_edits(void)
+{
+  TRACE_ENTER;
+  bool revoked = false;
+  int i, n = pivec_count(&_all_buffers);
+  for (i = 0; i < n; i++) {
+    BUFFER buf = (BUFFER)pivec_get(&_all_buffers, i);
+    if (buf->loader != NULL && journal_revoke(buf)) {
+      buffer_clrflags(buf, BUF_FLG_DIRTY);
+      revoked = true;
+    }
+  }
+  TRACE_RETURN(revoked);
+}
+
+
+// Sets up to load filename into buf.  The file is only looked at by
+// __loadfile_read, so that can be done on any thread.
+void __loadfile_init(struct loadfile_t* lf, BUFFER buf, cstr* filename, bool tabexpand, bool split)
+{
+  TRACE_ENTER;
+  memset(lf, 0, sizeof(struct loadfile_t));
+  cstr_initfrom(&lf->name, filename);
+  cstr_trimleft(&lf->name, poe_iswhitespace);
+  cstr_trimright(&lf->name, poe_iswhitespace);
+  if (cstr_count(&lf->name) >= 2 && cstr_get(&lf->name, 0) == '~' && cstr_get(&lf->name, 1) == '/') {
+    cstr_remove(&lf->name, 0);
+    const char* home = getenv("HOME");
+    if (home != NULL) {
+      int homelen = strlen(home);
+      cstr_insertm(&lf->name, 0, homelen, home);
+    }
+  }
+  lf->tabexpand = tabexpand;
+  tabs_init(&lf->tabs, 0, buf->profile->tabexpand_size, NULL);
+  lf->want_map = buffer_tstflags(buf, BUF_FLG_MAPPED);
+  lf->split = split;
+  arena_init(&lf->text, LINE_TEXT_BLKSIZE);
+  vec_init(&lf->lines, LOAD_BATCH_LINES, sizeof(struct line_t));
+  TRACE_EXIT;
+}
+
+
+void __loadfile_destroy(struct loadfile_t* lf)
+{
+  TRACE_ENTER;
+  if (lf->f != NULL)
+    fclose(lf->f);
+  int i, n = vec_count(&lf->lines);
+  for (i = 0; i < n; i++)
+    __line_destroy((struct line_t*)vec_get(&lf->lines, i));
+  vec_destroy(&lf->lines);
+  arena_destroy(&lf->text);
+  if (lf->data != NULL) {
+    if (lf->mapped) {
+      __map_guard_remove(lf->data);
+      munmap(lf->data, lf->datalen);
+    }
+    else
+      free(lf->data);
+  }
+  tabs_destroy(&lf->tabs);
+  cstr_destroy(&lf->name);
+  TRACE_EXIT;
+}
+
+
+// Finds and opens the file, and reads it in.  Files big enough to be
+// read in the background are left open for the loader thread, and
+// the rest are split into lines if the caller asked for that and
+// there aren't too many to hold at once.  Touches nothing but lf.
+void __loadfile_read(struct loadfile_t* lf)
+{
+  TRACE_ENTER;
+  if (NULL == realpath(cstr_getbufptr(&lf->name), lf->path))
+    TRACE_EXIT;
+  lf->found = true;
+
+  lf->f = fopen(lf->path, "r+");
+  if (lf->f == NULL && errno == EACCES) {
+    errno = 0;
+    lf->f = fopen(lf->path, "r");
+    lf->flg_rdonly = BUF_FLG_RDONLY;
+  }
+  if (lf->f == NULL) {
+    lf->open_errno = errno;
+    TRACE_EXIT;
+  }
+  lf->opened = true;
+
+  // Read-only files (and buffers that ask for it) are viewed through
+  // a private mapping rather than copied, which costs nothing up
+  // front anyway.
+  struct stat st;
+  if (!lf->flg_rdonly && !lf->want_map && __load_async && fstat(fileno(lf->f), &st) == 0
+      && S_ISREG(st.st_mode) && st.st_size >= LOAD_ASYNC_MIN)
+    TRACE_EXIT;
+  __loadfile_readdata(lf);
+  if (lf->data != NULL && lf->split && lf->datalen < LOAD_SPLIT_MAX) {
+    __load_split(lf->data, lf->data + lf->datalen, true, lf->mapped, lf->tabexpand, &lf->tabs,
+                 &lf->text, &lf->lines, INT_MAX, &lf->nborrowed);
+    lf->split_done = true;
+  }
+  TRACE_EXIT;
+}
+
+
+void __loadfile_readdata(struct loadfile_t* lf)
+{
+  TRACE_ENTER;
+  if (lf->flg_rdonly || lf->want_map) {
+    lf->data = __load_map(lf->f, &lf->datalen);
+    lf->mapped = (lf->data != NULL);
+  }
+  if (!lf->mapped)
+    lf->data = __load_slurp(lf->f, &lf->datalen);
+  if (lf->data == NULL)
+    lf->read_errno = errno;
+  fclose(lf->f);
+  lf->f = NULL;
+  TRACE_EXIT;
+}
+
+
+// Puts what __loadfile_read found into the buffer, naming it after
+// the file.  Main thread only.
+POE_ERR __loadfile_attach(BUFFER buf, struct loadfile_t* lf)
+{
+  TRACE_ENTER;
+  if (!lf->found)
     TRACE_RETURN(POE_ERR_FILE_NOT_FOUND);
+  POE_ERR err = POE_ERR_OK;
+  char expanded_filename[PATH_MAX+1];
+  strcpy(expanded_filename, lf->path);
   const char* pszFilename = expanded_filename;
   
   // clean out the buffer
-  //buffer_removelines(buf, 0, buffer_count(buf), true);
   buffer_clear(buf, false, true);
   
   // Decide on a buffer name (may have to try basename<1>, basename<2>, etc...
   cstr_assignstr(&buf->orig_filename, pszFilename);
   cstr_assignstr(&buf->curr_filename, pszFilename);
   
-  const char* pszBasename = (const char*)basename(pszFilename);
-  const char* pszDirname = (const char*)dirname(pszFilename);
+  const char* pszBasename = (const char*)basename(expanded_filename);
+  const char* pszDirname = (const char*)dirname(expanded_filename);
   if (pszBasename == NULL)
     logerr("basename('%s') returned error %d", pszFilename, errno);
   
   if (pszBasename[0] == '/') {
     cstr_assignstr(&buf->base_buffername, pszBasename+1);
   }
-  else {
-    cstr_assignstr(&buf->base_buffername, pszBasename);
+  else {
+    cstr_assignstr(&buf->base_buffername, pszBasename);
+  }
+  cstr_assignstr(&buf->orig_dirname, pszDirname);
+  cstr_assignstr(&buf->curr_dirname, pszDirname);
+  
+  cstr cand_buffername = _buffer_make_unique_name(&buf->base_buffername);
+  cstr_assign(&buf->buffername, &cand_buffername);
+  cstr_destroy(&cand_buffername);
+  
+  buffer_setflags(buf, BUF_FLG_VISIBLE);
+  buffer_clrflags(buf, BUF_FLG_DIRTY|BUF_FLG_RDONLY|BUF_FLG_NEW|BUF_FLG_PARTIAL);
+  
+  if (!lf->opened) {
+    logerr("error %d opening file '%s'", lf->open_errno, lf->path);
+    buffer_setflags(buf, BUF_FLG_NEW);
+    switch (lf->open_errno) {
+    case EPERM: case EIO: case EACCES:
+      err = POE_ERR_READING_FILE;
+      break;
+    case ENOENT:
+      err = POE_ERR_FILE_NOT_FOUND;
+      break;
+    default:
+      err = POE_ERR_CANT_OPEN;
+      break;
+    }
+    goto done;
+  }
+  
+  // Big files carry on loading in the background.
+  if (lf->f != NULL) {
+    if (_buffer_load_start(buf, lf->f, lf->tabexpand)) {
+      lf->f = NULL;
+      goto done;
+    }
+    __loadfile_readdata(lf);
+  }
+  if (lf->data == NULL) {
+    logerr("error %d reading file '%s'", lf->read_errno, lf->path);
+    err = POE_ERR_READING_FILE;
+    goto done;
+  }
+
+  // load the file...
+  if (lf->split_done) {
+    arena_merge(&buf->text, &lf->text);
+    __load_append(buf, &lf->lines);
+  }
+  else {
+    char* p = lf->data;
+    char* end = lf->data + lf->datalen;
+    while (p < end) {
+      p = __load_split(p, end, true, lf->mapped, lf->tabexpand, &lf->tabs, &buf->text,
+                       &lf->lines, LOAD_BATCH_LINES, &lf->nborrowed);
+      __load_append(buf, &lf->lines);
+    }
+  }
+  if (!lf->mapped) {
+    if (lf->nborrowed == 0)
+      free(lf->data);
+    else
+      arena_adopt(&buf->text, lf->data);
+  }
+  else if (lf->nborrowed == 0) {
+    __map_guard_remove(lf->data);
+    munmap(lf->data, lf->datalen);
+  }
+  else {
+    buf->map = lf->data;
+    buf->maplen = lf->datalen;
+    buffer_setflags(buf, BUF_FLG_MAPPED);
+  }
+  lf->data = NULL;
+  
+ done:
+  // update buffer flags
+  buffer_clrflags(buf, BUF_FLG_DIRTY);
+  buffer_setflags(buf, BUF_FLG_VISIBLE | lf->flg_rdonly);
+  buffer_ensure_min_lines(buf, false);
+  journal_clear(buf->journal);
+
+  TRACE_RETURN(err);
+}
+
+
+POE_ERR buffer_load(BUFFER buf, cstr* filename, bool tabexpand)
+{
+  TRACE_ENTER;
+  VALIDATEBUFFER(buf);
+  struct loadfile_t lf;
+  __loadfile_init(&lf, buf, filename, tabexpand, false);
+  __loadfile_read(&lf);
+  POE_ERR err = __loadfile_attach(buf, &lf);
+  __loadfile_destroy(&lf);
+  TRACE_RETURN(err);
+}
+
+
+// Loads n files into n buffers.  The files are read and split up on
+// the worker pool, all at once, and then put into their buffers in
+// the order given, so the buffers are named just as if they had been
+// loaded one after the other.  errs gets the result for each.
+void buffers_load_many(int n, BUFFER* bufs, cstr** filenames, bool tabexpand, POE_ERR* errs)
+{
+  TRACE_ENTER;
+  struct loadmany_t lm;
+  lm.files = (struct loadfile_t*)calloc(max(n, 1), sizeof(struct loadfile_t));
+  lm.n = n;
+  lm.next = 0;
+  int i;
+  for (i = 0; i < n; i++) {
+    VALIDATEBUFFER(bufs[i]);
+    __loadfile_init(&lm.files[i], bufs[i], filenames[i], tabexpand, true);
+  }
+  if (n > 1 && workpool_size() > 1)
+    workpool_run(__loadmany_job, &lm, NULL, NULL);
+  else
+    __loadmany_job(&lm, 0);
+  for (i = 0; i < n; i++) {
+    errs[i] = __loadfile_attach(bufs[i], &lm.files[i]);
+    __loadfile_destroy(&lm.files[i]);
+  }
+  free(lm.files);
+  TRACE_EXIT;
+}
+
+
+void __loadmany_job(void* arg, int worker)
+{
+  TRACE_ENTER;
+  struct loadmany_t* lm = arg;
+  int i;
+  while ((i = __atomic_fetch_add(&lm->next, 1, __ATOMIC_RELAXED)) < lm->n)
+    __loadfile_read(&lm->files[i]);
+  TRACE_EXIT;
+}
+
+
+// Output staging for buffer_save.  Short pieces are copied into a
+// large stage, long ones are queued by reference, and the lot is
+// handed to writev a batch at a time.
+#define SAVE_STAGE_SIZE (256*1024)
+#define SAVE_DIRECT_MIN (4*1024)
+#define SAVE_MAX_IOV    (64)
+
+struct saveout_t {
+  int fd;
+  struct iovec iov[SAVE_MAX_IOV];
+  int niov;
+  char* stage;
+  size_t stage_len;  // bytes used in the stage
+  size_t stage_seg;  // start of the staged bytes not queued yet
+  bool failed;
+};
+
+
+void __save_flush(struct saveout_t* out)
+{
+  TRACE_ENTER;
+  if (out->stage_len > out->stage_seg) {
+    out->iov[out->niov].iov_base = out->stage + out->stage_seg;
+    out->iov[out->niov].iov_len = out->stage_len - out->stage_seg;
+    out->niov++;
   }
-  cstr_assignstr(&buf->orig_dirname, pszDirname);
-  cstr_assignstr(&buf->curr_dirname, pszDirname);
-  
-  cstr cand_buffername = _buffer_make_unique_name(&buf->base_buffername);
-  cstr_assign(&buf->buffername, &cand_buffername);
-  
-  buffer_setflags(buf, BUF_FLG_VISIBLE);
-  buffer_clrflags(buf, BUF_FLG_DIRTY|BUF_FLG_RDONLY|BUF_FLG_NEW);
-  
-  // Open the file...
-  FILE* f = fopen(pszFilename, "r+");
-  if (f == NULL && errno == EACCES) {
-    errno = 0;
-    f = fopen(pszFilename, "r");
-    flg_rdonly = BUF_FLG_RDONLY;
+  struct iovec* iov = out->iov;
+  int niov = out->niov;
+  while (niov > 0 && !out->failed) {
+    ssize_t nwritten = writev(out->fd, iov, niov);
+    if (nwritten < 0) {
+      if (errno != EINTR)
+        out->failed = true;
+      continue;
+    }
+    // skip whatever made it out, and pick up after a short write
+    while (niov > 0 && (size_t)nwritten >= iov->iov_len) {
+      nwritten -= iov->iov_len;
+      iov++;
+      niov--;
+    }
+    if (niov > 0) {
+      iov->iov_base = (char*)iov->iov_base + nwritten;
+      iov->iov_len -= nwritten;
+    }
   }
-  if (f == NULL) {
-    logerr("error %d opening file '%s'", errno, pszFilename);
-    buffer_setflags(buf, BUF_FLG_NEW);
-    switch (errno) {
-    case EPERM: case EIO: case EACCES:
-      buffer_ensure_min_lines(buf, false);
-      err = POE_ERR_READING_FILE;
-      goto done;
-      break;
-    case ENOENT:
-      buffer_ensure_min_lines(buf, false);
-      err = POE_ERR_FILE_NOT_FOUND;
-      goto done;
-      break;
-    default:
-      buffer_ensure_min_lines(buf, false);
-      err = POE_ERR_CANT_OPEN;
-      goto done;
-      break;
+  out->niov = 0;
+  out->stage_len = out->stage_seg = 0;
+  TRACE_EXIT;
+}
+
+
+void __save_put(struct saveout_t* out, const char* s, size_t n)
+{
+  TRACE_ENTER;
+  if (n == 0)
+    TRACE_EXIT;
+  if (n >= SAVE_DIRECT_MIN) {
+    // leave room for this and the staged bytes ahead of it
+    if (out->niov >= SAVE_MAX_IOV-2)
+      __save_flush(out);
+    if (out->stage_len > out->stage_seg) {
+      out->iov[out->niov].iov_base = out->stage + out->stage_seg;
+      out->iov[out->niov].iov_len = out->stage_len - out->stage_seg;
+      out->niov++;
+      out->stage_seg = out->stage_len;
     }
+    out->iov[out->niov].iov_base = (char*)s;
+    out->iov[out->niov].iov_len = n;
+    out->niov++;
   }
-  
-  // load the file...
-  struct line_t line;
-  __line_init(&line);
-  cstr* str = &line.txt;
-  int col = 0;
-  int c;
-  int seenquotes = 0;
-  while (!feof(f)) {
-    c = fgetc(f);
-    while (c != '\n' && c != '\r' && !feof(f)) {
-      if (c == '"' || c == '\'')
-        seenquotes++;
-      if (c == '\t' && ((seenquotes&1) == 0) && tabexpand) {
-        int nextcol = tabs_next(&load_tabs, col);
-        cstr_appendct(str, ' ', nextcol-col);
-        col = nextcol;
-      }
-      else {
-        cstr_append(str, (char)c);
-        col++;
-      }
-      c = fgetc(f);
+  else {
+    if (out->stage_len + n > SAVE_STAGE_SIZE)
+      __save_flush(out);
+    memcpy(out->stage + out->stage_len, s, n);
+    out->stage_len += n;
+  }
+  TRACE_EXIT;
+}
+
+
+// Finds the next blank or double quote in s[i..n), checking a word
+// at a time.
+int __save_scan(const char* s, int i, int n)
+{
+  const uint64_t ones = 0x0101010101010101ULL, highs = 0x8080808080808080ULL;
+  const uint64_t blanks = ones * ' ', quotes = ones * '"';
+  while (i + 8 <= n) {
+    uint64_t w;
+    memcpy(&w, s+i, 8);
+    uint64_t a = w ^ blanks, b = w ^ quotes;
+    if ((((a - ones) & ~a) | ((b - ones) & ~b)) & highs)
+      break;
+    i += 8;
+  }
+  while (i < n && s[i] != ' ' && s[i] != '"')
+    i++;
+  return i;
+}
+
+
+// Writes a line, turning runs of blanks that reach a tab stop into
+// tabs.  Blanks inside double quotes are left alone.
+void __save_line(struct saveout_t* out, const char* s, int len, tabstops* tabs, bool blankcompress)
+{
+  TRACE_ENTER;
+  if (!blankcompress) {
+    __save_put(out, s, len);
+    TRACE_EXIT;
+  }
+  int j = 0, start = 0;
+  bool inquotes = false;
+  while ((j = __save_scan(s, j, len)) < len) {
+    if (s[j] == '"') {
+      inquotes = !inquotes;
+      j++;
+      continue;
     }
-    line.flags = LINE_INITIAL_FLAGS;
-    if (c == '\r') {
-      c = fgetc(f);
-      line.flags |= LINE_FLG_CR;
-      if (c == '\n') {
-        line.flags |= LINE_FLG_LF;
-      }
-      else {
-        ungetc(c, f);
-      }
+    if (inquotes) {
+      j++;
+      continue;
     }
-    else if (c == '\n') {
-      line.flags |= LINE_FLG_LF;
+    int runlen = 1;
+    while (j+runlen < len && s[j+runlen] == ' ')
+      runlen++;
+    // buffer columns and text positions are the same, tabs having
+    // been expanded on load
+    int nextcol = tabs_next(tabs, j);
+    if (runlen > 2 && runlen >= nextcol-j) {
+      __save_put(out, s+start, j-start);
+      __save_put(out, "\t", 1);
+      j = start = nextcol;
     }
-        
-    // if we are at eof, then we only write out the line if it has
-    // something (i.e. we have an unterminated last line)
-    if (!feof(f) || cstr_count(str) > 0) {
-      buffer_appendline(buf, &line);
-      col = 0;
-      seenquotes = 0;
-      cstr_clear(str);
+    else {
+      j += runlen;
     }
   }
-  fclose(f);
-  
-  // finish up
-  cstr_destroy(&cand_buffername);
-  __line_destroy(&line);
-  
- done:
-  cstr_destroy(&cpy_filename);
-  // update buffer flags
-  buffer_clrflags(buf, BUF_FLG_DIRTY);
-  buffer_setflags(buf, BUF_FLG_VISIBLE | flg_rdonly);
-  tabs_destroy(&load_tabs);
-  buffer_ensure_min_lines(buf, false);
+  __save_put(out, s+start, len-start);
+  TRACE_EXIT;
+}
 
-  TRACE_RETURN(err);
+
+POE_ERR __save_errno_err(int e)
+{
+  switch (e) {
+  case EPERM: case EIO: case EACCES:
+    return POE_ERR_READING_FILE;
+  case ENOENT:
+    return POE_ERR_FILE_NOT_FOUND;
+  default:
+    return POE_ERR_CANT_OPEN;
+  }
+}
+
+
+// Extended attributes, ACLs among them, stay with the old file when
+// a new one is renamed over it.  SELinux labels are left out, since
+// every file has one and the new file gets its own.
+bool __save_has_xattrs(const char* path)
+{
+  TRACE_ENTER;
+  bool rval = false;
+#if defined(__linux__)
+  ssize_t len = listxattr(path, NULL, 0);
+  if (len > 0) {
+    char* names = malloc(len);
+    len = (names == NULL) ? -1 : listxattr(path, names, len);
+    ssize_t i;
+    for (i = 0; i < len && !rval; i += strlen(names+i) + 1)
+      rval = strcmp(names+i, "security.selinux") != 0;
+    if (len < 0)
+      rval = true;
+    free(names);
+  }
+#endif
+  TRACE_RETURN(rval);
+}
+
+
+// Makes the rename of a file into its directory stick
+POE_ERR __save_sync_dir(const char* path)
+{
+  TRACE_ENTER;
+  char* dir = strsave(path);
+  int dfd = open(dirname(dir), O_RDONLY);
+  free(dir);
+  if (dfd < 0)
+    TRACE_RETURN(POE_ERR_OK);
+  POE_ERR rval = POE_ERR_OK;
+  if (fsync(dfd) != 0 && errno != EINVAL)
+    rval = POE_ERR_WRITING_FILE;
+  close(dfd);
+  TRACE_RETURN(rval);
 }
 
 
+// The buffer is written to a temporary file next to the target,
+// which is synced and then renamed over the target, so a failed
+// save leaves the old file as it was.
 POE_ERR buffer_save(BUFFER buf, cstr* filename, bool blankcompress)
 {
   TRACE_ENTER;
   VALIDATEBUFFER(buf);
   
-  tabstops save_tabs;
-  tabs_init(&save_tabs, 0, buf->profile->tabexpand_size, NULL);
-  
   POE_ERR rval = POE_ERR_OK;
+  if (buf->loader != NULL)
+    TRACE_RETURN(POE_ERR_STILL_LOADING);
   if (filename == NULL)
     filename = &buf->curr_filename;
   const char* pszFilename = cstr_getbufptr(filename);
   //logmsg("buffer_save, curr_filename = '%s'", cstr_getbufptr(&buf->curr_filename));
   if (cstr_count(&buf->curr_filename) == 0 && (pszFilename == NULL || strlen(pszFilename) == 0))
-    return POE_ERR_MISSING_FILE_NAME;
+    TRACE_RETURN(POE_ERR_MISSING_FILE_NAME);
   
   // figure out which name to use
   // should really construct out of basename(filename) + "/" + base_buffername)
@@ -1492,69 +3158,95 @@ POE_ERR buffer_save(BUFFER buf, cstr* filename, bool blankcompress)
     cstr_append(&save_filename, '/');
     cstr_appendm(&save_filename, strlen(pszFilename), pszFilename);
   }
-  
-  // Open, and handle any errors...
-  FILE* f = fopen(cstr_getbufptr(&save_filename), "w");
-  if (f == NULL) {
+
+  // Replace the file a symlink points at rather than the link
+  char* resolved = realpath(cstr_getbufptr(&save_filename), NULL);
+  if (resolved != NULL) {
+    cstr_assignstr(&save_filename, resolved);
+    free(resolved);
+  }
+  const char* target = cstr_getbufptr(&save_filename);
+  // Saving what we have of a file over the whole of it would lose the rest
+  if (buffer_tstflags(buf, BUF_FLG_PARTIAL) && strcmp(target, cstr_getbufptr(&buf->orig_filename)) == 0) {
     cstr_destroy(&save_filename);
-    switch (errno) {
-    case EPERM: case EIO: case EACCES:
-      TRACE_RETURN(POE_ERR_READING_FILE);
-      break;
-    case ENOENT:
-      TRACE_RETURN(POE_ERR_FILE_NOT_FOUND);
-      break;
-    default:
-      TRACE_RETURN(POE_ERR_CANT_OPEN);
-      break;
+    TRACE_RETURN(POE_ERR_PARTIAL_FILE);
+  }
+  struct stat st;
+  bool exists = stat(target, &st) == 0;
+  if (exists && access(target, W_OK) != 0) {
+    rval = __save_errno_err(errno);
+    cstr_destroy(&save_filename);
+    TRACE_RETURN(rval);
+  }
+
+  // Write a temp file and rename it over the target, so a failed save
+  // leaves the old file alone.  Files with other links or extended
+  // attributes, and files we couldn't hand back to their owner, would
+  // come out changed, so those are overwritten in place, as are files
+  // in directories we can't write.
+  cstr tmp_filename;
+  cstr_initfrom(&tmp_filename, &save_filename);
+  cstr_appendstr(&tmp_filename, ".poeXXXXXX");
+  char* tmpname = (char*)cstr_getbufptr(&tmp_filename);
+  bool inplace = exists && (st.st_nlink > 1 || __save_has_xattrs(target));
+  int fd = -1;
+  if (!inplace) {
+    fd = mkstemp(tmpname);
+    if (fd < 0 && exists && (errno == EACCES || errno == EPERM || errno == EROFS))
+      inplace = true;
+  }
+  if (fd >= 0 && exists) {
+    fchmod(fd, st.st_mode & 07777);
+    if (fchown(fd, st.st_uid, st.st_gid) != 0) {
+      close(fd);
+      unlink(tmpname);
+      fd = -1;
+      inplace = true;
     }
   }
-  
+  else if (fd >= 0) {
+    mode_t mask = umask(0);
+    umask(mask);
+    fchmod(fd, 0666 & ~mask);
+  }
+  if (inplace) {
+    // Truncating a file the buffer still has mapped would take the
+    // text out from under it
+    if (buf->map != NULL)
+      _buffer_release_text(buf);
+    fd = open(target, O_WRONLY|O_TRUNC);
+  }
+  if (fd < 0) {
+    rval = __save_errno_err(errno);
+    cstr_destroy(&tmp_filename);
+    cstr_destroy(&save_filename);
+    TRACE_RETURN(rval);
+  }
+
+  struct saveout_t out;
+  out.fd = fd;
+  out.niov = 0;
+  out.stage = malloc(SAVE_STAGE_SIZE);
+  out.stage_len = out.stage_seg = 0;
+  out.failed = out.stage == NULL;
+
+  tabstops save_tabs;
+  tabs_init(&save_tabs, 0, buf->profile->tabexpand_size, NULL);
   int nlines = buffer_count(buf);
   int i;
-  for (i = 0; i < nlines; i++) {
+  for (i = 0; i < nlines && !out.failed; i++) {
     struct line_t* line = _line(buf, i);
     // Write the line, compressing tabs as necessary
-    int j, col = 0;
-    int len = cstr_count(&line->txt);
-    int seenquotes = 0;
-    for (j = 0; j < len; j++) {
-      char c = cstr_get(&line->txt, j);
-      if (c == ' ' && blankcompress && ((seenquotes&1) == 0)) {
-        int nextcol = tabs_next(&save_tabs, col);
-        int runlen = strspn(cstr_getcharptr(&line->txt, j), " ");
-        if (runlen > 2 && runlen >= nextcol-col) {
-          fputc('\t', f);
-          col = nextcol;
-          j = nextcol-1; // will be incremented in 'for'
-        }
-        else {
-          int k;
-          for (k = 0; k < runlen; k++)
-            fputc(c, f);
-          col = col+runlen;
-          j += runlen-1;
-        }
-      }
-      else if (c == '"' || c == '\"') {
-        seenquotes++;
-        fputc((int)c, f);
-        col++;
-      }
-      else {
-        fputc((int)c, f);
-        col++;
-      }
-    }
+    __save_line(&out, __line_text(line), line->ct, &save_tabs, blankcompress);
     // terminate the line appropriately
     if ((line->flags & (LINE_FLG_CR | LINE_FLG_LF)) == (LINE_FLG_CR | LINE_FLG_LF)) { // crlf
-      fputc('\r', f); fputc('\n', f);
+      __save_put(&out, "\r\n", 2);
     }
     else if ((line->flags & LINE_FLG_CR) == LINE_FLG_CR) { // cr
-      fputc('\r', f);
+      __save_put(&out, "\r", 1);
     }
     else if ((line->flags & LINE_FLG_LF) == LINE_FLG_LF) { // lf
-      fputc('\n', f);
+      __save_put(&out, "\n", 1);
     }
     else {
       // Unterminated line. This is a fairly common occurrence on the
@@ -1562,15 +3254,30 @@ POE_ERR buffer_save(BUFFER buf, cstr* filename, bool blankcompress)
       // middle of the file then there's a problem.
       // printf("unterminated line %d / %d\n", i, nlines);
       if (i < nlines-1)
-        fputc('\n', f);
+        __save_put(&out, "\n", 1);
     }
   }
-  
-  fclose(f);
+  __save_flush(&out);
+  free(out.stage);
+  tabs_destroy(&save_tabs);
+
+  if (out.failed || fsync(fd) != 0)
+    rval = POE_ERR_WRITING_FILE;
+  if (close(fd) != 0)
+    rval = POE_ERR_WRITING_FILE;
+  if (!inplace) {
+    if (rval == POE_ERR_OK && rename(tmpname, target) != 0)
+      rval = POE_ERR_WRITING_FILE;
+    if (rval != POE_ERR_OK)
+      unlink(tmpname);
+    else
+      rval = __save_sync_dir(target);
+  }
+  cstr_destroy(&tmp_filename);
   cstr_destroy(&save_filename);
   
-  buffer_clrflags(buf, BUF_FLG_DIRTY|BUF_FLG_NEW);
-  tabs_destroy(&save_tabs);
+  if (rval == POE_ERR_OK)
+    buffer_clrflags(buf, BUF_FLG_DIRTY|BUF_FLG_NEW);
   TRACE_RETURN(rval);
 }
 
@@ -1615,12 +3322,14 @@ bool buffer_wrap_line(BUFFER buf,
     TRACE_RETURN(false);
   }
   
-  MARK rgn = mark_alloc(0);
-  mark_start(rgn, Marktype_Line, buf, row, 0);
   if (lastrow < 0)
     lastrow = max(row, max(0, buffer_findparagraphsep(buf, row, 1)-1));
-  mark_extend(rgn, Marktype_Line, buf, max(row, lastrow), 0);
-  int l1 = row, l2 = lastrow, c2 = 0;
+  // Every join and split is inside the region, so its end moves with
+  // the line count.
+  int l1 = row, l2 = max(row, lastrow);
+  int l2_ct = l2 - buffer_count(buf);
+  if (upd_marks)
+    marks_begin_batch(buf);
   
   int i;
   bool didsplit = false;
@@ -1645,11 +3354,12 @@ bool buffer_wrap_line(BUFFER buf,
       didsplit |= didsplitthis;
       i++;
     }
-    mark_get_end(rgn, &l2, &c2);
+    l2 = l2_ct + buffer_count(buf);
     this_leftmargin = lmargin;
   }
   
-  mark_free(rgn);
+  if (upd_marks)
+    marks_end_batch(buf);
   TRACE_RETURN(didsplit);
 }
 
@@ -1681,8 +3391,8 @@ int buffer_respace(BUFFER buf, int line, char_pred_t spacepred, bool upd_marks)
 {
   TRACE_ENTER;
   int nchars_delta = 0;
-  int i, len = buffer_line_length(buf, line);
-  const char* str = buffer_getbufptr(buf, line);
+  int i, len;
+  const char* str = buffer_getlineptr(buf, line, &len);
   
   // Skip leading spaces
   for (i = 0; i < len && (*spacepred)(str[i]); i++)
@@ -1719,54 +3429,235 @@ int buffer_respace(BUFFER buf, int line, char_pred_t spacepred, bool upd_marks)
       i -= nrem;
     }
         
-    len = buffer_line_length(buf, line);
-    str = buffer_getbufptr(buf, line);
+    str = buffer_getlineptr(buf, line, &len);
   }
   TRACE_RETURN(nchars_delta);
 }
 
 
-bool buffer_search(BUFFER buf, int* prow, int* pcol, int* pendcol, const cstr* pat, bool exact, int direction)
+// Searches big enough to be worth splitting across the worker pool.
+// The lines are cut into chunks that are handed out in search order,
+// so once a chunk has a match no later chunk needs to be looked at.
+#define PARSRCH_MIN_LINES   (65536)
+#define PARSRCH_CHUNK_LINES (8192)
+
+struct parsrch_t {
+  BUFFER buf;
+  const srchpat* pat;
+  int direction;
+  int row, col;       // where the search starts
+  int nrows;          // lines to search, from row in the search direction
+  int nchunks;
+  bool all;           // find every match, not just the first
+  int next_chunk;     // next chunk to hand out
+  int found_chunk;    // earliest chunk with a match so far
+  int cancelled;
+  struct srchhit_t* first;     // per chunk, its first match
+  struct vec_t* hits;          // per chunk, all its matches
+};
+
+static bool (*_search_cancelled)(void) = NULL;
+
+
+void __parsrch_chunk(struct parsrch_t* ps, int chunk);
+void __parsrch_job(void* arg, int worker);
+void __parsrch_poll(void* arg);
+POE_ERR __parsrch_run(struct parsrch_t* ps);
+
+
+// Sets the function a long search calls, from the thread that
+// started it, to ask whether the user wants it stopped.
+void buffer_set_search_cancel(bool (*cancelled)(void))
 {
   TRACE_ENTER;
-  int row = *prow, col = *pcol;
-  bool found = false;
-  if (direction > 0) {
-    int nrows = buffer_count(buf);
-    while (!found && row < nrows) {
-      struct line_t* line = _line(buf, row);
-      int i = (exact ? cstr_find : cstr_findi)(&line->txt, col, pat, 1);
-      if (i >= 0) {
-        col = i;
-        found = true;
-      }
-      else {
-        row++;
-        col = 0;
-      }
+  _search_cancelled = cancelled;
+  TRACE_EXIT;
+}
+
+
+// Searches from (row, col) for the compiled pattern, forwards for a
+// match at or after the position, backwards for one that starts
+// before it.
+POE_ERR buffer_search(BUFFER buf, int* prow, int* pcol, int* pendcol, const srchpat* pat, int direction)
+{
+  TRACE_ENTER;
+  VALIDATEBUFFER(buf);
+  int nlines = buffer_count(buf);
+  struct parsrch_t ps;
+  memset(&ps, 0, sizeof(ps));
+  ps.buf = buf;
+  ps.pat = pat;
+  ps.direction = direction > 0 ? 1 : -1;
+  ps.row = *prow;
+  ps.col = *pcol;
+  if (ps.direction > 0) {
+    ps.row = max(ps.row, 0);
+    ps.nrows = nlines - ps.row;
+  }
+  else {
+    if (ps.row >= nlines) {
+      ps.row = nlines-1;
+      ps.col = INT_MAX;
+    }
+    ps.nrows = ps.row + 1;
+  }
+  if (direction == 0 || ps.nrows <= 0)
+    TRACE_RETURN(POE_ERR_NOT_FOUND);
+
+  POE_ERR err = __parsrch_run(&ps);
+  if (err == POE_ERR_OK) {
+    if (ps.found_chunk < ps.nchunks) {
+      struct srchhit_t* hit = &ps.first[ps.found_chunk];
+      *prow = hit->row;
+      *pcol = hit->col;
+      *pendcol = hit->endcol;
+    }
+    else {
+      err = POE_ERR_NOT_FOUND;
     }
   }
-  else if (direction < 0) {
-    while (!found && row >= 0) {
-      struct line_t* line = _line(buf, row);
-      int i = (exact ? cstr_find : cstr_findi)(&line->txt, col, pat, -1);
-      if (i >= 0) {
-        col = i;
-        found = true;
+  free(ps.first);
+  TRACE_RETURN(err);
+}
+
+
+// Finds every match in the buffer, appending their positions to hits
+// (struct srchhit_t) in buffer order if it isn't NULL.  Matches on a
+// line don't overlap.  Returns the number found, or -1 if the search
+// was cancelled.
+int buffer_search_all(BUFFER buf, const srchpat* pat, struct vec_t* hits)
+{
+  TRACE_ENTER;
+  VALIDATEBUFFER(buf);
+  struct parsrch_t ps;
+  memset(&ps, 0, sizeof(ps));
+  ps.buf = buf;
+  ps.pat = pat;
+  ps.direction = 1;
+  ps.nrows = buffer_count(buf);
+  ps.all = true;
+  if (ps.nrows <= 0)
+    TRACE_RETURN(0);
+
+  int i, ct = 0;
+  POE_ERR err = __parsrch_run(&ps);
+  for (i = 0; i < ps.nchunks; i++) {
+    ct += vec_count(&ps.hits[i]);
+    if (hits != NULL && err == POE_ERR_OK) {
+      int j;
+      for (j = 0; j < vec_count(&ps.hits[i]); j++)
+        vec_append(hits, vec_get(&ps.hits[i], j));
+    }
+    vec_destroy(&ps.hits[i]);
+  }
+  free(ps.hits);
+  free(ps.first);
+  TRACE_RETURN(err == POE_ERR_OK ? ct : -1);
+}
+
+
+POE_ERR __parsrch_run(struct parsrch_t* ps)
+{
+  TRACE_ENTER;
+  int i;
+  ps->nchunks = (ps->nrows + PARSRCH_CHUNK_LINES - 1) / PARSRCH_CHUNK_LINES;
+  ps->next_chunk = 0;
+  ps->found_chunk = ps->nchunks;
+  ps->cancelled = 0;
+  ps->first = calloc(ps->nchunks, sizeof(struct srchhit_t));
+  if (ps->all) {
+    ps->hits = calloc(ps->nchunks, sizeof(struct vec_t));
+    for (i = 0; i < ps->nchunks; i++)
+      vec_init(&ps->hits[i], 0, sizeof(struct srchhit_t));
+  }
+  if (ps->nrows >= PARSRCH_MIN_LINES && workpool_size() > 1)
+    workpool_run(__parsrch_job, ps, __parsrch_poll, ps);
+  else
+    __parsrch_job(ps, 0);
+  TRACE_RETURN(ps->cancelled ? POE_ERR_CANCELLED : POE_ERR_OK);
+}
+
+
+void __parsrch_job(void* arg, int worker)
+{
+  TRACE_ENTER;
+  struct parsrch_t* ps = arg;
+  for (;;) {
+    int chunk = __atomic_fetch_add(&ps->next_chunk, 1, __ATOMIC_SEQ_CST);
+    if (chunk >= ps->nchunks || __atomic_load_n(&ps->cancelled, __ATOMIC_RELAXED))
+      break;
+    // chunks go out in order, so if this one's past a match they all are
+    if (!ps->all && chunk > __atomic_load_n(&ps->found_chunk, __ATOMIC_SEQ_CST))
+      break;
+    __parsrch_chunk(ps, chunk);
+  }
+  TRACE_EXIT;
+}
+
+
+void __parsrch_poll(void* arg)
+{
+  TRACE_ENTER;
+  struct parsrch_t* ps = arg;
+  if (_search_cancelled != NULL && _search_cancelled())
+    __atomic_store_n(&ps->cancelled, 1, __ATOMIC_RELAXED);
+  TRACE_EXIT;
+}
+
+
+// Searches one chunk's lines, a leaf of the line tree at a time,
+// without touching the tree's lookup hint.
+void __parsrch_chunk(struct parsrch_t* ps, int chunk)
+{
+  TRACE_ENTER;
+  const struct linetree_t* t = &ps->buf->lines;
+  int ahead = chunk * PARSRCH_CHUNK_LINES;
+  int nrows = min(PARSRCH_CHUNK_LINES, ps->nrows - ahead);
+  int row = ps->row + ps->direction * ahead;
+  struct vec_t matches;
+  vec_init(&matches, ps->all ? 16 : 0, sizeof(struct rxmatch_t));
+  while (nrows > 0) {
+    if (__atomic_load_n(&ps->cancelled, __ATOMIC_RELAXED))
+      goto done;
+    int first, n;
+    struct line_t* lines = linetree_span(t, row, &first, &n);
+    for (; nrows > 0 && row >= first && row < first+n; row += ps->direction, nrows--) {
+      struct line_t* line = lines + (row - first);
+      const char* s = __line_text(line);
+      int len = line->ct;
+      bool at_start = row == ps->row;
+      int k, end;
+      if (ps->all) {
+        vec_clear(&matches);
+        int nfound = srchpat_find_all(ps->pat, s, len, at_start ? max(ps->col, 0) : 0, &matches);
+        const struct rxmatch_t* m = vec_getbufptr(&matches);
+        for (k = 0; k < nfound; k++) {
+          struct srchhit_t hit = { row, m[k].start, m[k].end };
+          vec_append(&ps->hits[chunk], &hit);
+        }
+        continue;
       }
-      else {
-        row--;
-        col = INT_MAX;
+      if (ps->direction > 0)
+        k = srchpat_find(ps->pat, s, len, at_start ? max(ps->col, 0) : 0, &end);
+      else
+        k = srchpat_rfind(ps->pat, s, len, at_start ? ps->col : INT_MAX, &end);
+      if (k >= 0) {
+        ps->first[chunk].row = row;
+        ps->first[chunk].col = k;
+        ps->first[chunk].endcol = end;
+        // keep the earliest chunk that has a match
+        int best = __atomic_load_n(&ps->found_chunk, __ATOMIC_SEQ_CST);
+        while (chunk < best
+               && !__atomic_compare_exchange_n(&ps->found_chunk, &best, chunk, false,
+                                               __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST))
+          ;
+        goto done;
       }
     }
   }
-  
-  if (found) {
-    *prow = row;
-    *pcol = col;
-    *pendcol = col + cstr_count(pat);
-  }
-  TRACE_RETURN(found);
+ done:
+  vec_destroy(&matches);
+  TRACE_EXIT;
 }
 
 
@@ -1815,6 +3706,7 @@ void buffer_load_dir_listing(BUFFER buf, const char* dirname)
   }
   
   closedir(dir);
+  journal_clear(buf->journal);
   buffer_clrflags(buf, BUF_FLG_DIRTY|BUF_FLG_NEW);
   buffer_setflags(buf, BUF_FLG_RDONLY);
   TRACE_EXIT;
@@ -1824,6 +3716,13 @@ void buffer_load_dir_listing(BUFFER buf, const char* dirname)
 void buffer_clear(BUFFER buf, bool ensure_min_lines, bool upd_marks)
 {
   TRACE_ENTER;
+  buffer_load_cancel(buf);
+  // clearing a buffer starts its history over
+  struct journal_t* j = _buffer_journal(buf);
+  if (j != NULL) {
+    journal_clear(j);
+    journal_hold(j);
+  }
   buffer_ensure_min_lines(buf, false);
   if (ensure_min_lines) {
     buffer_removelines(buf, 1, max(0, buffer_count(buf)-1), upd_marks);
@@ -1832,6 +3731,79 @@ void buffer_clear(BUFFER buf, bool ensure_min_lines, bool upd_marks)
   else {
     buffer_removelines(buf, 0, buffer_count(buf), upd_marks);
   }
+  if (j != NULL)
+    journal_release(j);
+  _buffer_release_text(buf);
+  TRACE_EXIT;
+}
+
+
+// Drops the file mapping and the buffer's arena, first copying out
+// any lines that still point into them.
+void _buffer_release_text(BUFFER buf)
+{
+  TRACE_ENTER;
+  if (buf->map == NULL && buf->text.blks == NULL)
+    TRACE_EXIT;
+  int i, n = linetree_count(&buf->lines);
+  for (i = 0; i < n; i++)
+    __line_own(_line(buf, i));
+  if (buf->map != NULL) {
+    __map_guard_remove(buf->map);
+    munmap(buf->map, buf->maplen);
+  }
+  buf->map = NULL;
+  buf->maplen = 0;
+  arena_destroy(&buf->text);
+  TRACE_EXIT;
+}
+
+
+// Packs the text of every line that isn't mapped or short enough to
+// keep inline into one block that fits it exactly, and frees the old
+// arena.  Edited lines give back the slack their heap blocks grew,
+// and text the arena was still holding for lines since edited or
+// deleted is released.
+void buffer_compact(BUFFER buf)
+{
+  TRACE_ENTER;
+  VALIDATEBUFFER(buf);
+  // lines still to be taken from the loader point into text that's
+  // already been handed to buf->text
+  if (buf->loader != NULL)
+    TRACE_EXIT;
+  int i, n = linetree_count(&buf->lines);
+  size_t total = 0;
+  for (i = 0; i < n; i++) {
+    struct line_t* l = _line(buf, i);
+    if (!(l->flags & LINE_FLG_MAPPED) && l->ct > LINE_INLINE_MAX)
+      total += l->ct + 1;
+  }
+  arena text;
+  arena_init(&text, LINE_TEXT_BLKSIZE);
+  char* p = total > 0 ? arena_get(&text, total) : NULL;
+  for (i = 0; i < n; i++) {
+    struct line_t* l = _line(buf, i);
+    if (l->flags & LINE_FLG_MAPPED)
+      continue;
+    int ct = l->ct;
+    if (ct <= LINE_INLINE_MAX) {
+      // short lines are kept in their descriptors
+      __line_own(l);
+      continue;
+    }
+    memcpy(p, __line_text(l), ct);
+    p[ct] = '\0';
+    int flags = l->flags, expanded = l->expanded;
+    if (!(flags & LINE_FLG_POOLED))
+      __line_destroy(l);
+    __line_initpooled(l, p, ct);
+    l->flags = flags | LINE_FLG_POOLED;
+    l->expanded = expanded;
+    p += ct+1;
+  }
+  arena_destroy(&buf->text);
+  buf->text = text;
   TRACE_EXIT;
 }
 
@@ -1873,11 +3845,40 @@ struct line_t* _line(BUFFER buf, int line)
 {
   TRACE_ENTER;
   VALIDATEBUFFER(buf);
-  struct line_t* rval = (struct line_t*)vec_get(&buf->lines, line);
+  struct line_t* rval = linetree_get(&buf->lines, line);
+  TRACE_RETURN(rval);
+}
+
+
+// Same as _line, but the line is safe to modify.
+struct line_t* _wline(BUFFER buf, int line)
+{
+  TRACE_ENTER;
+  struct line_t* rval = _line(buf, line);
+  __line_own(rval);
+  rval->expanded = 0;
+  linetree_touch(&buf->lines, line);
+  _buffer_damage(buf, line, line);
   TRACE_RETURN(rval);
 }
 
 
+// The journal to record an edit to buf in, or NULL if the edit
+// shouldn't be recorded: internal and command line buffers aren't
+// journaled, and neither are the pieces of a compound edit.
+struct journal_t* _buffer_journal(BUFFER buf)
+{
+  TRACE_ENTER;
+  if (buf->flags & (BUF_FLG_INTERNAL|BUF_FLG_CMDLINE))
+    TRACE_RETURN(NULL);
+  if (buf->journal == NULL)
+    buf->journal = journal_alloc();
+  if (journal_held(buf->journal))
+    TRACE_RETURN(NULL);
+  TRACE_RETURN(buf->journal);
+}
+
+
 void _expand_to_line(BUFFER buf, int line)
 {
   TRACE_ENTER;
@@ -1896,9 +3897,13 @@ void _expand_to_col(BUFFER buf, int line, int col)
   VALIDATEBUFFER(buf);
   __check_line_exists(__func__, buf, line);
   struct line_t* l = _line(buf, line);
-  int linelen = cstr_count(&l->txt);
+  int linelen = l->ct;
   if (col >= linelen) {
-    cstr_appendct(&l->txt, ' ', col - linelen + 1);
+    l = _wline(buf, line);
+    memset(__line_splice(l, linelen, 0, col - linelen + 1), ' ', col - linelen + 1);
+    struct journal_t* j = _buffer_journal(buf);
+    if (j != NULL)
+      journal_inschars(j, line, linelen, __line_text(l)+linelen, col - linelen + 1);
   }
   TRACE_EXIT;
 }
@@ -1908,8 +3913,8 @@ void __check_line_exists(const char* dbgname, BUFFER buf, int line)
 {
   TRACE_ENTER;
   VALIDATEBUFFER(buf);
-  if (line >= vec_count(&buf->lines) || line < 0)
-    poe_err(1, "%s error: line out of bounds %d %d", dbgname, line, vec_count(&buf->lines));
+  if (line >= linetree_count(&buf->lines) || line < 0)
+    poe_err(1, "%s error: line out of bounds %d %d", dbgname, line, linetree_count(&buf->lines));
   TRACE_EXIT;
 }
 
@@ -1918,13 +3923,13 @@ void __check_line_col_exists(const char* dbgname, BUFFER buf, int line, int col)
 {
   TRACE_ENTER;
   VALIDATEBUFFER(buf);
-  if (line >= vec_count(&buf->lines) || line < 0)
+  if (line >= linetree_count(&buf->lines) || line < 0)
     poe_err(1, "%s error: line %d out of bounds %d",
-            dbgname, line, vec_count(&buf->lines));
+            dbgname, line, linetree_count(&buf->lines));
   struct line_t* pline = _line(buf, line);
-  if (col >= cstr_count(&pline->txt))
+  if (col >= pline->ct)
     poe_err(1, "%s error: col %d of line %d out of bounds (%d)", 
-            dbgname, col, line, cstr_count(&pline->txt));
+            dbgname, col, line, pline->ct);
   TRACE_EXIT;
 }
 
@@ -1933,7 +3938,7 @@ void __check_line_lim(const char* dbgname, BUFFER buf, int line)
 {
   TRACE_ENTER;
   VALIDATEBUFFER(buf);
-  if (line > vec_count(&buf->lines) || line < 0)
+  if (line > linetree_count(&buf->lines) || line < 0)
     poe_err(1, "%s error: line out of bounds %d", dbgname, line);
   TRACE_EXIT;
 }
@@ -1943,7 +3948,7 @@ void __check_lines_exist(const char* dbgname, BUFFER buf, int startline, int nli
 {
   TRACE_ENTER;
   VALIDATEBUFFER(buf);
-  if (startline+nlines > vec_count(&buf->lines))
+  if (startline+nlines > linetree_count(&buf->lines))
     poe_err(1, "%s error: line out of bounds %d", dbgname, startline+nlines);
   if (startline < 0)
     poe_err(1, "%s error: negative line %d", dbgname, startline);
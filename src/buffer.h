@@ -4,8 +4,8 @@
 #define LINE_FLG_LF         (1<<2)
 #define LINE_FLG_CR         (1<<3)
 #define LINE_FLG_ANNOTATION (1<<4)
-#define LINE_FLG_RSVD1      (1<<5)
-#define LINE_FLG_RSVD2      (1<<6)
+#define LINE_FLG_MAPPED     (1<<5)
+#define LINE_FLG_POOLED     (1<<6)
 #define LINE_FLG_RSVD3      (1<<7)
 
 #define BUF_FLG_DIRTY       (1<<0)
@@ -14,15 +14,38 @@
 #define BUF_FLG_CMDLINE     (1<<3)
 #define BUF_FLG_RDONLY      (1<<4)
 #define BUF_FLG_NEW         (1<<5)
-
-
+#define BUF_FLG_MAPPED      (1<<6)
+#define BUF_FLG_PARTIAL     (1<<7)
+
+
+// A line's text is kept in the descriptor itself when it is short
+// enough, which includes every empty line.  Otherwise it points at
+// its own heap block, sized to the next power of two, or at text the
+// buffer owns (LINE_FLG_MAPPED, LINE_FLG_POOLED).  expanded is how
+// many chars expanding its tabs added when it was loaded, so its size
+// in the file can still be found.  It fits in the descriptor's
+// padding, so it stops counting at 65535: a line whose tabs grew it
+// by more than that counts as longer than it was in the file, and
+// offsets from there to the end of the file are too big by the rest.
 typedef unsigned short int line_flags_t;
 struct line_t {
-  struct cstr_t txt;
+  union {
+    char* s;
+    char inl[sizeof(char*)];
+  } u;
+  int ct;
   line_flags_t flags;
+  unsigned short int expanded;
 };
 typedef struct line_t LINE;
 
+void line_initstr(struct line_t* l, const char* s);
+void line_initstrn(struct line_t* l, const char* s, int n);
+void line_assignstr(struct line_t* l, const char* s);
+void line_destroy(struct line_t* l);
+int line_count(const struct line_t* l);
+size_t line_heapsize(const struct line_t* l);
+
 
 typedef int (*char_test)(char c);
 
@@ -49,6 +72,10 @@ bool buffer_setbasename(BUFFER buf, const cstr* new_basename);
 void buffer_setflags(BUFFER buf, int flg);
 void buffer_clrflags(BUFFER buf, int flg);
 bool buffer_tstflags(BUFFER buf, int flg);
+bool buffer_get_damage(BUFFER buf, int* first, int* last);
+void buffer_clear_damage(BUFFER buf);
+struct journal_t;
+struct journal_t* buffer_journal(BUFFER buf);
 
 POE_ERR buffer_setmargins(BUFFER buf, int leftmargin, int rightmargin, int paragraph);
 void buffer_getmargins(BUFFER buf, int* pleftmargin, int* prightmargin, int* pparagraph);
@@ -59,6 +86,7 @@ PROFILEPTR buffer_get_profile(BUFFER buf);
 void buffer_set_profile(BUFFER buf, PROFILEPTR profile);
 
 void buffer_clear(BUFFER buf, bool ensure_min_lines, bool upd_marks);
+void buffer_compact(BUFFER buf);
 int buffer_nexttab(BUFFER buf, int col);
 int buffer_prevtab(BUFFER buf, int col);
 void buffer_setlineflags(BUFFER pbuf, int line, int flags);
@@ -66,6 +94,10 @@ void buffer_setlinesflags(BUFFER pbuf, int line, int n, int flags);
 void buffer_clrlineflags(BUFFER pbuf, int line, int flags);
 int buffer_tstlineflags(BUFFER pbuf, int line, int flags);
 int buffer_line_length(BUFFER buf, int line);
+int64_t buffer_size(BUFFER buf);
+int64_t buffer_line_offset(BUFFER buf, int line);
+int64_t buffer_char_offset(BUFFER buf, int line, int col);
+int buffer_find_offset(BUFFER buf, int64_t off, int* pcol);
 struct line_t* buffer_get(BUFFER buf, int line);
 int buffer_scantill_nowrap(BUFFER buf, int line, int col, int direction, char_test testf);
 bool buffer_isblankline(BUFFER buf, int line);
@@ -89,13 +121,25 @@ void buffer_setcstr(BUFFER buf, int line, struct cstr_t* a);
 void buffer_setstrn(BUFFER buf, int line, int col, const char* s, int n, bool upd_marks);
 void buffer_insertblanklines(BUFFER buf, int line, int nlines, bool upd_marks);
 void buffer_removelines(BUFFER buf, int line, int n, bool upd_marks);
+void buffer_takelines(BUFFER buf, int line, int n, struct line_t* out, bool upd_marks);
+void buffer_insertlines_owned(BUFFER buf, int line, int n, struct line_t* lines, bool upd_marks);
 void buffer_insert(BUFFER buf, int line, int col, char c, bool upd_marks);
 void buffer_insertct(BUFFER buf, int line, int col, char c, int ct, bool upd_marks);
 void buffer_insertstrn(BUFFER buf, int line, int col, const char* s, int n, bool upd_marks);
+const char* buffer_getlineptr(BUFFER buf, int line, int* plen);
 const char* buffer_getbufptr(BUFFER buf, int line);
 const char* buffer_getcharptr(BUFFER buf, int line, int col);
 void buffer_removechar(BUFFER buf, int line, int col, bool upd_marks);
 void buffer_removechars(BUFFER buf, int line, int col, int n, bool upd_marks);
+
+// One of several replacements made to a line at once: the n
+// characters at col become the len characters at s.
+struct bufedit_t {
+  int col, n;
+  const char* s;
+  int len;
+};
+void buffer_replacechars(BUFFER buf, int line, const struct bufedit_t* edits, int nedits, bool upd_marks);
 void buffer_upperchars(BUFFER buf, int line, int col, int n);
 void buffer_lowerchars(BUFFER buf, int line, int col, int n);
 POE_ERR buffer_copyinsertchars(BUFFER dstbuf, int dstline, int dstcol,
@@ -115,8 +159,24 @@ POE_ERR buffer_splitline(BUFFER buf, int row, int col, bool update_marks);
 POE_ERR buffer_joinline(BUFFER buf, int row, bool update_marks);
 
 POE_ERR buffer_load(BUFFER dst, cstr* filename, bool tabexpand);
+void buffers_load_many(int n, BUFFER* bufs, cstr** filenames, bool tabexpand, POE_ERR* errs);
 POE_ERR buffer_save(BUFFER dst, cstr* filename, bool blankcompress);
 
+// With async loading on, buffer_load returns once a big file's first
+// few lines are in, and a thread reads the rest.  buffers_load_poll
+// adds what it has read to the buffer.  Until the load is done the
+// buffer can be looked at and searched, but not changed or saved.
+// A load that is cancelled, or fails part way, leaves the buffer
+// with what it had and BUF_FLG_PARTIAL set.
+void buffer_set_load_async(bool async);
+bool buffer_loading(BUFFER buf);
+int buffer_load_progress(BUFFER buf);
+void buffer_load_cancel(BUFFER buf);
+void buffer_load_wait(BUFFER buf);
+int buffers_load_poll(void);
+bool buffers_load_revoke_edits(void);
+bool buffers_check_maps(void);
+
 bool buffer_wrap_line(BUFFER dst,
 					  int row, int lastrow,
 					  int pmargin, int lmargin, int rmargin,
@@ -124,8 +184,14 @@ bool buffer_wrap_line(BUFFER dst,
 
 int buffer_respace(BUFFER buf, int line, char_pred_t spacepred, bool upd_marks);
 
-bool buffer_search(BUFFER buf, int* row, int* col, int* endcol,
-				   const cstr* pat, bool exact, int direction);
+struct srchpat_t;
+struct srchhit_t {
+  int row, col, endcol;
+};
+void buffer_set_search_cancel(bool (*cancelled)(void));
+POE_ERR buffer_search(BUFFER buf, int* row, int* col, int* endcol,
+                      const struct srchpat_t* pat, int direction);
+int buffer_search_all(BUFFER buf, const struct srchpat_t* pat, struct vec_t* hits);
 
 void buffer_load_dir_listing(BUFFER buf, const char* dir);
 
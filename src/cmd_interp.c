@@ -85,6 +85,66 @@ POE_ERR interpret_command_seq(cmd_ctx* ctx)
 }
 
 
+// Looks up every command in the sequence once, the same way
+// interpret_command_seq would, so it can be run again and again
+// without going back to the command table.
+vec* preproc_command_seq(const pivec* cmdseq)
+{
+  TRACE_ENTER;
+  vec* preproc = vec_alloc(4, sizeof(struct preproc_cmd_t));
+  int pc = 0;
+  while (!END_OF_CMD(cmdseq, pc)) {
+    struct preproc_cmd_t cmd;
+    int args = -1;
+    cmd.pc = pc;
+    cmd.cmd_func = lookup_command(cmdseq, pc, &args);
+    if (args < 0 || END_OF_CMD(cmdseq, args))
+      args = -1;
+    cmd.args_pc = args;
+    while (!END_OF_CMD(cmdseq, pc))
+      pc++;
+    pc++;
+    cmd.next_pc = pc;
+    vec_append(preproc, &cmd);
+  }
+  TRACE_RETURN(preproc);
+}
+
+
+// Runs a sequence that's been through preproc_command_seq.
+// ctx->cmdseq is the raw sequence, which the commands take their
+// arguments from.
+POE_ERR interpret_preproc_seq(cmd_ctx* ctx, const vec* preproc)
+{
+  TRACE_ENTER;
+  POE_ERR rval = POE_ERR_UNK_CMD;
+  const struct preproc_cmd_t* cmds = vec_getbufptr(preproc);
+  int i = 0, n = vec_count(preproc);
+  while (i < n && cmd_error == POE_ERR_OK) {
+    const struct preproc_cmd_t* cmd = &cmds[i];
+    if (cmd->cmd_func == NULL) {
+      rval = cmd_error = POE_ERR_UNK_CMD;
+      break;
+    }
+    ctx->pc = cmd->args_pc;
+    update_context(ctx);
+    rval = cmd_error = cmd->cmd_func(ctx);
+    if (ctx->pc < cmd->next_pc)
+      ctx->pc = cmd->next_pc;
+
+    // A command can take more than its own arguments (DEFINE takes the
+    // rest of the sequence), so carry on from wherever it stopped.
+    while (++i < n && cmds[i].pc < ctx->pc)
+      ;
+    if (i < n && cmds[i].pc != ctx->pc) {
+      rval = interpret_command_seq(ctx);
+      break;
+    }
+  }
+  TRACE_RETURN(rval);
+}
+
+
 cstr format_command(const pivec* cmdseq, int pc)
 {
   TRACE_ENTER;
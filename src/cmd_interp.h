@@ -3,6 +3,8 @@
 extern POE_ERR cmd_error;
 
 POE_ERR interpret_command_seq(cmd_ctx* ctx);
+vec* preproc_command_seq(const pivec* cmdseq);
+POE_ERR interpret_preproc_seq(cmd_ctx* ctx, const vec* preproc);
 POE_ERR check_command(pivec* cmdseq, int pc);
 cstr format_command(const pivec* cmdseq, int pc);
 cstr format_command_seq(const pivec* cmdseq, int pc);
@@ -8,6 +8,7 @@
 #include <stdarg.h>
 #include <ctype.h>
 #include <unistd.h>
+#include <glob.h>
 
 #include "trace.h"
 #include "logging.h"
@@ -16,6 +17,7 @@
 #include "utils.h"
 #include "vec.h"
 #include "cstr.h"
+#include "arena.h"
 #include "bufid.h"
 #include "mark.h"
 #include "markstack.h"
@@ -23,6 +25,9 @@
 #include "margins.h"
 #include "key_interp.h"
 #include "buffer.h"
+#include "srchpat.h"
+#include "rx.h"
+#include "journal.h"
 #include "view.h"
 #include "window.h"
 #include "commands.h"
@@ -40,22 +45,138 @@ extern POE_ERR __cmd_err;
 
 
 
+// Every word that appears in a command name is interned as a small
+// integer symbol when the command is defined.  Looking a word up goes
+// through a hash table keyed on the folded word, and each trie node
+// keeps its children sorted by symbol, so finding a command never
+// compares more than a couple of strings and never changes the trie.
+// Nothing is added once the commands are defined, so lookups are safe
+// from any thread.
+
 struct cmddef_trie_pair_t {
-  const char* name;
-  struct cmddef_trie_t* node; 
+  int sym;
+  struct cmddef_trie_t* node;
 };
 
 struct cmddef_trie_t {
   command_handler_t func; // may be null
-  struct vec_t /* struct cmddef_trie_pair_t */ children; 
+  struct vec_t /* struct cmddef_trie_pair_t */ children; // sorted by sym
 };
 
 struct cmddef_trie_t* __cmd_trie = NULL;
 
+pivec __cmd_syms;             // the name of each symbol
+int* __cmd_symhash = NULL;    // open addressed, symbol or -1
+unsigned __cmd_symhash_size = 0;
+
+
+unsigned __cmd_symhash_word(const char* word);
+int __cmd_find_sym(const char* word);
+int __cmd_intern_sym(const char* word);
+void __cmd_rehash_syms(unsigned size);
+struct cmddef_trie_t* __cmd_trie_child(const struct cmddef_trie_t* trienode, int sym, int* pidx);
+void __free_cmd_trie(struct cmddef_trie_t* trienode);
+
+
+// FNV-1a over the lower-cased word, since command names aren't case
+// sensitive.
+unsigned __cmd_symhash_word(const char* word)
+{
+  unsigned h = 2166136261u;
+  for (; *word != '\0'; word++) {
+    h ^= (unsigned char)tolower((unsigned char)*word);
+    h *= 16777619u;
+  }
+  return h;
+}
+
+
+// The symbol for a word, or -1 if no command uses it.
+int __cmd_find_sym(const char* word)
+{
+  TRACE_ENTER;
+  if (__cmd_symhash == NULL)
+    TRACE_RETURN(-1);
+  unsigned mask = __cmd_symhash_size - 1;
+  unsigned h = __cmd_symhash_word(word) & mask;
+  int sym;
+  while ((sym = __cmd_symhash[h]) >= 0) {
+    if (strcasecmp(word, CMD_STRVAL(pivec_get(&__cmd_syms, sym))) == 0)
+      TRACE_RETURN(sym);
+    h = (h + 1) & mask;
+  }
+  TRACE_RETURN(-1);
+}
+
+
+int __cmd_intern_sym(const char* word)
+{
+  TRACE_ENTER;
+  int sym = __cmd_find_sym(word);
+  if (sym >= 0)
+    TRACE_RETURN(sym);
+  if (__cmd_symhash == NULL)
+    pivec_init(&__cmd_syms, 256);
+  sym = pivec_append(&__cmd_syms, CMD_STR(strsave(word)));
+  // keep the table no more than half full
+  if ((unsigned)pivec_count(&__cmd_syms) * 2 > __cmd_symhash_size)
+    __cmd_rehash_syms(__cmd_symhash_size == 0 ? 512 : __cmd_symhash_size * 2);
+  else {
+    unsigned mask = __cmd_symhash_size - 1;
+    unsigned h = __cmd_symhash_word(word) & mask;
+    while (__cmd_symhash[h] >= 0)
+      h = (h + 1) & mask;
+    __cmd_symhash[h] = sym;
+  }
+  TRACE_RETURN(sym);
+}
+
+
+void __cmd_rehash_syms(unsigned size)
+{
+  TRACE_ENTER;
+  free(__cmd_symhash);
+  __cmd_symhash = (int*)malloc(size * sizeof(int));
+  __cmd_symhash_size = size;
+  unsigned h, mask = size - 1;
+  for (h = 0; h < size; h++)
+    __cmd_symhash[h] = -1;
+  int sym, nsyms = pivec_count(&__cmd_syms);
+  for (sym = 0; sym < nsyms; sym++) {
+    h = __cmd_symhash_word(CMD_STRVAL(pivec_get(&__cmd_syms, sym))) & mask;
+    while (__cmd_symhash[h] >= 0)
+      h = (h + 1) & mask;
+    __cmd_symhash[h] = sym;
+  }
+  TRACE_EXIT;
+}
+
+
+// Binary search of a node's children.  Returns the child for sym, or
+// NULL with *pidx set to where it would go.
+struct cmddef_trie_t* __cmd_trie_child(const struct cmddef_trie_t* trienode, int sym, int* pidx)
+{
+  TRACE_ENTER;
+  const struct cmddef_trie_pair_t* children = vec_getbufptr(&trienode->children);
+  int lo = 0, hi = vec_count(&trienode->children);
+  while (lo < hi) {
+    int mid = (lo + hi) / 2;
+    if (children[mid].sym == sym) {
+      if (pidx != NULL)
+        *pidx = mid;
+      TRACE_RETURN(children[mid].node);
+    }
+    if (children[mid].sym < sym)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  if (pidx != NULL)
+    *pidx = lo;
+  TRACE_RETURN(NULL);
+}
 
  
-// The names should be statically allocated or otherwise safe, because
-// we won't copy them into the tree.  This is fine for the expected use.
 void __defcmd_trie(struct cmddef_trie_t* trienode,
                    const char** cmdspec, int cmd_idx,
                    command_handler_t func)
@@ -71,26 +192,18 @@ void __defcmd_trie(struct cmddef_trie_t* trienode,
     TRACE_EXIT;
   }
 
-  int i, nchildren = vec_count(&trienode->children);
-  for (i = 0; i < nchildren; i++) {
-    struct cmddef_trie_pair_t* pChildpair = vec_get(&trienode->children, i);
-		const char* thatname = pChildpair->name;
-    int icmp = strcasecmp(thisname, thatname);
-		if (icmp == 0) { // partial match, recurse on rest of command
-			struct cmddef_trie_t* thatnode = pChildpair->node;
-      __defcmd_trie(thatnode, cmdspec, cmd_idx+1, func);
-      TRACE_EXIT;
-    }
+  int sym = __cmd_intern_sym(thisname);
+  int idx;
+  struct cmddef_trie_t* pChildnode = __cmd_trie_child(trienode, sym, &idx);
+  if (pChildnode == NULL) {
+    // Not here yet, so add it where it keeps the children in order.
+    struct cmddef_trie_pair_t childpair;
+    pChildnode = (struct cmddef_trie_t*)calloc(1, sizeof(struct cmddef_trie_t));
+    vec_init(&pChildnode->children, 1, sizeof(struct cmddef_trie_pair_t));
+    childpair.sym = sym;
+    childpair.node = pChildnode;
+    vec_insert(&trienode->children, idx, &childpair);
   }
-  // Ran off the end of the child list without finding a spot.  Add it
-  // at the end of the child list.
-  struct cmddef_trie_pair_t childpair;
-  struct cmddef_trie_t* pChildnode;
-	pChildnode = (struct cmddef_trie_t*)calloc(1, sizeof(struct cmddef_trie_t));
-  vec_init(&pChildnode->children, 1, sizeof(struct cmddef_trie_pair_t));
-  childpair.name = strsave(thisname);
-  childpair.node = pChildnode;
-  vec_append(&trienode->children, &childpair);
   __defcmd_trie(pChildnode, cmdspec, cmd_idx+1, func);
   TRACE_EXIT;
 }
@@ -101,14 +214,14 @@ void defcmd_trie(const char** cmdspec, command_handler_t func)
   TRACE_ENTER;
   if (__cmd_trie == NULL) {
     __cmd_trie = (struct cmddef_trie_t*)calloc(1, sizeof(struct cmddef_trie_t));
-    vec_init(&__cmd_trie->children, 100, sizeof(struct cmddef_trie_t));
+    vec_init(&__cmd_trie->children, 100, sizeof(struct cmddef_trie_pair_t));
   }
   __defcmd_trie(__cmd_trie, cmdspec, 0, func);
   TRACE_EXIT;
 }
 
 
-command_handler_t __lookup_command_trie(struct cmddef_trie_t* trienode,
+command_handler_t __lookup_command_trie(const struct cmddef_trie_t* trienode,
                                         const pivec* cmdseq,
                                         int pc,
                                         int* args_idx,
@@ -138,28 +251,12 @@ command_handler_t __lookup_command_trie(struct cmddef_trie_t* trienode,
     TRACE_RETURN(cur_hndlr);
   }
 
-  const char* thisname = CMD_STRVAL(pivec_get(cmdseq, pc));
-
-  int i, nchildren = vec_count(&trienode->children);
-	struct cmddef_trie_pair_t* pPrevchildpair = NULL;
-  for (i = 0; i < nchildren; i++) {
-    struct cmddef_trie_pair_t* pChildpair = vec_get(&trienode->children, i);
-		const char* thatname = pChildpair->name;
-    int icmp = strcasecmp(thisname, thatname);
-		if (icmp == 0) { // Partial match, recurse on rest of command
-			// Nudge this child forward if there's room
-			struct cmddef_trie_t* thatnode = pChildpair->node;
-			if (pPrevchildpair != NULL) {
-				struct cmddef_trie_pair_t tmp;
-				memmove(&tmp, pChildpair, sizeof(struct cmddef_trie_pair_t));
-				memmove(pChildpair, pPrevchildpair, sizeof(struct cmddef_trie_pair_t));
-				memmove(pPrevchildpair, &tmp, sizeof(struct cmddef_trie_pair_t));
-			}
-      cur_hndlr = __lookup_command_trie(thatnode, cmdseq, pc+1, args_idx,
-																				cur_hndlr, cur_args_idx);
-      TRACE_RETURN(cur_hndlr);
-    }
-		pPrevchildpair = pChildpair;
+  int sym = __cmd_find_sym(CMD_STRVAL(pivec_get(cmdseq, pc)));
+  const struct cmddef_trie_t* thatnode = sym < 0 ? NULL : __cmd_trie_child(trienode, sym, NULL);
+  if (thatnode != NULL) { // Partial match, recurse on rest of command
+    cur_hndlr = __lookup_command_trie(thatnode, cmdseq, pc+1, args_idx,
+                                      cur_hndlr, cur_args_idx);
+    TRACE_RETURN(cur_hndlr);
   }
   *args_idx = cur_args_idx;
   TRACE_RETURN(cur_hndlr);
@@ -180,6 +277,20 @@ command_handler_t lookup_command_trie(const pivec* cmdseq,
 }
 
 
+void __free_cmd_trie(struct cmddef_trie_t* trienode)
+{
+  TRACE_ENTER;
+  int i, nchildren = vec_count(&trienode->children);
+  for (i = 0; i < nchildren; i++) {
+    struct cmddef_trie_pair_t* pChildpair = vec_get(&trienode->children, i);
+    __free_cmd_trie(pChildpair->node);
+  }
+  vec_destroy(&trienode->children);
+  free(trienode);
+  TRACE_EXIT;
+}
+
+
 
 void defcmds(void);
 
@@ -195,6 +306,19 @@ void init_commands(void)
 void close_commands(void)
 {
   TRACE_ENTER;
+  if (__cmd_trie != NULL) {
+    __free_cmd_trie(__cmd_trie);
+    __cmd_trie = NULL;
+  }
+  if (__cmd_symhash != NULL) {
+    int sym, nsyms = pivec_count(&__cmd_syms);
+    for (sym = 0; sym < nsyms; sym++)
+      free((char*)CMD_STRVAL(pivec_get(&__cmd_syms, sym)));
+    pivec_destroy(&__cmd_syms);
+    free(__cmd_symhash);
+    __cmd_symhash = NULL;
+    __cmd_symhash_size = 0;
+  }
   TRACE_EXIT;
 }
 
@@ -216,24 +340,6 @@ command_handler_t lookup_command(const pivec* cmdseq, int pc, int* args_idx)
 }
 
 
-POE_ERR _savelines_other(BUFFER src, int line, int nlines)
-{
-  TRACE_ENTER;
-  // Don't save command lines
-  if (buffer_tstflags(src, BUF_FLG_CMDLINE))
-    TRACE_RETURN(POE_ERR_OK);
-  char hdr_line[PATH_MAX+64];
-  const char* buffername = buffer_name(src);
-  snprintf(hdr_line, sizeof(hdr_line), "********** %s %d %d **********", 
-           buffername==NULL?"???":buffername,
-           line+1, line+nlines+1);
-  buffer_insertblanklines(unnamed_buffer, 0, 2, true);
-  POE_ERR err = buffer_copyinsertlines(unnamed_buffer, 1, src, line, nlines, true);
-  buffer_insertstrn(unnamed_buffer, 0, 0, hdr_line, strlen(hdr_line), true);
-  TRACE_RETURN(err);
-}
-
-
 void xtract_targ_context(cmd_ctx* ctx, WINPTR* w, VIEWPTR* v, BUFFER* b, int* r, int* c)
 {
   TRACE_ENTER;
@@ -292,6 +398,12 @@ void xtract_cmd_context(cmd_ctx* ctx, WINPTR* w, VIEWPTR* v, BUFFER* b, int* r,
   WINPTR w; VIEWPTR v; BUFFER b; int r, c;      \
   xtract_targ_context(ctx, &w,&v,&b,&r,&c);
 
+// Buffers can't be changed until they've finished loading, so
+// commands that change one turn it down before doing anything.
+#define CMD_REFUSE_LOADING(b)                   \
+  if (buffer_loading(b))                        \
+    CMD_RETURN(POE_ERR_STILL_LOADING)
+
 
 
 int next_parm_int(cmd_ctx* ctx, int deflt)
@@ -653,6 +765,7 @@ POE_ERR cmd_bottom(cmd_ctx* ctx)
 POE_ERR _cmd_char(cmd_ctx* ctx, char chr)
 {
   CMD_ENTER_BND(ctx, wnd, view, buf, row, col);
+  CMD_REFUSE_LOADING(buf);
   POE_ERR err = POE_ERR_OK;
   int insert_mode = view_get_insertmode(ctx->targ_view);
   if (iscntrl(chr))
@@ -702,6 +815,7 @@ POE_ERR cmd_char(cmd_ctx* ctx)
 POE_ERR cmd_str(cmd_ctx* ctx)
 {
   CMD_ENTER_BND(ctx, wnd, view, buf, row, col);
+  CMD_REFUSE_LOADING(buf);
   POE_ERR err = POE_ERR_OK;
   markstack_cur_seal();
   if (!next_parm_is_str(ctx)) {
@@ -740,6 +854,7 @@ POE_ERR cmd_str(cmd_ctx* ctx)
 POE_ERR cmd_insert_text(cmd_ctx* ctx)
 {
   CMD_ENTER_BND(ctx, wnd, view, buf, row, col);
+  CMD_REFUSE_LOADING(buf);
   POE_ERR err = POE_ERR_OK;
   markstack_cur_seal();
   if (!next_parm_is_str(ctx)) {
@@ -766,6 +881,7 @@ POE_ERR cmd_insert_text(cmd_ctx* ctx)
 POE_ERR cmd_rubout(cmd_ctx* ctx)
 {
   CMD_ENTER(ctx);
+  CMD_REFUSE_LOADING(ctx->targ_buf);
   POE_ERR err = POE_ERR_OK;
   markstack_cur_seal();
   int targ_col = max(0, ctx->targ_col-1);
@@ -782,6 +898,7 @@ POE_ERR cmd_rubout(cmd_ctx* ctx)
 POE_ERR cmd_delete_char(cmd_ctx* ctx)
 {
   CMD_ENTER(ctx);
+  CMD_REFUSE_LOADING(ctx->targ_buf);
   markstack_cur_seal();
   buffer_removechar(ctx->targ_buf, ctx->targ_row, ctx->targ_col, true);
   CMD_RETURN(POE_ERR_OK);
@@ -791,6 +908,7 @@ POE_ERR cmd_delete_char(cmd_ctx* ctx)
 POE_ERR cmd_delete_char_join(cmd_ctx* ctx)
 {
   CMD_ENTER_DATAONLY_BND(ctx, wnd, view, buf, row, col);
+  CMD_REFUSE_LOADING(buf);
   markstack_cur_seal();
   POE_ERR err = POE_ERR_OK;
   int nlines = buffer_count(buf);
@@ -798,7 +916,6 @@ POE_ERR cmd_delete_char_join(cmd_ctx* ctx)
   if (row == nlines-1 && col >= nchars)
     CMD_RETURN(err);
   if (col >= nchars) {
-    _savelines_other(buf, row, 2);
     err = buffer_joinline(buf, row, true);
   }
   if (err == POE_ERR_OK)
@@ -879,8 +996,8 @@ POE_ERR cmd_indent(cmd_ctx* ctx)
 POE_ERR cmd_erase_begin_line(cmd_ctx* ctx)
 {
   CMD_ENTER(ctx);
+  CMD_REFUSE_LOADING(ctx->targ_buf);
   markstack_cur_seal();
-  _savelines_other(ctx->targ_buf, ctx->targ_row, 1);
   buffer_removechars(ctx->targ_buf, ctx->targ_row, 0, ctx->targ_col, true);
   view_move_cursor_to(ctx->targ_view, ctx->targ_row, ctx->targ_col);
   CMD_RETURN(POE_ERR_OK);
@@ -890,8 +1007,8 @@ POE_ERR cmd_erase_begin_line(cmd_ctx* ctx)
 POE_ERR cmd_erase_end_line(cmd_ctx* ctx)
 {
   CMD_ENTER_BND(ctx, wnd, view, buf, row, col);
+  CMD_REFUSE_LOADING(buf);
   markstack_cur_seal();
-  _savelines_other(buf, row, 1);
   int len = buffer_line_length(buf, row);
   int nCharsToRemove = max(0, len-col);
   buffer_removechars(buf, row, col, nCharsToRemove, true);
@@ -902,8 +1019,8 @@ POE_ERR cmd_erase_end_line(cmd_ctx* ctx)
 POE_ERR cmd_delete_line(cmd_ctx* ctx)
 {
   CMD_ENTER_BND(ctx, wnd, view, buf, row, col);
+  CMD_REFUSE_LOADING(buf);
   markstack_cur_seal();
-  _savelines_other(buf, row, 1);
   if (buffer_count(buf) == 1) {
     int len = buffer_line_length(buf, 0);
     buffer_removechars(buf, 0, 0, len, true);
@@ -918,6 +1035,7 @@ POE_ERR cmd_delete_line(cmd_ctx* ctx)
 POE_ERR cmd_insert_line(cmd_ctx* ctx)
 {
   CMD_ENTER_BND(ctx, wnd, view, buf, row, col);
+  CMD_REFUSE_LOADING(buf);
   markstack_cur_seal();
   int nlines = next_parm_int(ctx, 1);
   buffer_insertblanklines(buf, row+1, nlines, true);
@@ -1075,8 +1193,8 @@ POE_ERR cmd_end_paragraph(cmd_ctx* ctx)
 POE_ERR cmd_split(cmd_ctx* ctx)
 {
   CMD_ENTER_DATAONLY(ctx);
+  CMD_REFUSE_LOADING(ctx->targ_buf);
   markstack_cur_seal();
-  _savelines_other(ctx->targ_buf, ctx->targ_row, 1);
   POE_ERR err = buffer_splitline(ctx->targ_buf, ctx->targ_row, ctx->targ_col, true);
   view_move_cursor_to(ctx->targ_view, ctx->targ_row, ctx->targ_col);
   CMD_RETURN(err);
@@ -1086,11 +1204,11 @@ POE_ERR cmd_split(cmd_ctx* ctx)
 POE_ERR cmd_join(cmd_ctx* ctx)
 {
   CMD_ENTER_DATAONLY(ctx);
+  CMD_REFUSE_LOADING(ctx->targ_buf);
   markstack_cur_seal();
   int nrows = buffer_count(ctx->targ_buf);
   if (ctx->targ_row >= nrows-1)
     CMD_RETURN(POE_ERR_OK);
-  _savelines_other(ctx->targ_buf, ctx->targ_row, 2);
   buffer_joinline(ctx->targ_buf, ctx->targ_row, true);
   CMD_RETURN(POE_ERR_OK);
 }
@@ -1099,12 +1217,12 @@ POE_ERR cmd_join(cmd_ctx* ctx)
 POE_ERR cmd_rubout_join(cmd_ctx* ctx)
 {
   CMD_ENTER_DATAONLY_BND(ctx, wnd, view, buf, row, col);
+  CMD_REFUSE_LOADING(buf);
   POE_ERR err = POE_ERR_OK;
   markstack_cur_seal();
   if (row == 0 && col == 0)
     CMD_RETURN(err);
   if (col == 0) {
-    _savelines_other(buf, row-1, 2);
     view_move_cursor_to(view, row-1, buffer_line_length(buf, row-1));
     row = row-1;
     err = buffer_joinline(buf, row-1, true);
@@ -1299,11 +1417,39 @@ POE_ERR cmd_column(cmd_ctx* ctx)
 }
 
 
+// Moves to a byte offset in the file, counting from 0, such as one
+// from a crash report.  Big offsets come to us as strings.
+POE_ERR cmd_goto_offset(cmd_ctx* ctx)
+{
+  CMD_ENTER(ctx);
+  int64_t off = -1;
+  if (next_parm_is_int(ctx)) {
+    off = next_parm_int(ctx, -1);
+  }
+  else {
+    const char* s = next_parm_str(ctx, NULL);
+    char* end;
+    if (s != NULL && poe_isdigit(*s)) {
+      off = strtoll(s, &end, 10);
+      if (*end != '\0')
+        off = -1;
+    }
+  }
+  if (off < 0)
+    CMD_RETURN(POE_ERR_UNK_CMD);
+  int col;
+  int row = buffer_find_offset(ctx->targ_buf, off, &col);
+  view_move_cursor_to(ctx->targ_view, row, col);
+  CMD_RETURN(POE_ERR_OK);
+}
+
+
 // Used by both upper and lower case operations
 typedef void (*upperop_t)(BUFFER, int, int, int);
 POE_ERR _cmd_upperlower(cmd_ctx* ctx, upperop_t op)
 {
   CMD_ENTER_BND(ctx, wnd, view, buf, row, col);
+  CMD_REFUSE_LOADING(buf);
   markstack_cur_seal();
   enum marktype typ;
   int l1, c1, l2, c2;
@@ -1313,14 +1459,12 @@ POE_ERR _cmd_upperlower(cmd_ctx* ctx, upperop_t op)
   int i;
   switch (typ) {
   case Marktype_Line:
-    _savelines_other(buf, l1, l2-l1+1);
     for (i = l1; i <= l2; i++)
       (*op)(buf, i, 0, buffer_line_length(buf, i));
     err = POE_ERR_OK;
     break;
   case Marktype_Block:
     {
-      _savelines_other(buf, l1, l2-l1+1);
       int mark_width = c2 - c1 + 1;
       for (i = l1; i <= l2; i++)
         (*op)(buf, i, c1, mark_width);
@@ -1328,7 +1472,6 @@ POE_ERR _cmd_upperlower(cmd_ctx* ctx, upperop_t op)
     }
     break;
   case Marktype_Char:
-    _savelines_other(buf, l1, l2-l1+1);
     if (l1 == l2) {
       (*op)(buf, l1, c1, c2-c1+1);
     }
@@ -1364,6 +1507,7 @@ POE_ERR cmd_lowercase(cmd_ctx* ctx)
 POE_ERR _cmd_shift(cmd_ctx* ctx, int cols_to_shift)
 {
   CMD_ENTER_DATAONLY_BND(ctx, wnd, view, buf, row, col);
+  CMD_REFUSE_LOADING(buf);
   enum marktype typ;
   int l1, c1, l2, c2;
   POE_ERR err = markstack_cur_get_bounds(&typ, &l1, &c1, &l2, &c2);
@@ -1372,7 +1516,6 @@ POE_ERR _cmd_shift(cmd_ctx* ctx, int cols_to_shift)
   int i;
   switch (typ) {
   case Marktype_Line: case Marktype_Block:
-    _savelines_other(buf, l1, l2-l1+1);
     if (typ == Marktype_Line)
       c1 = 0;
     for (i = l1; i <= l2; i++) {
@@ -1386,7 +1529,6 @@ POE_ERR _cmd_shift(cmd_ctx* ctx, int cols_to_shift)
     err = POE_ERR_OK;
     break;
   case Marktype_Char:
-    _savelines_other(buf, l1, l2-l1+1);
     for (i = l1; i <= l2; i++) {
       int col = i == l1 ? c1 : 0;
       if (cols_to_shift < 0) {
@@ -1470,6 +1612,7 @@ POE_ERR cmd_delete_mark(cmd_ctx* ctx)
   POE_ERR err = markstack_cur_get_buffer(&buf);
 	if (err != POE_ERR_OK)
 		CMD_RETURN(err);
+  CMD_REFUSE_LOADING(buf);
   enum marktype typ;
   int l1, c1, l2, c2;
   err = markstack_cur_get_bounds(&typ, &l1, &c1, &l2, &c2);
@@ -1478,7 +1621,6 @@ POE_ERR cmd_delete_mark(cmd_ctx* ctx)
   switch (typ) {
   case Marktype_Line:
     {
-      _savelines_other(buf, l1, l2-l1+1);
       err = markstack_cur_unmark();
       buffer_removelines(buf, l1, l2-l1+1, true);
       buffer_ensure_min_lines(buf, true);
@@ -1486,7 +1628,6 @@ POE_ERR cmd_delete_mark(cmd_ctx* ctx)
     break;
   case Marktype_Block:
     {
-      _savelines_other(buf, l1, l2-l1+1);
       err = markstack_cur_unmark();
       int i, cols_to_shift = c2-c1+1;
       for (i = l1; i <= l2; i++) {
@@ -1496,7 +1637,6 @@ POE_ERR cmd_delete_mark(cmd_ctx* ctx)
     break;
   case Marktype_Char:
     {
-      _savelines_other(buf, l1, l2-l1+1);
       err = markstack_cur_unmark();
       if (l1 == l2) {
         buffer_removechars(buf, l1, c1, c2-c1+1, true);
@@ -1526,6 +1666,7 @@ POE_ERR cmd_delete_mark(cmd_ctx* ctx)
 POE_ERR cmd_copy_mark(cmd_ctx* ctx)
 {
   CMD_ENTER_DATAONLY_BND(ctx, wnd, view, buf, row, col);
+  CMD_REFUSE_LOADING(buf);
   markstack_cur_seal();
   enum marktype typ;
   int l1, c1, l2, c2;
@@ -1544,7 +1685,6 @@ POE_ERR cmd_copy_mark(cmd_ctx* ctx)
     break;
   case Marktype_Block:
     nl = l2-l1+1;
-    _savelines_other(buf, row, 2);
     nc = c2-c1+1;
     for (i = 0; i < nl; i++) {
       buffer_copyinsertchars(buf, row+i, col, markbuf, l1+i, c1, nc, true);
@@ -1553,7 +1693,6 @@ POE_ERR cmd_copy_mark(cmd_ctx* ctx)
   case Marktype_Char:
     nl = l2-l1+1;
     nc = c2-c1+1;
-    _savelines_other(buf, row, 1);
     if (l1 == l2) {
       buffer_copyinsertchars(buf, row, col, markbuf, l1, c1, nc, true);
     }
@@ -1618,6 +1757,10 @@ POE_ERR cmd_move_mark(cmd_ctx* ctx)
 	if (curmark != NULL && mark_hittest_point(curmark, orig_buf, orig_row, orig_col, 0, 0)) {
 		CMD_RETURN(POE_ERR_SRC_DEST_CONFLICT);
 	}
+  CMD_REFUSE_LOADING(orig_buf);
+  BUFFER markbuf;
+  if (markstack_cur_get_buffer(&markbuf) == POE_ERR_OK)
+    CMD_REFUSE_LOADING(markbuf);
   POE_ERR err = cmd_copy_mark(ctx);
   if (err == POE_ERR_OK) {
     err = cmd_delete_mark(ctx);
@@ -1645,6 +1788,7 @@ POE_ERR cmd_fill_mark(cmd_ctx* ctx)
   err = markstack_cur_get_buffer(&markbuf);
   if (err != POE_ERR_OK)
     CMD_RETURN(err);
+  CMD_REFUSE_LOADING(markbuf);
   int parm_chr = next_parm_int(ctx, -1);
   char chr;
   if (parm_chr >= 0)
@@ -1657,7 +1801,6 @@ POE_ERR cmd_fill_mark(cmd_ctx* ctx)
   switch (typ) {
   case Marktype_Line:
     {
-      _savelines_other(markbuf, l1, l2-l1+1);
       for (i = l1; i <= l2; i++) {
         n = buffer_line_length(markbuf, i);
         buffer_setcharct(markbuf, i, 0, chr, n);
@@ -1668,7 +1811,6 @@ POE_ERR cmd_fill_mark(cmd_ctx* ctx)
   case Marktype_Block:
     {
       n = l2-l1+1;
-      _savelines_other(markbuf, l1, n);
       for (i = l1; i <= l2; i++)
         buffer_setcharct(markbuf, i, c1, chr, c2-c1+1);
     }
@@ -1677,7 +1819,6 @@ POE_ERR cmd_fill_mark(cmd_ctx* ctx)
   case Marktype_Char:
     {
       n = l2-l1+1;
-      _savelines_other(markbuf, l1, n);
       if (l1 == l2) {
         buffer_setcharct(markbuf, l1, c1, chr, c2-c1+1);
       }
@@ -1712,6 +1853,7 @@ POE_ERR cmd_confirm_change(cmd_ctx* ctx)
 POE_ERR cmd_overlay_block(cmd_ctx* ctx)
 {
   CMD_ENTER_DATAONLY_BND(ctx, wnd, view, buf, row, col);
+  CMD_REFUSE_LOADING(buf);
   markstack_cur_seal();
   enum marktype typ;
   int l1, c1, l2, c2;
@@ -1729,7 +1871,6 @@ POE_ERR cmd_overlay_block(cmd_ctx* ctx)
   case Marktype_Block:
     nl = l2-l1+1;
     nc = c2-c1+1;
-    _savelines_other(buf, row, nl);
     for (i = 0; i < nl; i++)
       buffer_copyoverlaychars(buf, row+i, col, markbuf, l1+i, c1, nc, true);
     err = POE_ERR_OK;
@@ -1760,6 +1901,7 @@ POE_ERR cmd_reflow(cmd_ctx* ctx)
   err = markstack_cur_get_buffer(&markbuf);
   if (err != POE_ERR_OK)
     CMD_RETURN(err);
+  CMD_REFUSE_LOADING(markbuf);
   // Switch buffers if necessary
   if (buf != markbuf) {
     wins_cur_switchbuffer(markbuf);
@@ -1772,9 +1914,12 @@ POE_ERR cmd_reflow(cmd_ctx* ctx)
     {
       int leftmargin, rightmargin, paragraphmargin;
       buffer_getmargins(buf, &leftmargin, &rightmargin, &paragraphmargin);
-      _savelines_other(buf, l1, l2-l1+1);
       int i;
       int didsplit = false;
+      // The joins and splits all happen inside the mark, so its end
+      // moves with the line count.
+      int l2_ct = l2 - buffer_count(buf);
+      marks_begin_batch(buf);
       for (i = l1; i <= l2; ) {
         if (i < l2) {
           buffer_insert(buf, i, buffer_line_length(buf, i), ' ', true);
@@ -1785,8 +1930,9 @@ POE_ERR cmd_reflow(cmd_ctx* ctx)
         didsplit = buffer_wrap_line(buf, i, max(i, l2-1), firstmargin, restmargin, rightmargin, true);
         if (didsplit || i == l2)
           i++;
-        markstack_cur_get_end(&l2, &c2);
+        l2 = l2_ct + buffer_count(buf);
       }
+      marks_end_batch(buf);
     }
     break;
   case Marktype_Char: case Marktype_Block:
@@ -1800,6 +1946,9 @@ POE_ERR cmd_reflow(cmd_ctx* ctx)
 }
 
 
+// Big enough that a typical command line's strings fit in one block
+#define CMDLINE_ARENA_BLKSIZE (512)
+
 POE_ERR cmd_execute(cmd_ctx* ctx)
 {
   CMD_ENTER(ctx);
@@ -1813,14 +1962,15 @@ POE_ERR cmd_execute(cmd_ctx* ctx)
   // Get command text and parse it
   cstr cmd_text;
   pivec tokens;
-  struct line_t* line = buffer_get(cmdbuf, 0);
-  cstr_initfrom(&cmd_text, &line->txt);
+  arena strs;
+  cstr_initstr(&cmd_text, buffer_getbufptr(cmdbuf, 0));
   pivec_init(&tokens, 10);
+  arena_init(&strs, CMDLINE_ARENA_BLKSIZE);
   cstr_trimleft(&cmd_text, poe_iswhitespace);
   cstr_trimright(&cmd_text, poe_iswhitespace);
   int parse_pos = 0;
   //logmsg("parsing command line");
-  POE_ERR err = parse_cmdline(&cmd_text, &tokens, &parse_pos);
+  POE_ERR err = parse_cmdline(&cmd_text, &tokens, &parse_pos, &strs);
 
   // Dump out the parsed tokens for debugging
   /* int i, n = pivec_count(&tokens); */
@@ -1865,11 +2015,75 @@ POE_ERR cmd_execute(cmd_ctx* ctx)
 
   cstr_destroy(&cmd_text);
   pivec_destroy(&tokens);
+  arena_destroy(&strs);
   
   TRACE_RETURN(err);
 }
 
 
+// Edits every file that matches a wildcard pattern, reading the new
+// ones all at once.  *pfirst gets the buffer of the first match that
+// could be loaded.  Returns POE_ERR_NOT_FOUND if nothing matches.
+POE_ERR _cmd_edit_wild(cstr* pattern, bool tabexpand, BUFFER* pfirst)
+{
+  TRACE_ENTER;
+  *pfirst = BUFFER_NULL;
+  glob_t g;
+  if (glob(cstr_getbufptr(pattern), GLOB_MARK|GLOB_TILDE, NULL, &g) != 0) {
+    globfree(&g);
+    TRACE_RETURN(POE_ERR_NOT_FOUND);
+  }
+  int i, n = (int)g.gl_pathc, nnew = 0;
+  cstr* names = (cstr*)calloc(n, sizeof(cstr));
+  BUFFER* matches = (BUFFER*)calloc(n, sizeof(BUFFER));
+  BUFFER* bufs = (BUFFER*)calloc(n, sizeof(BUFFER));
+  cstr** filenames = (cstr**)calloc(n, sizeof(cstr*));
+  POE_ERR* errs = (POE_ERR*)calloc(n, sizeof(POE_ERR));
+  for (i = 0; i < n; i++) {
+    cstr_initstr(&names[i], g.gl_pathv[i]);
+    // GLOB_MARK puts a slash after directories
+    if (cstr_get(&names[i], cstr_count(&names[i])-1) == '/')
+      continue;
+    matches[i] = buffers_find_eithername(&names[i]);
+    if (matches[i] == BUFFER_NULL) {
+      matches[i] = bufs[nnew] = buffer_alloc("", BUF_FLG_VISIBLE, 0, default_profile);
+      filenames[nnew++] = &names[i];
+    }
+  }
+  buffers_load_many(nnew, bufs, filenames, tabexpand, errs);
+
+  POE_ERR err = POE_ERR_NOT_FOUND;
+  int j = 0;
+  for (i = 0; i < n; i++) {
+    if (j < nnew && matches[i] == bufs[j]) {
+      if (errs[j] != POE_ERR_OK) {
+        if (err == POE_ERR_NOT_FOUND)
+          err = errs[j];
+        buffer_free(matches[i]);
+        matches[i] = BUFFER_NULL;
+      }
+      j++;
+    }
+    if (matches[i] != BUFFER_NULL && *pfirst == BUFFER_NULL)
+      *pfirst = matches[i];
+    cstr_destroy(&names[i]);
+  }
+  if (*pfirst != BUFFER_NULL) {
+    // say so if some of them couldn't be loaded
+    if (err != POE_ERR_NOT_FOUND)
+      wins_set_message(poe_err_message(err));
+    err = POE_ERR_OK;
+  }
+  free(errs);
+  free(filenames);
+  free(bufs);
+  free(matches);
+  free(names);
+  globfree(&g);
+  TRACE_RETURN(err);
+}
+
+
 POE_ERR cmd_edit(cmd_ctx* ctx)
 {
   CMD_ENTER_BND(ctx, wnd, view, buf, row, col);
@@ -1915,12 +2129,18 @@ POE_ERR cmd_edit(cmd_ctx* ctx)
         editbuf = foundbuf;
       }
       else {
-        //logmsg("loading new buffer");
-        editbuf = buffer_alloc("", BUF_FLG_VISIBLE, 0, default_profile);
-        err = buffer_load(editbuf, &tmp_filename, file_tab_expand);
-        if (err == POE_ERR_FILE_NOT_FOUND) {
-          err = POE_ERR_OK;
-          wins_set_message("New file");
+        // a pattern that matches nothing is the name of a new file
+        err = POE_ERR_NOT_FOUND;
+        if (strpbrk(cstr_getbufptr(&tmp_filename), "*?[") != NULL)
+          err = _cmd_edit_wild(&tmp_filename, file_tab_expand, &editbuf);
+        if (err == POE_ERR_NOT_FOUND) {
+          //logmsg("loading new buffer");
+          editbuf = buffer_alloc("", BUF_FLG_VISIBLE, 0, default_profile);
+          err = buffer_load(editbuf, &tmp_filename, file_tab_expand);
+          if (err == POE_ERR_FILE_NOT_FOUND) {
+            err = POE_ERR_OK;
+            wins_set_message("New file");
+          }
         }
       }
     }
@@ -1930,7 +2150,7 @@ POE_ERR cmd_edit(cmd_ctx* ctx)
       //logmsg("switching to buffer");
       wins_cur_switchbuffer(editbuf);
     }
-    else {
+    else if (editbuf != BUFFER_NULL) {
       buffer_free(editbuf);
     }
     cstr_destroy(&tmp_filename);
@@ -2024,24 +2244,11 @@ POE_ERR cmd_file(cmd_ctx* ctx)
 }
 
 
-// options:
-// '-' == search backwards
-// 'e' == force case sensitivity
-POE_ERR _cmd_locate(BUFFER buf,
-                    int* prow, int* pcol, int* pendcol,
-                    const cstr* patstr, const cstr* optstr)
+// Works out whether a search should be case sensitive, from the 'e'
+// option and the buffer's search mode.
+bool _cmd_search_exact(BUFFER buf, const char* pat, bool bSrchExact)
 {
   TRACE_ENTER;
-  POE_ERR err = POE_ERR_OK;
-  const char* pat = cstr_getbufptr(patstr);
-  const char* opts = cstr_getbufptr(optstr);
-  int direction = (strchr(opts, '-') != NULL) ? -1 : 1;
-  bool bSrchExact = strchr(opts, 'e') != NULL;
-  if (direction > 0)
-    buffer_right_wrap(buf, prow, pcol);
-  else if (direction < 0)
-    buffer_left_wrap(buf, prow, pcol);
-  bool bFound = false;
   PROFILEPTR profile = buffer_get_profile(buf);
   if (!bSrchExact) {
     switch (profile->searchmode) {
@@ -2068,13 +2275,41 @@ POE_ERR _cmd_locate(BUFFER buf,
       break;
     }
   }
+  TRACE_RETURN(bSrchExact);
+}
 
-  *pendcol = *pcol;
-  bFound = buffer_search(buf, prow, pcol, pendcol, patstr, bSrchExact, direction);
-  if (bFound)
-    err = POE_ERR_OK;
+
+// Compiles a search pattern for the given options:
+// 'e' == force case sensitivity
+// 'r' == the pattern is a regular expression
+POE_ERR _cmd_compile_pattern(BUFFER buf, const cstr* patstr, const char* opts, srchpat* sp)
+{
+  TRACE_ENTER;
+  POE_ERR err = POE_ERR_OK;
+  bool bSrchExact = _cmd_search_exact(buf, cstr_getbufptr(patstr), strchr(opts, 'e') != NULL);
+  if (strchr(opts, 'r') != NULL)
+    err = srchpat_init_regex(sp, patstr, bSrchExact);
   else
-    err = POE_ERR_NOT_FOUND;
+    srchpat_init(sp, patstr, bSrchExact);
+  TRACE_RETURN(err);
+}
+
+
+// Finds the next match of a compiled pattern after (or, searching
+// backwards, before) the cursor.
+POE_ERR _cmd_locate(BUFFER buf,
+                    int* prow, int* pcol, int* pendcol,
+                    const srchpat* sp, int direction)
+{
+  TRACE_ENTER;
+  POE_ERR err = POE_ERR_OK;
+  if (direction > 0)
+    buffer_right_wrap(buf, prow, pcol);
+  else if (direction < 0)
+    buffer_left_wrap(buf, prow, pcol);
+
+  *pendcol = *pcol;
+  err = buffer_search(buf, prow, pcol, pendcol, sp, direction);
   TRACE_RETURN(err);
 }
 
@@ -2084,6 +2319,8 @@ POE_ERR _cmd_locate(BUFFER buf,
 // 's' == mark found string with a character mark
 // 'e' == force case sensitivity
 // 'o' == force search from end (top or bottom depending on '-')
+// 'c' == count the occurrences in the whole buffer, without moving
+// 'r' == the pattern is a regular expression
 POE_ERR cmd_locate(cmd_ctx* ctx)
 {
   CMD_ENTER_BND(ctx, wnd, view, buf, row, col);
@@ -2094,6 +2331,7 @@ POE_ERR cmd_locate(cmd_ctx* ctx)
   int direction = (strchr(opts, '-') != NULL) ? -1 : 1;
   bool bSelectFound = strchr(opts, 'e') != NULL;
   bool bFromEnd = strchr(opts, 'o') != NULL;
+  bool bCount = strchr(opts, 'c') != NULL;
 
   if (bFromEnd) {
     if (direction > 0) {
@@ -2106,37 +2344,152 @@ POE_ERR cmd_locate(cmd_ctx* ctx)
   }
   int endcol = col;
   if (pat == NULL || strlen(pat) == 0) {
-    err = POE_ERR_SRCH_STR;
-  }
-  else {
-    cstr patstr, optstr;
-    cstr_initstr(&patstr, pat);
-    cstr_initstr(&optstr, opts);
-    err = _cmd_locate(buf, &row, &col, &endcol, &patstr, &optstr);
-    cstr_destroy(&patstr);
-    cstr_destroy(&optstr);
+    ctx->save_commandline = true;
+    CMD_RETURN(POE_ERR_SRCH_STR);
+  }
+
+  cstr patstr;
+  cstr_initstr(&patstr, pat);
+  srchpat sp;
+  err = _cmd_compile_pattern(buf, &patstr, opts, &sp);
+  if (err == POE_ERR_OK && bCount) {
+    int n = buffer_search_all(buf, &sp, NULL);
+    if (n < 0)
+      err = POE_ERR_CANCELLED;
+    else if (n == 0)
+      err = POE_ERR_NOT_FOUND;
+    else
+      _printf_cmdline(ctx, "%d found", n);
   }
-
-  if (err == POE_ERR_OK) {
-    if (bSelectFound) {
-      markstack_cur_unmark();
-      markstack_cur_place(Marktype_Char, buf, row, col);
-      markstack_cur_place(Marktype_Char, buf, row, endcol-1);
+  else if (err == POE_ERR_OK) {
+    err = _cmd_locate(buf, &row, &col, &endcol, &sp, direction);
+    if (err == POE_ERR_OK) {
+      if (bSelectFound) {
+        markstack_cur_unmark();
+        markstack_cur_place(Marktype_Char, buf, row, col);
+        markstack_cur_place(Marktype_Char, buf, row, endcol-1);
+      }
+      view_move_cursor_to(view, row, col);
+      cmd_cursor_data(ctx);
     }
-    view_move_cursor_to(view, row, col);
-    cmd_cursor_data(ctx);
   }
+  srchpat_destroy(&sp);
+  cstr_destroy(&patstr);
   ctx->save_commandline = true;
   CMD_RETURN(err);
 }
 
 
+// Appends the text that replaces the match in s[0..n) from col to
+// endcol.  For regular expressions \\1 to \\9 stand for what the groups
+// matched, \\0 for the whole match, and \\\\ for a backslash.  Nothing
+// is appended if the groups can't be filled in.
+POE_ERR _cmd_change_text(const srchpat* sp, bool bRegex,
+                         const char* s, int n, int col, int endcol,
+                         const cstr* replstr, cstr* out)
+{
+  TRACE_ENTER;
+  const char* r = cstr_getbufptr(replstr);
+  int i, rn = cstr_count(replstr);
+  if (!bRegex || memchr(r, '\\', rn) == NULL) {
+    cstr_appendm(out, rn, r);
+    TRACE_RETURN(POE_ERR_OK);
+  }
+  int caps[2*(RX_MAXGROUPS+1)];
+  if (!srchpat_captures(sp, s, n, col, endcol, caps)) {
+    for (i = 0; i+1 < rn; i++) {
+      if (r[i] == '\\' && r[i+1] >= '1' && r[i+1] <= '9')
+        TRACE_RETURN(POE_ERR_MATCH_TOO_LONG);
+      if (r[i] == '\\')
+        i++;
+    }
+  }
+  for (i = 0; i < rn; i++) {
+    if (r[i] == '\\' && i+1 < rn && isdigit((unsigned char)r[i+1])) {
+      int g = r[++i] - '0';
+      if (caps[2*g] >= 0)
+        cstr_appendm(out, caps[2*g+1] - caps[2*g], s + caps[2*g]);
+    }
+    else if (r[i] == '\\' && i+1 < rn && r[i+1] == '\\') {
+      cstr_append(out, r[++i]);
+    }
+    else {
+      cstr_append(out, r[i]);
+    }
+  }
+  TRACE_RETURN(POE_ERR_OK);
+}
+
+
+// Changes every match in the buffer without asking.  The matches are
+// all found first, then each line that has any is rebuilt once.
+POE_ERR _cmd_change_all(BUFFER buf, const srchpat* sp, const cstr* replstr, bool bRegex,
+                        bool bOnlyMarked, bool bOnlyUnmarked, int* pcount)
+{
+  TRACE_ENTER;
+  struct vec_t hits;
+  vec_init(&hits, 0, sizeof(struct srchhit_t));
+  int nhits = buffer_search_all(buf, sp, &hits);
+  if (nhits < 0) {
+    vec_destroy(&hits);
+    TRACE_RETURN(POE_ERR_CANCELLED);
+  }
+  const struct srchhit_t* hit = vec_getbufptr(&hits);
+  struct vec_t edits;
+  vec_init(&edits, 16, sizeof(struct bufedit_t));
+  cstr text;
+  cstr_init(&text, 64);
+  int i = 0, j, count = 0;
+  POE_ERR err = POE_ERR_OK;
+  while (i < nhits) {
+    int row = hit[i].row;
+    int len;
+    const char* s = buffer_getlineptr(buf, row, &len);
+    vec_clear(&edits);
+    cstr_clear(&text);
+    for (; i < nhits && hit[i].row == row; i++) {
+      if (bOnlyMarked || bOnlyUnmarked) {
+        bool bIsMarked = markstack_hittest_point(buf, row, hit[i].col,
+                                                 MARK_FLG_VISIBLE, MARK_FLG_VISIBLE);
+        if (!((bOnlyMarked && bIsMarked) || (bOnlyUnmarked && !bIsMarked)))
+          continue;
+      }
+      int at = cstr_count(&text);
+      POE_ERR e = _cmd_change_text(sp, bRegex, s, len, hit[i].col, hit[i].endcol, replstr, &text);
+      if (e != POE_ERR_OK) {
+        // leave this one alone, change the rest, and say so
+        err = e;
+        continue;
+      }
+      struct bufedit_t ed = { hit[i].col, hit[i].endcol - hit[i].col, NULL, cstr_count(&text) - at };
+      vec_append(&edits, &ed);
+    }
+    // the replacement texts are laid end to end in text
+    struct bufedit_t* ed = vec_getbufptr(&edits);
+    const char* t = cstr_getbufptr(&text);
+    for (j = 0; j < vec_count(&edits); t += ed[j].len, j++)
+      ed[j].s = t;
+    buffer_replacechars(buf, row, ed, vec_count(&edits), true);
+    count += vec_count(&edits);
+  }
+  cstr_destroy(&text);
+  vec_destroy(&edits);
+  vec_destroy(&hits);
+  *pcount = count;
+  if (err == POE_ERR_OK && count == 0)
+    err = POE_ERR_NOT_FOUND;
+  TRACE_RETURN(err);
+}
+
+
 // options:
 // '-' == search backwards
 // 'e' == force case sensitivity
 // '*' == replace all occurrences
 // 'm' == replace only marked occurrences
 // 'n' == replace only unmarked occurrences
+// 'r' == the pattern is a regular expression
+// 'a' == change every occurrence in the file at once, without asking
 POE_ERR _cmd_change(cmd_ctx* ctx,
                     int row, int col,
                     const cstr* patstr, const cstr* replstr,
@@ -2146,14 +2499,31 @@ POE_ERR _cmd_change(cmd_ctx* ctx,
   POE_ERR err = POE_ERR_OK;
   int endcol = col;
   const char* opts = cstr_getbufptr(optstr);
+  int direction = (strchr(opts, '-') != NULL) ? -1 : 1;
   bool bReplaceAll = strchr(opts, '*') != NULL;
   bool bOnlyMarked = strchr(opts, 'm') != NULL;
   bool bOnlyUnmarked = strchr(opts, 'n') != NULL;
+  bool bRegex = strchr(opts, 'r') != NULL;
+  bool bChangeAll = strchr(opts, 'a') != NULL;
   int nReplacements = 0;
   bool bDone = false;
   enum confirmation_t confirmation;
+  srchpat sp;
+  err = _cmd_compile_pattern(ctx->targ_buf, patstr, opts, &sp);
+  if (err == POE_ERR_OK && bChangeAll) {
+    err = _cmd_change_all(ctx->targ_buf, &sp, replstr, bRegex,
+                          bOnlyMarked, bOnlyUnmarked, &nReplacements);
+    if (err == POE_ERR_OK)
+      _printf_cmdline(ctx, "%d changed", nReplacements);
+  }
+  if (err != POE_ERR_OK || bChangeAll) {
+    srchpat_destroy(&sp);
+    TRACE_RETURN(err);
+  }
+  cstr text;
+  cstr_init(&text, cstr_count(replstr) + 1);
   do {
-    err = _cmd_locate(ctx->targ_buf, &row, &col, &endcol, patstr, optstr);
+    err = _cmd_locate(ctx->targ_buf, &row, &col, &endcol, &sp, direction);
     confirmation = confirmation_n;
     // Is this one we care about?
     bool bShouldAttempt = err == POE_ERR_OK;
@@ -2170,17 +2540,27 @@ POE_ERR _cmd_change(cmd_ctx* ctx,
       }
       confirmation = get_confirmation("Confirm change");
       if (confirmation == confirmation_y) {
+        cstr_clear(&text);
+        int len;
+        const char* s = buffer_getlineptr(ctx->targ_buf, row, &len);
+        err = _cmd_change_text(&sp, bRegex, s, len, col, endcol, replstr, &text);
+        if (err != POE_ERR_OK)
+          break;
+        marks_begin_batch(ctx->targ_buf);
         buffer_removechars(ctx->targ_buf, row, col, endcol-col, true);
-        buffer_insertstrn(ctx->targ_buf, row, col, cstr_getbufptr(replstr), cstr_count(replstr), true);
+        buffer_insertstrn(ctx->targ_buf, row, col, cstr_getbufptr(&text), cstr_count(&text), true);
+        marks_end_batch(ctx->targ_buf);
         ++nReplacements;
       }
     }
     bDone = bShouldAttempt && !bReplaceAll;
   } while (!bDone && err == POE_ERR_OK && confirmation != confirmation_esc);
+  cstr_destroy(&text);
+  srchpat_destroy(&sp);
 
   // If we were doing a replace-all, the last search would have
   // returned an error, that isn't reflective of what actual happened.
-  if (nReplacements > 0)
+  if (nReplacements > 0 && err != POE_ERR_MATCH_TOO_LONG)
     err = POE_ERR_OK;
   TRACE_RETURN(err);
 }
@@ -2193,9 +2573,12 @@ POE_ERR _cmd_change(cmd_ctx* ctx,
 // 'm' == replace only marked occurrences
 // 'n' == replace only unmarked occurrences
 // 'o' == force search from end (top or bottom depending on '-')
+// 'r' == the pattern is a regular expression
+// 'a' == change every occurrence in the file at once, without asking
 POE_ERR cmd_change(cmd_ctx* ctx)
 {
   CMD_ENTER_BND(ctx, wnd, view, buf, row, col);
+  CMD_REFUSE_LOADING(buf);
   markstack_cur_seal();
   POE_ERR err = POE_ERR_OK;
   const char* pat = next_parm_str(ctx, NULL);
@@ -2235,6 +2618,7 @@ POE_ERR cmd_change(cmd_ctx* ctx)
 POE_ERR cmd_trim_leading(cmd_ctx* ctx)
 {
   CMD_ENTER(ctx);
+  CMD_REFUSE_LOADING(ctx->targ_buf);
   markstack_cur_seal();
   buffer_trimleft(ctx->targ_buf, ctx->targ_row, true);
   CMD_RETURN(POE_ERR_OK);
@@ -2244,6 +2628,7 @@ POE_ERR cmd_trim_leading(cmd_ctx* ctx)
 POE_ERR cmd_trim_trailing(cmd_ctx* ctx)
 {
   CMD_ENTER(ctx);
+  CMD_REFUSE_LOADING(ctx->targ_buf);
   markstack_cur_seal();
   buffer_trimright(ctx->targ_buf, ctx->targ_row, true);
   CMD_RETURN(POE_ERR_OK);
@@ -2253,6 +2638,7 @@ POE_ERR cmd_trim_trailing(cmd_ctx* ctx)
 POE_ERR cmd_trim(cmd_ctx* ctx)
 {
   CMD_ENTER(ctx);
+  CMD_REFUSE_LOADING(ctx->targ_buf);
   buffer_trimright(ctx->targ_buf, ctx->targ_row, true);
   buffer_trimleft(ctx->targ_buf, ctx->targ_row, true);
   CMD_RETURN(POE_ERR_OK);
@@ -2367,7 +2753,7 @@ POE_ERR cmd_qry_key(cmd_ctx* ctx)
   if (keyname == NULL) {
     wins_set_message("Press a key to identify");
     wins_repaint_all();
-    keyname = ui_get_key();
+    keyname = key_name(ui_get_key());
   }
   if (keyname != NULL) {
     cstr fmtted_def;
@@ -2663,6 +3049,7 @@ POE_ERR cmd_center_in_margins(cmd_ctx* ctx)
   err = markstack_cur_get_buffer(&markbuf);
   if (err != POE_ERR_OK)
     CMD_RETURN(err);
+  CMD_REFUSE_LOADING(markbuf);
   // Switch buffers if necessary
   if (buf != markbuf) {
     wins_cur_switchbuffer(markbuf);
@@ -2675,7 +3062,6 @@ POE_ERR cmd_center_in_margins(cmd_ctx* ctx)
     {
       int leftmargin, rightmargin, paragraphmargin;
       buffer_getmargins(buf, &leftmargin, &rightmargin, &paragraphmargin);
-      _savelines_other(buf, l1, l2-l1+1);
       int i;
       for (i = l1; i <= l2; i++) {
         buffer_trimright(buf, i, true);
@@ -2738,13 +3124,24 @@ POE_ERR cmd_qry_chr(cmd_ctx* ctx)
 }
 
 
+// The byte offset of the data cursor, as a command to go back to it.
+POE_ERR cmd_qry_offset(cmd_ctx* ctx)
+{
+  CMD_ENTER(ctx);
+  int64_t off = buffer_char_offset(ctx->data_buf, ctx->data_row, ctx->data_col);
+  _printf_cmdline(ctx, "goto offset %lld", (long long)off);
+  ctx->save_commandline = true;
+  CMD_RETURN(POE_ERR_OK);
+}
+
+
 
 POE_ERR cmd_copy_to_command(cmd_ctx* ctx)
 {
   CMD_ENTER(ctx);
-  struct line_t* line = buffer_get(ctx->data_buf, ctx->data_row);
   cmd_erase_command_line(ctx);
-  buffer_insertstrn(ctx->cmd_buf, 0, 0, cstr_getbufptr(&line->txt), cstr_count(&line->txt), true);
+  buffer_insertstrn(ctx->cmd_buf, 0, 0, buffer_getbufptr(ctx->data_buf, ctx->data_row),
+                    buffer_line_length(ctx->data_buf, ctx->data_row), true);
   view_move_cursor_to(ctx->cmd_view, 0, 0);
   CMD_RETURN(POE_ERR_OK);
 }
@@ -2754,9 +3151,10 @@ POE_ERR cmd_copy_to_command(cmd_ctx* ctx)
 POE_ERR cmd_copy_from_command(cmd_ctx* ctx)
 {
   CMD_ENTER(ctx);
-  struct line_t* line = buffer_get(ctx->cmd_buf, 0);
+  CMD_REFUSE_LOADING(ctx->data_buf);
   buffer_insertblanklines(ctx->data_buf, ctx->data_row+1, 1, true);
-  buffer_insertstrn(ctx->data_buf, ctx->data_row+1, 0, cstr_getbufptr(&line->txt), cstr_count(&line->txt), true);
+  buffer_insertstrn(ctx->data_buf, ctx->data_row+1, 0, buffer_getbufptr(ctx->cmd_buf, 0),
+                    buffer_line_length(ctx->cmd_buf, 0), true);
   view_move_cursor_to(ctx->cmd_view, 0, 0);
   CMD_RETURN(POE_ERR_OK);
 }
@@ -2829,6 +3227,84 @@ POE_ERR cmd_cd(cmd_ctx* ctx)
 }
 
 
+POE_ERR _cmd_undo_redo(cmd_ctx* ctx, bool redo)
+{
+  TRACE_ENTER;
+  int row = ctx->data_row, col = ctx->data_col;
+  POE_ERR err;
+  if (redo)
+    err = journal_redo(ctx->data_buf, &row, &col);
+  else
+    err = journal_undo(ctx->data_buf, &row, &col);
+  if (err == POE_ERR_OK) {
+    row = max(0, min(row, buffer_count(ctx->data_buf)-1));
+    view_move_cursor_to(ctx->data_view, row, col);
+  }
+  TRACE_RETURN(err);
+}
+
+
+POE_ERR cmd_undo(cmd_ctx* ctx)
+{
+  CMD_ENTER(ctx);
+  CMD_REFUSE_LOADING(ctx->data_buf);
+  POE_ERR err = _cmd_undo_redo(ctx, false);
+  CMD_RETURN(err);
+}
+
+
+POE_ERR cmd_redo(cmd_ctx* ctx)
+{
+  CMD_ENTER(ctx);
+  CMD_REFUSE_LOADING(ctx->data_buf);
+  POE_ERR err = _cmd_undo_redo(ctx, true);
+  CMD_RETURN(err);
+}
+
+
+// Stops loading the current file, keeping what has been read so far.
+POE_ERR cmd_cancel_load(cmd_ctx* ctx)
+{
+  CMD_ENTER(ctx);
+  buffer_load_cancel(ctx->data_buf);
+  CMD_RETURN(POE_ERR_OK);
+}
+
+
+// Repacks the current file's text to give back memory left over from
+// editing it.
+POE_ERR cmd_compact(cmd_ctx* ctx)
+{
+  CMD_ENTER(ctx);
+  CMD_REFUSE_LOADING(ctx->data_buf);
+  buffer_compact(ctx->data_buf);
+  CMD_RETURN(POE_ERR_OK);
+}
+
+
+POE_ERR cmd_qry_undolimit(cmd_ctx* ctx)
+{
+  CMD_ENTER(ctx);
+  _printf_cmdline(ctx, "set undolimit %d", (int)(journal_get_limit() / 1024));
+  ctx->save_commandline = true;
+  CMD_RETURN(POE_ERR_OK);
+}
+
+
+// The limit is in Kbytes, per buffer.
+POE_ERR cmd_set_undolimit(cmd_ctx* ctx)
+{
+  CMD_ENTER(ctx);
+  POE_ERR err = POE_ERR_OK;
+  int limit = next_parm_int(ctx, -1);
+  if (limit < 0)
+    err = POE_ERR_SET_VAL_UNK;
+  else
+    journal_set_limit((size_t)limit * 1024);
+  CMD_RETURN(err);
+}
+
+
 POE_ERR cmd_name(cmd_ctx* ctx)
 {
   CMD_ENTER_BND(ctx, wnd, view, buf, row, col);
@@ -2861,11 +3337,13 @@ void defcmds(void)
   DEFCMD(cmd_qry_hsplit,               "?", "HSPLIT");
   DEFCMD(cmd_qry_key,                  "?", "KEY");
   DEFCMD(cmd_qry_margins,              "?", "MARGINS");
+  DEFCMD(cmd_qry_offset,               "?", "OFFSET");
   DEFCMD(cmd_qry_oncommand,            "?", "ONCOMMAND");
   DEFCMD(cmd_qry_searchcase,           "?", "SEARCHCASE");
   DEFCMD(cmd_qry_tabexpand_size,       "?", "TABEXPAND", "SIZE");
   DEFCMD(cmd_qry_tabexpand,            "?", "TABEXPAND");
   DEFCMD(cmd_qry_tabs,                 "?", "TABS");
+  DEFCMD(cmd_qry_undolimit,            "?", "UNDOLIMIT");
   DEFCMD(cmd_qry_vsplit,               "?", "VSPLIT");
   DEFCMD(cmd_qry_wrap,                 "?", "WRAP");
 
@@ -2879,6 +3357,7 @@ void defcmds(void)
   DEFCMD(cmd_bottom_edge,              "BOTTOM",      "EDGE");
   DEFCMD(cmd_bottom,                   "BOTTOM");     
                                                       
+  DEFCMD(cmd_cancel_load,              "CANCEL",      "LOAD");
   DEFCMD(cmd_cd,                       "CD");
   DEFCMD(cmd_center_in_margins,        "CENTER",      "IN",      "MARGINS");
   DEFCMD(cmd_center_line,              "CENTER",      "LINE");
@@ -2887,6 +3366,7 @@ void defcmds(void)
   DEFCMD(cmd_clear_marks,              "CLEAR",       "MARKS");
   DEFCMD(cmd_column,                   "COLUMN");
   DEFCMD(cmd_command_toggle,           "COMMAND",     "TOGGLE");
+  DEFCMD(cmd_compact,                  "COMPACT");
   DEFCMD(cmd_confirm_change,           "CONFIRM",     "CHANGE");
   DEFCMD(cmd_copy_mark,                "COPY",        "MARK");
   DEFCMD(cmd_copy_from_command,        "COPY",        "FROM", "COMMAND");
@@ -2920,6 +3400,7 @@ void defcmds(void)
   DEFCMD(cmd_find_blank_line,          "FIND",        "BLANK",   "LINE");
   DEFCMD(cmd_find_prev_blank_line,     "FIND",        "PREV",    "BLANK", "LINE");
   DEFCMD(cmd_first_nonblank,           "FIRST",       "NONBLANK");
+  DEFCMD(cmd_goto_offset,              "GOTO",        "OFFSET");
                                                       
   DEFCMD(cmd_indent,                   "INDENT");     
   DEFCMD(cmd_insert_line,              "INSERT",      "LINE");
@@ -2967,6 +3448,7 @@ void defcmds(void)
                                                       
   DEFCMD(cmd_replace_mode,             "REPLACE",     "MODE");
   DEFCMD(cmd_resize_display,           "REDRAW");
+  DEFCMD(cmd_redo,                     "REDO");
   DEFCMD(cmd_reflow,                   "REFLOW");
   DEFCMD(cmd_resize_display,           "RESIZE",      "DISPLAY");
   DEFCMD(cmd_right_edge,               "RIGHT",       "EDGE");
@@ -2985,6 +3467,7 @@ void defcmds(void)
   DEFCMD(cmd_set_tabexpand_size,       "SET",         "TABEXPAND", "SIZE");
   DEFCMD(cmd_set_tabexpand,            "SET",         "TABEXPAND");
   DEFCMD(cmd_set_tabs,                 "SET",         "TABS");
+  DEFCMD(cmd_set_undolimit,            "SET",         "UNDOLIMIT");
   DEFCMD(cmd_set_vsplit,               "SET",         "VSPLIT");
   DEFCMD(cmd_set_wrap,                 "SET",         "WRAP");
   DEFCMD(cmd_shift_left,               "SHIFT",       "LEFT");
@@ -3002,6 +3485,7 @@ void defcmds(void)
   DEFCMD(cmd_top_edge,                 "TOP",         "EDGE");
   DEFCMD(cmd_top,                      "TOP");
                                                       
+  DEFCMD(cmd_undo,                     "UNDO");
   DEFCMD(cmd_unmark,                   "UNMARK");
   DEFCMD(cmd_up,                       "UP");
   DEFCMD(cmd_uppercase,                "UPPERCASE");
@@ -14,6 +14,7 @@
 #define CMD_IS_STR(p) ((p)>__CMD_INT_SHIFTED_MASK__)
 
 #define CMD_INTVAL(p) (signextend_int((int)(((p)>>1)&__CMD_INT_MASK__), 20))
+#define CMD_INT_MAX (__CMD_INT_MASK__>>1)
 #define CMD_STRVAL(p) ((const char*)(void*)(p))
 
 struct cmd_ctx_t {
@@ -31,21 +32,15 @@ typedef struct cmd_ctx_t cmd_ctx;
 typedef POE_ERR (*command_handler_t)(cmd_ctx* ctx);
 
 
-////////////////////////////////////////
-// Not being used yet...
-enum parm_type_t { intlit, stringlit, charlit };
-struct parm_t {
-  enum parm_type_t parm_type;
-  int ival;
-  const char* sval;
-  char cval;
-};
-
+// A command sequence with each command already looked up, so running
+// it again doesn't have to go back through the command table.  The
+// arguments are left where they are in the raw sequence.
 struct preproc_cmd_t {
-  command_handler_t cmd_func;
-  vec/*parm_t*/* parms_idx;
+  command_handler_t cmd_func;   // NULL for an unknown command
+  int pc;                       // where the command starts
+  int args_pc;                  // its first argument, or -1 for none
+  int next_pc;                  // where the next command starts
 };
-////////////////////////////////////////
 
 
 void init_commands(void);
@@ -245,7 +245,7 @@ void set_default_profile(void)
          CMD_STR("CURSOR"), CMD_STR("COMMAND"));
   DEFKEY(default_profile, "S-F3", CMD_STR("REFLOW"));
   DEFKEY(default_profile, "S-F4", CMD_STR("UNDO"));
-  DEFKEY(default_profile, "S-F5", CMD_NULL);
+  DEFKEY(default_profile, "S-F5", CMD_STR("REDO"));
   DEFKEY(default_profile, "S-F6",
          CMD_STR("ERASE"), CMD_STR("BEGIN"), CMD_STR("LINE"), CMD_SEP,
          CMD_STR("BEGIN"), CMD_STR("LINE"));
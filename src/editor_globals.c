@@ -21,6 +21,7 @@
 
 bool __quit = false;
 bool __resize_needed = false;
+bool __batch = false;
 POE_ERR cmd_error = POE_ERR_OK;
 BUFFER dir_buffer;
 BUFFER keys_buffer;
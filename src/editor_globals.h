@@ -5,6 +5,7 @@
 
 extern bool __quit;
 extern bool __resize_needed;
+extern bool __batch;
 extern POE_ERR cmd_error;
 extern BUFFER dir_buffer;
 extern BUFFER keys_buffer;
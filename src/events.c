@@ -0,0 +1,183 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+
+#include "trace.h"
+#include "logging.h"
+#include "utils.h"
+#include "events.h"
+
+
+#define EVENTS_MAX_WATCHED (16)
+
+struct watched_t {
+  int fd;
+  event_handler handler;
+  void* arg;
+};
+
+// Reading end, writing end, or -1 until init_events
+static int _wake_pipe[2] = {-1, -1};
+static struct watched_t _watched[EVENTS_MAX_WATCHED];
+static int _nwatched = 0;
+// set once the descriptor events_wait is given hangs up or fails
+static bool _input_closed = false;
+
+
+void _events_drain(int fd);
+int _events_find(int fd);
+
+
+void init_events(void)
+{
+  TRACE_ENTER;
+  if (_wake_pipe[0] >= 0)
+    TRACE_EXIT;
+  if (pipe(_wake_pipe) != 0) {
+    logerr("events: can't make the wake pipe, error %d", errno);
+    _wake_pipe[0] = _wake_pipe[1] = -1;
+    TRACE_EXIT;
+  }
+  int i;
+  for (i = 0; i < 2; i++) {
+    fcntl(_wake_pipe[i], F_SETFL, fcntl(_wake_pipe[i], F_GETFL) | O_NONBLOCK);
+    fcntl(_wake_pipe[i], F_SETFD, FD_CLOEXEC);
+  }
+  TRACE_EXIT;
+}
+
+
+void close_events(void)
+{
+  TRACE_ENTER;
+  if (_wake_pipe[0] >= 0) {
+    close(_wake_pipe[0]);
+    close(_wake_pipe[1]);
+    _wake_pipe[0] = _wake_pipe[1] = -1;
+  }
+  _nwatched = 0;
+  TRACE_EXIT;
+}
+
+
+// No tracing here, it's called from signal handlers.  A full pipe
+// already has a wakeup waiting in it, so a failed write is fine.
+void events_wake(void)
+{
+  int saved = errno;
+  if (_wake_pipe[1] >= 0) {
+    char c = 0;
+    ssize_t rc = write(_wake_pipe[1], &c, 1);
+    (void)rc;
+  }
+  errno = saved;
+}
+
+
+bool events_watch(int fd, event_handler handler, void* arg)
+{
+  TRACE_ENTER;
+  events_unwatch(fd);
+  if (_nwatched == EVENTS_MAX_WATCHED) {
+    logerr("events: too many descriptors to watch fd %d", fd);
+    TRACE_RETURN(false);
+  }
+  _watched[_nwatched].fd = fd;
+  _watched[_nwatched].handler = handler;
+  _watched[_nwatched].arg = arg;
+  _nwatched++;
+  TRACE_RETURN(true);
+}
+
+
+void events_unwatch(int fd)
+{
+  TRACE_ENTER;
+  int i = _events_find(fd);
+  if (i >= 0)
+    _watched[i] = _watched[--_nwatched];
+  TRACE_EXIT;
+}
+
+
+// Waits up to msec (forever if it's negative) for infd to have
+// something to read, or for anything else to happen.  Returns true if
+// infd is ready.  Handlers for whatever else is ready have been
+// called by the time it returns.
+bool events_wait(int infd, int msec)
+{
+  TRACE_ENTER;
+  struct pollfd fds[EVENTS_MAX_WATCHED+2];
+  struct watched_t ready[EVENTS_MAX_WATCHED];
+  int i, nfds = 0, nready = 0;
+  if (infd >= 0) {
+    fds[nfds].fd = infd;
+    fds[nfds++].events = POLLIN;
+  }
+  int wake = nfds;
+  if (_wake_pipe[0] >= 0) {
+    fds[nfds].fd = _wake_pipe[0];
+    fds[nfds++].events = POLLIN;
+  }
+  int first = nfds;
+  for (i = 0; i < _nwatched; i++) {
+    fds[nfds].fd = _watched[i].fd;
+    fds[nfds++].events = POLLIN;
+  }
+  for (i = 0; i < nfds; i++)
+    fds[i].revents = 0;
+  // a signal arriving just counts as something happening
+  if (poll(fds, nfds, msec) <= 0)
+    TRACE_RETURN(false);
+  if (infd >= 0 && (fds[0].revents & (POLLHUP|POLLERR|POLLNVAL)))
+    _input_closed = true;
+  if (wake < first && fds[wake].revents != 0)
+    _events_drain(_wake_pipe[0]);
+  // handlers may watch or unwatch, so work from a copy
+  for (i = first; i < nfds; i++) {
+    if (fds[i].revents != 0)
+      ready[nready++] = _watched[i-first];
+  }
+  for (i = 0; i < nready; i++) {
+    if (_events_find(ready[i].fd) >= 0)
+      ready[i].handler(ready[i].fd, ready[i].arg);
+  }
+  TRACE_RETURN(infd >= 0 && fds[0].revents != 0);
+}
+
+
+// Whether the input events_wait watches has hung up, as a terminal
+// does when the connection to it is dropped.  Nothing more will come
+// from it, and poll will keep saying it's ready.
+bool events_input_closed(void)
+{
+  TRACE_ENTER;
+  TRACE_RETURN(_input_closed);
+}
+
+
+void _events_drain(int fd)
+{
+  TRACE_ENTER;
+  char buf[64];
+  while (read(fd, buf, sizeof(buf)) > 0)
+    ;
+  TRACE_EXIT;
+}
+
+
+int _events_find(int fd)
+{
+  TRACE_ENTER;
+  int i;
+  for (i = 0; i < _nwatched; i++) {
+    if (_watched[i].fd == fd)
+      TRACE_RETURN(i);
+  }
+  TRACE_RETURN(-1);
+}
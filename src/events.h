@@ -0,0 +1,19 @@
+//
+// What the UI waits on between keys.  events_wait sleeps until the
+// keyboard has something, a watched descriptor is ready, or someone
+// calls events_wake, so an idle editor uses no cpu at all.
+// events_wake only writes to a pipe, so it's safe from signal
+// handlers and other threads; it's how SIGWINCH and background loads
+// get the UI's attention.  Descriptors being watched (timers, results
+// from workers, ...) have their handler called from events_wait when
+// they're ready to read.
+//
+typedef void (*event_handler)(int fd, void* arg);
+
+void init_events(void);
+void close_events(void);
+void events_wake(void);
+bool events_watch(int fd, event_handler handler, void* arg);
+void events_unwatch(int fd);
+bool events_wait(int infd, int msec);
+bool events_input_closed(void);
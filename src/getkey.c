@@ -2,6 +2,8 @@
 #include <stdlib.h>
 #include <string.h>
 #include <stdint.h>
+#include <unistd.h>
+#include <signal.h>
 #include <ncurses.h>
 
 #include "utils.h"
@@ -14,7 +16,9 @@
 #include "tabstops.h"
 #include "margins.h"
 #include "key_interp.h"
+#include "buffer.h"
 #include "getkey.h"
+#include "events.h"
 #include "editor_globals.h"
 #include "view.h"
 #include "window.h"
@@ -23,7 +27,17 @@
 // key decoding
 //
 
-#define MAX_KEYSEQ_NAME_LEN (64)
+#define KEYNAME_LEN (16)
+
+static char _key_names[KEYCODE_COUNT][KEYNAME_LEN];
+static bool _key_names_ready = false;
+
+// Keys handed out ahead of the keyboard, for replaying a recording
+static int* _replay_keys = NULL;
+static int _replay_count = 0;
+static int _replay_next = 0;
+
+void _init_key_names(void);
 
 struct keyxlat_t {
   int code;
@@ -131,51 +145,156 @@ int _compare_xlats(const void* a, const void* b)
 void init_getkey(void)
 {
   TRACE_ENTER;
+  _init_key_names();
+  TRACE_EXIT;
+}
+
+
+// Names every key code once, so that naming a key later is just an
+// array lookup.
+void _init_key_names(void)
+{
+  TRACE_ENTER;
+  if (_key_names_ready)
+    TRACE_EXIT;
   qsort(_misc_key_xlat,
         sizeof(_misc_key_xlat)/sizeof(_misc_key_xlat[0]),
         sizeof(_misc_key_xlat[0]),
         _compare_xlats);
+  int c;
+  for (c = 0; c < KEYCODE_COUNT; c++) {
+    char* name = _key_names[c];
+    if (c >= 'a' && c <= 'z') {
+      snprintf(name, KEYNAME_LEN, "%c", c);
+    }
+    else if (c >= 'A' && c <= 'Z') {
+      snprintf(name, KEYNAME_LEN, "S-%c", c-'A'+'a');
+    }
+    else if (c >= 225 && c <= 250) { /* xterm alt-letters */
+      snprintf(name, KEYNAME_LEN, "A-%c", c-225+'a');
+    }
+    else if (c >= 193 && c <= 218) { /* xterm alt-shift-letters */
+      snprintf(name, KEYNAME_LEN, "A-S-%c", c-193+'a');
+    }
+    else if (c >= 134 && c <= 154) { /* xterm ctrl-alt-letters */
+      snprintf(name, KEYNAME_LEN, "A-C-%c", c-134+'a');
+    }
+    else if (c >= 176 && c <= 185) { /* xterm alt-numbers */
+      snprintf(name, KEYNAME_LEN, "A-%c", c-176+'0');
+    }
+    else if (c >= '0' && c <= '9') {
+      snprintf(name, KEYNAME_LEN, "%c", c);
+    }
+    else {
+      struct keyxlat_t key;
+      key.code = c;
+      key.name = NULL;
+      void* p = bsearch(&key,
+                        _misc_key_xlat, 
+                        sizeof(_misc_key_xlat)/sizeof(_misc_key_xlat[0]),
+                        sizeof(_misc_key_xlat[0]),
+                        _compare_xlats);
+      if (p == NULL)
+        snprintf(name, KEYNAME_LEN, "KEY%04d", c);
+      else
+        strlcpy(name, ((struct keyxlat_t*)p)->name, KEYNAME_LEN);
+    }
+  }
+  _key_names_ready = true;
   TRACE_EXIT;
 }
 
 
+// The code of the key with the given name, or -1 if there isn't one.
+int key_code(const char* name)
+{
+  TRACE_ENTER;
+  if (!_key_names_ready)
+    _init_key_names();
+  int c;
+  for (c = 0; c < KEYCODE_COUNT; c++) {
+    if (strcasecmp(_key_names[c], name) == 0)
+      TRACE_RETURN(c);
+  }
+  TRACE_RETURN(-1);
+}
+
+
+const char* key_name(int keycode)
+{
+  TRACE_ENTER;
+  if (keycode < 0 || keycode >= KEYCODE_COUNT)
+    TRACE_RETURN(NULL);
+  if (!_key_names_ready)
+    _init_key_names();
+  TRACE_RETURN(_key_names[keycode]);
+}
+
+
 void close_getkey(void)
 {
   TRACE_ENTER;
+  free(_replay_keys);
+  _replay_keys = NULL;
+  _replay_count = _replay_next = 0;
+  TRACE_EXIT;
+}
+
+
+// Queues up keys to be read before anything typed, as if they had
+// all been typed at once.
+void ui_replay_keys(const int* keys, int n)
+{
+  TRACE_ENTER;
+  free(_replay_keys);
+  _replay_keys = (int*)malloc(max(n, 1) * sizeof(int));
+  memcpy(_replay_keys, keys, n * sizeof(int));
+  _replay_count = n;
+  _replay_next = 0;
   TRACE_EXIT;
 }
 
 
+int ui_replay_left(void)
+{
+  TRACE_ENTER;
+  TRACE_RETURN(_replay_count - _replay_next);
+}
+
+
 POE_ERR get_insertable_key(char* pchr)
 {
   TRACE_ENTER;
   *pchr = '\0';
   wins_set_message("Type a letter");
   wins_repaint_all();
-  const char* keyname = ui_get_key();
-  if (keyname == NULL)
+  int key = ui_get_key();
+  if (key < 0)
     TRACE_RETURN(POE_ERR_KEY_NOT_DEFINED);
-  POE_ERR err = translate_insertable_key(keyname, pchr);
+  POE_ERR err = translate_insertable_key(key, pchr);
   wins_set_message("");
   TRACE_RETURN(err);
 }
 
 
+// Batch scripts can't be asked, so they get whatever they asked for.
 enum confirmation_t get_confirmation(const char* prompt)
 {
   TRACE_ENTER;
+  if (__batch)
+    TRACE_RETURN(confirmation_y);
   wins_set_message(prompt);
   wins_repaint_all();
-  const char* keyname = ui_get_key();
-  if (keyname == NULL) {
+  int key = ui_get_key();
+  if (key < 0) {
 	wins_set_message("");
     TRACE_RETURN(confirmation_n);
   }
-  if (strcasecmp(keyname, "ESC") == 0) {
+  if (key == KEYCODE_ESC) {
 	wins_set_message("");
 	TRACE_RETURN(confirmation_esc);
   }
-  bool ok = is_confirm_key(keyname);
+  bool ok = is_confirm_key(key);
   wins_set_message("");
   if (ok)
 	TRACE_RETURN(confirmation_y)
@@ -184,68 +303,86 @@ enum confirmation_t get_confirmation(const char* prompt)
 }
 
 
-const char* ui_get_key(void)
+// Checks, without waiting for a key, whether ESC has been pressed.
+// Any other key is pushed back to be read normally.
+bool ui_cancel_requested(void)
+{
+  TRACE_ENTER;
+  if (__batch)
+    TRACE_RETURN(false);
+  timeout(0);
+  int c = getch();
+  bool rval = c == KEYCODE_ESC;
+  if (c != ERR && !rval)
+    ungetch(c);
+  TRACE_RETURN(rval);
+}
+
+
+// Waits for a key and returns its code, or -1 if there's no keyboard
+// to wait on or it has hung up.  key_name gives the name it's bound
+// by.
+int ui_get_key(void)
 {
   TRACE_ENTER;
-  static char _keyname[MAX_KEYSEQ_NAME_LEN];
   int c;
-  const char* keyname = _keyname;
 
-  timeout(100);
+  // There's no keyboard in batch mode
+  if (__batch)
+    TRACE_RETURN(-1);
+  if (_replay_next < _replay_count)
+    TRACE_RETURN(_replay_keys[_replay_next++]);
 
   do {
+    // Files still loading are brought in between keys, with no wait
+    // while there's more ready to bring in.
+    int loaded = buffers_load_poll();
+    if (loaded >= 0) {
+      wins_repaint_all();
+      refresh();
+    }
+    timeout(0);
     c = getch();
+    // Nothing to do, so sleep until there's a key, a resize, or more
+    // of a file has been read.
+    if (c == ERR && loaded <= 0 && !__resize_needed)
+      events_wait(STDIN_FILENO, -1);
+    // A dropped terminal is dealt with as SIGHUP would be; if that
+    // doesn't end things, there are no more keys, so quit.
+    if (c == ERR && events_input_closed()) {
+      raise(SIGHUP);
+      __quit = true;
+      TRACE_RETURN(-1);
+    }
     if (__resize_needed) {
       c = KEY_RESIZE;
       __resize_needed = false;
     }
-  } while (c == -1 || c == ERR);
+  } while (c == -1 || c == ERR || c >= KEYCODE_COUNT);
 
-  if (c >= 'a' && c <= 'z') {
-    _keyname[0] = c;
-    _keyname[1] = '\0';
-  }
-  else if (c >= 'A' && c <= 'Z') {
-    snprintf(_keyname, sizeof(_keyname), "S-%c", c-'A'+'a');
-  }
-  else if (c >= 225 && c <= 250) { /* xterm alt-letters */
-    snprintf(_keyname, sizeof(_keyname), "A-%c", c-225+'a');
-  }
-  else if (c >= 193 && c <= 218) { /* xterm alt-shift-letters */
-    snprintf(_keyname, sizeof(_keyname), "A-S-%c", c-193+'a');
-  }
-  else if (c >= 134 && c <= 154) { /* xterm ctrl-alt-letters */
-    snprintf(_keyname, sizeof(_keyname), "A-C-%c", c-134+'a');
-  }
-  else if (c >= 176 && c <= 185) { /* xterm alt-numbers */
-    snprintf(_keyname, sizeof(_keyname), "A-%c", c-176+'0');
-  }
-  else if (c >= '0' && c <= '9') {
-    _keyname[0] = c;
-    _keyname[1] = '\0';
-  }
-  else {
-    struct keyxlat_t key;
-    key.code = c;
-    key.name = NULL;
-    void* p = bsearch(&key,
-                      _misc_key_xlat, 
-                      sizeof(_misc_key_xlat)/sizeof(_misc_key_xlat[0]),
-                      sizeof(_misc_key_xlat[0]),
-                      _compare_xlats);
-    if (p == NULL) {
-      snprintf(_keyname, sizeof(_keyname), "KEY%04d", c);
-    }
-    else {
-      keyname = ((struct keyxlat_t*)p)->name;
-    }
-  }
-
-  if (keyname[0] == '\0')
-    TRACE_RETURN(NULL)
-  else
-    TRACE_RETURN(keyname)
+  TRACE_RETURN(c);
 }
 
 
-
+// Returns the next key if one has already been typed, or -1 if
+// there's nothing waiting.
+int ui_poll_key(void)
+{
+  TRACE_ENTER;
+  if (__batch)
+    TRACE_RETURN(-1);
+  if (_replay_next < _replay_count)
+    TRACE_RETURN(_replay_keys[_replay_next++]);
+  int c;
+  do {
+    timeout(0);
+    c = getch();
+    if (__resize_needed) {
+      c = KEY_RESIZE;
+      __resize_needed = false;
+    }
+    if (c == ERR)
+      TRACE_RETURN(-1);
+  } while (c < 0 || c >= KEYCODE_COUNT);
+  TRACE_RETURN(c);
+}
@@ -2,10 +2,24 @@
 void init_getkey(void);
 void close_getkey(void);
 
+// Keys are passed around as their curses codes, which all fall below
+// KEYCODE_COUNT (poe's own codes for keys curses doesn't know start
+// at POE_SPECIAL_KEY).
+#define KEYCODE_COUNT (1024)
+#define KEYCODE_ESC (27)
+
 enum confirmation_t {confirmation_y, confirmation_n, confirmation_esc};
 
 
 POE_ERR get_insertable_key(char* pchr);
 enum confirmation_t get_confirmation(const char* prompt);
-const char* ui_get_key();
+int ui_get_key(void);
+int ui_poll_key(void);
+const char* key_name(int keycode);
+int key_code(const char* name);
+bool ui_cancel_requested(void);
+
+// Keys queued here are read before the keyboard, for benchmarks
+void ui_replay_keys(const int* keys, int n);
+int ui_replay_left(void);
 
@@ -0,0 +1,515 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "trace.h"
+#include "logging.h"
+#include "poe_err.h"
+#include "utils.h"
+#include "vec.h"
+#include "cstr.h"
+#include "bufid.h"
+#include "tabstops.h"
+#include "margins.h"
+#include "key_interp.h"
+#include "buffer.h"
+#include "journal.h"
+
+
+enum jop_t {
+  JOP_INSCHARS,   // txt was inserted at row/col
+  JOP_DELCHARS,   // txt was removed from row/col
+  JOP_SETCHARS,   // row/col was overwritten; txt is the old then the new text
+  JOP_INSLINES,   // n lines were inserted at row
+  JOP_DELLINES,   // n lines were removed from row
+  JOP_SPLIT,      // row was split at col
+  JOP_JOIN,       // row+1 was joined onto the end of row, which was col long
+};
+
+struct jrec_t {
+  int group;
+  enum jop_t op;
+  int row, col, n;
+  char* txt;
+  // Lines that are out of the buffer: the removed lines of a
+  // DELLINES that's in effect, or the lines of an undone INSLINES.
+  struct line_t* lines;
+  size_t bytes;
+};
+
+struct journal_t {
+  struct vec_t /* struct jrec_t */ recs;
+  int ndone;        // recs before this are in effect, the rest can be redone
+  size_t bytes;
+  int held;         // recording is off while this is non-zero
+};
+
+static int _journal_group = 0;
+static size_t _journal_limit = JOURNAL_DEFAULT_LIMIT;
+
+
+struct jrec_t* _journal_append(struct journal_t* j, enum jop_t op, int row, int col, int n);
+struct jrec_t* _journal_mergeable(struct journal_t* j, enum jop_t op, int row);
+void _journal_resize(struct journal_t* j, struct jrec_t* r);
+void _journal_trim(struct journal_t* j);
+void _journal_drop_redo(struct journal_t* j);
+void _journal_apply(BUFFER buf, struct jrec_t* r, bool undo);
+size_t __jrec_size(const struct jrec_t* r);
+void __jrec_destroy(struct jrec_t* r);
+void __jrec_free_lines(struct line_t* lines, int n);
+
+
+struct journal_t* journal_alloc()
+{
+  TRACE_ENTER;
+  struct journal_t* j = (struct journal_t*)calloc(1, sizeof(struct journal_t));
+  vec_init(&j->recs, 16, sizeof(struct jrec_t));
+  TRACE_RETURN(j);
+}
+
+
+void journal_free(struct journal_t* j)
+{
+  TRACE_ENTER;
+  if (j == NULL)
+    TRACE_EXIT;
+  journal_clear(j);
+  vec_destroy(&j->recs);
+  free(j);
+  TRACE_EXIT;
+}
+
+
+void journal_clear(struct journal_t* j)
+{
+  TRACE_ENTER;
+  if (j == NULL)
+    TRACE_EXIT;
+  int i, n = vec_count(&j->recs);
+  for (i = 0; i < n; i++)
+    __jrec_destroy(vec_get(&j->recs, i));
+  vec_clear(&j->recs);
+  j->ndone = 0;
+  j->bytes = 0;
+  TRACE_EXIT;
+}
+
+
+// Starts a new undo group.  Everything recorded until the next call,
+// in any buffer, is undone and redone together.
+void journal_next_group()
+{
+  TRACE_ENTER;
+  _journal_group++;
+  TRACE_EXIT;
+}
+
+
+void journal_set_limit(size_t limit)
+{
+  TRACE_ENTER;
+  _journal_limit = limit;
+  TRACE_EXIT;
+}
+
+
+size_t journal_get_limit()
+{
+  TRACE_ENTER;
+  TRACE_RETURN(_journal_limit);
+}
+
+
+size_t journal_bytes(const struct journal_t* j)
+{
+  TRACE_ENTER;
+  size_t rval = (j == NULL) ? 0 : j->bytes;
+  TRACE_RETURN(rval);
+}
+
+
+// Compound edits hold the journal while they run and record
+// themselves as a single operation afterwards.
+void journal_hold(struct journal_t* j)
+{
+  TRACE_ENTER;
+  j->held++;
+  TRACE_EXIT;
+}
+
+
+void journal_release(struct journal_t* j)
+{
+  TRACE_ENTER;
+  j->held--;
+  TRACE_EXIT;
+}
+
+
+bool journal_held(const struct journal_t* j)
+{
+  TRACE_ENTER;
+  TRACE_RETURN(j->held > 0);
+}
+
+
+void journal_inschars(struct journal_t* j, int row, int col, const char* s, int n)
+{
+  TRACE_ENTER;
+  if (n <= 0)
+    TRACE_EXIT;
+  // typing a run of characters is one record, not one per character
+  struct jrec_t* r = _journal_mergeable(j, JOP_INSCHARS, row);
+  if (r != NULL && col == r->col + r->n) {
+    r->txt = realloc(r->txt, r->n + n);
+    memcpy(r->txt + r->n, s, n);
+    r->n += n;
+  }
+  else {
+    r = _journal_append(j, JOP_INSCHARS, row, col, n);
+    r->txt = malloc(n);
+    memcpy(r->txt, s, n);
+  }
+  _journal_resize(j, r);
+  _journal_trim(j);
+  TRACE_EXIT;
+}
+
+
+void journal_delchars(struct journal_t* j, int row, int col, const char* s, int n)
+{
+  TRACE_ENTER;
+  if (n <= 0)
+    TRACE_EXIT;
+  struct jrec_t* r = _journal_mergeable(j, JOP_DELCHARS, row);
+  if (r != NULL && col == r->col) {
+    // deleting forwards
+    r->txt = realloc(r->txt, r->n + n);
+    memcpy(r->txt + r->n, s, n);
+    r->n += n;
+  }
+  else if (r != NULL && col + n == r->col) {
+    // rubbing out backwards
+    r->txt = realloc(r->txt, r->n + n);
+    memmove(r->txt + n, r->txt, r->n);
+    memcpy(r->txt, s, n);
+    r->n += n;
+    r->col = col;
+  }
+  else {
+    r = _journal_append(j, JOP_DELCHARS, row, col, n);
+    r->txt = malloc(n);
+    memcpy(r->txt, s, n);
+  }
+  _journal_resize(j, r);
+  _journal_trim(j);
+  TRACE_EXIT;
+}
+
+
+void journal_setchars(struct journal_t* j, int row, int col, const char* olds, const char* news, int n)
+{
+  TRACE_ENTER;
+  if (n <= 0 || memcmp(olds, news, n) == 0)
+    TRACE_EXIT;
+  struct jrec_t* r = _journal_append(j, JOP_SETCHARS, row, col, n);
+  r->txt = malloc(2*n);
+  memcpy(r->txt, olds, n);
+  memcpy(r->txt + n, news, n);
+  _journal_resize(j, r);
+  _journal_trim(j);
+  TRACE_EXIT;
+}
+
+
+void journal_inslines(struct journal_t* j, int row, int n)
+{
+  TRACE_ENTER;
+  if (n <= 0)
+    TRACE_EXIT;
+  struct jrec_t* r = _journal_mergeable(j, JOP_INSLINES, -1);
+  if (r != NULL && row == r->row + r->n)
+    r->n += n;
+  else
+    r = _journal_append(j, JOP_INSLINES, row, 0, n);
+  _journal_resize(j, r);
+  _journal_trim(j);
+  TRACE_EXIT;
+}
+
+
+// Takes ownership of lines, which must own their text.
+void journal_dellines(struct journal_t* j, int row, int n, struct line_t* lines)
+{
+  TRACE_ENTER;
+  if (n <= 0) {
+    free(lines);
+    TRACE_EXIT;
+  }
+  struct jrec_t* r = _journal_append(j, JOP_DELLINES, row, 0, n);
+  r->lines = lines;
+  _journal_resize(j, r);
+  _journal_trim(j);
+  TRACE_EXIT;
+}
+
+
+void journal_split(struct journal_t* j, int row, int col)
+{
+  TRACE_ENTER;
+  struct jrec_t* r = _journal_append(j, JOP_SPLIT, row, col, 0);
+  _journal_resize(j, r);
+  _journal_trim(j);
+  TRACE_EXIT;
+}
+
+
+void journal_join(struct journal_t* j, int row, int col)
+{
+  TRACE_ENTER;
+  struct jrec_t* r = _journal_append(j, JOP_JOIN, row, col, 0);
+  _journal_resize(j, r);
+  _journal_trim(j);
+  TRACE_EXIT;
+}
+
+
+// Undoes the most recent group of edits to buf that's still in
+// effect, and leaves row/col where the earliest of them happened.
+POE_ERR journal_undo(BUFFER buf, int* row, int* col)
+{
+  TRACE_ENTER;
+  struct journal_t* j = buffer_journal(buf);
+  if (j == NULL || j->ndone == 0)
+    TRACE_RETURN(POE_ERR_NOTHING_TO_UNDO);
+  journal_hold(j);
+  int group = ((struct jrec_t*)vec_get(&j->recs, j->ndone-1))->group;
+  while (j->ndone > 0) {
+    struct jrec_t* r = vec_get(&j->recs, j->ndone-1);
+    if (r->group != group)
+      break;
+    _journal_apply(buf, r, true);
+    _journal_resize(j, r);
+    *row = r->row;
+    *col = r->col;
+    j->ndone--;
+  }
+  journal_release(j);
+  TRACE_RETURN(POE_ERR_OK);
+}
+
+
+// Takes back whatever the current group has done to buf, for edits
+// that shouldn't have been made.  Unlike UNDO, it can't be redone.
+// Returns false if the group hasn't touched buf.
+bool journal_revoke(BUFFER buf)
+{
+  TRACE_ENTER;
+  struct journal_t* j = buffer_journal(buf);
+  if (j == NULL || j->ndone == 0)
+    TRACE_RETURN(false);
+  struct jrec_t* r = vec_get(&j->recs, j->ndone-1);
+  if (r->group != _journal_group)
+    TRACE_RETURN(false);
+  int row, col;
+  journal_undo(buf, &row, &col);
+  _journal_drop_redo(j);
+  TRACE_RETURN(true);
+}
+
+
+// Redoes the next group of undone edits to buf, and leaves row/col
+// where the last of them happened.
+POE_ERR journal_redo(BUFFER buf, int* row, int* col)
+{
+  TRACE_ENTER;
+  struct journal_t* j = buffer_journal(buf);
+  if (j == NULL || j->ndone == vec_count(&j->recs))
+    TRACE_RETURN(POE_ERR_NOTHING_TO_REDO);
+  journal_hold(j);
+  int n = vec_count(&j->recs);
+  int group = ((struct jrec_t*)vec_get(&j->recs, j->ndone))->group;
+  while (j->ndone < n) {
+    struct jrec_t* r = vec_get(&j->recs, j->ndone);
+    if (r->group != group)
+      break;
+    _journal_apply(buf, r, false);
+    _journal_resize(j, r);
+    *row = r->row;
+    *col = r->col;
+    j->ndone++;
+  }
+  journal_release(j);
+  TRACE_RETURN(POE_ERR_OK);
+}
+
+
+struct jrec_t* _journal_append(struct journal_t* j, enum jop_t op, int row, int col, int n)
+{
+  TRACE_ENTER;
+  _journal_drop_redo(j);
+  struct jrec_t r;
+  memset(&r, 0, sizeof(r));
+  r.group = _journal_group;
+  r.op = op;
+  r.row = row;
+  r.col = col;
+  r.n = n;
+  vec_append(&j->recs, &r);
+  j->ndone++;
+  struct jrec_t* rval = vec_get(&j->recs, j->ndone-1);
+  TRACE_RETURN(rval);
+}
+
+
+// The last record, if a new op/row can be folded into it.
+struct jrec_t* _journal_mergeable(struct journal_t* j, enum jop_t op, int row)
+{
+  TRACE_ENTER;
+  _journal_drop_redo(j);
+  if (j->ndone == 0)
+    TRACE_RETURN(NULL);
+  struct jrec_t* r = vec_get(&j->recs, j->ndone-1);
+  if (r->group != _journal_group || r->op != op || (row >= 0 && r->row != row))
+    TRACE_RETURN(NULL);
+  TRACE_RETURN(r);
+}
+
+
+void _journal_resize(struct journal_t* j, struct jrec_t* r)
+{
+  TRACE_ENTER;
+  j->bytes -= r->bytes;
+  r->bytes = __jrec_size(r);
+  j->bytes += r->bytes;
+  TRACE_EXIT;
+}
+
+
+// Drops the oldest groups until the journal fits, but never the
+// group being recorded.
+void _journal_trim(struct journal_t* j)
+{
+  TRACE_ENTER;
+  int n = vec_count(&j->recs);
+  if (j->bytes <= _journal_limit || n == 0)
+    TRACE_EXIT;
+  int newest = ((struct jrec_t*)vec_get(&j->recs, n-1))->group;
+  int i = 0;
+  while (i < n && j->bytes > _journal_limit) {
+    int group = ((struct jrec_t*)vec_get(&j->recs, i))->group;
+    if (group == newest)
+      break;
+    for (; i < n; i++) {
+      struct jrec_t* r = vec_get(&j->recs, i);
+      if (r->group != group)
+        break;
+      j->bytes -= r->bytes;
+      __jrec_destroy(r);
+    }
+  }
+  if (i > 0) {
+    vec_removem(&j->recs, 0, i);
+    j->ndone -= i;
+  }
+  TRACE_EXIT;
+}
+
+
+// A new edit makes the undone ones unreachable.
+void _journal_drop_redo(struct journal_t* j)
+{
+  TRACE_ENTER;
+  int i, n = vec_count(&j->recs);
+  if (j->ndone == n)
+    TRACE_EXIT;
+  for (i = j->ndone; i < n; i++) {
+    struct jrec_t* r = vec_get(&j->recs, i);
+    j->bytes -= r->bytes;
+    __jrec_destroy(r);
+  }
+  vec_removem(&j->recs, j->ndone, n - j->ndone);
+  TRACE_EXIT;
+}
+
+
+void _journal_apply(BUFFER buf, struct jrec_t* r, bool undo)
+{
+  TRACE_ENTER;
+  switch (r->op) {
+  case JOP_INSCHARS:
+  case JOP_DELCHARS:
+    if (undo == (r->op == JOP_INSCHARS))
+      buffer_removechars(buf, r->row, r->col, r->n, true);
+    else
+      buffer_insertstrn(buf, r->row, r->col, r->txt, r->n, true);
+    break;
+  case JOP_SETCHARS:
+    // not buffer_setstrn, which pads the line out past the new text
+    buffer_removechars(buf, r->row, r->col, r->n, false);
+    buffer_insertstrn(buf, r->row, r->col, undo ? r->txt : r->txt + r->n, r->n, false);
+    break;
+  case JOP_INSLINES:
+  case JOP_DELLINES:
+    if (undo == (r->op == JOP_INSLINES)) {
+      r->lines = calloc(r->n, sizeof(struct line_t));
+      buffer_takelines(buf, r->row, r->n, r->lines, true);
+    }
+    else {
+      buffer_insertlines_owned(buf, r->row, r->n, r->lines, true);
+      free(r->lines);
+      r->lines = NULL;
+    }
+    break;
+  case JOP_SPLIT:
+  case JOP_JOIN:
+    if (undo == (r->op == JOP_SPLIT))
+      buffer_joinline(buf, r->row, true);
+    else
+      buffer_splitline(buf, r->row, r->col, true);
+    break;
+  }
+  TRACE_EXIT;
+}
+
+
+size_t __jrec_size(const struct jrec_t* r)
+{
+  TRACE_ENTER;
+  size_t rval = sizeof(struct jrec_t);
+  if (r->txt != NULL)
+    rval += (r->op == JOP_SETCHARS) ? 2*r->n : r->n;
+  if (r->lines != NULL) {
+    int i;
+    rval += r->n * sizeof(struct line_t);
+    for (i = 0; i < r->n; i++)
+      rval += line_heapsize(&r->lines[i]);
+  }
+  TRACE_RETURN(rval);
+}
+
+
+void __jrec_destroy(struct jrec_t* r)
+{
+  TRACE_ENTER;
+  free(r->txt);
+  r->txt = NULL;
+  if (r->lines != NULL)
+    __jrec_free_lines(r->lines, r->n);
+  r->lines = NULL;
+  r->bytes = 0;
+  TRACE_EXIT;
+}
+
+
+void __jrec_free_lines(struct line_t* lines, int n)
+{
+  TRACE_ENTER;
+  int i;
+  for (i = 0; i < n; i++)
+    line_destroy(&lines[i]);
+  free(lines);
+  TRACE_EXIT;
+}
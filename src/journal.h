@@ -0,0 +1,39 @@
+//
+// Undo/redo journal.  Each buffer keeps a log of the edits made to
+// it, one small record per primitive operation, rather than copies
+// of the lines an edit touches.  Records are tagged with the group
+// (usually one key press) that made them, and UNDO/REDO step back and
+// forth a whole group at a time.  Removed lines are moved into the
+// journal rather than copied, so undoing a large delete costs no more
+// than the delete did.
+//
+// Once a buffer's journal grows past the limit the oldest groups are
+// dropped.  The newest group is always kept.
+//
+struct journal_t;
+
+#define JOURNAL_DEFAULT_LIMIT (32*1024*1024)
+
+struct journal_t* journal_alloc(void);
+void journal_free(struct journal_t* j);
+void journal_clear(struct journal_t* j);
+void journal_next_group(void);
+void journal_set_limit(size_t limit);
+size_t journal_get_limit(void);
+size_t journal_bytes(const struct journal_t* j);
+
+void journal_hold(struct journal_t* j);
+void journal_release(struct journal_t* j);
+bool journal_held(const struct journal_t* j);
+
+void journal_inschars(struct journal_t* j, int row, int col, const char* s, int n);
+void journal_delchars(struct journal_t* j, int row, int col, const char* s, int n);
+void journal_setchars(struct journal_t* j, int row, int col, const char* olds, const char* news, int n);
+void journal_inslines(struct journal_t* j, int row, int n);
+void journal_dellines(struct journal_t* j, int row, int n, struct line_t* lines);
+void journal_split(struct journal_t* j, int row, int col);
+void journal_join(struct journal_t* j, int row, int col);
+
+POE_ERR journal_undo(BUFFER buf, int* row, int* col);
+POE_ERR journal_redo(BUFFER buf, int* row, int* col);
+bool journal_revoke(BUFFER buf);
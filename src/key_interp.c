@@ -15,25 +15,42 @@
 #include "poe_exit.h"
 #include "vec.h"
 #include "cstr.h"
+#include "arena.h"
 #include "bufid.h"
 #include "mark.h"
 #include "tabstops.h"
 #include "margins.h"
 #include "key_interp.h"
 #include "buffer.h"
+#include "journal.h"
 #include "view.h"
 #include "window.h"
 #include "commands.h"
 #include "cmd_interp.h"
+#include "getkey.h"
 #include "default_profile.h"
 #include "editor_globals.h"
 
 
 void log_view_info();
 
+// Most profiles are a few hundred short key definitions
+#define PROFILE_ARENA_BLKSIZE (8192)
+
 void defkey(PROFILEPTR prof, const char* keyname, const intptr_t* cmds, size_t ncmds);
 struct keydef_t* find_keydef(PROFILEPTR prof, const char* keyname);
-pivec* _save_cmds(const intptr_t* cmds, size_t n);
+int _keydef_index(PROFILEPTR prof, const char* prefix, const char* keyname);
+void _build_keymap(PROFILEPTR prof);
+void _save_cmds(struct cmdseq_t* saved, const intptr_t* cmds, size_t n, arena* strs);
+void _free_cmds(struct cmdseq_t* saved);
+void _retire_cmds(struct cmdseq_t* saved);
+void _free_retired_cmds(void);
+
+// A key can redefine itself, or any key that's running under it, so
+// commands replaced while keys are running are kept until they're done
+int _keys_running = 0;
+struct cmdseq_t* _retired_cmds = NULL;
+int _nretired_cmds = 0;
 
 
 PROFILEPTR alloc_profile(const char* name/* , PROFILEPTR parent */)
@@ -43,6 +60,8 @@ PROFILEPTR alloc_profile(const char* name/* , PROFILEPTR parent */)
   cstr_initstr(&prof->name, name);
   prof->keydefs_sorted = false;
   vec_init(&prof->key_defs, 10, sizeof(struct keydef_t));
+  prof->keymap = NULL;
+  prof->strs = arena_alloc(PROFILE_ARENA_BLKSIZE);
   tabs_init(&prof->default_tabstops, 0, 8, NULL);
   margins_init(&prof->default_margins, 0, 255, 0);
   prof->tabexpand_size = 8;
@@ -65,13 +84,12 @@ void free_profile(PROFILEPTR prof)
   int i, n = vec_count(&prof->key_defs);
   for (i = 0; i < n; i++) {
     struct keydef_t* keydef = vec_get(&prof->key_defs, i);
-    free((char*)keydef->keyname);
     keydef->keyname = NULL;
-    // Fix!  This leaks the memory for any strings in the cmds vec...  
-    pivec_free(keydef->cmds);
-    keydef->cmds = NULL;
+    _free_cmds(&keydef->cmds);
   }
   vec_destroy(&prof->key_defs);
+  free(prof->keymap);
+  arena_free(prof->strs);
   free(prof);
   TRACE_EXIT;
 }
@@ -104,16 +122,20 @@ void load_current_key_definitions(BUFFER keys_buffer, PROFILEPTR profile)
   logmsg("adding %d definitions to .keydefs", n);
   for (i = 0; i < n; i++) {
     struct keydef_t* pkeydef = vec_get(pdefs, i);
-    cstr fmt_seq = format_command_seq(pkeydef->cmds, 0);
+    cstr fmt_seq = format_command_seq(pkeydef->cmds.raw_cmdseq, 0);
+    cstr text;
+    cstr_init(&text, 1);
+    cstr_appendstr(&text, "def ");
+    cstr_appendstr(&text, pkeydef->keyname);
+    cstr_appendstr(&text, " = ");
+    cstr_appendstr(&text, cstr_getbufptr(&fmt_seq));
+    cstr_destroy(&fmt_seq);
     struct line_t line;
+    line_initstrn(&line, cstr_getbufptr(&text), cstr_count(&text));
     line.flags = LINE_FLG_LF|LINE_FLG_DIRTY;
-    cstr_init(&line.txt, 1);
-    cstr_appendstr(&line.txt, "def ");
-    cstr_appendstr(&line.txt, pkeydef->keyname);
-    cstr_appendstr(&line.txt, " = ");
-    cstr_appendstr(&line.txt, cstr_getbufptr(&fmt_seq));
-    cstr_destroy(&fmt_seq);
+    cstr_destroy(&text);
     buffer_appendline(keys_buffer, &line);
+    line_destroy(&line);
   }
   TRACE_EXIT;
 }
@@ -139,19 +161,17 @@ int _find_subcmd(const char* cmd, pivec* cmds, int pc)
 }
 
 
-POE_ERR translate_insertable_key(const char* keyname, char* pchr)
+POE_ERR translate_insertable_key(int keycode, char* pchr)
 {
   TRACE_ENTER;
-  char* ucKeyname = strupr(strsave(keyname));
   WINPTR cur_wnd = wins_get_cur();
   PROFILEPTR prof = win_get_profile(cur_wnd);
-  struct keydef_t* keydef = find_keydef(prof, ucKeyname);
+  struct keydef_t* keydef = find_keydef_bycode(prof, keycode, keymode_plain);
   if (keydef == NULL) {
-    logmsg("can't find definition for key %s", ucKeyname);
-    free(ucKeyname);
+    logmsg("can't find definition for key %s", key_name(keycode));
     TRACE_RETURN(POE_ERR_INVALID_KEY);
   }
-  pivec* cmds = keydef->cmds;
+  pivec* cmds = keydef->cmds.raw_cmdseq;
   int chr_pc = _find_subcmd("CHAR", cmds, 0);
   if (chr_pc < 0)
     TRACE_RETURN(POE_ERR_INVALID_KEY);
@@ -164,23 +184,21 @@ POE_ERR translate_insertable_key(const char* keyname, char* pchr)
 }
 
 
-bool is_confirm_key(const char* keyname)
+bool is_confirm_key(int keycode)
 {
   TRACE_ENTER;
-  char* ucKeyname = strupr(strsave(keyname));
   WINPTR cur_wnd = wins_get_cur();
   PROFILEPTR prof = win_get_profile(cur_wnd);
-  struct keydef_t* keydef = find_keydef(prof, ucKeyname);
+  struct keydef_t* keydef = find_keydef_bycode(prof, keycode, keymode_plain);
   if (keydef == NULL) {
-    logmsg("can't find definition for key %s", ucKeyname);
-    free(ucKeyname);
+    logmsg("can't find definition for key %s", key_name(keycode));
     TRACE_RETURN(false);
   }
   //logmsg("found definition for key %s", ucKeyname);
   //cstr cmdseq_descr = format_command_seq(keydef->cmds);
   //logmsg("executing commands: %s", cstr_getbufptr(&cmdseq_descr));
   //cstr_destroy(&cmdseq_descr);
-  pivec* cmds = keydef->cmds;
+  pivec* cmds = keydef->cmds.raw_cmdseq;
   int conf_pc = _find_subcmd("CONFIRM", cmds, 0);
   if (conf_pc < 0)
     TRACE_RETURN(false);
@@ -212,7 +230,7 @@ POE_ERR get_key_def(BUFFER buf, cstr* fmtted_def, const char* keyname)
     err = POE_ERR_INVALID_KEY;
   }
   else {
-    cstr fmt_seq = format_command_seq(keydef->cmds, 0);
+    cstr fmt_seq = format_command_seq(keydef->cmds.raw_cmdseq, 0);
     cstr_clear(fmtted_def);
     cstr_appendstr(fmtted_def, "def ");
     cstr_appendstr(fmtted_def, keyname);
@@ -225,7 +243,7 @@ POE_ERR get_key_def(BUFFER buf, cstr* fmtted_def, const char* keyname)
 }
 
 
-POE_ERR wins_handle_key(const char* keyname)
+POE_ERR wins_handle_key(int keycode)
 {
   TRACE_ENTER;
   WINPTR cur_wnd = wins_get_cur();
@@ -234,52 +252,13 @@ POE_ERR wins_handle_key(const char* keyname)
   ctx.src_is_commandline = false;
   update_context(&ctx);
 
-  char ucKeyname[MAX_KEYNAME_LEN];
-  struct keydef_t* keydef = NULL;
-  if (buffer_tstflags(ctx.targ_buf, BUF_FLG_CMDLINE)) {
-    // first check cmd-ins/repl-keyname
-    memset(ucKeyname, 0, sizeof(ucKeyname));
-		strlcat(ucKeyname, "CMD-", sizeof(ucKeyname));
-    if (view_tstflags(ctx.targ_view, VIEW_FLG_INSERTMODE))
-      strlcat(ucKeyname, "INS-", sizeof(ucKeyname));
-    else
-      strlcat(ucKeyname, "REP-", sizeof(ucKeyname));
-    strlcat(ucKeyname, keyname, sizeof(ucKeyname));
-    strupr(ucKeyname);
-    //logmsg("trying to look up key '%s'", ucKeyname);
-    keydef = find_keydef(prof, ucKeyname);
-
-    if (keydef == NULL) {
-      // then check cmd-keyname
-      memset(ucKeyname, 0, sizeof(ucKeyname));
-      if (buffer_tstflags(ctx.targ_buf, BUF_FLG_CMDLINE))
-            strlcat(ucKeyname, "CMD-", sizeof(ucKeyname));
-      strlcat(ucKeyname, keyname, sizeof(ucKeyname));
-      strupr(ucKeyname);
-      //logmsg("trying to look up key '%s'", ucKeyname);
-      keydef = find_keydef(prof, ucKeyname);
-    }
-  }
-  else {
-    // first check ins/repl-keyname
-    memset(ucKeyname, 0, sizeof(ucKeyname));
-    if (view_tstflags(ctx.targ_view, VIEW_FLG_INSERTMODE))
-      strlcat(ucKeyname, "INS-", sizeof(ucKeyname));
-    else
-      strlcat(ucKeyname, "REP-", sizeof(ucKeyname));
-    strlcat(ucKeyname, keyname, sizeof(ucKeyname));
-    strupr(ucKeyname);
-    //logmsg("trying to look up key '%s'", ucKeyname);
-    keydef = find_keydef(prof, ucKeyname);
-  }
-  
-  if (keydef == NULL) {
-    // then just try the keyname
-    strlcpy(ucKeyname, keyname, sizeof(ucKeyname));
-    strupr(ucKeyname);
-    //logmsg("finally try to look up key '%s'", ucKeyname);
-    keydef = find_keydef(prof, ucKeyname);
-  }
+  enum keymode_t mode;
+  bool insert = view_tstflags(ctx.targ_view, VIEW_FLG_INSERTMODE);
+  if (buffer_tstflags(ctx.targ_buf, BUF_FLG_CMDLINE))
+    mode = insert ? keymode_cmd_ins : keymode_cmd_rep;
+  else
+    mode = insert ? keymode_ins : keymode_rep;
+  struct keydef_t* keydef = find_keydef_bycode(prof, keycode, mode);
 
   //struct keydef_t* keydef = find_keydef(prof, ucKeyname);
   POE_ERR err = POE_ERR_OK;
@@ -297,9 +276,24 @@ POE_ERR wins_handle_key(const char* keyname)
     kbd_ctx.src_is_commandline = false;
     kbd_ctx.save_commandline = false;
     update_context(&kbd_ctx);
-    kbd_ctx.cmdseq = keydef->cmds;
+    // Hang on to the commands themselves; the key could define another
+    // key and move the definitions around.
+    struct cmdseq_t cmds = keydef->cmds;
+    kbd_ctx.cmdseq = cmds.raw_cmdseq;
     kbd_ctx.pc = 0;
-    err = interpret_command_seq(&kbd_ctx);
+    // everything one key does is undone together
+    journal_next_group();
+    _keys_running++;
+    err = interpret_preproc_seq(&kbd_ctx, cmds.preproc_cmdseq);
+    if (--_keys_running == 0)
+      _free_retired_cmds();
+    // files that are still loading can be looked at, but not changed;
+    // the commands that change them refuse, and this catches the rest
+    if (buffers_load_revoke_edits())
+      err = cmd_error = POE_ERR_STILL_LOADING;
+    // or had a mapped file cut short under them
+    if (buffers_check_maps())
+      err = cmd_error = POE_ERR_FILE_CUT_SHORT;
         
     if (update_context(&kbd_ctx)) {
       view_move_cursor_to(kbd_ctx.data_view, kbd_ctx.data_row, kbd_ctx.data_col);
@@ -329,7 +323,8 @@ struct keydef_t* _find_keydef(PROFILEPTR prof, const char* keyname)
   if (prof->keydefs_sorted) {
     struct keydef_t srchkey;
     srchkey.keyname = keyname;
-    srchkey.cmds = NULL;
+    srchkey.cmds.raw_cmdseq = NULL;
+    srchkey.cmds.preproc_cmdseq = NULL;
     void* found = bsearch(&srchkey,
                           vec_getbufptr(&prof->key_defs),
                           vec_count(&prof->key_defs),
@@ -359,10 +354,71 @@ void sort_profile_keydefs(PROFILEPTR prof)
         sizeof(struct keydef_t),
         compare_keydefs_keyname);
   prof->keydefs_sorted = true;
+  _build_keymap(prof);
+  TRACE_EXIT;
+}
+
+
+// The index in key_defs of the definition named prefix+keyname, or -1
+int _keydef_index(PROFILEPTR prof, const char* prefix, const char* keyname)
+{
+  TRACE_ENTER;
+  char ucKeyname[MAX_KEYNAME_LEN];
+  snprintf(ucKeyname, sizeof(ucKeyname), "%s%s", prefix, keyname);
+  strupr(ucKeyname);
+  struct keydef_t* keydef = _find_keydef(prof, ucKeyname);
+  if (keydef == NULL)
+    TRACE_RETURN(-1);
+  int i = keydef - (struct keydef_t*)vec_getbufptr(&prof->key_defs);
+  TRACE_RETURN(i);
+}
+
+
+// Works out, for every key code in every mode, which definition the
+// key runs.  A mode looks for its own definition first (CMD-INS-x,
+// then CMD-x, on the command line; INS-x or REP-x in the data area),
+// and falls back to the plain key name.
+void _build_keymap(PROFILEPTR prof)
+{
+  TRACE_ENTER;
+  if (prof->keymap == NULL)
+    prof->keymap = (int*)malloc(KEYCODE_COUNT * keymode_count * sizeof(int));
+  int c;
+  for (c = 0; c < KEYCODE_COUNT; c++) {
+    const char* name = key_name(c);
+    int* map = &prof->keymap[c * keymode_count];
+    int plain = _keydef_index(prof, "", name);
+    int cmd = _keydef_index(prof, "CMD-", name);
+    if (cmd < 0)
+      cmd = plain;
+    int i;
+    map[keymode_plain] = plain;
+    map[keymode_rep] = (i = _keydef_index(prof, "REP-", name)) >= 0 ? i : plain;
+    map[keymode_ins] = (i = _keydef_index(prof, "INS-", name)) >= 0 ? i : plain;
+    map[keymode_cmd_rep] = (i = _keydef_index(prof, "CMD-REP-", name)) >= 0 ? i : cmd;
+    map[keymode_cmd_ins] = (i = _keydef_index(prof, "CMD-INS-", name)) >= 0 ? i : cmd;
+  }
   TRACE_EXIT;
 }
 
 
+// Finds what a key does in the given mode with a couple of array
+// lookups.
+struct keydef_t* find_keydef_bycode(PROFILEPTR prof, int keycode, enum keymode_t mode)
+{
+  TRACE_ENTER;
+  if (prof == NULL || keycode < 0 || keycode >= KEYCODE_COUNT)
+    TRACE_RETURN(NULL);
+  if (!prof->keydefs_sorted)
+    sort_profile_keydefs(prof);
+  int i = prof->keymap[keycode * keymode_count + mode];
+  if (i < 0)
+    TRACE_RETURN(NULL);
+  struct keydef_t* keydef = vec_get(&prof->key_defs, i);
+  TRACE_RETURN(keydef);
+}
+
+
 struct keydef_t* find_keydef(PROFILEPTR prof, const char* keyname)
 {
   TRACE_ENTER;
@@ -378,34 +434,89 @@ struct keydef_t* find_keydef(PROFILEPTR prof, const char* keyname)
 void defkey(PROFILEPTR prof, const char* keyname, const intptr_t* cmds, size_t ncmds)
 {
   TRACE_ENTER;
-  char* ucKeyname = strupr(strsave(keyname));
+  char ucKeyname[MAX_KEYNAME_LEN];
+  strlcpy(ucKeyname, keyname, sizeof(ucKeyname));
+  strupr(ucKeyname);
   struct keydef_t* keydef = _find_keydef(prof, ucKeyname);
   if (keydef != NULL) {
     //logmsg("redefining key %s with %d cmds", keyname, ncmds);
-    // FIX!  This leaks memory from any strings in keydef->cmds
-    pivec_free(keydef->cmds);
-    keydef->cmds = _save_cmds(cmds, ncmds);
-    free(ucKeyname);
+    // The old strings stay in the profile's arena until it's freed
+    _retire_cmds(&keydef->cmds);
+    _save_cmds(&keydef->cmds, cmds, ncmds, prof->strs);
   }
   else {
     struct keydef_t newkeydef;
-    newkeydef.keyname = ucKeyname;
-    newkeydef.cmds = _save_cmds(cmds, ncmds);
+    newkeydef.keyname = arena_strsave(prof->strs, ucKeyname);
+    _save_cmds(&newkeydef.cmds, cmds, ncmds, prof->strs);
     vec_append(&prof->key_defs, &newkeydef);
-    if (prof->keydefs_sorted)
+    if (prof->keydefs_sorted) {
+      prof->keydefs_sorted = false;
       sort_profile_keydefs(prof);
+    }
+  }
+  TRACE_EXIT;
+}
+
+
+// Keeps a copy of a key's commands, with each one already looked up
+// so pressing the key doesn't have to.  The strings are copied into
+// strs, since the commands usually come from a parse that is about
+// to be thrown away.
+void _save_cmds(struct cmdseq_t* saved, const intptr_t* cmds, size_t n, arena* strs)
+{
+  TRACE_ENTER;
+  saved->raw_cmdseq = pivec_alloc(n);
+  int i;
+  for (i = 0; i < n; i++) {
+    if (CMD_IS_STR(cmds[i]))
+      pivec_append(saved->raw_cmdseq, CMD_STR(arena_strsave(strs, CMD_STRVAL(cmds[i]))));
+    else
+      pivec_append(saved->raw_cmdseq, cmds[i]);
   }
+  saved->preproc_cmdseq = preproc_command_seq(saved->raw_cmdseq);
   TRACE_EXIT;
 }
 
 
-pivec* _save_cmds(const intptr_t* cmds, size_t n)
+// Frees commands that have been replaced, or keeps them for later if
+// they could still be running
+void _retire_cmds(struct cmdseq_t* saved)
+{
+  TRACE_ENTER;
+  if (_keys_running == 0) {
+    _free_cmds(saved);
+    TRACE_EXIT;
+  }
+  _retired_cmds = realloc(_retired_cmds, (_nretired_cmds+1) * sizeof(struct cmdseq_t));
+  _retired_cmds[_nretired_cmds++] = *saved;
+  saved->raw_cmdseq = NULL;
+  saved->preproc_cmdseq = NULL;
+  TRACE_EXIT;
+}
+
+
+void _free_retired_cmds(void)
 {
   TRACE_ENTER;
-  pivec* saved = pivec_alloc(n);
   int i;
-  for (i = 0; i < n; i++)
-    pivec_append(saved, cmds[i]);
-  TRACE_RETURN(saved);
+  for (i = 0; i < _nretired_cmds; i++)
+    _free_cmds(&_retired_cmds[i]);
+  free(_retired_cmds);
+  _retired_cmds = NULL;
+  _nretired_cmds = 0;
+  TRACE_EXIT;
+}
+
+
+void _free_cmds(struct cmdseq_t* saved)
+{
+  TRACE_ENTER;
+  if (saved->raw_cmdseq != NULL)
+    pivec_free(saved->raw_cmdseq);
+  if (saved->preproc_cmdseq != NULL)
+    vec_free(saved->preproc_cmdseq);
+  saved->raw_cmdseq = NULL;
+  saved->preproc_cmdseq = NULL;
+  TRACE_EXIT;
 }
 
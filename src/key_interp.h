@@ -8,13 +8,19 @@ struct cmdseq_t {
 
 struct keydef_t {
   const char* keyname;
-  pivec* cmds;
+  struct cmdseq_t cmds;
 };
 
+// Where a key is pressed, which decides which of its definitions runs
+enum keymode_t {keymode_plain, keymode_rep, keymode_ins, keymode_cmd_rep, keymode_cmd_ins,
+                 keymode_count};
+
 struct profile_t {
   cstr name;
   bool keydefs_sorted;
   struct vec_t/*keydef_t*/ key_defs;
+  int* keymap;  // key_defs index for each key code and keymode_t, once sorted
+  struct arena_t* strs;  // key names and the strings in their commands
   margins default_margins;
   tabstops default_tabstops;
   bool tabexpand;
@@ -32,10 +38,11 @@ typedef struct profile_t* PROFILEPTR;
 void init_key_interp(void);
 void close_key_interp(void);
 void load_current_key_definitions(BUFFER keys_buffer, PROFILEPTR profile);
-POE_ERR wins_handle_key(const char* keyname);
-POE_ERR translate_insertable_key(const char* keyname, char* pchr);
-bool is_confirm_key(const char* keyname);
+POE_ERR wins_handle_key(int keycode);
+POE_ERR translate_insertable_key(int keycode, char* pchr);
+bool is_confirm_key(int keycode);
 struct keydef_t* find_keydef(PROFILEPTR prof, const char* keyname);
+struct keydef_t* find_keydef_bycode(PROFILEPTR prof, int keycode, enum keymode_t mode);
 POE_ERR get_key_def(BUFFER buf, cstr* fmtted_def, const char* keyname);
 void sort_profile_keydefs(PROFILEPTR prof);
 
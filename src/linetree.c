@@ -0,0 +1,600 @@
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "trace.h"
+#include "poe_err.h"
+#include "poe_exit.h"
+#include "utils.h"
+#include "vec.h"
+#include "cstr.h"
+#include "bufid.h"
+#include "tabstops.h"
+#include "margins.h"
+#include "key_interp.h"
+#include "buffer.h"
+#include "linetree.h"
+
+
+#define LT_LEAF_MAX (128)
+#define LT_NODE_MAX (64)
+
+struct lt_leaf_t {
+  int ct;
+  int cap;
+  struct line_t* lines;
+};
+
+// A child's entry in bytes is LT_STALE until it's next needed.
+#define LT_STALE (-1)
+
+struct lt_node_t {
+  int nkids;
+  int counts[LT_NODE_MAX];
+  int64_t bytes[LT_NODE_MAX];
+  void* kids[LT_NODE_MAX];
+};
+
+
+struct lt_leaf_t* _lt_leaf_alloc(struct linetree_t* t, int cap);
+void _lt_leaf_free(struct linetree_t* t, struct lt_leaf_t* leaf);
+void _lt_leaf_reserve(struct linetree_t* t, struct lt_leaf_t* leaf, int n);
+void _lt_free(struct linetree_t* t, void* node, int height);
+int _lt_nodecount(void* node, int height);
+void* _lt_insert(struct linetree_t* t, void* node, int height, int i, struct line_t* a);
+void _lt_removem(struct linetree_t* t, void* node, int height, int i, int n);
+void _lt_compact(struct linetree_t* t, struct lt_node_t* nd, int height);
+bool _lt_merge(struct linetree_t* t, struct lt_node_t* nd, int height, int k);
+int _lt_linebytes(const struct line_t* l);
+int64_t _lt_bytes(void* node, int height);
+int64_t _lt_kidbytes(struct lt_node_t* nd, int k, int height);
+
+
+void linetree_init(struct linetree_t* t, int capacity)
+{
+  TRACE_ENTER;
+  t->cap = 0;
+  t->ct = 0;
+  t->height = 0;
+  t->root = _lt_leaf_alloc(t, min(max(capacity, 1), LT_LEAF_MAX));
+  t->hint_leaf = NULL;
+  t->hint_start = 0;
+  TRACE_EXIT;
+}
+
+
+void linetree_destroy(struct linetree_t* t)
+{
+  TRACE_ENTER;
+  if (t->root != NULL)
+    _lt_free(t, t->root, t->height);
+  t->root = NULL;
+  t->height = 0;
+  t->ct = 0;
+  t->cap = 0;
+  t->hint_leaf = NULL;
+  TRACE_EXIT;
+}
+
+
+int linetree_count(const struct linetree_t* t)
+{
+  TRACE_ENTER;
+  int rval = t->ct;
+  TRACE_RETURN(rval);
+}
+
+
+int linetree_capacity(const struct linetree_t* t)
+{
+  TRACE_ENTER;
+  int rval = t->cap;
+  TRACE_RETURN(rval);
+}
+
+
+struct line_t* linetree_get(struct linetree_t* t, int i)
+{
+  TRACE_ENTER;
+#ifdef POE_DBG_LIM
+  if (i < 0 || i >= t->ct)
+    poe_err(1, "linetree_get %d/%d", i, t->ct);
+#endif
+  struct lt_leaf_t* leaf = t->hint_leaf;
+  if (leaf != NULL && i >= t->hint_start && i < t->hint_start + leaf->ct)
+    TRACE_RETURN(leaf->lines + (i - t->hint_start));
+  int start = i;
+  void* node = t->root;
+  int h;
+  for (h = t->height; h > 0; h--) {
+    struct lt_node_t* nd = node;
+    int k;
+    for (k = 0; k < nd->nkids-1 && i >= nd->counts[k]; k++)
+      i -= nd->counts[k];
+    node = nd->kids[k];
+  }
+  leaf = node;
+  t->hint_leaf = leaf;
+  t->hint_start = start - i;
+  TRACE_RETURN(leaf->lines + i);
+}
+
+
+// Returns the lines of the leaf holding line i, and sets *first to
+// the number of the leaf's first line and *n to how many it holds.
+// Unlike linetree_get this doesn't touch the tree, so several threads
+// can read it at once.
+struct line_t* linetree_span(const struct linetree_t* t, int i, int* first, int* n)
+{
+  TRACE_ENTER;
+#ifdef POE_DBG_LIM
+  if (i < 0 || i >= t->ct)
+    poe_err(1, "linetree_span %d/%d", i, t->ct);
+#endif
+  int start = i;
+  void* node = t->root;
+  int h;
+  for (h = t->height; h > 0; h--) {
+    struct lt_node_t* nd = node;
+    int k;
+    for (k = 0; k < nd->nkids-1 && i >= nd->counts[k]; k++)
+      i -= nd->counts[k];
+    node = nd->kids[k];
+  }
+  struct lt_leaf_t* leaf = node;
+  *first = start - i;
+  *n = leaf->ct;
+  TRACE_RETURN(leaf->lines);
+}
+
+
+int linetree_append(struct linetree_t* t, struct line_t* a)
+{
+  TRACE_ENTER;
+  int pos = t->ct;
+  linetree_insert(t, pos, a);
+  TRACE_RETURN(pos);
+}
+
+
+void linetree_insert(struct linetree_t* t, int i, struct line_t* a)
+{
+  TRACE_ENTER;
+#ifdef POE_DBG_LIM
+  if (i < 0 || i > t->ct)
+    poe_err(1, "linetree_insert %d/%d", i, t->ct);
+#endif
+  t->hint_leaf = NULL;
+  void* right = _lt_insert(t, t->root, t->height, i, a);
+  if (right != NULL) {
+    struct lt_node_t* root = calloc(1, sizeof(struct lt_node_t));
+    root->nkids = 2;
+    root->kids[0] = t->root;
+    root->counts[0] = _lt_nodecount(t->root, t->height);
+    root->bytes[0] = LT_STALE;
+    root->kids[1] = right;
+    root->counts[1] = _lt_nodecount(right, t->height);
+    root->bytes[1] = LT_STALE;
+    t->root = root;
+    t->height++;
+  }
+  t->ct++;
+  TRACE_EXIT;
+}
+
+
+void linetree_insertm(struct linetree_t* t, int i, int n, struct line_t* a)
+{
+  TRACE_ENTER;
+  int j;
+  for (j = 0; j < n; j++)
+    linetree_insert(t, i+j, a+j);
+  TRACE_EXIT;
+}
+
+
+void linetree_remove(struct linetree_t* t, int i)
+{
+  TRACE_ENTER;
+  linetree_removem(t, i, 1);
+  TRACE_EXIT;
+}
+
+
+void linetree_removem(struct linetree_t* t, int i, int n)
+{
+  TRACE_ENTER;
+  if (n <= 0)
+    TRACE_EXIT;
+#ifdef POE_DBG_LIM
+  if (i < 0 || i+n > t->ct)
+    poe_err(1, "linetree_removem %d+%d/%d", i, n, t->ct);
+#endif
+  t->hint_leaf = NULL;
+  _lt_removem(t, t->root, t->height, i, n);
+  t->ct -= n;
+  // Shrink the tree while the root has only one child
+  while (t->height > 0 && ((struct lt_node_t*)t->root)->nkids <= 1) {
+    struct lt_node_t* root = t->root;
+    if (root->nkids == 0) {
+      t->root = _lt_leaf_alloc(t, 1);
+      t->height = 0;
+    }
+    else {
+      t->root = root->kids[0];
+      t->height--;
+    }
+    free(root);
+  }
+  TRACE_EXIT;
+}
+
+
+// Line i's text has changed size.
+void linetree_touch(struct linetree_t* t, int i)
+{
+  TRACE_ENTER;
+#ifdef POE_DBG_LIM
+  if (i < 0 || i >= t->ct)
+    poe_err(1, "linetree_touch %d/%d", i, t->ct);
+#endif
+  void* node = t->root;
+  int h;
+  for (h = t->height; h > 0; h--) {
+    struct lt_node_t* nd = node;
+    int k;
+    for (k = 0; k < nd->nkids-1 && i >= nd->counts[k]; k++)
+      i -= nd->counts[k];
+    nd->bytes[k] = LT_STALE;
+    node = nd->kids[k];
+  }
+  TRACE_EXIT;
+}
+
+
+int64_t linetree_bytes(struct linetree_t* t)
+{
+  TRACE_ENTER;
+  if (t->ct == 0)
+    TRACE_RETURN(0);
+  int64_t rval = _lt_bytes(t->root, t->height);
+  // an unterminated last line is saved that way
+  if (!(linetree_get(t, t->ct-1)->flags & (LINE_FLG_CR|LINE_FLG_LF)))
+    rval--;
+  TRACE_RETURN(rval);
+}
+
+
+// The offset of the start of line i; i may be one past the last line.
+int64_t linetree_offset(struct linetree_t* t, int i)
+{
+  TRACE_ENTER;
+#ifdef POE_DBG_LIM
+  if (i < 0 || i > t->ct)
+    poe_err(1, "linetree_offset %d/%d", i, t->ct);
+#endif
+  int64_t off = 0;
+  void* node = t->root;
+  int h;
+  for (h = t->height; h > 0; h--) {
+    struct lt_node_t* nd = node;
+    int k;
+    for (k = 0; k < nd->nkids-1 && i >= nd->counts[k]; k++) {
+      i -= nd->counts[k];
+      off += _lt_kidbytes(nd, k, h);
+    }
+    node = nd->kids[k];
+  }
+  struct lt_leaf_t* leaf = node;
+  int j;
+  for (j = 0; j < i && j < leaf->ct; j++)
+    off += _lt_linebytes(leaf->lines+j);
+  TRACE_RETURN(off);
+}
+
+
+// Returns the line that byte off falls in, and sets *lineoff to the
+// offset of its start.  Offsets past the end give the last line.
+int linetree_find_offset(struct linetree_t* t, int64_t off, int64_t* lineoff)
+{
+  TRACE_ENTER;
+  int line = 0;
+  int64_t start = 0;
+  void* node = t->root;
+  int h;
+  for (h = t->height; h > 0; h--) {
+    struct lt_node_t* nd = node;
+    int k;
+    for (k = 0; k < nd->nkids-1; k++) {
+      int64_t b = _lt_kidbytes(nd, k, h);
+      if (off < start + b)
+        break;
+      start += b;
+      line += nd->counts[k];
+    }
+    node = nd->kids[k];
+  }
+  struct lt_leaf_t* leaf = node;
+  int j;
+  for (j = 0; j < leaf->ct-1; j++) {
+    int b = _lt_linebytes(leaf->lines+j);
+    if (off < start + b)
+      break;
+    start += b;
+  }
+  *lineoff = start;
+  TRACE_RETURN(line + j);
+}
+
+
+struct lt_leaf_t* _lt_leaf_alloc(struct linetree_t* t, int cap)
+{
+  TRACE_ENTER;
+  struct lt_leaf_t* leaf = calloc(1, sizeof(struct lt_leaf_t));
+  leaf->cap = max(1, cap);
+  leaf->lines = calloc(leaf->cap, sizeof(struct line_t));
+  t->cap += leaf->cap;
+  TRACE_RETURN(leaf);
+}
+
+
+void _lt_leaf_free(struct linetree_t* t, struct lt_leaf_t* leaf)
+{
+  TRACE_ENTER;
+  t->cap -= leaf->cap;
+  free(leaf->lines);
+  free(leaf);
+  TRACE_EXIT;
+}
+
+
+// Leaves grow by doubling like a vec until they're full size.
+void _lt_leaf_reserve(struct linetree_t* t, struct lt_leaf_t* leaf, int n)
+{
+  TRACE_ENTER;
+  if (n <= leaf->cap)
+    TRACE_EXIT;
+  int cap = leaf->cap;
+  while (cap < n)
+    cap <<= 1;
+  cap = min(cap, LT_LEAF_MAX);
+  leaf->lines = reallocarray(leaf->lines, cap, sizeof(struct line_t));
+  t->cap += cap - leaf->cap;
+  leaf->cap = cap;
+  TRACE_EXIT;
+}
+
+
+void _lt_free(struct linetree_t* t, void* node, int height)
+{
+  TRACE_ENTER;
+  if (height == 0) {
+    _lt_leaf_free(t, node);
+  }
+  else {
+    struct lt_node_t* nd = node;
+    int k;
+    for (k = 0; k < nd->nkids; k++)
+      _lt_free(t, nd->kids[k], height-1);
+    free(nd);
+  }
+  TRACE_EXIT;
+}
+
+
+int _lt_nodecount(void* node, int height)
+{
+  TRACE_ENTER;
+  if (height == 0)
+    TRACE_RETURN(((struct lt_leaf_t*)node)->ct);
+  struct lt_node_t* nd = node;
+  int k, ct = 0;
+  for (k = 0; k < nd->nkids; k++)
+    ct += nd->counts[k];
+  TRACE_RETURN(ct);
+}
+
+
+// Inserts a at i within node.  If the node had to be split, the new
+// right hand sibling is returned for the caller to link in.  Splits
+// caused by appending leave the full node alone, so that sequential
+// loads pack the tree densely.
+void* _lt_insert(struct linetree_t* t, void* node, int height, int i, struct line_t* a)
+{
+  TRACE_ENTER;
+  if (height == 0) {
+    struct lt_leaf_t* leaf = node;
+    struct lt_leaf_t* right = NULL;
+    if (leaf->ct == LT_LEAF_MAX) {
+      int keep = (i == leaf->ct) ? leaf->ct : leaf->ct/2;
+      right = _lt_leaf_alloc(t, LT_LEAF_MAX);
+      right->ct = leaf->ct - keep;
+      memcpy(right->lines, leaf->lines+keep, right->ct*sizeof(struct line_t));
+      leaf->ct = keep;
+      if (i > keep || keep == LT_LEAF_MAX) {
+        i -= keep;
+        leaf = right;
+      }
+    }
+    _lt_leaf_reserve(t, leaf, leaf->ct+1);
+    memmove(leaf->lines+i+1, leaf->lines+i, (leaf->ct-i)*sizeof(struct line_t));
+    leaf->lines[i] = *a;
+    leaf->ct++;
+    TRACE_RETURN(right);
+  }
+
+  struct lt_node_t* nd = node;
+  int k;
+  for (k = 0; k < nd->nkids-1 && i > nd->counts[k]; k++)
+    i -= nd->counts[k];
+  void* kid = _lt_insert(t, nd->kids[k], height-1, i, a);
+  nd->counts[k]++;
+  nd->bytes[k] = LT_STALE;
+  if (kid == NULL)
+    TRACE_RETURN(NULL);
+
+  int kidct = _lt_nodecount(kid, height-1);
+  nd->counts[k] -= kidct;
+  int pos = k+1;
+  struct lt_node_t* right = NULL;
+  if (nd->nkids == LT_NODE_MAX) {
+    int keep = (pos == nd->nkids) ? nd->nkids : nd->nkids/2;
+    right = calloc(1, sizeof(struct lt_node_t));
+    right->nkids = nd->nkids - keep;
+    memcpy(right->kids, nd->kids+keep, right->nkids*sizeof(void*));
+    memcpy(right->counts, nd->counts+keep, right->nkids*sizeof(int));
+    memcpy(right->bytes, nd->bytes+keep, right->nkids*sizeof(int64_t));
+    nd->nkids = keep;
+    if (pos > keep || keep == LT_NODE_MAX) {
+      pos -= keep;
+      nd = right;
+    }
+  }
+  memmove(nd->kids+pos+1, nd->kids+pos, (nd->nkids-pos)*sizeof(void*));
+  memmove(nd->counts+pos+1, nd->counts+pos, (nd->nkids-pos)*sizeof(int));
+  memmove(nd->bytes+pos+1, nd->bytes+pos, (nd->nkids-pos)*sizeof(int64_t));
+  nd->kids[pos] = kid;
+  nd->counts[pos] = kidct;
+  nd->bytes[pos] = LT_STALE;
+  nd->nkids++;
+  TRACE_RETURN(right);
+}
+
+
+// Removes lines [i, i+n) from node.  Children that are wholly inside
+// the range are freed without visiting their lines.
+void _lt_removem(struct linetree_t* t, void* node, int height, int i, int n)
+{
+  TRACE_ENTER;
+  if (height == 0) {
+    struct lt_leaf_t* leaf = node;
+    memmove(leaf->lines+i, leaf->lines+i+n, (leaf->ct-i-n)*sizeof(struct line_t));
+    leaf->ct -= n;
+    TRACE_EXIT;
+  }
+  struct lt_node_t* nd = node;
+  int k, start = 0;
+  for (k = 0; k < nd->nkids && start < i+n; k++) {
+    int ct = nd->counts[k];
+    int lo = max(i, start);
+    int hi = min(i+n, start+ct);
+    if (lo < hi) {
+      if (lo == start && hi == start+ct) {
+        _lt_free(t, nd->kids[k], height-1);
+        nd->kids[k] = NULL;
+      }
+      else {
+        _lt_removem(t, nd->kids[k], height-1, lo-start, hi-lo);
+      }
+      nd->counts[k] -= hi-lo;
+      nd->bytes[k] = LT_STALE;
+    }
+    start += ct;
+  }
+  _lt_compact(t, nd, height);
+  TRACE_EXIT;
+}
+
+
+// Drops freed children, then merges small neighbours so that
+// deletions don't leave a tree full of nearly empty nodes.
+void _lt_compact(struct linetree_t* t, struct lt_node_t* nd, int height)
+{
+  TRACE_ENTER;
+  int j = 0, k;
+  for (k = 0; k < nd->nkids; k++) {
+    if (nd->kids[k] != NULL) {
+      nd->kids[j] = nd->kids[k];
+      nd->counts[j] = nd->counts[k];
+      nd->bytes[j] = nd->bytes[k];
+      j++;
+    }
+  }
+  nd->nkids = j;
+  for (k = 0; k+1 < nd->nkids; ) {
+    if (!_lt_merge(t, nd, height, k))
+      k++;
+  }
+  TRACE_EXIT;
+}
+
+
+// Merges child k+1 into child k if either is under a quarter full and
+// the two fit in one node.
+bool _lt_merge(struct linetree_t* t, struct lt_node_t* nd, int height, int k)
+{
+  TRACE_ENTER;
+  if (height == 1) {
+    struct lt_leaf_t* a = nd->kids[k];
+    struct lt_leaf_t* b = nd->kids[k+1];
+    if ((a->ct >= LT_LEAF_MAX/4 && b->ct >= LT_LEAF_MAX/4) || a->ct + b->ct > LT_LEAF_MAX)
+      TRACE_RETURN(false);
+    _lt_leaf_reserve(t, a, a->ct + b->ct);
+    memcpy(a->lines+a->ct, b->lines, b->ct*sizeof(struct line_t));
+    a->ct += b->ct;
+    _lt_leaf_free(t, b);
+  }
+  else {
+    struct lt_node_t* a = nd->kids[k];
+    struct lt_node_t* b = nd->kids[k+1];
+    if ((a->nkids >= LT_NODE_MAX/4 && b->nkids >= LT_NODE_MAX/4) || a->nkids + b->nkids > LT_NODE_MAX)
+      TRACE_RETURN(false);
+    memcpy(a->kids+a->nkids, b->kids, b->nkids*sizeof(void*));
+    memcpy(a->counts+a->nkids, b->counts, b->nkids*sizeof(int));
+    memcpy(a->bytes+a->nkids, b->bytes, b->nkids*sizeof(int64_t));
+    a->nkids += b->nkids;
+    free(b);
+  }
+  nd->counts[k] += nd->counts[k+1];
+  if (nd->bytes[k] != LT_STALE && nd->bytes[k+1] != LT_STALE)
+    nd->bytes[k] += nd->bytes[k+1];
+  else
+    nd->bytes[k] = LT_STALE;
+  memmove(nd->kids+k+1, nd->kids+k+2, (nd->nkids-k-2)*sizeof(void*));
+  memmove(nd->counts+k+1, nd->counts+k+2, (nd->nkids-k-2)*sizeof(int));
+  memmove(nd->bytes+k+1, nd->bytes+k+2, (nd->nkids-k-2)*sizeof(int64_t));
+  nd->nkids--;
+  TRACE_RETURN(true);
+}
+
+
+// A line's size in the file.  A line with neither CR nor LF is saved
+// with an LF unless it's the last, which linetree_bytes allows for.
+int _lt_linebytes(const struct line_t* l)
+{
+  TRACE_ENTER;
+  int rval = l->ct - l->expanded + ((l->flags & (LINE_FLG_CR|LINE_FLG_LF)) == (LINE_FLG_CR|LINE_FLG_LF) ? 2 : 1);
+  TRACE_RETURN(rval);
+}
+
+
+int64_t _lt_bytes(void* node, int height)
+{
+  TRACE_ENTER;
+  int64_t rval = 0;
+  int k;
+  if (height == 0) {
+    struct lt_leaf_t* leaf = node;
+    for (k = 0; k < leaf->ct; k++)
+      rval += _lt_linebytes(leaf->lines+k);
+  }
+  else {
+    struct lt_node_t* nd = node;
+    for (k = 0; k < nd->nkids; k++)
+      rval += _lt_kidbytes(nd, k, height);
+  }
+  TRACE_RETURN(rval);
+}
+
+
+// The size of child k of nd, summing it again if it's stale.
+int64_t _lt_kidbytes(struct lt_node_t* nd, int k, int height)
+{
+  TRACE_ENTER;
+  if (nd->bytes[k] == LT_STALE)
+    nd->bytes[k] = _lt_bytes(nd->kids[k], height-1);
+  TRACE_RETURN(nd->bytes[k]);
+}
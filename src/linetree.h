@@ -0,0 +1,43 @@
+
+//
+// Counted B+tree of lines.  Index, insert and remove are all
+// O(log n), so edits near the top of a large buffer don't have to
+// move every line after them.  Leaves hold the line structs
+// themselves; interior nodes hold the line count of each child.
+//
+// Interior nodes also cache the byte size of each child, so a line's
+// offset in the file, and the line at an offset, can be found in
+// O(log n).  A line's size is what it takes up in the file: its text
+// as it was read, before any tabs were expanded, plus its CR/LF, or
+// one byte if it has neither and isn't the last line, as it would be
+// saved.  Once a line is edited its text counts as it is.  Edits to
+// a line's text must be reported with linetree_touch, which drops
+// the cached sizes on its path; they're summed again the next time
+// an offset is asked for.
+//
+struct linetree_t {
+  void* root;
+  int height;   // 0 == root is a leaf
+  int ct;
+  int cap;
+  // last leaf looked up, to make sequential access cheap
+  void* hint_leaf;
+  int hint_start;
+};
+typedef struct linetree_t linetree;
+
+void linetree_init(struct linetree_t* t, int capacity);
+void linetree_destroy(struct linetree_t* t);
+int linetree_count(const struct linetree_t* t);
+int linetree_capacity(const struct linetree_t* t);
+struct line_t* linetree_get(struct linetree_t* t, int i);
+struct line_t* linetree_span(const struct linetree_t* t, int i, int* first, int* n);
+int linetree_append(struct linetree_t* t, struct line_t* a);
+void linetree_insert(struct linetree_t* t, int i, struct line_t* a);
+void linetree_insertm(struct linetree_t* t, int i, int n, struct line_t* a);
+void linetree_remove(struct linetree_t* t, int i);
+void linetree_removem(struct linetree_t* t, int i, int n);
+void linetree_touch(struct linetree_t* t, int i);
+int64_t linetree_bytes(struct linetree_t* t);
+int64_t linetree_offset(struct linetree_t* t, int i);
+int linetree_find_offset(struct linetree_t* t, int64_t off, int64_t* lineoff);
@@ -7,6 +7,7 @@
 #include <signal.h>
 #include <setjmp.h>
 #include <limits.h>
+#include <time.h>
 
 #include "trace.h"
 #include "logging.h"
@@ -26,18 +27,32 @@
 #include "buffer.h"
 #include "commands.h"
 #include "getkey.h"
+#include "events.h"
 #include "cmd_interp.h"
 #include "default_profile.h"
 #include "editor_globals.h"
 #include "srchpath.h"
+#include "batch.h"
 
 
 
+// Keys already typed are run back to back, without a repaint between
+// them, for up to this long.
+#define KEY_BATCH_MSEC (50)
+
+
 struct cmdline_args {
   int test;
   int help;
   int logging;
   const char* escdelay;
+  int benchpaint;
+  const char* benchkeys;
+  int* bench_keys;
+  int nbench_keys;
+  int nocoalesce;
+  const char* batch;
+  int jobs;
   struct pivec_t/* cstr* */ files;
   char* error;
 };
@@ -47,6 +62,8 @@ struct cmdline_args {
 int parse_args(int argc, char** argv, struct cmdline_args* args);
 void show_args(struct cmdline_args* args);
 void show_help();
+bool _load_bench_keys(struct cmdline_args* args);
+int64_t _now_msec(void);
 
 void _catch_signals(int* rc, sigjmp_buf* sigjmpbuf, jmp_buf* jmpbuf);
 void _release_signals();
@@ -77,7 +94,7 @@ int main(int argc, char** argv)
     code = setjmp(jmpbuf);
     if (code == 0) {
       _catch_signals(&rc, &sigjmpbuf, &jmpbuf);
-      _do_main(argc, argv);
+      rc = _do_main(argc, argv);
       _release_signals();
     }
     else {
@@ -123,6 +140,10 @@ int _do_main(int argc, char** argv)
     show_help();
     poe_exit(1);
   }
+  if (args.benchkeys != NULL && !_load_bench_keys(&args)) {
+    fprintf(stderr, "pe error: %s\n", args.error);
+    poe_exit(1);
+  }
 
   // show_args(&args);
 
@@ -136,6 +157,9 @@ int _do_main(int argc, char** argv)
   /* tabs_init(&default_tabstops, 0, 8, NULL); */
   /* margins_init(&default_margins, 0, 79, 4); */
 
+  // batch mode runs without curses
+  __batch = args.batch != NULL;
+
   //logmsg("init marks");
   init_marks();
   //logmsg("init markstack");
@@ -145,13 +169,16 @@ int _do_main(int argc, char** argv)
   //logmsg("init windows");
   init_windows();
   //logmsg("init getkey");
+  init_events();
   init_getkey();
+  buffer_set_search_cancel(ui_cancel_requested);
   //logmsg("init key interp");
   init_key_interp();
-  //logmsg("setting default profile");
-  set_default_profile();
   //logmsg("init commands");
   init_commands();
+  //logmsg("setting default profile");
+  // (after the commands, which key definitions are looked up in)
+  set_default_profile();
   
   const char* poe_profile_path = getenv("POE_PROFILE_PATH");
   if (poe_profile_path == NULL)
@@ -165,6 +192,8 @@ int _do_main(int argc, char** argv)
   POE_ERR err = _load_default_profile();
   if (err != POE_ERR_OK) {
 	wins_set_message(poe_err_message(cmd_error));
+	if (__batch && err != POE_ERR_CMD_FILE_NOT_FOUND)
+	  fprintf(stderr, "pe: poe.pro: %s\n", poe_err_message(err));
   }
   win_set_commandmode(wins_get_cur(), default_profile->oncommand);
 
@@ -176,7 +205,16 @@ int _do_main(int argc, char** argv)
   buffer_ensure_min_lines(keys_buffer, false);
   buffer_ensure_min_lines(unnamed_buffer, false);
 
-  if (err == POE_ERR_OK) {
+  // Once there's a screen to show them on, big files load in the
+  // background.  The profile, read above, always loads in full.
+  buffer_set_load_async(!__batch && args.benchpaint == 0 && args.benchkeys == NULL);
+
+  int rc = 0;
+  if (__batch) {
+	rc = batch_run(args.batch, &args.files, args.jobs);
+	__quit = true;
+  }
+  else if (err == POE_ERR_OK) {
 	// load the files
 	int i, n = pivec_count(&args.files);
 	if (n == 0) {
@@ -186,12 +224,19 @@ int _do_main(int argc, char** argv)
 	}
 	else {
 	  //logmsg("loading files from command line");
+	  // read them all at once, but in the order given as far as
+	  // buffer numbers and names go
+	  BUFFER* bufs = (BUFFER*)calloc(n, sizeof(BUFFER));
+	  cstr** filenames = (cstr**)calloc(n, sizeof(cstr*));
+	  POE_ERR* errs = (POE_ERR*)calloc(n, sizeof(POE_ERR));
 	  for (i = 0; i < n; i++) {
-		BUFFER buf = buffer_alloc("", BUF_FLG_VISIBLE, 0, default_profile);
-		cstr* filename = (cstr*)pivec_get(&args.files, i);
-		//logmsg("loading file '%s'", cstr_getbufptr(filename));
-		/*POE_ERR err = */buffer_load(buf, filename, default_profile->tabexpand);
+		bufs[i] = buffer_alloc("", BUF_FLG_VISIBLE, 0, default_profile);
+		filenames[i] = (cstr*)pivec_get(&args.files, i);
 	  }
+	  buffers_load_many(n, bufs, filenames, default_profile->tabexpand, errs);
+	  free(errs);
+	  free(filenames);
+	  free(bufs);
 	}
 	// switch away from poe.pro...
 	wins_cur_nextbuffer();
@@ -204,24 +249,48 @@ int _do_main(int argc, char** argv)
   }
   
 
-  // Event loop for the editor
-  char achKeyname[64];
-  do {
+  double bench_fps = 0;
+  if (args.benchpaint > 0) {
+    wins_ensure_initial_win();
+    bench_fps = wins_bench_repaint(args.benchpaint, 500);
+    __quit = true;
+  }
+
+  int nkeys = 0, npaints = 0;
+  int64_t bench_start = 0;
+  if (args.benchkeys != NULL) {
+    ui_replay_keys(args.bench_keys, args.nbench_keys);
+    free(args.bench_keys);
+    bench_start = _now_msec();
+  }
+
+  // Event loop for the editor.  Once a key has been dealt with, any
+  // that have been typed since are run straight after it, so that the
+  // screen doesn't fall further and further behind the keyboard.  The
+  // batch is cut short after KEY_BATCH_MSEC so it still gets painted.
+  while (!__quit && visible_buffers_count() != 0) {
     wins_ensure_initial_win(); // make darn sure we have a view in the main slot
     wins_repaint_all();
     refresh();
+    npaints++;
 
-    achKeyname[0] = '\0';
-
-    const char* lpszKeyname = ui_get_key();
-    if (lpszKeyname != NULL) {
+    int key = ui_get_key();
+    int64_t batch_end = _now_msec() + KEY_BATCH_MSEC;
+    while (key >= 0) {
       //logmsg("---------------------------------------------------------");
-      //logmsg("got key '%s'", lpszKeyname);
-      strlcpy(achKeyname, lpszKeyname, sizeof(achKeyname));
-      wins_handle_key(achKeyname);
+      //logmsg("got key '%s'", key_name(key));
+      wins_handle_key(key);
       wins_set_message(poe_err_message(cmd_error));
+      nkeys++;
+      if (args.nocoalesce || __quit || visible_buffers_count() == 0 || _now_msec() >= batch_end)
+        break;
+      wins_ensure_initial_win();
+      key = ui_poll_key();
     }
-  } while (!__quit && visible_buffers_count() != 0);
+    if (args.benchkeys != NULL && ui_replay_left() == 0)
+      break;
+  }
+  double bench_secs = (_now_msec() - bench_start) / 1000.0;
 
   //logmsg("closing commands");
   close_commands();
@@ -229,8 +298,18 @@ int _do_main(int argc, char** argv)
   close_key_interp();
   //logmsg("closing getkey");
   close_getkey();
+  close_events();
   //logmsg("closing windows");
   close_windows();
+  if (args.benchpaint > 0) {
+    shutdown_windows();
+    printf("%d frames, %.1f frames/sec\n", args.benchpaint, bench_fps);
+  }
+  if (args.benchkeys != NULL) {
+    shutdown_windows();
+    printf("%d keys, %d repaints, %.1f keys/sec%s\n", nkeys, npaints,
+           bench_secs > 0 ? nkeys / bench_secs : 0, args.nocoalesce ? " (one at a time)" : "");
+  }
   //logmsg("shutting down marks");
   shutdown_marks();
   //logmsg("shutting down markstack");
@@ -238,7 +317,7 @@ int _do_main(int argc, char** argv)
   //logmsg("shutting down buffer");
   shutdown_buffer();
   //logmsg("exiting");
-  TRACE_RETURN(0);
+  TRACE_RETURN(rc);
   // shutdown_trace_stack();
 }
 
@@ -269,6 +348,41 @@ int parse_args(int argc, char** argv, struct cmdline_args* args)
       args->escdelay = argv[i+1];
       ++i;
     }
+    else if (strcasecmp(argv[i], "-benchpaint") == 0) {
+      if (argc <= i+1) {
+        fprintf(stderr, "missing value for -benchpaint\n");
+        exit(1);
+      }
+      args->benchpaint = atoi(argv[i+1]);
+      ++i;
+    }
+    else if (strcasecmp(argv[i], "-benchkeys") == 0) {
+      if (argc <= i+1) {
+        fprintf(stderr, "missing value for -benchkeys\n");
+        exit(1);
+      }
+      args->benchkeys = argv[i+1];
+      ++i;
+    }
+    else if (strcasecmp(argv[i], "-nocoalesce") == 0) {
+      ++args->nocoalesce;
+    }
+    else if (strcasecmp(argv[i], "-batch") == 0) {
+      if (argc <= i+1) {
+        fprintf(stderr, "missing value for -batch\n");
+        exit(1);
+      }
+      args->batch = argv[i+1];
+      ++i;
+    }
+    else if (strcasecmp(argv[i], "-jobs") == 0) {
+      if (argc <= i+1) {
+        fprintf(stderr, "missing value for -jobs\n");
+        exit(1);
+      }
+      args->jobs = atoi(argv[i+1]);
+      ++i;
+    }
     else if (argv[i][0] == '-') {
       char msgbuf[1024];
       snprintf(msgbuf, sizeof(msgbuf), "unknown option %s", argv[i]);
@@ -281,6 +395,10 @@ int parse_args(int argc, char** argv, struct cmdline_args* args)
       pivec_append(&args->files, (intptr_t)filename);
     }
   }
+  if (args->batch != NULL && pivec_count(&args->files) == 0) {
+    args->error = strsave("-batch needs at least one file");
+    TRACE_RETURN(0);
+  }
   TRACE_RETURN(1);
 }
 
@@ -312,11 +430,62 @@ void show_help()
   fprintf(stderr, " -logerr\tlog only errors (default)\n");
   fprintf(stderr, " -logmsg\tlog informational messages\n");
   fprintf(stderr, " -escdelay n\tset escape delay (msec)\n");
+  fprintf(stderr, " -benchpaint n\trepaint n frames with many marks and report frames/sec\n");
+  fprintf(stderr, " -benchkeys file\ttype the keys named in file as fast as they can be run, and report keys/sec\n");
+  fprintf(stderr, " -nocoalesce\trepaint after every key, even when more are waiting\n");
+  fprintf(stderr, " -batch script\trun the commands in script against each file, without a screen\n");
+  fprintf(stderr, " -jobs n\tuse n worker processes for -batch (default one per cpu)\n");
   TRACE_EXIT;
 }
 
 
 
+// Reads the names of the keys for -benchkeys, separated by blanks or
+// newlines, as they're written in DEF.
+bool _load_bench_keys(struct cmdline_args* args)
+{
+  TRACE_ENTER;
+  char msgbuf[1024];
+  FILE* f = fopen(args->benchkeys, "r");
+  if (f == NULL) {
+    snprintf(msgbuf, sizeof(msgbuf), "can't open %s", args->benchkeys);
+    args->error = strsave(msgbuf);
+    TRACE_RETURN(false);
+  }
+  vec keys;
+  vec_init(&keys, 1024, sizeof(int));
+  char name[64];
+  bool ok = true;
+  while (ok && fscanf(f, "%63s", name) == 1) {
+    int key = key_code(name);
+    if (key < 0) {
+      snprintf(msgbuf, sizeof(msgbuf), "unknown key %s in %s", name, args->benchkeys);
+      args->error = strsave(msgbuf);
+      ok = false;
+    }
+    vec_append(&keys, &key);
+  }
+  fclose(f);
+  if (ok) {
+    args->nbench_keys = vec_count(&keys);
+    args->bench_keys = (int*)malloc(max(args->nbench_keys, 1) * sizeof(int));
+    if (args->nbench_keys > 0)
+      memcpy(args->bench_keys, vec_getbufptr(&keys), args->nbench_keys * sizeof(int));
+  }
+  vec_destroy(&keys);
+  TRACE_RETURN(ok);
+}
+
+
+int64_t _now_msec(void)
+{
+  TRACE_ENTER;
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  TRACE_RETURN((int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000);
+}
+
+
 void _catch_signals(int* rc, sigjmp_buf* sigjmpbuf, jmp_buf* jmpbuf)
 {
   TRACE_ENTER;
@@ -373,8 +542,10 @@ void _release_signals()
 
 void _pe_resize_sig(int sigraised)
 {
-  if (sigraised == SIGWINCH)
+  if (sigraised == SIGWINCH) {
     __resize_needed = true;
+    events_wake();
+  }
 }
 
 
@@ -41,6 +41,75 @@ struct mark_t {
 
 struct pivec_t/*MARK*/ _all_marks;
 int _next_mark_id = 0;
+// Bumped whenever a stacked mark changes, so the display can tell
+// when the highlighting needs repainting.
+unsigned int _marks_gen = 0;
+
+
+// Per buffer index of mark line ranges for hit testing.  The entries
+// are sorted by first line and searched as an implicit binary tree,
+// each node holding the furthest last line in its subtree, so a hit
+// test only visits marks that can cover the row.  Positional changes
+// just flag the index stale, and it's rebuilt on the next hit test.
+struct markidx_ent_t {
+  MARK mark;
+  int l1, l2;
+  int maxl2;
+};
+
+// Positional change recorded while a buffer's marks are batched
+enum markop_t {
+  Markop_InsertedLines, Markop_RemovedLines,
+  Markop_InsertedChars, Markop_RemovedChars,
+  Markop_InsertedCharBlk, Markop_RemovedCharBlk,
+  Markop_Split, Markop_Join
+};
+
+struct markupd_t {
+  enum markop_t op;
+  int line, col;
+  int n, leading, trailing;
+  int buf_lines;
+};
+
+// A run of lines, numbered as they were when the batch began, that
+// have all moved by delta since.
+struct lineseg_t {
+  int start, end;
+  int delta;
+};
+
+// The batch's line map always keeps at least this many runs before
+// giving up on them
+#define MARK_LINEMAP_MINSEGS (64)
+
+struct bufmarks_t {
+  BUFFER buf;
+  struct pivec_t/*MARK*/ marks;
+  bool stale;
+  struct vec_t/*struct markidx_ent_t*/ idx;
+  int batch;
+  struct vec_t/*struct markupd_t*/ pending;
+  // Where the queued updates have moved each line to.  Lines in no
+  // run, or in hot, were edited themselves, and a mark that ends on
+  // one has the whole queue replayed.
+  struct vec_t/*struct lineseg_t*/ segs;
+  struct vec_t/*int*/ hot;
+  bool unmapped;  // more runs than marks, so everything is replayed
+};
+
+struct markidx_qry_t {
+  BUFFER buf;
+  int row, col;
+  bool point;
+  int flags_mask, flags_chk;
+  bool newest;
+  MARK found;
+  struct vec_t* spans;  // collect the covered columns instead
+};
+
+struct pivec_t/*struct bufmarks_t* */ _all_bufmarks;
+struct bufmarks_t* _last_bufmarks = NULL;
 
 
 void _mark_init(MARK mark, int markid, int flags);
@@ -53,6 +122,26 @@ void _mark_upd_split(MARK mark, BUFFER buf, int line, int col);
 void _mark_upd_join(MARK mark, BUFFER buf, int line, int col);
 void _mark_canonicalize(MARK mark);
 POE_ERR _mark_check(MARK mark);
+struct bufmarks_t* _bufmarks_get(BUFFER buf, bool create);
+void _bufmarks_invalidate(BUFFER buf);
+void _bufmarks_free(BUFFER buf);
+void _bufmarks_rebuild(struct bufmarks_t* bm);
+void _bufmarks_flush(struct bufmarks_t* bm);
+void _mark_setbuf(MARK mark, BUFFER buf);
+void _mark_flush(MARK mark);
+void _mark_touched(MARK mark);
+void _mark_apply(MARK mark, BUFFER buf, const struct markupd_t* upd);
+void _marks_upd(BUFFER buf, struct markupd_t* upd);
+MARK _marks_hittest(BUFFER buf, int row, int col, bool point, int flags_mask, int flags_chk, bool newest);
+int __markidx_cmp(const void* a, const void* b);
+int __markidx_build(struct vec_t* idx, int lo, int hi);
+void __linemap_reset(struct bufmarks_t* bm);
+void __linemap_add(struct bufmarks_t* bm, const struct markupd_t* upd);
+int __linemap_seek(const struct bufmarks_t* bm, int line);
+bool __linemap_find(const struct bufmarks_t* bm, int line, int* pdelta);
+int __int_cmp(const void* a, const void* b);
+void __markidx_find(struct vec_t* idx, int lo, int hi, struct markidx_qry_t* q);
+bool _mark_line_span(MARK mark, int row, int* c1, int* c2);
 
 
 void init_marks()
@@ -60,6 +149,8 @@ void init_marks()
   TRACE_ENTER;
   _next_mark_id = 1;
   pivec_init(&_all_marks, 10);
+  pivec_init(&_all_bufmarks, 10);
+  _last_bufmarks = NULL;
   TRACE_EXIT;
 }
 
@@ -72,6 +163,9 @@ void shutdown_marks()
     _mark_free((MARK)pivec_get(&_all_marks, i));
   }
   pivec_destroy(&_all_marks);
+  while (pivec_count(&_all_bufmarks) > 0)
+    _bufmarks_free(((struct bufmarks_t*)pivec_get(&_all_bufmarks, 0))->buf);
+  pivec_destroy(&_all_bufmarks);
   TRACE_EXIT;
 }
 
@@ -156,7 +250,7 @@ void mark_unmark(MARK mark)
 {
   TRACE_ENTER;
   VALIDATEMARK(mark);
-  mark->buf = BUFFER_NULL;
+  _mark_setbuf(mark, BUFFER_NULL);
   mark->flags &= ~(MARK_FLG_STARTED|MARK_FLG_ENDED|MARK_FLG_SEALED);
   mark->typ = Marktype_None;
   mark->l1 = 0;
@@ -197,17 +291,19 @@ int marks_count()
 void mark_free_marks_in_buffer(BUFFER buf)
 {
   TRACE_ENTER;
-  int i;
-  for (i = 0; i < pivec_count(&_all_marks); ) {
-    MARK mark = (MARK)pivec_get(&_all_marks, i);
-	if (mark->buf == buf) {
-	  _mark_free(mark);
-	  pivec_remove(&_all_marks, i);
-	}
-	else {
-	  i++;
-	}
+  struct bufmarks_t* bm = _bufmarks_get(buf, false);
+  if (bm != NULL) {
+    vec_clear(&bm->pending);
+    // Freeing a mark drops it from the buffer's list
+    while (pivec_count(&bm->marks) > 0) {
+      MARK mark = (MARK)pivec_get(&bm->marks, pivec_count(&bm->marks)-1);
+      int i = __find_mark(mark);
+      _mark_free(mark);
+      if (i >= 0)
+        pivec_remove(&_all_marks, i);
+    }
   }
+  _bufmarks_free(buf);
   TRACE_EXIT;
 }
 
@@ -217,6 +313,7 @@ void mark_setflags(MARK mark, int flags)
   TRACE_ENTER;
   VALIDATEMARK(mark);
   mark->flags |= flags;
+  _mark_touched(mark);
   TRACE_EXIT;
 }
 
@@ -225,6 +322,7 @@ void mark_clrflags(MARK mark, int flags)
 {
   TRACE_ENTER;
   VALIDATEMARK(mark);
+  _mark_touched(mark);
   mark->flags &= ~flags;
   TRACE_EXIT;
 }
@@ -243,6 +341,7 @@ POE_ERR mark_get_buffer(MARK mark, BUFFER* buf)
 {
   TRACE_ENTER;
   VALIDATEMARK(mark);
+  _mark_flush(mark);
   *buf = mark->buf;
   POE_ERR rval = _mark_check(mark);
   TRACE_RETURN(rval);
@@ -253,6 +352,7 @@ POE_ERR mark_get_type(MARK mark, enum marktype* typ)
 {
   TRACE_ENTER;
   VALIDATEMARK(mark);
+  _mark_flush(mark);
   *typ = mark->typ;
   POE_ERR rval = _mark_check(mark);
   TRACE_RETURN(rval);
@@ -263,6 +363,7 @@ POE_ERR mark_get_start(MARK mark, int* line, int* col)
 {
   TRACE_ENTER;
   VALIDATEMARK(mark);
+  _mark_flush(mark);
   *line = mark->l1;
   *col = mark->c1;
   POE_ERR rval = _mark_check(mark);
@@ -274,6 +375,7 @@ POE_ERR mark_get_end(MARK mark, int* line, int* col)
 {
   TRACE_ENTER;
   VALIDATEMARK(mark);
+  _mark_flush(mark);
   *line = mark->l2;
   *col = mark->c2;
   POE_ERR rval = _mark_check(mark);
@@ -285,6 +387,7 @@ POE_ERR mark_get_bounds(MARK mark, enum marktype *typ, int* l1, int* c1, int* l2
 {
   TRACE_ENTER;
   VALIDATEMARK(mark);
+  _mark_flush(mark);
   POE_ERR rc = _mark_check(mark);
   if (rc != POE_ERR_OK) {
     *typ = Marktype_None;
@@ -317,6 +420,7 @@ bool mark_hittest_point(MARK mark, BUFFER buf, int row, int col, int flags_mask,
 {
   TRACE_ENTER;
   VALIDATEMARK(mark);
+  _mark_flush(mark);
   if (mark->buf != buf)
     TRACE_RETURN(false);
   if ((mark->flags & flags_mask) != flags_chk)
@@ -353,6 +457,7 @@ bool mark_hittest_line(MARK mark, BUFFER buf, int row, int flags_mask, int flags
 {
   TRACE_ENTER;
   VALIDATEMARK(mark);
+  _mark_flush(mark);
   if (mark->buf != buf)
     TRACE_RETURN(false);
   if ((mark->flags & flags_mask) != flags_chk)
@@ -370,29 +475,70 @@ bool mark_hittest_line(MARK mark, BUFFER buf, int row, int flags_mask, int flags
 }
 
 
+unsigned int marks_generation()
+{
+  TRACE_ENTER;
+  TRACE_RETURN(_marks_gen);
+}
+
+
 MARK marks_hittest_point(BUFFER buf, int row, int col, int flags_mask, int flags_chk)
 {
   TRACE_ENTER;
-  int i, n = pivec_count(&_all_marks);
-  for (i = 0; i < n; i++) {
-    MARK mark = (MARK)pivec_get(&_all_marks, i);
-    if (mark_hittest_point(mark, buf, row, col, flags_mask, flags_chk))
-      TRACE_RETURN(mark);
-  }
-  TRACE_RETURN(NULL);
+  MARK rval = _marks_hittest(buf, row, col, true, flags_mask, flags_chk, false);
+  TRACE_RETURN(rval);
 }
 
 
 MARK marks_hittest_line(BUFFER buf, int row, int flags_mask, int flags_chk)
 {
   TRACE_ENTER;
-  int i, n = pivec_count(&_all_marks);
-  for (i = 0; i < n; i++) {
-    MARK mark = (MARK)pivec_get(&_all_marks, i);
-    if (mark_hittest_line(mark, buf, row, flags_mask, flags_chk))
-      TRACE_RETURN(mark);
-  }
-  TRACE_RETURN(NULL);
+  MARK rval = _marks_hittest(buf, row, 0, false, flags_mask, flags_chk, false);
+  TRACE_RETURN(rval);
+}
+
+
+MARK marks_hittest_point_newest(BUFFER buf, int row, int col, int flags_mask, int flags_chk)
+{
+  TRACE_ENTER;
+  MARK rval = _marks_hittest(buf, row, col, true, flags_mask, flags_chk, true);
+  TRACE_RETURN(rval);
+}
+
+
+MARK marks_hittest_line_newest(BUFFER buf, int row, int flags_mask, int flags_chk)
+{
+  TRACE_ENTER;
+  MARK rval = _marks_hittest(buf, row, 0, false, flags_mask, flags_chk, true);
+  TRACE_RETURN(rval);
+}
+
+
+// Appends the column range each matching mark covers on the row to
+// spans (struct markspan_t), and returns the number appended.  The
+// ranges come out in no particular order and may overlap.
+int marks_line_spans(BUFFER buf, int row, int flags_mask, int flags_chk, struct vec_t* spans)
+{
+  TRACE_ENTER;
+  if (buf == BUFFER_NULL)
+    TRACE_RETURN(0);
+  struct bufmarks_t* bm = _bufmarks_get(buf, true);
+  _bufmarks_flush(bm);
+  if (bm->stale)
+    _bufmarks_rebuild(bm);
+  int ct = vec_count(spans);
+  struct markidx_qry_t q;
+  q.buf = buf;
+  q.row = row;
+  q.col = 0;
+  q.point = false;
+  q.flags_mask = flags_mask;
+  q.flags_chk = flags_chk;
+  q.newest = false;
+  q.found = MARK_NULL;
+  q.spans = spans;
+  __markidx_find(&bm->idx, 0, vec_count(&bm->idx), &q);
+  TRACE_RETURN(vec_count(spans) - ct);
 }
 
 
@@ -427,12 +573,12 @@ void _mark_upd_insertedlines(MARK mark, BUFFER buf, int line, int lines_inserted
 
 
 // Make sure this is called before actually removing the lines!  It
-// uses the buffer line count in one spot.
-void _mark_upd_removedlines(MARK mark, BUFFER buf, int line, int lines_removed)
+// uses the buffer line count in one spot.  buf_lines is that count as
+// of the edit, or -1 to ask the buffer.
+void _mark_upd_removedlines(MARK mark, BUFFER buf, int line, int lines_removed, int buf_lines)
 {
   TRACE_ENTER;
   VALIDATEMARK(mark);
-  int buf_lines;
   if (mark->buf != buf) TRACE_EXIT; // Happened in a different buffer
   if (line > mark->l2) TRACE_EXIT;  // Happened after the marked lines
   if (lines_removed <= 0) TRACE_EXIT;
@@ -484,7 +630,8 @@ void _mark_upd_removedlines(MARK mark, BUFFER buf, int line, int lines_removed)
   case Marktype_Block:
     // Ignores changes in buffer contents, except that it won't run
     // off the end of the buffer.
-    buf_lines = buffer_count(buf);
+    if (buf_lines < 0)
+      buf_lines = buffer_count(buf);
     if (l1 >= buf_lines - lines_removed) {
       mark_unmark(mark);
     }
@@ -618,7 +765,7 @@ void _mark_upd_split(MARK mark, BUFFER buf, int line, int col)
 // uses the # lines in the buffer in one spot!
 // lines_removed = 0 if the char range is contained in one line
 // lines_removed = 1 if the char range was from (l1, c1) to (l1+1, c2)
-void mark_upd_removedcharblk(MARK mark, BUFFER buf, int line, int col, int lines_removed, int leading_chars_removed, int trailing_chars_removed)
+void mark_upd_removedcharblk(MARK mark, BUFFER buf, int line, int col, int lines_removed, int leading_chars_removed, int trailing_chars_removed, int buf_lines)
 {
   TRACE_ENTER;
   VALIDATEMARK(mark);
@@ -627,7 +774,7 @@ void mark_upd_removedcharblk(MARK mark, BUFFER buf, int line, int col, int lines
 
   switch (mark->typ) {
   case Marktype_Line:
-    _mark_upd_removedlines(mark, buf, line+1, lines_removed);
+    _mark_upd_removedlines(mark, buf, line+1, lines_removed, buf_lines);
     break;
   case Marktype_Char:
     if (lines_removed == 0) {
@@ -635,13 +782,13 @@ void mark_upd_removedcharblk(MARK mark, BUFFER buf, int line, int col, int lines
     }
     else {
       _mark_upd_removedchars(mark, buf, line, col, leading_chars_removed);
-      _mark_upd_removedlines(mark, buf, line+1, lines_removed-1);
+      _mark_upd_removedlines(mark, buf, line+1, lines_removed-1, buf_lines);
       _mark_upd_removedchars(mark, buf, line+1, 0, trailing_chars_removed);
       _mark_upd_join(mark, buf, line, col);
     }
     break;
   case Marktype_Block:
-    _mark_upd_removedlines(mark, buf, line+1, lines_removed);
+    _mark_upd_removedlines(mark, buf, line+1, lines_removed, buf_lines);
     break;
   case Marktype_None:
     break;
@@ -772,8 +919,9 @@ POE_ERR mark_bookmark(MARK mark, enum marktype typ, BUFFER buf, int line, int co
   if (mark->typ != Marktype_None || (mark->flags & MARK_FLG_BOOKMARK) != MARK_FLG_BOOKMARK) {
     TRACE_RETURN(POE_ERR_MARK_TYPE_CONFLICT);
   }
+  _mark_setbuf(mark, buf);
+  _mark_flush(mark);
   mark->typ = typ;
-  mark->buf = buf;
   mark->l1 = mark->l2 = line;
   mark->c1 = mark->c2 = col;
   mark->firstlmark = mark->firstcmark = 1;
@@ -785,11 +933,13 @@ POE_ERR mark_move_bookmark(MARK mark, enum marktype typ, int line, int col)
 {
   TRACE_ENTER;
   VALIDATEMARK(mark);
+  _mark_flush(mark);
   if (mark->typ != typ || (mark->flags & MARK_FLG_BOOKMARK) != MARK_FLG_BOOKMARK) {
     TRACE_RETURN(POE_ERR_MARK_TYPE_CONFLICT);
   }
   int buf_lines = buffer_count(mark->buf);
   line = max(-1, min(buf_lines-1, line));
+  _bufmarks_invalidate(mark->buf);
   mark->l1 = line; mark->l2 = line;
   mark->c1 = col; mark->c2 = col;
   mark->firstlmark = mark->firstcmark = 1;
@@ -801,6 +951,7 @@ POE_ERR mark_get_bookmark(MARK mark, enum marktype typ, int* line, int* col)
 {
   TRACE_ENTER;
   VALIDATEMARK(mark);
+  _mark_flush(mark);
   if (mark->typ != typ || (mark->flags & MARK_FLG_BOOKMARK) != MARK_FLG_BOOKMARK) {
     *line = 0;
     *col = 0;
@@ -819,11 +970,14 @@ POE_ERR mark_start(MARK mark, enum marktype typ, BUFFER buf, int line, int col)
   if (mark->typ != Marktype_None) {
     TRACE_RETURN(POE_ERR_MARK_TYPE_CONFLICT);
   }
+  _mark_setbuf(mark, buf);
+  // updates batched before now are for marks that were already there
+  _mark_flush(mark);
   mark->typ = typ;
-  mark->buf = buf;
   mark->l1 = mark->l2 = line;
   mark->c1 = mark->c2 = col;
   mark->firstlmark = mark->firstcmark = 1;
+  _mark_touched(mark);
   mark_setflags(mark, MARK_FLG_STARTED);
   TRACE_RETURN(POE_ERR_OK);
 }
@@ -833,12 +987,14 @@ int mark_extend(MARK mark, enum marktype typ, BUFFER buf, int line, int col)
 {
   TRACE_ENTER;
   VALIDATEMARK(mark);
+  _mark_flush(mark);
   if (mark->typ != typ)
     TRACE_RETURN(POE_ERR_MARK_TYPE_CONFLICT);
   if (mark->buf != buf)
     TRACE_RETURN(POE_ERR_MARKED_BLOCK_EXISTS);
   if (mark_tstflags(mark, MARK_FLG_SEALED))
     TRACE_RETURN(POE_ERR_MARKED_BLOCK_EXISTS);
+  _bufmarks_invalidate(mark->buf);
   mark_setflags(mark, MARK_FLG_ENDED);
   if (mark->firstlmark)
     mark->l2 = line;
@@ -849,6 +1005,7 @@ int mark_extend(MARK mark, enum marktype typ, BUFFER buf, int line, int col)
   else
     mark->c1 = col;
   _mark_canonicalize(mark);
+  _mark_touched(mark);
   TRACE_RETURN(POE_ERR_OK);
 }
 
@@ -857,6 +1014,7 @@ void mark_seal(MARK mark)
 {
   TRACE_ENTER;
   VALIDATEMARK(mark);
+  _mark_flush(mark);
   if (mark->typ == Marktype_None) 
     TRACE_EXIT;
   if (mark_tstflags(mark, MARK_FLG_ENDED))
@@ -870,17 +1028,29 @@ void mark_seal(MARK mark)
 // Update the marks with possible positional changes
 //
 
+void marks_begin_batch(BUFFER buf)
+{
+  TRACE_ENTER;
+  _bufmarks_get(buf, true)->batch++;
+  TRACE_EXIT;
+}
+
+
+void marks_end_batch(BUFFER buf)
+{
+  TRACE_ENTER;
+  struct bufmarks_t* bm = _bufmarks_get(buf, false);
+  if (bm != NULL && bm->batch > 0 && --bm->batch == 0)
+    _bufmarks_flush(bm);
+  TRACE_EXIT;
+}
+
+
 void marks_upd_insertedlines(BUFFER buf, int line, int lines_inserted)
 {
   TRACE_ENTER;
-  int n = pivec_count(&_all_marks);
-  int i;
-  for (i = 0; i < n; ++i) {
-    MARK mark = (MARK)pivec_get(&_all_marks, i);
-    if (mark->buf != buf) continue; // Happened in a different buffer
-    if (line > mark->l2) continue;  // Happened after the marked lines
-    _mark_upd_insertedlines(mark, buf, line, lines_inserted);
-  }
+  struct markupd_t upd = { Markop_InsertedLines, line, 0, lines_inserted, 0, 0, -1 };
+  _marks_upd(buf, &upd);
   TRACE_EXIT;
 }
 
@@ -890,14 +1060,8 @@ void marks_upd_insertedlines(BUFFER buf, int line, int lines_inserted)
 void marks_upd_removedlines(BUFFER buf, int line, int lines_removed)
 {
   TRACE_ENTER;
-  int n = pivec_count(&_all_marks);
-  int i;
-  for (i = 0; i < n; ++i) {
-    MARK mark = (MARK)pivec_get(&_all_marks, i);
-    if (mark->buf != buf) continue; // Happened in a different buffer
-    if (line > mark->l2) continue;  // Happened after the marked lines
-    _mark_upd_removedlines(mark, buf, line, lines_removed);
-  }
+  struct markupd_t upd = { Markop_RemovedLines, line, 0, lines_removed, 0, 0, -1 };
+  _marks_upd(buf, &upd);
   TRACE_EXIT;
 }
 
@@ -905,14 +1069,8 @@ void marks_upd_removedlines(BUFFER buf, int line, int lines_removed)
 void marks_upd_insertedcharblk(BUFFER buf, int line, int col, int lines_inserted, int leading_chars_inserted, int trailing_chars_inserted)
 {
   TRACE_ENTER;
-  int n = pivec_count(&_all_marks);
-  int i;
-  for (i = 0; i < n; ++i) {
-    MARK mark = (MARK)pivec_get(&_all_marks, i);
-    if (mark->buf != buf) continue; // Happened in a different buffer
-    if (line > mark->l2) continue;  // Happened after the marked lines
-    mark_upd_insertedcharblk(mark, buf, line, col, lines_inserted, leading_chars_inserted, trailing_chars_inserted);
-  }
+  struct markupd_t upd = { Markop_InsertedCharBlk, line, col, lines_inserted, leading_chars_inserted, trailing_chars_inserted, -1 };
+  _marks_upd(buf, &upd);
   TRACE_EXIT;
 }
 
@@ -920,14 +1078,8 @@ void marks_upd_insertedcharblk(BUFFER buf, int line, int col, int lines_inserted
 void marks_upd_insertedchars(BUFFER buf, int line, int col, int chars_inserted)
 {
   TRACE_ENTER;
-  int n = pivec_count(&_all_marks);
-  int i;
-  for (i = 0; i < n; ++i) {
-    MARK mark = (MARK)pivec_get(&_all_marks, i);
-    if (mark->buf != buf) continue; // Happened in a different buffer
-    if (line > mark->l2) continue;  // Happened after the marked lines
-    _mark_upd_insertedchars(mark, buf, line, col, chars_inserted);
-  }
+  struct markupd_t upd = { Markop_InsertedChars, line, col, chars_inserted, 0, 0, -1 };
+  _marks_upd(buf, &upd);
   TRACE_EXIT;
 }
 
@@ -939,34 +1091,17 @@ void marks_upd_insertedchars(BUFFER buf, int line, int col, int chars_inserted)
 void marks_upd_removedcharblk(BUFFER buf, int line, int col, int lines_removed, int leading_chars_removed, int trailing_chars_removed)
 {
   TRACE_ENTER;
-  int n = pivec_count(&_all_marks);
-  int i;
-  for (i = 0; i < n; ++i) {
-    MARK mark = (MARK)pivec_get(&_all_marks, i);
-    if (mark->buf != buf) continue; // Happened in a different buffer
-    if (line > mark->l2) continue;  // Happened after the marked lines
-    mark_upd_removedcharblk(mark, buf, line, col, lines_removed, leading_chars_removed, trailing_chars_removed);
-  }
+  struct markupd_t upd = { Markop_RemovedCharBlk, line, col, lines_removed, leading_chars_removed, trailing_chars_removed, -1 };
+  _marks_upd(buf, &upd);
   TRACE_EXIT;
 }
 
 
-
-// Make sure this is called before actually removing the chars!  It
-// uses the # lines in the buffer in one spot!
-// lines_removed = 0 if the char range is contained in one line e.g. (l1, c1) (l1, c2)
-// lines_removed = 1 if the char range was from (l1, c1) to (l1+1, c2)
 void marks_upd_removedchars(BUFFER buf, int line, int col, int chars_removed)
 {
   TRACE_ENTER;
-  int n = pivec_count(&_all_marks);
-  int i;
-  for (i = 0; i < n; ++i) {
-    MARK mark = (MARK)pivec_get(&_all_marks, i);
-    if (mark->buf != buf) continue; // Happened in a different buffer
-    if (line > mark->l2) continue;  // Happened after the marked lines
-    _mark_upd_removedchars(mark, buf, line, col, chars_removed);
-  }
+  struct markupd_t upd = { Markop_RemovedChars, line, col, chars_removed, 0, 0, -1 };
+  _marks_upd(buf, &upd);
   TRACE_EXIT;
 }
 
@@ -974,14 +1109,8 @@ void marks_upd_removedchars(BUFFER buf, int line, int col, int chars_removed)
 void marks_upd_split(BUFFER buf, int line, int col)
 {
   TRACE_ENTER;
-  int n = pivec_count(&_all_marks);
-  int i;
-  for (i = 0; i < n; ++i) {
-    MARK mark = (MARK)pivec_get(&_all_marks, i);
-    if (mark->buf != buf) continue; // Happened in a different buffer
-    if (line > mark->l2) continue;  // Happened after the marked lines
-    _mark_upd_split(mark, buf, line, col);
-  }
+  struct markupd_t upd = { Markop_Split, line, col, 0, 0, 0, -1 };
+  _marks_upd(buf, &upd);
   TRACE_EXIT;
 }
 
@@ -989,13 +1118,70 @@ void marks_upd_split(BUFFER buf, int line, int col)
 void marks_upd_join(BUFFER buf, int line, int col)
 {
   TRACE_ENTER;
-  int n = pivec_count(&_all_marks);
-  int i;
-  for (i = 0; i < n; ++i) {
-    MARK mark = (MARK)pivec_get(&_all_marks, i);
-    if (mark->buf != buf) continue; // Happened in a different buffer
-    if (line > mark->l2) continue;  // Happened after the marked lines
-    _mark_upd_join(mark, buf, line, col);
+  struct markupd_t upd = { Markop_Join, line, col, 0, 0, 0, -1 };
+  _marks_upd(buf, &upd);
+  TRACE_EXIT;
+}
+
+
+// Applies the update to the buffer's marks now, or queues it if the
+// buffer's marks are batched.
+void _marks_upd(BUFFER buf, struct markupd_t* upd)
+{
+  TRACE_ENTER;
+  struct bufmarks_t* bm = _bufmarks_get(buf, false);
+  if (bm == NULL)
+    TRACE_EXIT;   // never had any marks
+  bm->stale = true;
+  if (bm->batch > 0) {
+    // The buffer will have changed by the time this is applied
+    if (upd->op == Markop_RemovedLines || upd->op == Markop_RemovedCharBlk)
+      upd->buf_lines = buffer_count(buf);
+    vec_append(&bm->pending, upd);
+    if (!bm->unmapped)
+      __linemap_add(bm, upd);
+  }
+  else {
+    int i;
+    // Backwards, since an update can unmark a mark and drop it from
+    // the list.
+    for (i = pivec_count(&bm->marks)-1; i >= 0; i--)
+      _mark_apply((MARK)pivec_get(&bm->marks, i), buf, upd);
+  }
+  TRACE_EXIT;
+}
+
+
+void _mark_apply(MARK mark, BUFFER buf, const struct markupd_t* upd)
+{
+  TRACE_ENTER;
+  if (mark->buf != buf) TRACE_EXIT;    // unmarked by an earlier update
+  if (upd->line > mark->l2) TRACE_EXIT; // Happened after the marked lines
+  switch (upd->op) {
+  case Markop_InsertedLines:
+    _mark_upd_insertedlines(mark, buf, upd->line, upd->n);
+    break;
+  case Markop_RemovedLines:
+    _mark_upd_removedlines(mark, buf, upd->line, upd->n, upd->buf_lines);
+    break;
+  case Markop_InsertedChars:
+    _mark_upd_insertedchars(mark, buf, upd->line, upd->col, upd->n);
+    break;
+  case Markop_RemovedChars:
+    _mark_upd_removedchars(mark, buf, upd->line, upd->col, upd->n);
+    break;
+  case Markop_InsertedCharBlk:
+    mark_upd_insertedcharblk(mark, buf, upd->line, upd->col, upd->n, upd->leading, upd->trailing);
+    break;
+  case Markop_RemovedCharBlk:
+    mark_upd_removedcharblk(mark, buf, upd->line, upd->col, upd->n, upd->leading, upd->trailing, upd->buf_lines);
+    break;
+  case Markop_Split:
+    _mark_upd_split(mark, buf, upd->line, upd->col);
+    break;
+  case Markop_Join:
+    _mark_upd_join(mark, buf, upd->line, upd->col);
+    break;
   }
   TRACE_EXIT;
 }
@@ -1064,3 +1250,439 @@ int __find_mark(MARK srch)
   TRACE_RETURN(-1);
 }
 
+
+
+//
+// Per buffer mark index
+//
+
+struct bufmarks_t* _bufmarks_get(BUFFER buf, bool create)
+{
+  TRACE_ENTER;
+  if (_last_bufmarks != NULL && _last_bufmarks->buf == buf)
+    TRACE_RETURN(_last_bufmarks);
+  int i, n = pivec_count(&_all_bufmarks);
+  for (i = 0; i < n; i++) {
+    struct bufmarks_t* bm = (struct bufmarks_t*)pivec_get(&_all_bufmarks, i);
+    if (bm->buf == buf) {
+      _last_bufmarks = bm;
+      TRACE_RETURN(bm);
+    }
+  }
+  if (!create)
+    TRACE_RETURN(NULL);
+  struct bufmarks_t* bm = calloc(1, sizeof(struct bufmarks_t));
+  bm->buf = buf;
+  pivec_init(&bm->marks, 10);
+  bm->stale = true;
+  vec_init(&bm->idx, 10, sizeof(struct markidx_ent_t));
+  bm->batch = 0;
+  vec_init(&bm->pending, 10, sizeof(struct markupd_t));
+  vec_init(&bm->segs, 10, sizeof(struct lineseg_t));
+  vec_init(&bm->hot, 10, sizeof(int));
+  __linemap_reset(bm);
+  pivec_append(&_all_bufmarks, (intptr_t)bm);
+  _last_bufmarks = bm;
+  TRACE_RETURN(bm);
+}
+
+
+void _bufmarks_invalidate(BUFFER buf)
+{
+  TRACE_ENTER;
+  if (buf == BUFFER_NULL)
+    TRACE_EXIT;
+  struct bufmarks_t* bm = _bufmarks_get(buf, false);
+  if (bm != NULL)
+    bm->stale = true;
+  TRACE_EXIT;
+}
+
+
+void _bufmarks_free(BUFFER buf)
+{
+  TRACE_ENTER;
+  int i, n = pivec_count(&_all_bufmarks);
+  for (i = 0; i < n; i++) {
+    struct bufmarks_t* bm = (struct bufmarks_t*)pivec_get(&_all_bufmarks, i);
+    if (bm->buf == buf) {
+      if (_last_bufmarks == bm)
+        _last_bufmarks = NULL;
+      pivec_destroy(&bm->marks);
+      vec_destroy(&bm->idx);
+      vec_destroy(&bm->pending);
+      vec_destroy(&bm->segs);
+      vec_destroy(&bm->hot);
+      free(bm);
+      pivec_remove(&_all_bufmarks, i);
+      break;
+    }
+  }
+  TRACE_EXIT;
+}
+
+
+void _bufmarks_rebuild(struct bufmarks_t* bm)
+{
+  TRACE_ENTER;
+  _bufmarks_flush(bm);
+  vec_clear(&bm->idx);
+  int i, n = pivec_count(&bm->marks);
+  for (i = 0; i < n; i++) {
+    MARK mark = (MARK)pivec_get(&bm->marks, i);
+    if (mark->typ == Marktype_None)
+      continue;
+    struct markidx_ent_t ent;
+    ent.mark = mark;
+    ent.l1 = mark->l1;
+    ent.l2 = mark->l2;
+    ent.maxl2 = mark->l2;
+    vec_append(&bm->idx, &ent);
+  }
+  n = vec_count(&bm->idx);
+  if (n > 1)
+    qsort(vec_getbufptr(&bm->idx), n, sizeof(struct markidx_ent_t), __markidx_cmp);
+  __markidx_build(&bm->idx, 0, n);
+  bm->stale = false;
+  TRACE_EXIT;
+}
+
+
+// Finds the first mark (or the newest one) that covers the point or
+// line.
+MARK _marks_hittest(BUFFER buf, int row, int col, bool point, int flags_mask, int flags_chk, bool newest)
+{
+  TRACE_ENTER;
+  if (buf == BUFFER_NULL)
+    TRACE_RETURN(MARK_NULL);
+  struct bufmarks_t* bm = _bufmarks_get(buf, true);
+  _bufmarks_flush(bm);
+  if (bm->stale)
+    _bufmarks_rebuild(bm);
+  struct markidx_qry_t q;
+  q.buf = buf;
+  q.row = row;
+  q.col = col;
+  q.point = point;
+  q.flags_mask = flags_mask;
+  q.flags_chk = flags_chk;
+  q.newest = newest;
+  q.found = MARK_NULL;
+  q.spans = NULL;
+  __markidx_find(&bm->idx, 0, vec_count(&bm->idx), &q);
+  TRACE_RETURN(q.found);
+}
+
+
+// Applies the queued updates.  A line or character mark whose ends
+// are on lines the batch only moved is moved by the line map; the
+// rest run through the whole queue.
+void _bufmarks_flush(struct bufmarks_t* bm)
+{
+  TRACE_ENTER;
+  int nupds = vec_count(&bm->pending);
+  if (nupds == 0)
+    TRACE_EXIT;
+  const struct markupd_t* upds = vec_getbufptr(&bm->pending);
+  int nhot = vec_count(&bm->hot);
+  if (nhot > 1)
+    qsort(vec_getbufptr(&bm->hot), nhot, sizeof(int), __int_cmp);
+  int i, j, d1, d2;
+  for (i = pivec_count(&bm->marks)-1; i >= 0; i--) {
+    MARK mark = (MARK)pivec_get(&bm->marks, i);
+    if (mark->typ == Marktype_None)
+      continue;
+    if (!bm->unmapped && (mark->typ == Marktype_Line || mark->typ == Marktype_Char)
+        && __linemap_find(bm, mark->l1, &d1) && __linemap_find(bm, mark->l2, &d2)) {
+      mark->l1 += d1;
+      mark->l2 += d2;
+      continue;
+    }
+    for (j = 0; j < nupds && mark->buf == bm->buf; j++)
+      _mark_apply(mark, bm->buf, upds+j);
+  }
+  vec_clear(&bm->pending);
+  __linemap_reset(bm);
+  bm->stale = true;
+  TRACE_EXIT;
+}
+
+
+// Starts a batch's line map with every line where it was
+void __linemap_reset(struct bufmarks_t* bm)
+{
+  TRACE_ENTER;
+  struct lineseg_t all = { INT_MIN/2, INT_MAX/2, 0 };
+  vec_clear(&bm->segs);
+  vec_append(&bm->segs, &all);
+  vec_clear(&bm->hot);
+  bm->unmapped = false;
+  TRACE_EXIT;
+}
+
+
+// Folds a queued update into the line map.  Each update leaves the
+// lines before a alone, edits the lines a..b, and moves the lines
+// after b by d, as far as line and character marks are concerned.
+void __linemap_add(struct bufmarks_t* bm, const struct markupd_t* upd)
+{
+  TRACE_ENTER;
+  int a = upd->line, b = upd->line, d = 0;
+  switch (upd->op) {
+  case Markop_InsertedLines:
+    if (upd->n <= 0)
+      TRACE_EXIT;
+    b = a - 1;
+    d = upd->n;
+    break;
+  case Markop_RemovedLines:
+    if (upd->n <= 0)
+      TRACE_EXIT;
+    b = a + upd->n - 1;
+    d = -upd->n;
+    break;
+  case Markop_InsertedChars: case Markop_RemovedChars:
+    if (upd->n <= 0)
+      TRACE_EXIT;
+    break;
+  case Markop_InsertedCharBlk:
+    d = upd->n;
+    break;
+  case Markop_RemovedCharBlk:
+    b = a + upd->n;
+    d = -upd->n;
+    break;
+  case Markop_Split:
+    d = 1;
+    break;
+  case Markop_Join:
+    a = b = upd->line + 1;
+    d = -1;
+    break;
+  }
+  int i = __linemap_seek(bm, a);
+  int n = vec_count(&bm->segs);
+  struct lineseg_t* segs = vec_getbufptr(&bm->segs);
+  if (d == 0) {
+    // Edits within a line don't move anything, so the line is just
+    // noted, in case a mark ends on it.
+    if (i < n && segs[i].start + segs[i].delta <= a) {
+      int line = a - segs[i].delta;
+      vec_append(&bm->hot, &line);
+    }
+    TRACE_EXIT;
+  }
+  // The part of the run that's before a stays put
+  if (i < n && segs[i].start + segs[i].delta < a) {
+    struct lineseg_t before = segs[i];
+    before.end = a - 1 - segs[i].delta;
+    segs[i].start = a - segs[i].delta;
+    vec_insert(&bm->segs, i, &before);
+    segs = vec_getbufptr(&bm->segs);
+    i++;
+    n++;
+  }
+  // Drop whatever's in a..b and move the rest
+  int j = i;
+  while (j < n && segs[j].start + segs[j].delta <= b) {
+    if (segs[j].end + segs[j].delta > b) {
+      segs[j].start = b + 1 - segs[j].delta;
+      break;
+    }
+    j++;
+  }
+  if (j > i) {
+    vec_removem(&bm->segs, i, j - i);
+    segs = vec_getbufptr(&bm->segs);
+    n -= j - i;
+  }
+  for (j = i; j < n; j++)
+    segs[j].delta += d;
+  if (n > max(MARK_LINEMAP_MINSEGS, pivec_count(&bm->marks)))
+    bm->unmapped = true;
+  TRACE_EXIT;
+}
+
+
+// Finds the first run that ends at or after line, as the lines are now
+int __linemap_seek(const struct bufmarks_t* bm, int line)
+{
+  TRACE_ENTER;
+  const struct lineseg_t* segs = vec_getbufptr(&bm->segs);
+  int lo = 0, hi = vec_count(&bm->segs);
+  while (lo < hi) {
+    int mid = (lo + hi) / 2;
+    if (segs[mid].end + segs[mid].delta < line)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  TRACE_RETURN(lo);
+}
+
+
+// Finds how far the batch moved a line, as it was when the batch
+// began.  Returns false if the line was edited.
+bool __linemap_find(const struct bufmarks_t* bm, int line, int* pdelta)
+{
+  TRACE_ENTER;
+  const struct lineseg_t* segs = vec_getbufptr(&bm->segs);
+  int lo = 0, hi = vec_count(&bm->segs);
+  while (lo < hi) {
+    int mid = (lo + hi) / 2;
+    if (segs[mid].end < line)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  if (lo == vec_count(&bm->segs) || segs[lo].start > line)
+    TRACE_RETURN(false);
+  int nhot = vec_count(&bm->hot);
+  if (nhot > 0 && bsearch(&line, vec_getbufptr(&bm->hot), nhot, sizeof(int), __int_cmp) != NULL)
+    TRACE_RETURN(false);
+  *pdelta = segs[lo].delta;
+  TRACE_RETURN(true);
+}
+
+
+int __int_cmp(const void* a, const void* b)
+{
+  int ia = *(const int*)a, ib = *(const int*)b;
+  return (ia < ib) ? -1 : (ia > ib);
+}
+
+
+// Moves the mark to another buffer's list
+void _mark_setbuf(MARK mark, BUFFER buf)
+{
+  TRACE_ENTER;
+  if (mark->buf == buf)
+    TRACE_EXIT;
+  _mark_touched(mark);
+  struct bufmarks_t* bm;
+  if (mark->buf != BUFFER_NULL && (bm = _bufmarks_get(mark->buf, false)) != NULL) {
+    int i;
+    for (i = pivec_count(&bm->marks)-1; i >= 0; i--) {
+      if ((MARK)pivec_get(&bm->marks, i) == mark) {
+        pivec_remove(&bm->marks, i);
+        break;
+      }
+    }
+    bm->stale = true;
+  }
+  mark->buf = buf;
+  if (buf != BUFFER_NULL) {
+    bm = _bufmarks_get(buf, true);
+    pivec_append(&bm->marks, (intptr_t)mark);
+    bm->stale = true;
+  }
+  TRACE_EXIT;
+}
+
+
+// Works out which columns of the row the mark covers.  Same rules
+// as mark_hittest_point.
+bool _mark_line_span(MARK mark, int row, int* c1, int* c2)
+{
+  if (row < mark->l1 || row > mark->l2)
+    return false;
+  *c1 = 0;
+  *c2 = INT_MAX;
+  switch (mark->typ) {
+  case Marktype_None:
+    return false;
+  case Marktype_Line:
+    break;
+  case Marktype_Char:
+    if (row == mark->l1)
+      *c1 = mark->c1;
+    if (row == mark->l2)
+      *c2 = mark->c2;
+    break;
+  case Marktype_Block:
+    *c1 = mark->c1;
+    *c2 = mark->c2;
+    break;
+  }
+  return *c1 <= *c2;
+}
+
+
+void _mark_touched(MARK mark)
+{
+  if (mark->flags & MARK_FLG_STACKED)
+    _marks_gen++;
+}
+
+
+// Brings the mark up to date with any batched updates
+void _mark_flush(MARK mark)
+{
+  TRACE_ENTER;
+  if (mark->buf == BUFFER_NULL)
+    TRACE_EXIT;
+  struct bufmarks_t* bm = _bufmarks_get(mark->buf, false);
+  if (bm != NULL)
+    _bufmarks_flush(bm);
+  TRACE_EXIT;
+}
+
+
+int __markidx_cmp(const void* a, const void* b)
+{
+  const struct markidx_ent_t* ea = a;
+  const struct markidx_ent_t* eb = b;
+  if (ea->l1 != eb->l1)
+    return (ea->l1 < eb->l1) ? -1 : 1;
+  return (ea->mark->marknum < eb->mark->marknum) ? -1 : (ea->mark->marknum > eb->mark->marknum);
+}
+
+
+// Fills in maxl2 for the subtree rooted at the middle of [lo, hi),
+// and returns it.
+int __markidx_build(struct vec_t* idx, int lo, int hi)
+{
+  TRACE_ENTER;
+  if (lo >= hi)
+    TRACE_RETURN(INT_MIN);
+  int mid = lo + (hi-lo)/2;
+  struct markidx_ent_t* ent = vec_get(idx, mid);
+  int maxl2 = ent->l2;
+  maxl2 = max(maxl2, __markidx_build(idx, lo, mid));
+  maxl2 = max(maxl2, __markidx_build(idx, mid+1, hi));
+  ent->maxl2 = maxl2;
+  TRACE_RETURN(maxl2);
+}
+
+
+void __markidx_find(struct vec_t* idx, int lo, int hi, struct markidx_qry_t* q)
+{
+  TRACE_ENTER;
+  while (lo < hi) {
+    int mid = lo + (hi-lo)/2;
+    struct markidx_ent_t* ent = vec_get(idx, mid);
+    if (ent->maxl2 < q->row)
+      TRACE_EXIT;
+    __markidx_find(idx, lo, mid, q);
+    if (ent->l1 > q->row)
+      TRACE_EXIT;
+    if (ent->l2 >= q->row && q->spans != NULL) {
+      struct markspan_t span;
+      if ((ent->mark->flags & q->flags_mask) == q->flags_chk
+          && _mark_line_span(ent->mark, q->row, &span.c1, &span.c2))
+        vec_append(q->spans, &span);
+    }
+    else if (ent->l2 >= q->row) {
+      MARK mark = ent->mark;
+      bool hit = q->point
+        ? mark_hittest_point(mark, q->buf, q->row, q->col, q->flags_mask, q->flags_chk)
+        : mark_hittest_line(mark, q->buf, q->row, q->flags_mask, q->flags_chk);
+      if (hit && (q->found == MARK_NULL
+                  || (q->newest && mark->marknum > q->found->marknum)
+                  || (!q->newest && mark->marknum < q->found->marknum)))
+        q->found = mark;
+    }
+    lo = mid+1;
+  }
+  TRACE_EXIT;
+}
@@ -6,6 +6,12 @@ extern MARK INVALID_MARK;
 #define MARK_FLG_STARTED (1<<2)
 #define MARK_FLG_ENDED (1<<3)
 #define MARK_FLG_SEALED (1<<4)
+#define MARK_FLG_STACKED (1<<5)
+
+// Columns a mark covers on one line, c2 == INT_MAX for the whole line
+struct markspan_t {
+  int c1, c2;
+};
 
 
 void init_marks(void);
@@ -19,6 +25,7 @@ void mark_must_exist(const char* dbgstr, MARK mark);
 int mark_exists(MARK mark);
 int marks_count(void);
 void mark_free_marks_in_buffer(BUFFER buf);
+unsigned int marks_generation(void);
 
 void mark_setflags(MARK mark, int flags);
 void mark_clrflags(MARK mark, int flags);
@@ -45,8 +52,17 @@ bool mark_hittest_line(MARK mark, BUFFER buf, int row, int flags_mask, int flags
 
 MARK marks_hittest_point(BUFFER buf, int row, int col, int flags_mask, int flags_chk);
 MARK marks_hittest_line(BUFFER buf, int row, int flags_mask, int flags_chk);
+MARK marks_hittest_point_newest(BUFFER buf, int row, int col, int flags_mask, int flags_chk);
+MARK marks_hittest_line_newest(BUFFER buf, int row, int flags_mask, int flags_chk);
+int marks_line_spans(BUFFER buf, int row, int flags_mask, int flags_chk, struct vec_t* spans);
+
+// Update the marks with possible positional changes.  Between
+// marks_begin_batch and marks_end_batch the updates for the buffer
+// are queued, and applied in one pass when the marks are next looked
+// at or the batch ends.
+void marks_begin_batch(BUFFER buf);
+void marks_end_batch(BUFFER buf);
 
-// Update the marks with possible positional changes
 void marks_upd_insertedlines(BUFFER buf, int line, int lines_inserted);
 void marks_upd_removedlines(BUFFER buf, int line, int lines_removed);
 
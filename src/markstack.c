@@ -54,6 +54,7 @@ void markstack_pop_marks_in_buffer(BUFFER buf)
         BUFFER markbuf = BUFFER_NULL;
         POE_ERR err = mark_get_buffer(mark, &markbuf);
         if (err == POE_ERR_OK && markbuf == buf) {
+          mark_clrflags(mark, MARK_FLG_STACKED);
           pivec_remove(&_mark_stack, i);
         }
         else {
@@ -70,7 +71,7 @@ MARK markstack_push()
   TRACE_ENTER;
   if (pivec_count(&_mark_stack) > 0)
     mark_clrflags(markstack_current(), MARK_FLG_VISIBLE);
-  MARK m = mark_alloc(MARK_FLG_VISIBLE);
+  MARK m = mark_alloc(MARK_FLG_VISIBLE|MARK_FLG_STACKED);
   pivec_insert(&_mark_stack, 0, (intptr_t)m);
   TRACE_RETURN(m);
 }
@@ -109,30 +110,31 @@ MARK markstack_current()
 }
 
 
+// The stack is kept newest first, so the top-most hit is the newest
+// stacked mark that covers the point.
 MARK markstack_hittest_point(BUFFER buf, int row, int col, int flags_mask, int flags_chk)
 {
   TRACE_ENTER;
-  int i, n = pivec_count(&_mark_stack);
-  for (i = 0; i < n; i++) {
-    MARK m = (MARK)pivec_get(&_mark_stack, i);
-    if (mark_hittest_point(m, buf, row, col, flags_mask, flags_chk))
-      TRACE_RETURN(m);
-  }
-  TRACE_RETURN(MARK_NULL);
+  MARK rval = marks_hittest_point_newest(buf, row, col,
+                                         flags_mask|MARK_FLG_STACKED, flags_chk|MARK_FLG_STACKED);
+  TRACE_RETURN(rval);
 }
 
 
 MARK markstack_hittest_line(BUFFER buf, int row, int flags_mask, int flags_chk)
 {
   TRACE_ENTER;
-  int i, n = pivec_count(&_mark_stack);
-  for (i = 0; i < n; i++) {
-    MARK m = (MARK)pivec_get(&_mark_stack, i);
-    if (mark_hittest_line(m, buf, row, flags_mask, flags_chk)) {
-      TRACE_RETURN(m);
-    }
-  }
-  TRACE_RETURN(MARK_NULL);
+  MARK rval = marks_hittest_line_newest(buf, row,
+                                        flags_mask|MARK_FLG_STACKED, flags_chk|MARK_FLG_STACKED);
+  TRACE_RETURN(rval);
+}
+
+
+int markstack_line_spans(BUFFER buf, int row, int flags_mask, int flags_chk, struct vec_t* spans)
+{
+  TRACE_ENTER;
+  int rval = marks_line_spans(buf, row, flags_mask|MARK_FLG_STACKED, flags_chk|MARK_FLG_STACKED, spans);
+  TRACE_RETURN(rval);
 }
 
 
@@ -12,6 +12,7 @@ void markstack_pop_marks_in_buffer(BUFFER buf);
 
 MARK markstack_hittest_point(BUFFER buf, int row, int col, int flags_mask, int flags_chk);
 MARK markstack_hittest_line(BUFFER buf, int row, int flags_mask, int flags_chk);
+int markstack_line_spans(BUFFER buf, int row, int flags_mask, int flags_chk, struct vec_t* spans);
 
 POE_ERR markstack_cur_get_buffer(BUFFER* buf);
 POE_ERR markstack_cur_get_type(enum marktype* typ);
@@ -20,6 +20,7 @@
 #include "utils.h"
 #include "vec.h"
 #include "cstr.h"
+#include "arena.h"
 #include "tabstops.h"
 #include "margins.h"
 #include "bufid.h"
@@ -35,11 +36,11 @@
 
 enum token_t {tok_name, tok_strlit, tok_intlit, tok_unk, tok_end};
 
-POE_ERR _finish_parsing_locate(const cstr* str, cstr* tok_str, int* ppos, pivec* tokens);
-POE_ERR _finish_parsing_change(const cstr* str, cstr* tok_str, int* ppos, pivec* tokens);
-POE_ERR _finish_parsing_define(const cstr* str, cstr* tok_str, int* ppos, pivec* tokens);
-POE_ERR _parse_define_subcommand(const cstr* str, cstr* tok_str, int* ppos, pivec* tokens);
-POE_ERR _finish_parsing_generic(const cstr* str, cstr* tok_str, int* ppos, pivec* tokens);
+POE_ERR _finish_parsing_locate(const cstr* str, cstr* tok_str, int* ppos, pivec* tokens, arena* strs);
+POE_ERR _finish_parsing_change(const cstr* str, cstr* tok_str, int* ppos, pivec* tokens, arena* strs);
+POE_ERR _finish_parsing_define(const cstr* str, cstr* tok_str, int* ppos, pivec* tokens, arena* strs);
+POE_ERR _parse_define_subcommand(const cstr* str, cstr* tok_str, int* ppos, pivec* tokens, arena* strs);
+POE_ERR _finish_parsing_generic(const cstr* str, cstr* tok_str, int* ppos, pivec* tokens, arena* strs);
 bool _scancmdword(const cstr* str, cstr* tok_str, int* ppos);
 bool _scanword(const cstr* str, cstr* tok_str, int* ppos);
 bool _scannum(const cstr* str, cstr* tok_str, int* ppos);
@@ -50,7 +51,7 @@ bool _scan_locate_pattern(const cstr* str, cstr* tok_str, int* ppos, char* delim
 bool _scan_locate_replacement(const cstr* str, cstr* tok_str, int* ppos, char delimiter);
 
 
-POE_ERR _parse_single_command(const cstr* str, cstr* tok, int* ppos, pivec* tokens, int level)
+POE_ERR _parse_single_command(const cstr* str, cstr* tok, int* ppos, pivec* tokens, arena* strs, int level)
 {
   TRACE_ENTER;
   POE_ERR err = POE_ERR_OK;
@@ -60,41 +61,41 @@ POE_ERR _parse_single_command(const cstr* str, cstr* tok, int* ppos, pivec* toke
 
   if (cstr_get(str, pos) == '/') {
     // shortcut for locate
-    pivec_append(tokens, CMD_STR(strsave("locate")));
-    err = _finish_parsing_locate(str, tok, &pos, tokens);
+    pivec_append(tokens, CMD_STR("locate"));
+    err = _finish_parsing_locate(str, tok, &pos, tokens, strs);
     goto done;
   }
   else if (_scannum(str, tok, &pos)) {
     // shortcut for line
     long linenum = strtol(cstr_getbufptr(tok), NULL, 10);
-    pivec_append(tokens, CMD_STR(strsave("LINE")));
+    pivec_append(tokens, CMD_STR("LINE"));
     pivec_append(tokens, CMD_INT(linenum));
-    err = _finish_parsing_generic(str, tok, &pos, tokens);
+    err = _finish_parsing_generic(str, tok, &pos, tokens, strs);
     goto done;
   }
   else if (_scancmdword(str, tok, &pos)) {
 	//logmsg("parser scancmdword '%s'", cstr_getbufptr(tok));
     if (cstr_comparestr(tok, "l") == 0
         || cstr_comparestri(tok, "locate") == 0) {
-      pivec_append(tokens, CMD_STR(strsave("locate")));
-      err = _finish_parsing_locate(str, tok, &pos, tokens);
+      pivec_append(tokens, CMD_STR("locate"));
+      err = _finish_parsing_locate(str, tok, &pos, tokens, strs);
       goto done;
     }
     else if (cstr_comparestri(tok, "c") == 0
              || cstr_comparestri(tok, "change") == 0) {
-      pivec_append(tokens, CMD_STR(strsave("change")));
-      err = _finish_parsing_change(str, tok, &pos, tokens);
+      pivec_append(tokens, CMD_STR("change"));
+      err = _finish_parsing_change(str, tok, &pos, tokens, strs);
       goto done;
     }
     else if (level == 0 && (cstr_comparestri(tok, "def") == 0
 							|| cstr_comparestri(tok, "define") == 0)) {
-      pivec_append(tokens, CMD_STR(strsave("define")));
-      err = _finish_parsing_define(str, tok, &pos, tokens);
+      pivec_append(tokens, CMD_STR("define"));
+      err = _finish_parsing_define(str, tok, &pos, tokens, strs);
       goto done;
     }
     else {
-      pivec_append(tokens, CMD_STR(strsave(cstr_getbufptr(tok))));
-      err = _finish_parsing_generic(str, tok, &pos, tokens);
+      pivec_append(tokens, CMD_STR(arena_strsave(strs, cstr_getbufptr(tok))));
+      err = _finish_parsing_generic(str, tok, &pos, tokens, strs);
       goto done;
     }
   }
@@ -111,7 +112,7 @@ POE_ERR _parse_single_command(const cstr* str, cstr* tok, int* ppos, pivec* toke
 
 
 
-POE_ERR parse_cmdline(const cstr* str, pivec* tokens, int* parsepos)
+POE_ERR parse_cmdline(const cstr* str, pivec* tokens, int* parsepos, arena* strs)
 {
   TRACE_ENTER;
   pivec_clear(tokens);
@@ -128,7 +129,7 @@ POE_ERR parse_cmdline(const cstr* str, pivec* tokens, int* parsepos)
     goto done;
   }
   
-  err = _parse_single_command(&tmp, &tok, &pos, tokens, 0);
+  err = _parse_single_command(&tmp, &tok, &pos, tokens, strs, 0);
 
  done:
   cstr_destroy(&tok);
@@ -143,7 +144,7 @@ POE_ERR parse_cmdline(const cstr* str, pivec* tokens, int* parsepos)
 // Parsing support
 //
 
-POE_ERR _finish_parsing_locate(const cstr* str, cstr* tok_str, int* ppos, pivec* tokens)
+POE_ERR _finish_parsing_locate(const cstr* str, cstr* tok_str, int* ppos, pivec* tokens, arena* strs)
 {
   TRACE_ENTER;
   POE_ERR err = POE_ERR_UNK_CMD;
@@ -153,8 +154,8 @@ POE_ERR _finish_parsing_locate(const cstr* str, cstr* tok_str, int* ppos, pivec*
   bool bHavePat = _scan_locate_pattern(str, &srch_str, ppos, &delim);
   if (bHavePat) {
     _scanword(str, tok_str, ppos); // get any search options
-    pivec_append(tokens, CMD_STR(strsave(cstr_getbufptr(&srch_str))));
-    pivec_append(tokens, CMD_STR(strsave(cstr_getbufptr(tok_str))));
+    pivec_append(tokens, CMD_STR(arena_strsave(strs, cstr_getbufptr(&srch_str))));
+    pivec_append(tokens, CMD_STR(arena_strsave(strs, cstr_getbufptr(tok_str))));
     err = POE_ERR_OK;
   }
   cstr_destroy(&srch_str);
@@ -162,7 +163,7 @@ POE_ERR _finish_parsing_locate(const cstr* str, cstr* tok_str, int* ppos, pivec*
 }
 
 
-POE_ERR _finish_parsing_change(const cstr* str, cstr* tok_str, int* ppos, pivec* tokens)
+POE_ERR _finish_parsing_change(const cstr* str, cstr* tok_str, int* ppos, pivec* tokens, arena* strs)
 {
   TRACE_ENTER;
   POE_ERR err = POE_ERR_UNK_CMD;
@@ -178,9 +179,9 @@ POE_ERR _finish_parsing_change(const cstr* str, cstr* tok_str, int* ppos, pivec*
 	bool bHaveReplace = _scan_locate_replacement(str, &repl_str, ppos, delim);
 	if (bHaveReplace) {
 	  _scanword(str, tok_str, ppos); // get any search options
-	  pivec_append(tokens, CMD_STR(strsave(cstr_getbufptr(&srch_str))));
-	  pivec_append(tokens, CMD_STR(strsave(cstr_getbufptr(&repl_str))));
-	  pivec_append(tokens, CMD_STR(strsave(cstr_getbufptr(tok_str))));
+	  pivec_append(tokens, CMD_STR(arena_strsave(strs, cstr_getbufptr(&srch_str))));
+	  pivec_append(tokens, CMD_STR(arena_strsave(strs, cstr_getbufptr(&repl_str))));
+	  pivec_append(tokens, CMD_STR(arena_strsave(strs, cstr_getbufptr(tok_str))));
 	  err = POE_ERR_OK;
 	}
   }
@@ -190,13 +191,13 @@ POE_ERR _finish_parsing_change(const cstr* str, cstr* tok_str, int* ppos, pivec*
 }
 
 
-POE_ERR _finish_parsing_define(const cstr* str, cstr* tok_str, int* ppos, pivec* tokens)
+POE_ERR _finish_parsing_define(const cstr* str, cstr* tok_str, int* ppos, pivec* tokens, arena* strs)
 {
   TRACE_ENTER;
 
   if (!_scankeyname(str, tok_str, ppos))
 	TRACE_RETURN(POE_ERR_INVALID_KEY);
-  pivec_append(tokens, CMD_STR(strsave(cstr_getbufptr(tok_str))));
+  pivec_append(tokens, CMD_STR(arena_strsave(strs, cstr_getbufptr(tok_str))));
 
   //logmsg("keyname = '%s'", cstr_getbufptr(tok_str));
   if (*ppos < cstr_count(str)) {
@@ -209,7 +210,7 @@ POE_ERR _finish_parsing_define(const cstr* str, cstr* tok_str, int* ppos, pivec*
   (*ppos)++;
   POE_ERR err = POE_ERR_OK;
   do {
-	err = _parse_define_subcommand(str, tok_str, ppos, tokens);
+	err = _parse_define_subcommand(str, tok_str, ppos, tokens, strs);
   } while (err == POE_ERR_OK && *ppos < cstr_count(str));
   pivec_append(tokens, CMD_NULL);
 
@@ -220,7 +221,7 @@ POE_ERR _finish_parsing_define(const cstr* str, cstr* tok_str, int* ppos, pivec*
 }
 
 
-POE_ERR _parse_define_subcommand(const cstr* str, cstr* tok_str, int* ppos, pivec* tokens)
+POE_ERR _parse_define_subcommand(const cstr* str, cstr* tok_str, int* ppos, pivec* tokens, arena* strs)
 {
   TRACE_ENTER;
   POE_ERR err = POE_ERR_OK;
@@ -246,7 +247,7 @@ POE_ERR _parse_define_subcommand(const cstr* str, cstr* tok_str, int* ppos, pive
   pos++;
   int start_of_cmd_pos = pos;
   int start_of_cmd_tokens = pivec_count(tokens);
-  err = _parse_single_command(str, tok_str, &pos, tokens, 1);
+  err = _parse_single_command(str, tok_str, &pos, tokens, strs, 1);
   if (err != POE_ERR_OK)
 	TRACE_RETURN(err);
   pivec_append(tokens, CMD_SEP);
@@ -287,7 +288,7 @@ POE_ERR _parse_define_subcommand(const cstr* str, cstr* tok_str, int* ppos, pive
 }
 
 
-POE_ERR _finish_parsing_generic(const cstr* str, cstr* tok_str, int* ppos, pivec* tokens)
+POE_ERR _finish_parsing_generic(const cstr* str, cstr* tok_str, int* ppos, pivec* tokens, arena* strs)
 {
   TRACE_ENTER;
   POE_ERR err = POE_ERR_OK;
@@ -298,15 +299,20 @@ POE_ERR _finish_parsing_generic(const cstr* str, cstr* tok_str, int* ppos, pivec
     const char* pszTok = cstr_getbufptr(tok_str);
     switch (tok) {
     case tok_name:
-      pivec_append(tokens, CMD_STR(strsave(pszTok)));
+      pivec_append(tokens, CMD_STR(arena_strsave(strs, pszTok)));
       break;
     case tok_strlit:
-      pivec_append(tokens, CMD_STR(strsave(pszTok)));
+      pivec_append(tokens, CMD_STR(arena_strsave(strs, pszTok)));
       break;
     case tok_intlit:
       {
+        // numbers too big for a command int, such as file offsets,
+        // are left for the command to convert
         long l = strtol(pszTok, NULL, 10);
-        pivec_append(tokens, CMD_INT((int)l));
+        if (l > CMD_INT_MAX)
+          pivec_append(tokens, CMD_STR(arena_strsave(strs, pszTok)));
+        else
+          pivec_append(tokens, CMD_INT((int)l));
       }
       break;
     case tok_unk:
@@ -1,2 +1,4 @@
 
-POE_ERR parse_cmdline(const cstr* str, pivec* parsed_line, int* parsepos);
+// The strings in the parsed line are allocated from strs, and last as
+// long as it does.
+POE_ERR parse_cmdline(const cstr* str, pivec* parsed_line, int* parsepos, struct arena_t* strs);
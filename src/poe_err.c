@@ -51,6 +51,14 @@ const char* poe_err_message(POE_ERR err)
   case POE_ERR_NO_MARKS_SAVED: rval = "No marks saved"; break;
   case POE_ERR_SET_VAL_UNK: rval = "Attempted to SET an unrecognized value for this option"; break;  
   case POE_ERR_INVALID_LINE: rval = "Cursor is not on a line"; break;
+  case POE_ERR_CANCELLED: rval = "Cancelled"; break;
+  case POE_ERR_NOTHING_TO_UNDO: rval = "Nothing to undo"; break;
+  case POE_ERR_NOTHING_TO_REDO: rval = "Nothing to redo"; break;
+  case POE_ERR_BAD_REGEX: rval = "Invalid regular expression"; break;
+  case POE_ERR_STILL_LOADING: rval = "File is still loading"; break;
+  case POE_ERR_PARTIAL_FILE: rval = "Only part of the file was loaded"; break;
+  case POE_ERR_FILE_CUT_SHORT: rval = "The file was cut short while it was open"; break;
+  case POE_ERR_MATCH_TOO_LONG: rval = "Match too long to fill in its groups"; break;
   default:
     snprintf(errmsg, sizeof(errmsg), "Error %d", err);
     rval = errmsg;
@@ -45,3 +45,11 @@ const char* poe_err_message(POE_ERR err);
 #define POE_ERR_NO_MARKS_SAVED       (39) /* no marks to pop */
 #define POE_ERR_SET_VAL_UNK          (40) /* set of unknown option value */
 #define POE_ERR_INVALID_LINE         (41) /* cursor on invalid line (e.g. there aren't any lines yet) */
+#define POE_ERR_CANCELLED            (42) /* the user cancelled a long operation */
+#define POE_ERR_NOTHING_TO_UNDO      (43) /* UNDO with no edits left to undo */
+#define POE_ERR_NOTHING_TO_REDO      (44) /* REDO with no undone edits */
+#define POE_ERR_BAD_REGEX            (45) /* regular expression that doesn't compile */
+#define POE_ERR_STILL_LOADING        (46) /* tried to change or save a file that is still loading */
+#define POE_ERR_PARTIAL_FILE         (47) /* tried to save over a file that was only partly loaded */
+#define POE_ERR_FILE_CUT_SHORT       (48) /* a mapped file was truncated by someone else while open */
+#define POE_ERR_MATCH_TOO_LONG       (49) /* a regex match too long to fill in its groups for \1..\9 */
@@ -0,0 +1,959 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <ctype.h>
+#include <pthread.h>
+
+#include "trace.h"
+#include "poe_err.h"
+#include "utils.h"
+#include "vec.h"
+#include "rx.h"
+
+
+#define RX_MAXPROG       (32768)   // instructions in one compiled program
+#define RX_MAXREPEAT     (1000)    // largest count in {m,n}
+#define RX_MAXDEPTH      (200)     // nesting of ()
+#define RX_DFA_MAXSTATES (4096)    // states cached by one DFA
+#define RX_DFA_BUCKETS   (1024)
+#define RX_BT_MAXBITS    (64*1024*1024)
+
+
+//
+// Patterns are parsed into a tree of nodes, which is then compiled
+// into programs of these instructions.
+//
+enum rxnodetype_t {
+  RXN_EMPTY, RXN_SET, RXN_BOL, RXN_EOL, RXN_CAT, RXN_ALT, RXN_REPEAT, RXN_GROUP
+};
+
+struct rxnode_t {
+  enum rxnodetype_t type;
+  int a, b;         // children
+  int min, max;     // REPEAT; a max < 0 has no limit
+  int set;          // SET
+  int group;        // GROUP; 0 if it doesn't capture
+};
+
+enum rxop_t {
+  RXOP_SET,         // consume a character in set x
+  RXOP_SPLIT,       // carry on at both x and y, x first
+  RXOP_JMP,         // carry on at x
+  RXOP_SAVE,        // record the position in capture slot x
+  RXOP_BOL,         // only at the start of the text
+  RXOP_EOL,         // only at the end of the text
+  RXOP_MATCH,
+};
+
+struct rxinst_t {
+  enum rxop_t op;
+  int x, y;
+};
+
+struct rxset_t {
+  uint32_t bits[8];
+};
+
+#define RXSET_HAS(set, c) (((set)->bits[(unsigned char)(c) >> 5] >> ((unsigned char)(c) & 31)) & 1)
+
+struct rxprog_t {
+  struct rxinst_t* inst;
+  int n;
+};
+
+// A DFA state is the set of SET and EOL instructions the NFA could
+// be waiting at.  Transitions are filled in as they're first taken,
+// and once filled in they're read without a lock.
+struct rxstate_t {
+  struct rxstate_t* next[256];
+  struct rxstate_t* chain;
+  unsigned hash;
+  bool bol;         // made at the start of the text
+  bool match;       // a match ends here
+  bool eolmatch;    // a match ends here if the text does
+  bool transient;   // the cache was full; whoever steps off it frees it
+  int n;
+  int pcs[];
+};
+
+struct rxdfa_t {
+  const struct rxprog_t* prog;
+  const struct rxset_t* sets;
+  bool unanchored;
+  pthread_mutex_t lock;
+  struct rxstate_t* buckets[RX_DFA_BUCKETS];
+  int nstates;
+  struct rxstate_t* start[2];
+};
+
+struct rx_t {
+  struct rxset_t* sets;
+  int ngroups;
+  struct rxprog_t fwd, rev;
+  struct rxdfa_t fwd_dfa;     // anchored, finds where a match ends
+  struct rxdfa_t rev_dfa;     // unanchored over the text backwards, finds where matches start
+};
+
+struct rxparse_t {
+  const char* s;
+  int n, pos;
+  bool exact;
+  bool bad;
+  int depth;
+  int ngroups;
+  struct vec_t nodes;
+  struct vec_t sets;
+};
+
+struct rxcomp_t {
+  const struct vec_t* nodes;
+  struct rxinst_t* inst;
+  int n, cap;
+  bool bad;
+};
+
+struct rxwork_t {
+  int* stack;
+  unsigned char* seen;
+  int* list;
+  int nlist;
+  bool match;
+};
+
+
+int __rx_node(struct rxparse_t* p, enum rxnodetype_t type, int a, int b);
+int __rx_newset(struct rxparse_t* p);
+void __rx_setadd(struct rxparse_t* p, int set, unsigned char c);
+bool __rx_escape_class(struct rxparse_t* p, int set, char esc);
+int __rx_parse_alt(struct rxparse_t* p);
+int __rx_parse_cat(struct rxparse_t* p);
+int __rx_parse_repeat(struct rxparse_t* p);
+bool __rx_parse_bounds(struct rxparse_t* p, int* pmin, int* pmax);
+int __rx_parse_atom(struct rxparse_t* p);
+int __rx_parse_class(struct rxparse_t* p);
+int __rx_emit(struct rxcomp_t* c, enum rxop_t op, int x, int y);
+void __rx_compile_node(struct rxcomp_t* c, int ni, bool rev);
+bool __rx_compile_prog(const struct vec_t* nodes, int root, bool rev, struct rxprog_t* prog);
+void __rx_dfa_init(struct rxdfa_t* d, const struct rxprog_t* prog, const struct rxset_t* sets, bool unanchored);
+void __rx_dfa_destroy(struct rxdfa_t* d);
+struct rxwork_t* __rx_work_alloc(int n);
+void __rx_closure(const struct rxprog_t* prog, struct rxwork_t* w, int pc, bool bol, bool eol);
+struct rxstate_t* __rx_state(struct rxdfa_t* d, struct rxwork_t* w, bool bol);
+struct rxstate_t* __rx_step(struct rxdfa_t* d, struct rxstate_t* st, unsigned char c);
+struct rxstate_t* __rx_start(struct rxdfa_t* d, bool bol);
+int __rx_longest(struct rx_t* rx, const char* s, int n, int start);
+int __rx_intcmp(const void* a, const void* b);
+
+
+static inline struct rxstate_t* _rx_next(struct rxdfa_t* d, struct rxstate_t* st, unsigned char c)
+{
+  struct rxstate_t* nx = __atomic_load_n(&st->next[c], __ATOMIC_ACQUIRE);
+  if (nx == NULL) {
+    nx = __rx_step(d, st, c);
+    if (st->transient)
+      free(st);
+  }
+  return nx;
+}
+
+
+static inline bool _rx_accept(const struct rxstate_t* st, bool atend)
+{
+  return st->match || (atend && st->eolmatch);
+}
+
+
+POE_ERR rx_compile(struct rx_t** prx, const char* pat, int n, bool exact)
+{
+  TRACE_ENTER;
+  struct rxparse_t p;
+  memset(&p, 0, sizeof(p));
+  p.s = pat;
+  p.n = n;
+  p.exact = exact;
+  vec_init(&p.nodes, 16, sizeof(struct rxnode_t));
+  vec_init(&p.sets, 4, sizeof(struct rxset_t));
+  int root = __rx_parse_alt(&p);
+  // anything left over is an unmatched ')'
+  if (p.pos < p.n)
+    p.bad = true;
+
+  struct rx_t* rx = NULL;
+  if (!p.bad) {
+    rx = calloc(1, sizeof(struct rx_t));
+    rx->ngroups = min(p.ngroups, RX_MAXGROUPS);
+    rx->sets = malloc(max(vec_count(&p.sets), 1) * sizeof(struct rxset_t));
+    memcpy(rx->sets, vec_getbufptr(&p.sets), vec_count(&p.sets) * sizeof(struct rxset_t));
+    if (__rx_compile_prog(&p.nodes, root, false, &rx->fwd)
+        && __rx_compile_prog(&p.nodes, root, true, &rx->rev)) {
+      __rx_dfa_init(&rx->fwd_dfa, &rx->fwd, rx->sets, false);
+      __rx_dfa_init(&rx->rev_dfa, &rx->rev, rx->sets, true);
+    }
+    else {
+      free(rx->fwd.inst);
+      free(rx->rev.inst);
+      free(rx->sets);
+      free(rx);
+      rx = NULL;
+    }
+  }
+  vec_destroy(&p.nodes);
+  vec_destroy(&p.sets);
+  *prx = rx;
+  TRACE_RETURN(rx != NULL ? POE_ERR_OK : POE_ERR_BAD_REGEX);
+}
+
+
+void rx_free(struct rx_t* rx)
+{
+  TRACE_ENTER;
+  if (rx != NULL) {
+    __rx_dfa_destroy(&rx->fwd_dfa);
+    __rx_dfa_destroy(&rx->rev_dfa);
+    free(rx->fwd.inst);
+    free(rx->rev.inst);
+    free(rx->sets);
+    free(rx);
+  }
+  TRACE_EXIT;
+}
+
+
+int rx_ngroups(const struct rx_t* rx)
+{
+  TRACE_ENTER;
+  TRACE_RETURN(rx->ngroups);
+}
+
+
+// Returns the start of the leftmost match in s[0..n) that starts at
+// or after from, or -1, and sets end to the end of the longest match
+// from there.  The reversed pattern is run back from the end of the
+// text to find where matches start, then the pattern forward from the
+// leftmost of those to find where it ends.
+int rx_find(struct rx_t* rx, const char* s, int n, int from, int* end)
+{
+  TRACE_ENTER;
+  from = max(from, 0);
+  if (from > n)
+    TRACE_RETURN(-1);
+  struct rxdfa_t* d = &rx->rev_dfa;
+  struct rxstate_t* st = __rx_start(d, true);
+  int p, start = -1;
+  if (_rx_accept(st, n == 0))
+    start = n;
+  for (p = n-1; p >= from; p--) {
+    st = _rx_next(d, st, s[p]);
+    if (_rx_accept(st, p == 0))
+      start = p;
+  }
+  if (st->transient)
+    free(st);
+  if (start >= 0)
+    *end = __rx_longest(rx, s, n, start);
+  TRACE_RETURN(start);
+}
+
+
+// Appends every match in s[0..n) at or after from to matches, as
+// struct rxmatch_t, each found as rx_find would from where the last
+// one ended.  Where matches can start doesn't depend on from, so the
+// reversed pattern is only run back over the text once, and each
+// match then only costs the forward run to find its end.  Returns how
+// many were found.
+int rx_find_all(struct rx_t* rx, const char* s, int n, int from, struct vec_t* matches)
+{
+  TRACE_ENTER;
+  from = max(from, 0);
+  if (from > n)
+    TRACE_RETURN(0);
+  // the starts go into matches as they're found, last first
+  int base = vec_count(matches);
+  struct rxmatch_t m = { n, -1 };
+  struct rxdfa_t* d = &rx->rev_dfa;
+  struct rxstate_t* st = __rx_start(d, true);
+  int p;
+  if (_rx_accept(st, n == 0))
+    vec_append(matches, &m);
+  for (p = n-1; p >= from; p--) {
+    st = _rx_next(d, st, s[p]);
+    if (_rx_accept(st, p == 0)) {
+      m.start = p;
+      vec_append(matches, &m);
+    }
+  }
+  if (st->transient)
+    free(st);
+  int i, j, nstarts = vec_count(matches) - base;
+  struct rxmatch_t* ms = (struct rxmatch_t*)vec_getbufptr(matches) + base;
+  for (i = 0, j = nstarts-1; i < j; i++, j--) {
+    m = ms[i];
+    ms[i] = ms[j];
+    ms[j] = m;
+  }
+  // then each match is kept if it starts after the one before ends,
+  // written over the starts already looked at
+  int nfound = 0;
+  for (i = 0; i < nstarts; i++) {
+    if (ms[i].start < from)
+      continue;
+    ms[nfound].start = ms[i].start;
+    ms[nfound].end = __rx_longest(rx, s, n, ms[i].start);
+    // an empty match mustn't be found again
+    from = max(ms[nfound].end, ms[nfound].start+1);
+    nfound++;
+  }
+  vec_removem(matches, base + nfound, nstarts - nfound);
+  TRACE_RETURN(nfound);
+}
+
+
+// Returns the start of the rightmost match in s[0..n) that starts
+// before before, or -1, and sets end as rx_find does.
+int rx_rfind(struct rx_t* rx, const char* s, int n, int before, int* end)
+{
+  TRACE_ENTER;
+  struct rxdfa_t* d = &rx->rev_dfa;
+  struct rxstate_t* st = __rx_start(d, true);
+  int p, start = -1;
+  if (n < before && _rx_accept(st, n == 0))
+    start = n;
+  for (p = n-1; p >= 0 && start < 0; p--) {
+    st = _rx_next(d, st, s[p]);
+    if (p < before && _rx_accept(st, p == 0))
+      start = p;
+  }
+  if (st->transient)
+    free(st);
+  if (start >= 0)
+    *end = __rx_longest(rx, s, n, start);
+  TRACE_RETURN(start);
+}
+
+
+// Fills in caps with the start and end of each group, for a match
+// found in s[0..n) from start to end, -1 for groups that took no part
+// in it.  caps[0] and caps[1] are the whole match.  The backtracker
+// marks each (instruction, position) pair it tries, so it's linear in
+// the length of the match, but it needs a bit per pair; if that's too
+// many it gives up and returns false.
+bool rx_captures(const struct rx_t* rx, const char* s, int n, int start, int end, int* caps)
+{
+  TRACE_ENTER;
+  int i;
+  for (i = 0; i < 2*(RX_MAXGROUPS+1); i++)
+    caps[i] = -1;
+  caps[0] = start;
+  caps[1] = end;
+  const struct rxprog_t* prog = &rx->fwd;
+  size_t width = (size_t)(end - start + 1);
+  size_t nbits = (size_t)prog->n * width;
+  if (rx->ngroups == 0)
+    TRACE_RETURN(true);
+  if (start < 0 || end < start || end > n || nbits > RX_BT_MAXBITS)
+    TRACE_RETURN(false);
+
+  // a job is a thread to try, or a capture slot to put back (slot >= 0)
+  struct rxjob_t { int pc, pos, slot, old; };
+  uint32_t* visited = calloc((nbits + 31) / 32, sizeof(uint32_t));
+  int njobs = 0, capjobs = 64;
+  struct rxjob_t* jobs = malloc(capjobs * sizeof(struct rxjob_t));
+  bool found = false;
+  jobs[njobs++] = (struct rxjob_t){ 0, start, -1, 0 };
+  while (njobs > 0 && !found) {
+    struct rxjob_t job = jobs[--njobs];
+    if (job.slot >= 0) {
+      caps[job.slot] = job.old;
+      continue;
+    }
+    int pc = job.pc, pos = job.pos;
+    for (;;) {
+      size_t bit = (size_t)pc * width + (pos - start);
+      if (visited[bit >> 5] & (1u << (bit & 31)))
+        break;
+      visited[bit >> 5] |= 1u << (bit & 31);
+      const struct rxinst_t* in = &prog->inst[pc];
+      if (njobs + 2 > capjobs) {
+        capjobs *= 2;
+        jobs = realloc(jobs, capjobs * sizeof(struct rxjob_t));
+      }
+      if (in->op == RXOP_SET) {
+        if (pos >= end || !RXSET_HAS(&rx->sets[in->x], s[pos]))
+          break;
+        pc++;
+        pos++;
+      }
+      else if (in->op == RXOP_MATCH) {
+        found = pos == end;
+        break;
+      }
+      else if (in->op == RXOP_JMP) {
+        pc = in->x;
+      }
+      else if (in->op == RXOP_SPLIT) {
+        jobs[njobs++] = (struct rxjob_t){ in->y, pos, -1, 0 };
+        pc = in->x;
+      }
+      else if (in->op == RXOP_SAVE) {
+        jobs[njobs++] = (struct rxjob_t){ 0, 0, in->x, caps[in->x] };
+        caps[in->x] = pos;
+        pc++;
+      }
+      else if (in->op == RXOP_BOL) {
+        if (pos != 0)
+          break;
+        pc++;
+      }
+      else if (in->op == RXOP_EOL) {
+        if (pos != n)
+          break;
+        pc++;
+      }
+    }
+  }
+  free(jobs);
+  free(visited);
+  if (!found) {
+    for (i = 2; i < 2*(RX_MAXGROUPS+1); i++)
+      caps[i] = -1;
+  }
+  TRACE_RETURN(found);
+}
+
+
+//
+// Parsing
+//
+
+int __rx_node(struct rxparse_t* p, enum rxnodetype_t type, int a, int b)
+{
+  struct rxnode_t nd;
+  memset(&nd, 0, sizeof(nd));
+  nd.type = type;
+  nd.a = a;
+  nd.b = b;
+  return vec_append(&p->nodes, &nd);
+}
+
+
+int __rx_newset(struct rxparse_t* p)
+{
+  struct rxset_t set;
+  memset(&set, 0, sizeof(set));
+  return vec_append(&p->sets, &set);
+}
+
+
+void __rx_setadd(struct rxparse_t* p, int set, unsigned char c)
+{
+  struct rxset_t* rs = vec_get(&p->sets, set);
+  rs->bits[c >> 5] |= 1u << (c & 31);
+  if (!p->exact) {
+    unsigned char l = tolower(c), u = toupper(c);
+    rs->bits[l >> 5] |= 1u << (l & 31);
+    rs->bits[u >> 5] |= 1u << (u & 31);
+  }
+}
+
+
+// \d \w \s and their complements
+bool __rx_escape_class(struct rxparse_t* p, int set, char esc)
+{
+  int c;
+  bool neg = isupper((unsigned char)esc);
+  char cls = tolower((unsigned char)esc);
+  if (cls != 'd' && cls != 'w' && cls != 's')
+    return false;
+  struct rxset_t* rs = vec_get(&p->sets, set);
+  for (c = 0; c < 256; c++) {
+    bool in;
+    if (cls == 'd')
+      in = isdigit(c);
+    else if (cls == 'w')
+      in = isalnum(c) || c == '_';
+    else
+      in = isspace(c);
+    if (in != neg)
+      rs->bits[c >> 5] |= 1u << (c & 31);
+  }
+  return true;
+}
+
+
+int __rx_parse_alt(struct rxparse_t* p)
+{
+  int a = __rx_parse_cat(p);
+  while (!p->bad && p->pos < p->n && p->s[p->pos] == '|') {
+    p->pos++;
+    int b = __rx_parse_cat(p);
+    a = __rx_node(p, RXN_ALT, a, b);
+  }
+  return a;
+}
+
+
+int __rx_parse_cat(struct rxparse_t* p)
+{
+  int a = -1;
+  while (!p->bad && p->pos < p->n && p->s[p->pos] != '|' && p->s[p->pos] != ')') {
+    int b = __rx_parse_repeat(p);
+    a = (a < 0) ? b : __rx_node(p, RXN_CAT, a, b);
+  }
+  return (a < 0) ? __rx_node(p, RXN_EMPTY, -1, -1) : a;
+}
+
+
+int __rx_parse_repeat(struct rxparse_t* p)
+{
+  int a = __rx_parse_atom(p);
+  while (!p->bad && p->pos < p->n) {
+    char c = p->s[p->pos];
+    int min, max;
+    if (c == '*' || c == '+' || c == '?') {
+      min = (c == '+') ? 1 : 0;
+      max = (c == '?') ? 1 : -1;
+      p->pos++;
+    }
+    else if (c != '{' || !__rx_parse_bounds(p, &min, &max)) {
+      break;
+    }
+    a = __rx_node(p, RXN_REPEAT, a, -1);
+    struct rxnode_t* nd = vec_get(&p->nodes, a);
+    nd->min = min;
+    nd->max = max;
+  }
+  return a;
+}
+
+
+// {m} {m,} {m,n}.  Anything else starting with '{' is taken literally.
+bool __rx_parse_bounds(struct rxparse_t* p, int* pmin, int* pmax)
+{
+  int pos = p->pos + 1;
+  int m = 0, x;
+  if (pos >= p->n || !isdigit((unsigned char)p->s[pos]))
+    return false;
+  while (pos < p->n && isdigit((unsigned char)p->s[pos]) && m <= RX_MAXREPEAT)
+    m = m*10 + (p->s[pos++] - '0');
+  x = m;
+  if (pos < p->n && p->s[pos] == ',') {
+    pos++;
+    x = -1;
+    if (pos < p->n && isdigit((unsigned char)p->s[pos])) {
+      x = 0;
+      while (pos < p->n && isdigit((unsigned char)p->s[pos]) && x <= RX_MAXREPEAT)
+        x = x*10 + (p->s[pos++] - '0');
+    }
+  }
+  if (pos >= p->n || p->s[pos] != '}')
+    return false;
+  if (m > RX_MAXREPEAT || x > RX_MAXREPEAT || (x >= 0 && x < m))
+    p->bad = true;
+  p->pos = pos + 1;
+  *pmin = m;
+  *pmax = x;
+  return true;
+}
+
+
+int __rx_parse_atom(struct rxparse_t* p)
+{
+  char c = p->s[p->pos++];
+  int a, set;
+  switch (c) {
+  case '(':
+    if (++p->depth > RX_MAXDEPTH) {
+      p->bad = true;
+      return -1;
+    }
+    ++p->ngroups;
+    int group = (p->ngroups <= RX_MAXGROUPS) ? p->ngroups : 0;
+    a = __rx_parse_alt(p);
+    if (p->pos >= p->n || p->s[p->pos] != ')')
+      p->bad = true;
+    else
+      p->pos++;
+    p->depth--;
+    a = __rx_node(p, RXN_GROUP, a, -1);
+    ((struct rxnode_t*)vec_get(&p->nodes, a))->group = group;
+    return a;
+  case '*':
+  case '+':
+  case '?':
+    // nothing to repeat
+    p->bad = true;
+    return -1;
+  case '[':
+    return __rx_parse_class(p);
+  case '^':
+    return __rx_node(p, RXN_BOL, -1, -1);
+  case '$':
+    return __rx_node(p, RXN_EOL, -1, -1);
+  }
+
+  set = __rx_newset(p);
+  if (c == '.') {
+    struct rxset_t* rs = vec_get(&p->sets, set);
+    memset(rs->bits, 0xff, sizeof(rs->bits));
+  }
+  else if (c == '\\' && p->pos < p->n) {
+    char esc = p->s[p->pos++];
+    if (!__rx_escape_class(p, set, esc))
+      __rx_setadd(p, set, (esc == 't') ? '\t' : esc);
+  }
+  else {
+    __rx_setadd(p, set, c);
+  }
+  a = __rx_node(p, RXN_SET, -1, -1);
+  ((struct rxnode_t*)vec_get(&p->nodes, a))->set = set;
+  return a;
+}
+
+
+// [abc] [a-z] [^...].  A ']' first in the class is taken literally.
+int __rx_parse_class(struct rxparse_t* p)
+{
+  int c, set = __rx_newset(p);
+  bool neg = false, first = true;
+  if (p->pos < p->n && p->s[p->pos] == '^') {
+    neg = true;
+    p->pos++;
+  }
+  while (p->pos < p->n && (p->s[p->pos] != ']' || first)) {
+    first = false;
+    unsigned char lo = p->s[p->pos++];
+    if (lo == '\\' && p->pos < p->n) {
+      char esc = p->s[p->pos++];
+      if (__rx_escape_class(p, set, esc))
+        continue;
+      lo = (esc == 't') ? '\t' : esc;
+    }
+    unsigned char hi = lo;
+    if (p->pos+1 < p->n && p->s[p->pos] == '-' && p->s[p->pos+1] != ']') {
+      p->pos++;
+      hi = p->s[p->pos++];
+      if (hi == '\\' && p->pos < p->n) {
+        hi = p->s[p->pos++];
+        if (hi == 't')
+          hi = '\t';
+      }
+      if (hi < lo)
+        p->bad = true;
+    }
+    for (c = lo; c <= hi; c++)
+      __rx_setadd(p, set, c);
+  }
+  if (p->pos >= p->n)
+    p->bad = true;
+  else
+    p->pos++;
+  if (neg) {
+    struct rxset_t* rs = vec_get(&p->sets, set);
+    for (c = 0; c < 8; c++)
+      rs->bits[c] = ~rs->bits[c];
+  }
+  int a = __rx_node(p, RXN_SET, -1, -1);
+  ((struct rxnode_t*)vec_get(&p->nodes, a))->set = set;
+  return a;
+}
+
+
+//
+// Compiling
+//
+
+int __rx_emit(struct rxcomp_t* c, enum rxop_t op, int x, int y)
+{
+  if (c->n >= RX_MAXPROG) {
+    c->bad = true;
+    return -1;
+  }
+  if (c->n >= c->cap) {
+    c->cap = max(c->cap * 2, 16);
+    c->inst = reallocarray(c->inst, c->cap, sizeof(struct rxinst_t));
+  }
+  c->inst[c->n].op = op;
+  c->inst[c->n].x = x;
+  c->inst[c->n].y = y;
+  return c->n++;
+}
+
+
+// The reversed program matches the reversed text: concatenations run
+// the other way round and ^ and $ swap.  It's only used to find where
+// matches start, so it doesn't save captures.
+void __rx_compile_node(struct rxcomp_t* c, int ni, bool rev)
+{
+  if (c->bad)
+    return;
+  const struct rxnode_t* nd = vec_get(c->nodes, ni);
+  int i, pc, jmp;
+  switch (nd->type) {
+  case RXN_EMPTY:
+    break;
+  case RXN_SET:
+    __rx_emit(c, RXOP_SET, nd->set, 0);
+    break;
+  case RXN_BOL:
+    __rx_emit(c, rev ? RXOP_EOL : RXOP_BOL, 0, 0);
+    break;
+  case RXN_EOL:
+    __rx_emit(c, rev ? RXOP_BOL : RXOP_EOL, 0, 0);
+    break;
+  case RXN_CAT:
+    __rx_compile_node(c, rev ? nd->b : nd->a, rev);
+    __rx_compile_node(c, rev ? nd->a : nd->b, rev);
+    break;
+  case RXN_ALT:
+    pc = __rx_emit(c, RXOP_SPLIT, c->n+1, 0);
+    __rx_compile_node(c, nd->a, rev);
+    jmp = __rx_emit(c, RXOP_JMP, 0, 0);
+    if (c->bad)
+      break;
+    c->inst[pc].y = c->n;
+    __rx_compile_node(c, nd->b, rev);
+    if (!c->bad)
+      c->inst[jmp].x = c->n;
+    break;
+  case RXN_GROUP:
+    if (!rev && nd->group > 0)
+      __rx_emit(c, RXOP_SAVE, 2*nd->group, 0);
+    __rx_compile_node(c, nd->a, rev);
+    if (!rev && nd->group > 0)
+      __rx_emit(c, RXOP_SAVE, 2*nd->group+1, 0);
+    break;
+  case RXN_REPEAT:
+    for (i = 0; i < nd->min && !c->bad; i++)
+      __rx_compile_node(c, nd->a, rev);
+    if (nd->max < 0) {
+      pc = __rx_emit(c, RXOP_SPLIT, c->n+1, 0);
+      __rx_compile_node(c, nd->a, rev);
+      __rx_emit(c, RXOP_JMP, pc, 0);
+      if (!c->bad)
+        c->inst[pc].y = c->n;
+    }
+    else if (nd->max > nd->min) {
+      // each optional copy can skip straight to the end
+      int nopt = nd->max - nd->min;
+      int* splits = malloc(nopt * sizeof(int));
+      for (i = 0; i < nopt && !c->bad; i++) {
+        splits[i] = __rx_emit(c, RXOP_SPLIT, c->n+1, 0);
+        __rx_compile_node(c, nd->a, rev);
+      }
+      for (i = 0; i < nopt && !c->bad; i++)
+        c->inst[splits[i]].y = c->n;
+      free(splits);
+    }
+    break;
+  }
+}
+
+
+bool __rx_compile_prog(const struct vec_t* nodes, int root, bool rev, struct rxprog_t* prog)
+{
+  struct rxcomp_t c;
+  memset(&c, 0, sizeof(c));
+  c.nodes = nodes;
+  __rx_compile_node(&c, root, rev);
+  __rx_emit(&c, RXOP_MATCH, 0, 0);
+  if (c.bad) {
+    free(c.inst);
+    return false;
+  }
+  prog->inst = c.inst;
+  prog->n = c.n;
+  return true;
+}
+
+
+//
+// Lazy DFA
+//
+
+void __rx_dfa_init(struct rxdfa_t* d, const struct rxprog_t* prog, const struct rxset_t* sets, bool unanchored)
+{
+  memset(d, 0, sizeof(struct rxdfa_t));
+  d->prog = prog;
+  d->sets = sets;
+  d->unanchored = unanchored;
+  pthread_mutex_init(&d->lock, NULL);
+}
+
+
+void __rx_dfa_destroy(struct rxdfa_t* d)
+{
+  int i;
+  for (i = 0; i < RX_DFA_BUCKETS; i++) {
+    struct rxstate_t* st = d->buckets[i];
+    while (st != NULL) {
+      struct rxstate_t* chain = st->chain;
+      free(st);
+      st = chain;
+    }
+  }
+  pthread_mutex_destroy(&d->lock);
+}
+
+
+struct rxwork_t* __rx_work_alloc(int n)
+{
+  struct rxwork_t* w = malloc(sizeof(struct rxwork_t) + (3*n + 2)*sizeof(int) + n);
+  w->stack = (int*)(w + 1);
+  w->list = w->stack + 2*n + 2;
+  w->seen = (unsigned char*)(w->list + n);
+  memset(w->seen, 0, n);
+  w->nlist = 0;
+  w->match = false;
+  return w;
+}
+
+
+// Follows the program from pc as far as it can go without consuming
+// any text, adding the SET instructions it gets to to the work list,
+// and EOL ones too unless it's at the end of the text.
+void __rx_closure(const struct rxprog_t* prog, struct rxwork_t* w, int pc, bool bol, bool eol)
+{
+  int sp = 0;
+  w->stack[sp++] = pc;
+  while (sp > 0) {
+    pc = w->stack[--sp];
+    if (w->seen[pc])
+      continue;
+    w->seen[pc] = 1;
+    const struct rxinst_t* in = &prog->inst[pc];
+    switch (in->op) {
+    case RXOP_SET:
+      w->list[w->nlist++] = pc;
+      break;
+    case RXOP_MATCH:
+      w->match = true;
+      break;
+    case RXOP_JMP:
+      w->stack[sp++] = in->x;
+      break;
+    case RXOP_SPLIT:
+      w->stack[sp++] = in->y;
+      w->stack[sp++] = in->x;
+      break;
+    case RXOP_SAVE:
+      w->stack[sp++] = pc+1;
+      break;
+    case RXOP_BOL:
+      if (bol)
+        w->stack[sp++] = pc+1;
+      break;
+    case RXOP_EOL:
+      if (eol)
+        w->stack[sp++] = pc+1;
+      else
+        w->list[w->nlist++] = pc;
+      break;
+    }
+  }
+}
+
+
+// Finds or makes the state for the instructions in the work list.
+struct rxstate_t* __rx_state(struct rxdfa_t* d, struct rxwork_t* w, bool bol)
+{
+  int i;
+  qsort(w->list, w->nlist, sizeof(int), __rx_intcmp);
+  unsigned h = (bol ? 2 : 0) | (w->match ? 1 : 0);
+  for (i = 0; i < w->nlist; i++)
+    h = h*31 + w->list[i];
+
+  pthread_mutex_lock(&d->lock);
+  struct rxstate_t* st;
+  for (st = d->buckets[h % RX_DFA_BUCKETS]; st != NULL; st = st->chain) {
+    if (st->hash == h && st->bol == bol && st->match == w->match && st->n == w->nlist
+        && memcmp(st->pcs, w->list, w->nlist * sizeof(int)) == 0)
+      break;
+  }
+  if (st == NULL) {
+    st = calloc(1, sizeof(struct rxstate_t) + w->nlist * sizeof(int));
+    st->hash = h;
+    st->bol = bol;
+    st->match = w->match;
+    st->n = w->nlist;
+    memcpy(st->pcs, w->list, w->nlist * sizeof(int));
+    // would a match end here if the text did?
+    struct rxwork_t* ew = __rx_work_alloc(d->prog->n);
+    for (i = 0; i < st->n; i++) {
+      if (d->prog->inst[st->pcs[i]].op == RXOP_EOL)
+        __rx_closure(d->prog, ew, st->pcs[i]+1, bol, true);
+    }
+    st->eolmatch = ew->match;
+    free(ew);
+    if (d->nstates < RX_DFA_MAXSTATES) {
+      st->chain = d->buckets[h % RX_DFA_BUCKETS];
+      d->buckets[h % RX_DFA_BUCKETS] = st;
+      d->nstates++;
+    }
+    else {
+      st->transient = true;
+    }
+  }
+  pthread_mutex_unlock(&d->lock);
+  return st;
+}
+
+
+struct rxstate_t* __rx_step(struct rxdfa_t* d, struct rxstate_t* st, unsigned char c)
+{
+  int i;
+  const struct rxprog_t* prog = d->prog;
+  struct rxwork_t* w = __rx_work_alloc(prog->n);
+  for (i = 0; i < st->n; i++) {
+    const struct rxinst_t* in = &prog->inst[st->pcs[i]];
+    if (in->op == RXOP_SET && RXSET_HAS(&d->sets[in->x], c))
+      __rx_closure(prog, w, st->pcs[i]+1, false, false);
+  }
+  if (d->unanchored)
+    __rx_closure(prog, w, 0, false, false);
+  struct rxstate_t* nx = __rx_state(d, w, false);
+  free(w);
+  if (!st->transient && !nx->transient)
+    __atomic_store_n(&st->next[c], nx, __ATOMIC_RELEASE);
+  return nx;
+}
+
+
+struct rxstate_t* __rx_start(struct rxdfa_t* d, bool bol)
+{
+  struct rxstate_t* st = __atomic_load_n(&d->start[bol], __ATOMIC_ACQUIRE);
+  if (st != NULL)
+    return st;
+  struct rxwork_t* w = __rx_work_alloc(d->prog->n);
+  __rx_closure(d->prog, w, 0, bol, false);
+  st = __rx_state(d, w, bol);
+  free(w);
+  if (!st->transient)
+    __atomic_store_n(&d->start[bol], st, __ATOMIC_RELEASE);
+  return st;
+}
+
+
+// The end of the longest match starting at start, which is known to
+// be the start of one.
+int __rx_longest(struct rx_t* rx, const char* s, int n, int start)
+{
+  struct rxdfa_t* d = &rx->fwd_dfa;
+  struct rxstate_t* st = __rx_start(d, start == 0);
+  int i, last = start;
+  for (i = start; i < n && st->n > 0; i++) {
+    st = _rx_next(d, st, s[i]);
+    if (_rx_accept(st, i+1 == n))
+      last = i+1;
+  }
+  if (st->transient)
+    free(st);
+  return last;
+}
+
+
+int __rx_intcmp(const void* a, const void* b)
+{
+  return *(const int*)a - *(const int*)b;
+}
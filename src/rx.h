@@ -0,0 +1,32 @@
+//
+// Regular expressions for LOCATE and CHANGE.  A pattern is compiled
+// into a small NFA program, once as written and once reversed, and
+// searches run DFAs that are built from those programs a state at a
+// time as the text needs them.  Every search is a fixed number of
+// passes over the line, however the pattern is written.  Matches are
+// leftmost-longest.
+//
+// Capture groups are filled in afterwards, for a match that's already
+// been found, by a backtracker that never visits the same program
+// position and text position twice.
+//
+// Syntax: . [] [^] ^ $ () | * + ? {m} {m,} {m,n}, and the escapes
+// \d \D \w \W \s \S \t.  Any other escaped character stands for
+// itself.
+//
+struct rx_t;
+struct vec_t;
+
+#define RX_MAXGROUPS (9)
+
+struct rxmatch_t {
+  int start, end;
+};
+
+POE_ERR rx_compile(struct rx_t** prx, const char* pat, int n, bool exact);
+void rx_free(struct rx_t* rx);
+int rx_ngroups(const struct rx_t* rx);
+int rx_find(struct rx_t* rx, const char* s, int n, int from, int* end);
+int rx_rfind(struct rx_t* rx, const char* s, int n, int before, int* end);
+int rx_find_all(struct rx_t* rx, const char* s, int n, int from, struct vec_t* matches);
+bool rx_captures(const struct rx_t* rx, const char* s, int n, int start, int end, int* caps);
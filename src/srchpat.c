@@ -0,0 +1,195 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <ctype.h>
+
+#include "trace.h"
+#include "poe_err.h"
+#include "utils.h"
+#include "vec.h"
+#include "cstr.h"
+#include "srchpat.h"
+#include "rx.h"
+
+
+static unsigned char _fold[256];
+static bool _fold_ready = false;
+
+#define FOLD(sp, c) ((sp)->exact ? (unsigned char)(c) : _fold[(unsigned char)(c)])
+
+
+void _srchpat_init_fold(void);
+bool _srchpat_match(const struct srchpat_t* sp, const char* s);
+
+
+void srchpat_init(struct srchpat_t* sp, const struct cstr_t* pat, bool exact)
+{
+  TRACE_ENTER;
+  _srchpat_init_fold();
+  int i, m = cstr_count(pat);
+  sp->len = m;
+  sp->exact = exact;
+  sp->rx = NULL;
+  sp->pat = malloc(m+1);
+  for (i = 0; i < m; i++)
+    sp->pat[i] = FOLD(sp, cstr_get(pat, i));
+  sp->pat[m] = '\0';
+
+  // forward: how far the window can move given its last character,
+  // backward: the same given its first character
+  for (i = 0; i < 256; i++)
+    sp->fwd_skip[i] = sp->bwd_skip[i] = max(m, 1);
+  for (i = 0; i < m-1; i++)
+    sp->fwd_skip[(unsigned char)sp->pat[i]] = m-1-i;
+  for (i = m-1; i > 0; i--)
+    sp->bwd_skip[(unsigned char)sp->pat[i]] = i;
+  TRACE_EXIT;
+}
+
+
+// Compiles pat as a regular expression instead.
+POE_ERR srchpat_init_regex(struct srchpat_t* sp, const struct cstr_t* pat, bool exact)
+{
+  TRACE_ENTER;
+  memset(sp, 0, sizeof(struct srchpat_t));
+  sp->exact = exact;
+  POE_ERR err = rx_compile(&sp->rx, cstr_getbufptr(pat), cstr_count(pat), exact);
+  TRACE_RETURN(err);
+}
+
+
+void srchpat_destroy(struct srchpat_t* sp)
+{
+  TRACE_ENTER;
+  free(sp->pat);
+  rx_free(sp->rx);
+  sp->pat = NULL;
+  sp->rx = NULL;
+  sp->len = 0;
+  TRACE_EXIT;
+}
+
+
+// The number of capture groups; plain patterns have none.
+int srchpat_ngroups(const struct srchpat_t* sp)
+{
+  TRACE_ENTER;
+  TRACE_RETURN(sp->rx != NULL ? rx_ngroups(sp->rx) : 0);
+}
+
+
+// Returns the position of the first match in s[0..n) that starts at
+// or after from, or -1, and sets end to where it ends.
+int srchpat_find(const struct srchpat_t* sp, const char* s, int n, int from, int* end)
+{
+  TRACE_ENTER;
+  if (sp->rx != NULL)
+    TRACE_RETURN(rx_find(sp->rx, s, n, from, end));
+  int m = sp->len;
+  if (m <= 0 || from < 0 || n - from < m)
+    TRACE_RETURN(-1);
+  if (m == 1 && sp->exact) {
+    const char* r = memchr(s+from, sp->pat[0], n-from);
+    if (r == NULL)
+      TRACE_RETURN(-1);
+    *end = r-s + 1;
+    TRACE_RETURN(r-s);
+  }
+  int pos = from, last = n - m;
+  unsigned char tail = sp->pat[m-1];
+  while (pos <= last) {
+    unsigned char c = FOLD(sp, s[pos+m-1]);
+    if (c == tail && _srchpat_match(sp, s+pos)) {
+      *end = pos + m;
+      TRACE_RETURN(pos);
+    }
+    pos += sp->fwd_skip[c];
+  }
+  TRACE_RETURN(-1);
+}
+
+
+// Appends every match in s[0..n) at or after from to matches, as
+// struct rxmatch_t, each starting where the last one ended.  Returns
+// how many were found.
+int srchpat_find_all(const struct srchpat_t* sp, const char* s, int n, int from, struct vec_t* matches)
+{
+  TRACE_ENTER;
+  if (sp->rx != NULL)
+    TRACE_RETURN(rx_find_all(sp->rx, s, n, from, matches));
+  struct rxmatch_t m;
+  int nfound = 0;
+  while (from <= n && (m.start = srchpat_find(sp, s, n, from, &m.end)) >= 0) {
+    vec_append(matches, &m);
+    nfound++;
+    from = max(m.end, m.start+1);
+  }
+  TRACE_RETURN(nfound);
+}
+
+
+// Returns the position of the last match in s[0..n) that starts
+// before before, or -1, and sets end to where it ends.
+int srchpat_rfind(const struct srchpat_t* sp, const char* s, int n, int before, int* end)
+{
+  TRACE_ENTER;
+  if (sp->rx != NULL)
+    TRACE_RETURN(rx_rfind(sp->rx, s, n, before, end));
+  int m = sp->len;
+  int pos = min(before-1, n-m);
+  if (m <= 0 || pos < 0)
+    TRACE_RETURN(-1);
+  unsigned char head = sp->pat[0];
+  while (pos >= 0) {
+    unsigned char c = FOLD(sp, s[pos]);
+    if (c == head && _srchpat_match(sp, s+pos)) {
+      *end = pos + m;
+      TRACE_RETURN(pos);
+    }
+    pos -= sp->bwd_skip[c];
+  }
+  TRACE_RETURN(-1);
+}
+
+
+// Fills in caps (2*(RX_MAXGROUPS+1) ints) with the start and end of
+// each group in the match at s[start..end).  Plain patterns only have
+// the whole match.
+bool srchpat_captures(const struct srchpat_t* sp, const char* s, int n, int start, int end, int* caps)
+{
+  TRACE_ENTER;
+  if (sp->rx != NULL)
+    TRACE_RETURN(rx_captures(sp->rx, s, n, start, end, caps));
+  int i;
+  for (i = 0; i < 2*(RX_MAXGROUPS+1); i++)
+    caps[i] = -1;
+  caps[0] = start;
+  caps[1] = end;
+  TRACE_RETURN(true);
+}
+
+
+bool _srchpat_match(const struct srchpat_t* sp, const char* s)
+{
+  int i;
+  if (sp->exact)
+    return memcmp(s, sp->pat, sp->len) == 0;
+  for (i = 0; i < sp->len; i++) {
+    if (_fold[(unsigned char)s[i]] != (unsigned char)sp->pat[i])
+      return false;
+  }
+  return true;
+}
+
+
+void _srchpat_init_fold()
+{
+  if (_fold_ready)
+    return;
+  int i;
+  for (i = 0; i < 256; i++)
+    _fold[i] = tolower(i);
+  _fold_ready = true;
+}
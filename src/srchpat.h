@@ -0,0 +1,31 @@
+
+//
+// A search pattern compiled once and then run over as much text as
+// needed.  Matching uses Horspool's skip tables, one for each
+// direction, so searching backwards costs the same as forwards.
+// Inexact patterns are folded to lower case up front, and the text
+// is folded as it's read.  A pattern can instead be a regular
+// expression (see rx.h), whose matches vary in length, so the find
+// functions report where each match ends.
+//
+struct rx_t;
+struct vec_t;
+
+struct srchpat_t {
+  char* pat;
+  int len;
+  bool exact;
+  struct rx_t* rx;
+  int fwd_skip[256];
+  int bwd_skip[256];
+};
+typedef struct srchpat_t srchpat;
+
+void srchpat_init(struct srchpat_t* sp, const struct cstr_t* pat, bool exact);
+POE_ERR srchpat_init_regex(struct srchpat_t* sp, const struct cstr_t* pat, bool exact);
+void srchpat_destroy(struct srchpat_t* sp);
+int srchpat_ngroups(const struct srchpat_t* sp);
+int srchpat_find(const struct srchpat_t* sp, const char* s, int n, int from, int* end);
+int srchpat_rfind(const struct srchpat_t* sp, const char* s, int n, int before, int* end);
+int srchpat_find_all(const struct srchpat_t* sp, const char* s, int n, int from, struct vec_t* matches);
+bool srchpat_captures(const struct srchpat_t* sp, const char* s, int n, int start, int end, int* caps);
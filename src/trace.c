@@ -8,8 +8,9 @@
 
 
 #define MAX_DEPTH (256)
-const char *_trace_stack[MAX_DEPTH];
-int _stack_top = 0;
+// one stack per thread, so worker threads can trace as well
+__thread const char *_trace_stack[MAX_DEPTH];
+__thread int _stack_top = 0;
 
 
 void init_trace_stack()
@@ -262,7 +262,7 @@ struct vec_t* vec_alloc(int capacity, size_t element_size)
 {
   TRACE_ENTER;
   struct vec_t* v = calloc(1, sizeof(struct vec_t));
-  vec_init(v, element_size, capacity);
+  vec_init(v, capacity, element_size);
   TRACE_RETURN(v);
 }
 
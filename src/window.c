@@ -3,11 +3,13 @@
 #include <stdlib.h>
 #include <stdarg.h>
 #include <stdint.h>
+#include <limits.h>
 #include <signal.h>
 #include <string.h>
 #include <ctype.h>
 #include <ncurses.h>
 #include <unistd.h>
+#include <time.h>
 
 #include "trace.h"
 #include "logging.h"
@@ -52,6 +54,37 @@
 #define A_SPLITTERS (A_BOLD)
 
 
+// Cell classes used when painting a data line
+enum cellcls_t {
+  Cell_Norm,
+  Cell_Mark,
+  Cell_Ctrl,
+  Cell_Curs,
+};
+
+// A run of cells on a data line that are painted the same way
+struct rowspan_t {
+  int col, n;
+  enum cellcls_t cls;
+};
+
+
+// What the last repaint left on the screen, so that the next one
+// only has to redraw what changed.
+struct winpaint_t {
+  bool valid;
+  BUFFER data_buf;
+  int t, l, b, r;
+  int view_top, view_left;
+  int curs_row, curs_col; // command mode cursor cell in the data area
+  int in_data;
+  unsigned int marks_gen;
+  int cmd_left;
+  cstr info;
+  cstr msg;
+};
+
+
 struct window_t {
   int flags;
   int slot;
@@ -73,6 +106,13 @@ struct window_t {
 
   int in_data;
   cstr msg_txt;
+
+  struct winpaint_t painted;
+  // scratch space for painting a data line
+  char* rowtxt;
+  struct rowspan_t* rowspans;
+  int rowcap;
+  struct vec_t/*struct markspan_t*/ rowmarks;
 };
 
 typedef struct window_t WIN;
@@ -111,6 +151,8 @@ void _win_setflags(WINPTR pwin, int flags);
 void _win_clrflags(WINPTR pwin, int flags);
 int _win_tstflags(WINPTR pwin, int flags);
 void _win_repaint(WINPTR pwin, int slot);
+void _win_repaint_data_line(WINPTR pwin, int i, BUFFER data_buf, int nlines,
+                            int view_top, int view_left, int curs_col);
 
 void _ensure_view_for_buffer(WINPTR pwin);
 void _window_forget_buffer(WINPTR pwin, BUFFER buf);
@@ -125,16 +167,23 @@ void _win_clr_eol(WINPTR pwin, int scrrow, int scrcol, char c);
 WINPTR _getwin(const char* dbgstr, int slot);
 void _init_curses();
 void _init_curses_keys();
+void _wins_screen_extent(int* begrow, int* begcol, int* endrow, int* endcol);
+
+// The pretend screen that windows are laid out on in batch mode
+#define BATCH_SCREEN_ROWS (24)
+#define BATCH_SCREEN_COLS (80)
 
 
 void init_windows()
 {
   TRACE_ENTER;
   int i;
-  //logmsg("initting curses");
-  _init_curses();
-  //logmsg("initting curses keys");
-  _init_curses_keys();
+  if (!__batch) {
+    //logmsg("initting curses");
+    _init_curses();
+    //logmsg("initting curses keys");
+    _init_curses_keys();
+  }
   //logmsg("nulling windows");
   for (i = 0; i < MAX_WINDOWS; i++)
     _wins[i] = NULL;
@@ -351,8 +400,7 @@ void wins_ensure_initial_win()
     TRACE_EXIT;
   int begrow, begcol;
   int endrow, endcol;
-  getbegyx(stdscr, begrow, begcol);
-  getmaxyx(stdscr, endrow, endcol);
+  _wins_screen_extent(&begrow, &begcol, &endrow, &endcol);
 
   //logmsg("wins_ensure_initial_win, t=%d, l=%d, b=%d, r=%d", begrow, begcol, endrow-1, endcol-1);
   _win_alloc(0, begrow, begcol, endrow-1, endcol-1);
@@ -366,12 +414,14 @@ void wins_ensure_initial_win()
 void wins_resize(void)
 {
   TRACE_ENTER;
-  endwin();
-  refresh();
+  if (!__batch) {
+    endwin();
+    refresh();
+  }
+  wins_invalidate_all();
   int begrow, begcol;
   int endrow, endcol;
-  getbegyx(stdscr, begrow, begcol);
-  getmaxyx(stdscr, endrow, endcol);
+  _wins_screen_extent(&begrow, &begcol, &endrow, &endcol);
 
   int midrow = SCALE_SPLITTER(endrow+begrow, hsplitter);
   int midcol = SCALE_SPLITTER(endcol+begcol, vsplitter);
@@ -406,6 +456,22 @@ void wins_resize(void)
 }
 
 
+// The part of the screen the windows are laid out on
+void _wins_screen_extent(int* begrow, int* begcol, int* endrow, int* endcol)
+{
+  TRACE_ENTER;
+  if (__batch) {
+    *begrow = *begcol = 0;
+    *endrow = BATCH_SCREEN_ROWS;
+    *endcol = BATCH_SCREEN_COLS;
+    TRACE_EXIT;
+  }
+  getbegyx(stdscr, *begrow, *begcol);
+  getmaxyx(stdscr, *endrow, *endcol);
+  TRACE_EXIT;
+}
+
+
 WINPTR wins_get_cur(void)
 {
   TRACE_ENTER;
@@ -589,6 +655,8 @@ void wins_set_message(const char* message)
 void wins_repaint_all()
 {
   TRACE_ENTER;
+  if (__batch)
+    TRACE_EXIT;
   int i;
   // paint the current window last so the cursor is left in the right spot
   for (i = 0; i < MAX_WINDOWS; ++i) {
@@ -599,6 +667,60 @@ void wins_repaint_all()
   _wins_repaint_splitters();
   _win_repaint(_wins[_cur_win], _cur_win);
 
+  // Every window showing a buffer has caught up with its changes
+  for (i = 0; i < MAX_WINDOWS; ++i) {
+    if (_wins[i] == NULL)
+      continue;
+    buffer_clear_damage(_wins[i]->data_buf);
+    buffer_clear_damage(_wins[i]->cmd_buf);
+  }
+  TRACE_EXIT;
+}
+
+
+// Repaints the whole screen from scratch the given number of times
+// with nmarks block marks scattered over the current window's buffer,
+// and returns the frames per second.
+double wins_bench_repaint(int frames, int nmarks)
+{
+  TRACE_ENTER;
+  WINPTR pwin = _wins[_cur_win];
+  BUFFER buf = pwin->data_buf;
+  int data_ht = pwin->data_bot - pwin->data_top + 1;
+  int nrows = max(1, min(buffer_count(buf), data_ht));
+  int i;
+  for (i = 0; i < nmarks; i++) {
+    int l1 = (i*3) % nrows, c1 = (i*7) % 200;
+    markstack_push();
+    markstack_cur_start(Marktype_Block, buf, l1, c1);
+    markstack_cur_extend(Marktype_Block, buf, l1 + i%10, c1 + 5 + i%40);
+  }
+
+  struct timespec start, end;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  for (i = 0; i < frames; i++) {
+    wins_invalidate_all();
+    wins_repaint_all();
+    refresh();
+  }
+  clock_gettime(CLOCK_MONOTONIC, &end);
+
+  for (i = 0; i < nmarks; i++)
+    markstack_pop();
+  double secs = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+  TRACE_RETURN(secs > 0 ? frames / secs : 0);
+}
+
+
+// Forces the next repaint to redraw everything
+void wins_invalidate_all()
+{
+  TRACE_ENTER;
+  int i;
+  for (i = 0; i < MAX_WINDOWS; ++i) {
+    if (_wins[i] != NULL)
+      _wins[i]->painted.valid = false;
+  }
   TRACE_EXIT;
 }
 
@@ -661,6 +783,10 @@ void _win_init(WINPTR pwin, int slot, int t, int l, int b, int r)
   
   cstr_init(&pwin->msg_txt, 256);
   pwin->in_data = default_profile->oncommand == false;
+  pwin->painted.valid = false;
+  cstr_init(&pwin->painted.info, 0);
+  cstr_init(&pwin->painted.msg, 0);
+  vec_init(&pwin->rowmarks, 4, sizeof(struct markspan_t));
   TRACE_EXIT;
 }
 
@@ -689,6 +815,14 @@ void _win_destroy(WINPTR pwin)
   
   //logmsg("destroying msg string");
   cstr_destroy(&pwin->msg_txt);
+  cstr_destroy(&pwin->painted.info);
+  cstr_destroy(&pwin->painted.msg);
+  free(pwin->rowtxt);
+  free(pwin->rowspans);
+  pwin->rowtxt = NULL;
+  pwin->rowspans = NULL;
+  pwin->rowcap = 0;
+  vec_destroy(&pwin->rowmarks);
   TRACE_EXIT;
 }
 
@@ -700,9 +834,18 @@ void _win_move(WINPTR pwin, int t, int l, int b, int r)
   pwin->msgline = b; pwin->infoline = b-1; pwin->cmdline = b-2;
   pwin->data_bot = b-3; pwin->data_top = t;
   //logmsg("moving win, %d %d  %d %d, vsize = %d", t, l, b, r, pwin->data_bot - pwin->data_top);
-  view_set_hsize(pwin->data_view, r-l);
-  view_set_vsize(pwin->data_view, pwin->data_bot - pwin->data_top);
+  // no data view once the last buffer has been hidden
+  if (pwin->data_view != NULL) {
+    view_set_hsize(pwin->data_view, r-l);
+    view_set_vsize(pwin->data_view, pwin->data_bot - pwin->data_top);
+  }
   view_set_hsize(pwin->cmd_view, r-l);
+  if (r-l+1 > pwin->rowcap) {
+    pwin->rowcap = r-l+1;
+    pwin->rowtxt = realloc(pwin->rowtxt, pwin->rowcap);
+    pwin->rowspans = realloc(pwin->rowspans, pwin->rowcap * sizeof(struct rowspan_t));
+  }
+  pwin->painted.valid = false;
   TRACE_EXIT;
 }
 
@@ -998,7 +1141,7 @@ void _wins_repaint_splitters()
 void _win_repaint(WINPTR pwin, int slot)
 {
   TRACE_ENTER;
-  int i, j;
+  int i;
   //logmsg("painting window %d, (%d %d) (%d %d)", slot, pwin->t, pwin->l, pwin->b, pwin->r);
   int data_ht = pwin->data_bot - pwin->data_top + 1, view_wid = pwin->r - pwin->l + 1;
   int view_top, view_left, view_bot, view_right;
@@ -1021,143 +1164,117 @@ void _win_repaint(WINPTR pwin, int slot)
   /* logmsg("cmd cursor %d %d", cmd_cursor_line, cmd_cursor_col); */
   //logmsg("view_left = %d", view_left);
 
-  // draw data area
+  // Work out how much of the window is out of date.  Anything that
+  // moves the whole data area around forces a full repaint, otherwise
+  // only the lines the buffer says have changed are redrawn.
   BUFFER data_buf = pwin->data_buf;
   int nlines = buffer_count(data_buf);
-  //color_set(C_NORM_TXT, NULL);
-  //attron(A_NORM_TXT);
-  bkgdset(' ' | COLOR_PAIR(C_NORM_TXT) | A_NORM_TXT);
-  int disp_line = pwin->data_top;
-  int in_mark = 0;
-  MARK cur_mark = markstack_current();
-  BUFFER xbuf = 0L;
-  mark_get_buffer(cur_mark, &xbuf);
-  //logmsg("mark buffer = %ld, cur buffer = %ld", xbuf, data_buf);
-  for (i = 0; i < data_ht; i++) {
-    attroff(A_SYS_TXT);
-    const char* disptxt = NULL;
-    int displinelen;
-    if (view_top+i < -1) {
-      disptxt = "";
-      displinelen = 0;
-    }
-    else if (view_top+i == -1) {
-      disptxt = "==== Top of File ====";
-      displinelen = 21;
-      attron(A_SYS_TXT);
-    }
-    else if (view_top+i == nlines) {
-      disptxt = "==== Bottom of File ====";
-      displinelen = 24;
-      attron(A_SYS_TXT);
-    }
-    else if (view_top+i > nlines) {
-      disptxt = "";
-      displinelen = 0;
-    }
-    else {
-      const char* lpszLine = buffer_getbufptr(data_buf, view_top+i);
-      disptxt = lpszLine + min(strlen(lpszLine), view_left);
-      int linelen = buffer_line_length(data_buf, view_top+i) - view_left;
-      displinelen = min(linelen, view_wid);
-      displinelen = max(0, displinelen);
-      //logmsg("line %d, linelen = %d displinelen = %d", i, linelen, displinelen);
-    }
-
-    // Draw the line.
-    move(disp_line, pwin->l);
-    // Have to loop over the entire window width to make sure the hilighting displays correctly.
-    bool in_txt = true;
-    int line_has_mark = markstack_hittest_line(data_buf, view_top+i, FILTER_MARK_FLAGS_MASK, FILTER_MARK_FLAGS_CHK) != MARK_NULL;
-    //logmsg("line %d has mark %ld", i, line_mark);
-    for (j = 0; j < view_wid; j++) {
-      if (j >= displinelen)
-        in_txt = false;
-      int new_in_mark = line_has_mark && markstack_hittest_point(data_buf, view_top+i, view_left+j, FILTER_MARK_FLAGS_MASK, FILTER_MARK_FLAGS_CHK) != MARK_NULL;
-      if (!in_mark && new_in_mark) {
-        bkgdset(' ' | COLOR_PAIR(C_MARK_TXT) | A_MARK_TXT);
-      }
-      else if (in_mark && !new_in_mark) {
-        bkgdset(' ' | COLOR_PAIR(C_NORM_TXT) | A_NORM_TXT);
-      }
-      in_mark = new_in_mark;
-      char dispch;
-      bool in_ctrl = false;
-      if (in_txt) {
-        dispch = disptxt[j];
-        if (dispch == '\0' || iscntrl(dispch)) {
-          dispch = '@' + dispch;
-          bkgdset(' ' | COLOR_PAIR(C_CTRL_TXT) | A_CTRL_TXT);
-          in_ctrl = true;
-        }
-      }
-      else {
-        dispch = ' ';
-      }
+  struct winpaint_t* painted = &pwin->painted;
+  unsigned int marks_gen = marks_generation();
+  bool full = !painted->valid
+    || painted->data_buf != data_buf
+    || painted->t != pwin->t || painted->l != pwin->l
+    || painted->b != pwin->b || painted->r != pwin->r
+    || painted->view_top != view_top || painted->view_left != view_left
+    || painted->in_data != pwin->in_data
+    || painted->marks_gen != marks_gen;
+
+  int dmg_first, dmg_last;
+  if (!buffer_get_damage(data_buf, &dmg_first, &dmg_last)) {
+    dmg_first = INT_MAX;
+    dmg_last = -1;
+  }
 
-      // Figure out if we're at the cursor position...
-      bool in_curs = false;
-      if (!pwin->in_data
-          && i == pwin->t + cursor_line - view_top
-          && j == pwin->l + cursor_col - view_left) {
-        bkgdset(' ' | COLOR_PAIR(C_CURS_TXT) | A_CURS_TXT);
-        in_curs = 1;
-      }
+  // in command mode the data cursor is drawn as a highlighted cell
+  int curs_row = -1, curs_col = -1;
+  if (!pwin->in_data) {
+    curs_row = pwin->t + cursor_line - view_top;
+    curs_col = pwin->l + cursor_col - view_left;
+  }
+  bool curs_moved = painted->curs_row != curs_row || painted->curs_col != curs_col;
 
-      // paint the character
-      addch(dispch);
-
-      // Reset the background to either the normal color or the mark colors
-      if (in_ctrl || in_curs) {
-        if (in_mark) {
-          bkgdset(' ' | COLOR_PAIR(C_MARK_TXT) | A_MARK_TXT);
-        }
-        else {
-          bkgdset(' ' | COLOR_PAIR(C_NORM_TXT) | A_NORM_TXT);
-        }
-      }
-    }
-    //_win_clr_eol(pwin, ' ');
-    ++disp_line;
+  // draw data area
+  for (i = 0; i < data_ht; i++) {
+    int line = view_top + i;
+    bool dirty = full
+      || (line >= dmg_first && line <= dmg_last)
+      || (curs_moved && (i == painted->curs_row || i == curs_row));
+    if (dirty)
+      _win_repaint_data_line(pwin, i, data_buf, nlines, view_top, view_left,
+                             i == curs_row ? curs_col : -1);
   }
   attroff(A_NORM_TXT);
-  
+
   // draw cmdline
-  bkgdset(' ' | COLOR_PAIR(C_CMDLINE) | A_CMDLINE);
-  const char* lpszCmdLine = buffer_getbufptr(pwin->cmd_buf, 0);
-  int cmdlinelen = strlen(lpszCmdLine);
-  int left_cmd_charidx = min(cmdlinelen, cmd_left);
-  int n_cmd_chars = cmdlinelen - left_cmd_charidx;
-  mvaddnstr(pwin->cmdline, pwin->l, lpszCmdLine + left_cmd_charidx, n_cmd_chars);
-  _win_clr_eol(pwin, pwin->cmdline, pwin->l+n_cmd_chars, ' ');
-  attroff(A_CMDLINE);
-  
+  int cmd_first, cmd_last;
+  if (full || painted->cmd_left != cmd_left
+      || buffer_get_damage(pwin->cmd_buf, &cmd_first, &cmd_last)) {
+    bkgdset(' ' | COLOR_PAIR(C_CMDLINE) | A_CMDLINE);
+    const char* lpszCmdLine = buffer_getbufptr(pwin->cmd_buf, 0);
+    int cmdlinelen = strlen(lpszCmdLine);
+    int left_cmd_charidx = min(cmdlinelen, cmd_left);
+    int n_cmd_chars = cmdlinelen - left_cmd_charidx;
+    mvaddnstr(pwin->cmdline, pwin->l, lpszCmdLine + left_cmd_charidx, n_cmd_chars);
+    _win_clr_eol(pwin, pwin->cmdline, pwin->l+n_cmd_chars, ' ');
+    attroff(A_CMDLINE);
+  }
+
   // draw info line
   //logmsg("drawing info line win %d  row %d col %d", slot, pwin->infoline, pwin->l);
   int insert_mode = view_get_insertmode(active_view);
-  bkgdset(' ' | COLOR_PAIR(C_INFOLINE) | A_INFOLINE);
-  _win_clr_eol(pwin, pwin->infoline, pwin->l, ' ');
-  if (buffer_tstflags(data_buf, BUF_FLG_DIRTY))
-    bkgdset(' ' | COLOR_PAIR(C_INFOLINE_MOD) | A_INFOLINE);
+  bool buf_dirty = buffer_tstflags(data_buf, BUF_FLG_DIRTY);
   const char* bufname = buffer_name(data_buf);
   const char* dirname = buffer_curr_dirname(data_buf);
-  int namecol = 0;
-  if (bufname != NULL && strlen(bufname) > 0) {
-	namecol = strlen(bufname);
-    mvaddnstr(pwin->infoline, pwin->l, bufname, view_wid);
-  }
-  mvaddnstr(pwin->infoline, namecol+1, dirname, view_wid);
-  if (buffer_tstflags(data_buf, BUF_FLG_DIRTY))
-    bkgdset(' ' | COLOR_PAIR(C_INFOLINE) | A_INFOLINE);
   char linenum_info[256];
-  snprintf(linenum_info, sizeof(linenum_info), " %d %d %s ", cursor_line+1, cursor_col+1, insert_mode ? "Insert":"Replace");
-  mvaddstr(pwin->infoline, pwin->l+view_wid-strlen(linenum_info), linenum_info);
-  
-  // draw msg line 
-  bkgdset(' ' | COLOR_PAIR(C_MSGLINE) | A_MSGLINE);
-  _win_clr_eol(pwin, pwin->msgline, pwin->l, ' ');
-  mvaddstr(pwin->msgline, pwin->l, cstr_getbufptr(&pwin->msg_txt));
-  
+  int load_pct = buffer_load_progress(data_buf);
+  if (load_pct >= 0)
+    snprintf(linenum_info, sizeof(linenum_info), " Loading %d%% %d %d %s ", load_pct,
+             cursor_line+1, cursor_col+1, insert_mode ? "Insert":"Replace");
+  else
+    snprintf(linenum_info, sizeof(linenum_info), " %d %d %s ", cursor_line+1, cursor_col+1, insert_mode ? "Insert":"Replace");
+  char info_key[1024];
+  snprintf(info_key, sizeof(info_key), "%d|%s|%s|%s", buf_dirty,
+           bufname == NULL ? "" : bufname, dirname, linenum_info);
+  if (full || cstr_comparestr(&painted->info, info_key) != 0) {
+    bkgdset(' ' | COLOR_PAIR(C_INFOLINE) | A_INFOLINE);
+    _win_clr_eol(pwin, pwin->infoline, pwin->l, ' ');
+    if (buf_dirty)
+      bkgdset(' ' | COLOR_PAIR(C_INFOLINE_MOD) | A_INFOLINE);
+    int namecol = 0;
+    if (bufname != NULL && strlen(bufname) > 0) {
+      namecol = strlen(bufname);
+      mvaddnstr(pwin->infoline, pwin->l, bufname, view_wid);
+    }
+    mvaddnstr(pwin->infoline, namecol+1, dirname, view_wid);
+    if (buf_dirty)
+      bkgdset(' ' | COLOR_PAIR(C_INFOLINE) | A_INFOLINE);
+    mvaddstr(pwin->infoline, pwin->l+view_wid-strlen(linenum_info), linenum_info);
+    cstr_assignstr(&painted->info, info_key);
+  }
+
+  // draw msg line
+  if (full || cstr_compare(&painted->msg, &pwin->msg_txt) != 0) {
+    bkgdset(' ' | COLOR_PAIR(C_MSGLINE) | A_MSGLINE);
+    _win_clr_eol(pwin, pwin->msgline, pwin->l, ' ');
+    mvaddstr(pwin->msgline, pwin->l, cstr_getbufptr(&pwin->msg_txt));
+    cstr_assign(&painted->msg, &pwin->msg_txt);
+  }
+
+  // remember what's on the screen now
+  painted->valid = true;
+  painted->data_buf = data_buf;
+  painted->t = pwin->t;
+  painted->l = pwin->l;
+  painted->b = pwin->b;
+  painted->r = pwin->r;
+  painted->view_top = view_top;
+  painted->view_left = view_left;
+  painted->curs_row = curs_row;
+  painted->curs_col = curs_col;
+  painted->in_data = pwin->in_data;
+  painted->marks_gen = marks_gen;
+  painted->cmd_left = cmd_left;
+
   // draw cursor
   if (slot == _cur_win) {
     curs_set(insert_mode ? 1 : 2); // 0 = invisible, 1 = visible, 2 = more visible
@@ -1174,3 +1291,147 @@ void _win_repaint(WINPTR pwin, int slot)
 }
 
 
+#define _IS_CTRL_CELL(ch) ((ch) == '\0' || iscntrl(ch))
+
+
+int __markspan_cmp(const void* a, const void* b)
+{
+  const struct markspan_t* sa = a;
+  const struct markspan_t* sb = b;
+  return (sa->c1 > sb->c1) - (sa->c1 < sb->c1);
+}
+
+
+// Paints data row i of the window.  The marked columns are fetched
+// for the whole line at once and merged, the row is split into runs
+// of normal, marked, control and cursor cells in one pass, and then
+// each run is drawn with a single call.
+void _win_repaint_data_line(WINPTR pwin, int i, BUFFER data_buf, int nlines,
+                            int view_top, int view_left, int curs_col)
+{
+  TRACE_ENTER;
+  static const chtype cell_attrs[] = {
+    COLOR_PAIR(C_NORM_TXT) | A_NORM_TXT,
+    COLOR_PAIR(C_MARK_TXT) | A_MARK_TXT,
+    COLOR_PAIR(C_CTRL_TXT) | A_CTRL_TXT,
+    COLOR_PAIR(C_CURS_TXT) | A_CURS_TXT,
+  };
+  int j, k;
+  int view_wid = pwin->r - pwin->l + 1;
+  int line = view_top + i;
+  char* txt = pwin->rowtxt;
+
+  attroff(A_SYS_TXT);
+  const char* disptxt = NULL;
+  int displinelen;
+  bool is_txt = false;
+  if (line < -1 || line > nlines) {
+    disptxt = "";
+    displinelen = 0;
+  }
+  else if (line == -1) {
+    disptxt = "==== Top of File ====";
+    displinelen = 21;
+    attron(A_SYS_TXT);
+  }
+  else if (line == nlines) {
+    disptxt = "==== Bottom of File ====";
+    displinelen = 24;
+    attron(A_SYS_TXT);
+  }
+  else {
+    int linelen;
+    const char* pachLine = buffer_getlineptr(data_buf, line, &linelen);
+    disptxt = pachLine + min(linelen, view_left);
+    displinelen = min(linelen - view_left, view_wid);
+    displinelen = max(0, displinelen);
+    is_txt = true;
+  }
+  displinelen = min(displinelen, view_wid);
+
+  // the characters to show
+  for (j = 0; j < displinelen; j++) {
+    char dispch = disptxt[j];
+    txt[j] = _IS_CTRL_CELL(dispch) ? '@' + dispch : dispch;
+  }
+  if (j < view_wid)
+    memset(txt + j, ' ', view_wid - j);
+
+  // the marked columns, clipped to the view, sorted and merged
+  struct vec_t* marked = &pwin->rowmarks;
+  vec_clear(marked);
+  int nmarked = 0;
+  if (is_txt && markstack_line_spans(data_buf, line, FILTER_MARK_FLAGS_MASK, FILTER_MARK_FLAGS_CHK, marked) > 0) {
+    struct markspan_t* spans = vec_getbufptr(marked);
+    int n = vec_count(marked);
+    if (n > 1)
+      qsort(spans, n, sizeof(struct markspan_t), __markspan_cmp);
+    for (k = 0; k < n; k++) {
+      int c1 = max(spans[k].c1, view_left) - view_left;
+      int c2 = spans[k].c2 == INT_MAX ? view_wid-1 : min(spans[k].c2 - view_left, view_wid-1);
+      if (c1 > c2)
+        continue;
+      if (nmarked > 0 && c1 <= spans[nmarked-1].c2 + 1)
+        spans[nmarked-1].c2 = max(spans[nmarked-1].c2, c2);
+      else {
+        spans[nmarked].c1 = c1;
+        spans[nmarked].c2 = c2;
+        nmarked++;
+      }
+    }
+  }
+  const struct markspan_t* spans = vec_getbufptr(marked);
+
+  // split the row into runs
+  struct rowspan_t* runs = pwin->rowspans;
+  int nruns = 0, m = 0;
+  j = 0;
+  while (j < view_wid) {
+    while (m < nmarked && spans[m].c2 < j)
+      ++m;
+    bool in_mark = m < nmarked && spans[m].c1 <= j;
+    int end = in_mark ? spans[m].c2 + 1 : (m < nmarked ? spans[m].c1 : view_wid);
+    enum cellcls_t cls = in_mark ? Cell_Mark : Cell_Norm;
+    if (j == curs_col) {
+      cls = Cell_Curs;
+      k = j + 1;
+    }
+    else {
+      if (curs_col > j && curs_col < end)
+        end = curs_col;
+      k = j + 1;
+      if (j < displinelen) {
+        bool ctrl = _IS_CTRL_CELL(disptxt[j]);
+        if (ctrl)
+          cls = Cell_Ctrl;
+        while (k < end && k < displinelen && _IS_CTRL_CELL(disptxt[k]) == ctrl)
+          ++k;
+        if (k == displinelen && !ctrl)
+          k = end;
+      }
+      else {
+        k = end;
+      }
+    }
+    if (nruns > 0 && runs[nruns-1].cls == cls)
+      runs[nruns-1].n += k - j;
+    else {
+      runs[nruns].col = j;
+      runs[nruns].n = k - j;
+      runs[nruns].cls = cls;
+      nruns++;
+    }
+    j = k;
+  }
+
+  // and paint them
+  move(pwin->data_top + i, pwin->l);
+  for (k = 0; k < nruns; k++) {
+    bkgdset(' ' | cell_attrs[runs[k].cls]);
+    addnstr(txt + runs[k].col, runs[k].n);
+  }
+  bkgdset(' ' | cell_attrs[Cell_Norm]);
+  TRACE_EXIT;
+}
+
+
@@ -36,9 +36,11 @@ typedef struct cmd_ctx_t* cmd_ctx_ptr;
 bool update_context(cmd_ctx_ptr ctx);
 
 void wins_repaint_all(void);
+void wins_invalidate_all(void);
+double wins_bench_repaint(int frames, int nmarks);
 void wins_set_message(const char* message);
 
-const char* ui_get_key();
+int ui_get_key(void);
 
 
 
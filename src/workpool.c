@@ -0,0 +1,139 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "trace.h"
+#include "logging.h"
+#include "utils.h"
+#include "workpool.h"
+
+
+#define WORKPOOL_MAX (64)
+#define WORKPOOL_POLL_MSEC (50)
+
+static pthread_mutex_t _pool_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t _pool_work = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t _pool_done = PTHREAD_COND_INITIALIZER;
+static int _pool_size = 0;
+static int _pool_want = 0;            // threads to start, 0 == one per cpu
+static unsigned int _pool_gen = 0;    // bumped for each job
+static unsigned int _pool_start_gen = 0;  // _pool_gen when the threads started
+static int _pool_busy = 0;            // workers still on the current job
+static workpool_job _pool_job = NULL;
+static void* _pool_arg = NULL;
+
+
+void* _workpool_main(void* p);
+void _workpool_start(void);
+
+
+// Sets how many threads the pool will start, 0 for one per cpu.
+// Only has an effect before the pool is first used.
+void init_workpool(int nthreads)
+{
+  TRACE_ENTER;
+  pthread_mutex_lock(&_pool_lock);
+  _pool_want = max(0, min(nthreads, WORKPOOL_MAX));
+  pthread_mutex_unlock(&_pool_lock);
+  TRACE_EXIT;
+}
+
+
+int workpool_size()
+{
+  TRACE_ENTER;
+  pthread_mutex_lock(&_pool_lock);
+  _workpool_start();
+  int rval = _pool_size;
+  pthread_mutex_unlock(&_pool_lock);
+  TRACE_RETURN(rval);
+}
+
+
+void workpool_run(workpool_job job, void* arg, workpool_poll poll, void* pollarg)
+{
+  TRACE_ENTER;
+  pthread_mutex_lock(&_pool_lock);
+  _workpool_start();
+  if (_pool_size == 0) {
+    // couldn't start any threads, so do it ourselves
+    pthread_mutex_unlock(&_pool_lock);
+    job(arg, 0);
+    TRACE_EXIT;
+  }
+  _pool_job = job;
+  _pool_arg = arg;
+  _pool_busy = _pool_size;
+  _pool_gen++;
+  pthread_cond_broadcast(&_pool_work);
+  while (_pool_busy > 0) {
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    ts.tv_nsec += WORKPOOL_POLL_MSEC * 1000000L;
+    if (ts.tv_nsec >= 1000000000L) {
+      ts.tv_sec++;
+      ts.tv_nsec -= 1000000000L;
+    }
+    pthread_cond_timedwait(&_pool_done, &_pool_lock, &ts);
+    if (_pool_busy > 0 && poll != NULL) {
+      pthread_mutex_unlock(&_pool_lock);
+      poll(pollarg);
+      pthread_mutex_lock(&_pool_lock);
+    }
+  }
+  _pool_job = NULL;
+  _pool_arg = NULL;
+  pthread_mutex_unlock(&_pool_lock);
+  TRACE_EXIT;
+}
+
+
+// Called with the lock held
+void _workpool_start()
+{
+  TRACE_ENTER;
+  if (_pool_size > 0)
+    TRACE_EXIT;
+  int want = _pool_want;
+  if (want == 0) {
+    long ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+    want = (int)max(1, min(ncpus, WORKPOOL_MAX));
+  }
+  _pool_start_gen = _pool_gen;
+  while (_pool_size < want) {
+    pthread_t th;
+    if (pthread_create(&th, NULL, _workpool_main, (void*)(intptr_t)_pool_size) != 0) {
+      logerr("workpool: only started %d of %d threads", _pool_size, want);
+      break;
+    }
+    pthread_detach(th);
+    _pool_size++;
+  }
+  TRACE_EXIT;
+}
+
+
+void* _workpool_main(void* p)
+{
+  int worker = (int)(intptr_t)p;
+  unsigned int seen;
+  pthread_mutex_lock(&_pool_lock);
+  seen = _pool_start_gen;
+  for (;;) {
+    while (_pool_gen == seen)
+      pthread_cond_wait(&_pool_work, &_pool_lock);
+    seen = _pool_gen;
+    workpool_job job = _pool_job;
+    void* arg = _pool_arg;
+    pthread_mutex_unlock(&_pool_lock);
+    job(arg, worker);
+    pthread_mutex_lock(&_pool_lock);
+    if (--_pool_busy == 0)
+      pthread_cond_signal(&_pool_done);
+  }
+  return NULL;
+}
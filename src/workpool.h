@@ -0,0 +1,14 @@
+
+//
+// A pool of worker threads, started on first use and kept for the
+// life of the editor.  workpool_run hands the same job to every
+// worker, which splits the work up among themselves, and waits for
+// them all to finish.  While it waits it calls poll every so often
+// from the calling thread, so the UI can ask the job to stop.
+//
+typedef void (*workpool_job)(void* arg, int worker);
+typedef void (*workpool_poll)(void* arg);
+
+void init_workpool(int nthreads);
+int workpool_size(void);
+void workpool_run(workpool_job job, void* arg, workpool_poll poll, void* pollarg);
@@ -27,13 +27,17 @@
 #include "key_interp.h"
 #include "buffer.h"
 #include "editor_globals.h"
+#include "workpool.h"
 
 #include "test_vec.h"
+#include "test_arena.h"
+#include "test_events.h"
 #include "test_cstr.h"
 #include "test_tabstops.h"
 #include "test_mark.h"
 #include "test_markstack.h"
 #include "test_buffer.h"
+#include "test_rx.h"
 
 
 void test_test_1();
@@ -52,6 +56,8 @@ int main(int argc, char** argv)
   init_marks();
   init_markstack();
   init_buffer();
+  // enough workers to exercise the parallel paths on any machine
+  init_workpool(4);
   default_profile = alloc_profile("testing");
   
   /* tabs_init(&default_tabstops, 0, 8, NULL); */
@@ -141,6 +147,12 @@ int main(int argc, char** argv)
       runtest(test_vec_7);
       runtest(test_vec_8);
       runtest(test_vec_9);
+      runtest(test_vec_10);
+
+      runtest(test_arena_1);
+      runtest(test_arena_2);
+
+      runtest(test_events_1);
 
 
       runtest(test_tabstops_1);
@@ -189,6 +201,11 @@ int main(int argc, char** argv)
       runtest(test_mark_37);
       runtest(test_mark_38);
       runtest(test_mark_39);
+      runtest(test_mark_40);
+      runtest(test_mark_41);
+      runtest(test_mark_42);
+      runtest(test_mark_43);
+      runtest(test_mark_44);
 
 
 
@@ -220,6 +237,30 @@ int main(int argc, char** argv)
       runtest(test_buffer_19);
       runtest(test_buffer_20);
       runtest(test_buffer_21);
+      runtest(test_buffer_22);
+      runtest(test_buffer_23);
+      runtest(test_buffer_24);
+      runtest(test_buffer_25);
+      runtest(test_buffer_26);
+      runtest(test_buffer_27);
+      runtest(test_buffer_28);
+      runtest(test_buffer_29);
+      runtest(test_buffer_30);
+      runtest(test_buffer_31);
+      runtest(test_buffer_32);
+      runtest(test_buffer_33);
+      runtest(test_buffer_34);
+      runtest(test_buffer_35);
+      runtest(test_buffer_36);
+      runtest(test_buffer_37);
+      runtest(test_buffer_38);
+      runtest(test_buffer_39);
+      runtest(test_buffer_40);
+
+      runtest(test_rx_1);
+      runtest(test_rx_2);
+      runtest(test_rx_3);
+      runtest(test_rx_4);
     }
   }
 
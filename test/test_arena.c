@@ -0,0 +1,57 @@
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "trace.h"
+#include "arena.h"
+#include "testing.h"
+#include "logging.h"
+
+
+//
+// arena tests
+//
+void test_arena_1()
+{
+  TRACE_ENTER;
+  arena a;
+  arena_init(&a, 64);
+  char* s1 = arena_strsave(&a, "locate");
+  char* s2 = arena_strsave(&a, "abc");
+  if (strcmp(s1, "locate") != 0 || strcmp(s2, "abc") != 0)
+	failtest("strings are '%s' '%s'", s1, s2);
+  if (((intptr_t)s1 | (intptr_t)s2) & (sizeof(intptr_t)-1))
+	failtest("strings aren't aligned");
+  // both should come out of the same block
+  if (s2 <= s1 || s2 - s1 >= 64)
+	failtest("strings are %d apart", (int)(s2 - s1));
+  arena_destroy(&a);
+  if (a.blks != NULL)
+	failtest("blocks left after destroy");
+  TRACE_EXIT;
+}
+
+
+void test_arena_2()
+{
+  TRACE_ENTER;
+  arena* a = arena_alloc(32);
+  char* small = arena_strsave(a, "x");
+  char big[100];
+  memset(big, 'b', sizeof(big)-1);
+  big[sizeof(big)-1] = '\0';
+  char* pbig = arena_strsave(a, big);
+  // the rest of the first block is still used after an oversized one
+  char* small2 = arena_strsave(a, "y");
+  if (strcmp(pbig, big) != 0)
+	failtest("big string mangled");
+  if (small2 - small != sizeof(intptr_t))
+	failtest("small strings are %d apart", (int)(small2 - small));
+  int i;
+  for (i = 0; i < 1000; i++)
+	arena_get(a, 24);
+  if (strcmp(small, "x") != 0 || strcmp(small2, "y") != 0)
+	failtest("small strings mangled");
+  arena_free(a);
+  TRACE_EXIT;
+}
@@ -0,0 +1,2 @@
+void test_arena_1(void);
+void test_arena_2(void);
@@ -11,6 +11,9 @@
 #include <libgen.h>
 #endif
 #include <unistd.h>
+#include <limits.h>
+#include <dirent.h>
+#include <sys/stat.h>
 
 
 #include "trace.h"
@@ -24,6 +27,8 @@
 #include "margins.h"
 #include "key_interp.h"
 #include "buffer.h"
+#include "srchpat.h"
+#include "journal.h"
 #include "editor_globals.h"
 
 #include "testing.h"
@@ -58,7 +63,7 @@ void test_buffer_2()
   struct line_t l;
   BUFFER v = buffer_alloc("", BUF_FLG_INTERNAL, 0, default_profile);
 
-  cstr_initstr(&l.txt, "This is a test");
+  line_initstr(&l, "This is a test");
   l.flags = 0;
 
   buffer_appendline(v, &l);
@@ -68,7 +73,7 @@ void test_buffer_2()
   if (buffer_count(v) != 1)
     failtest("count %d != 1", buffer_count(v));
 
-  cstr_destroy(&l.txt);
+  line_destroy(&l);
   buffer_free(v);
 
   if (marks_count() > 1)
@@ -86,11 +91,11 @@ void test_buffer_3()
   struct line_t l;
   BUFFER v = buffer_alloc("", BUF_FLG_INTERNAL, 0, default_profile);
 
-  cstr_initstr(&l.txt, "This is a test");
+  line_initstr(&l, "This is a test");
   l.flags = 0;
   buffer_appendline(v, &l);
 
-  cstr_assignstr(&l.txt, "This is also a test");
+  line_assignstr(&l, "This is also a test");
   buffer_appendline(v, &l);
 
   if (buffer_capacity(v) != 2)
@@ -98,7 +103,7 @@ void test_buffer_3()
   if (buffer_count(v) != 2)
     failtest("count %d != 2", buffer_count(v));
 
-  cstr_destroy(&l.txt);
+  line_destroy(&l);
   buffer_free(v);
 
   if (marks_count() > 1)
@@ -116,14 +121,14 @@ void test_buffer_4()
   struct line_t l;
   BUFFER v = buffer_alloc("", BUF_FLG_INTERNAL, 0, default_profile);
 
-  cstr_initstr(&l.txt, "This is a test");
+  line_initstr(&l, "This is a test");
   l.flags = 0;
   buffer_appendline(v, &l);
 
-  cstr_assignstr(&l.txt, "This is also a test");
+  line_assignstr(&l, "This is also a test");
   buffer_appendline(v, &l);
 
-  cstr_assignstr(&l.txt, "As is this");
+  line_assignstr(&l, "As is this");
   buffer_appendline(v, &l);
 
   if (buffer_capacity(v) != 4)
@@ -131,7 +136,7 @@ void test_buffer_4()
   if (buffer_count(v) != 3)
     failtest("count %d != 3", buffer_count(v));
 
-  cstr_destroy(&l.txt);
+  line_destroy(&l);
   buffer_free(v);
 
   if (marks_count() > 1)
@@ -147,30 +152,26 @@ void test_buffer_5()
 {
   TRACE_ENTER;
   struct line_t l;
-  struct line_t* pl;
   BUFFER v = buffer_alloc("", BUF_FLG_INTERNAL, 0, default_profile);
 
-  cstr_initstr(&l.txt, "This is a test");
+  line_initstr(&l, "This is a test");
   l.flags = 0;
   buffer_appendline(v, &l);
 
-  cstr_assignstr(&l.txt, "This is also a test");
+  line_assignstr(&l, "This is also a test");
   buffer_appendline(v, &l);
 
-  cstr_assignstr(&l.txt, "As is this");
+  line_assignstr(&l, "As is this");
   buffer_appendline(v, &l);
 
-  pl = buffer_get(v, 0);
-  if (cstr_comparestr(&pl->txt, "This is a test") != 0)
+  if (strcmp(buffer_getbufptr(v, 0), "This is a test") != 0)
     failtest("line 0 != 'This is a test'\n");
-  pl = buffer_get(v, 1);
-  if (cstr_comparestr(&pl->txt, "This is also a test") != 0)
+  if (strcmp(buffer_getbufptr(v, 1), "This is also a test") != 0)
     failtest("line 0 != 'This is also a test'\n");
-  pl = buffer_get(v, 2);
-  if (cstr_comparestr(&pl->txt, "As is this") != 0)
+  if (strcmp(buffer_getbufptr(v, 2), "As is this") != 0)
     failtest("line 0 != 'As is this'\n");
 
-  cstr_destroy(&l.txt);
+  line_destroy(&l);
   buffer_free(v);
 
   if (marks_count() > 1)
@@ -186,29 +187,27 @@ void test_buffer_6()
 {
   TRACE_ENTER;
   struct line_t l;
-  struct line_t* pl;
   struct cstr_t s;
   BUFFER v = buffer_alloc("", BUF_FLG_INTERNAL, 0, default_profile);
 
   cstr_initstr(&s, "This is a test");
-  cstr_initstr(&l.txt, "This is a test");
+  line_initstr(&l, "This is a test");
 
   l.flags = 0;
   buffer_appendline(v, &l);
 
-  cstr_assignstr(&l.txt, "This is also a test");
+  line_assignstr(&l, "This is also a test");
   buffer_appendline(v, &l);
 
-  cstr_assignstr(&l.txt, "As is this");
+  line_assignstr(&l, "As is this");
   buffer_appendline(v, &l);
 
   buffer_setcstr(v, 1, &s);
   
-  pl = buffer_get(v, 1);
-  if (cstr_comparestr(&pl->txt, "This is a test") != 0)
+  if (strcmp(buffer_getbufptr(v, 1), "This is a test") != 0)
     failtest("line 1 != 'This is a test'\n");
 
-  cstr_destroy(&l.txt);
+  line_destroy(&l);
   cstr_destroy(&s);
   buffer_free(v);
 
@@ -228,17 +227,17 @@ void test_buffer_7()
   //  struct line_t* pl;
   BUFFER v = buffer_alloc("", BUF_FLG_INTERNAL, 0, default_profile);
 
-  cstr_initstr(&l.txt, "This is a test");
+  line_initstr(&l, "This is a test");
   l.flags = 0;
   buffer_appendline(v, &l);
 
-  cstr_assignstr(&l.txt, "This is also a test");
+  line_assignstr(&l, "This is also a test");
   buffer_appendline(v, &l);
 
-  cstr_assignstr(&l.txt, "As is this");
+  line_assignstr(&l, "As is this");
   buffer_appendline(v, &l);
 
-  cstr_assignstr(&l.txt, "And this too");
+  line_assignstr(&l, "And this too");
   buffer_appendline(v, &l);
 
   if (buffer_count(v) != 4)
@@ -248,7 +247,7 @@ void test_buffer_7()
   if (buffer_count(v) != 2)  // this was commented out for some reason
     failtest("count %d != 2", buffer_count(v)); //...
 
-  cstr_destroy(&l.txt);
+  line_destroy(&l);
   buffer_free(v);
 
   if (marks_count() > 1)
@@ -267,11 +266,11 @@ void test_buffer_8()
   //struct line_t* pl;
   BUFFER v = buffer_alloc("", BUF_FLG_INTERNAL, 0, default_profile);
 
-  cstr_initstr(&l.txt, "This is a test");
+  line_initstr(&l, "This is a test");
   l.flags = 0;
   buffer_appendline(v, &l);
 
-  cstr_assignstr(&l.txt, "This is also a test");
+  line_assignstr(&l, "This is also a test");
   buffer_appendline(v, &l);
 
   buffer_insert(v, 1, 0, '*', false);
@@ -279,7 +278,7 @@ void test_buffer_8()
     failtest("didn't insert '*'");
   }
 
-  cstr_destroy(&l.txt);
+  line_destroy(&l);
   buffer_free(v);
 
   if (marks_count() > 1)
@@ -298,18 +297,18 @@ void test_buffer_9()
   //struct line_t* pl;
   BUFFER v = buffer_alloc("", BUF_FLG_INTERNAL, 0, default_profile);
 
-  cstr_initstr(&l.txt, "This is a test");
+  line_initstr(&l, "This is a test");
   l.flags = 0;
   buffer_appendline(v, &l);
 
-  cstr_assignstr(&l.txt, "This is also a test");
+  line_assignstr(&l, "This is also a test");
   buffer_appendline(v, &l);
 
   buffer_insertstrn(v, 1, 0, "*!@", 4, false);
   if (strcmp(buffer_getbufptr(v, 1), "*!@This is also a test") != 0)
     failtest("didn't insert '*!@', -> '%s'", buffer_getbufptr(v, 1));
 
-  cstr_destroy(&l.txt);
+  line_destroy(&l);
   buffer_free(v);
 
   if (marks_count() > 1)
@@ -328,18 +327,18 @@ void test_buffer_10()
   //struct line_t* pl;
   BUFFER v = buffer_alloc("", BUF_FLG_INTERNAL, 0, default_profile);
 
-  cstr_initstr(&l.txt, "This is a test");
+  line_initstr(&l, "This is a test");
   l.flags = 0;
   buffer_appendline(v, &l);
 
-  cstr_assignstr(&l.txt, "This is also a test");
+  line_assignstr(&l, "This is also a test");
   buffer_appendline(v, &l);
 
   buffer_setchar(v, 1, 0, '*');
   if (strcmp(buffer_getbufptr(v, 1), "*his is also a test") != 0)
     failtest("didn't set '*'");
 
-  cstr_destroy(&l.txt);
+  line_destroy(&l);
   buffer_free(v);
 
   if (marks_count() > 1)
@@ -358,11 +357,11 @@ void test_buffer_11()
   //struct line_t* pl;
   BUFFER v = buffer_alloc("", BUF_FLG_INTERNAL, 0, default_profile);
 
-  cstr_initstr(&l.txt, "This is a test");
+  line_initstr(&l, "This is a test");
   l.flags = 0;
   buffer_appendline(v, &l);
 
-  cstr_assignstr(&l.txt, "This is also a test");
+  line_assignstr(&l, "This is also a test");
   buffer_appendline(v, &l);
 
   // setstrn should stop at the null, even though we said to use it
@@ -370,7 +369,7 @@ void test_buffer_11()
   if (strcmp(buffer_getbufptr(v, 1), "*!@s is also a test") != 0)
     failtest("didn't set '*!@', -> '%s'", buffer_getbufptr(v, 1));
 
-  cstr_destroy(&l.txt);
+  line_destroy(&l);
   buffer_free(v);
 
   if (marks_count() > 1)
@@ -389,18 +388,18 @@ void test_buffer_12()
   //struct line_t* pl;
   BUFFER v = buffer_alloc("", BUF_FLG_INTERNAL, 0, default_profile);
 
-  cstr_initstr(&l.txt, "This is a test");
+  line_initstr(&l, "This is a test");
   l.flags = 0;
   buffer_appendline(v, &l);
 
-  cstr_assignstr(&l.txt, "This is also a test");
+  line_assignstr(&l, "This is also a test");
   buffer_appendline(v, &l);
 
   buffer_removechar(v, 1, 0, false);
   if (strcmp(buffer_getbufptr(v, 1), "his is also a test") != 0)
     failtest("didn't remove char");
 
-  cstr_destroy(&l.txt);
+  line_destroy(&l);
   buffer_free(v);
 
   if (marks_count() > 1)
@@ -419,18 +418,18 @@ void test_buffer_13()
   //struct line_t* pl;
   BUFFER v = buffer_alloc("", BUF_FLG_INTERNAL, 0, default_profile);
 
-  cstr_initstr(&l.txt, "This is a test");
+  line_initstr(&l, "This is a test");
   l.flags = 0;
   buffer_appendline(v, &l);
 
-  cstr_assignstr(&l.txt, "This is also a test");
+  line_assignstr(&l, "This is also a test");
   buffer_appendline(v, &l);
 
   buffer_removechars(v, 1, 0, 3, false);
   if (strcmp(buffer_getbufptr(v, 1), "s is also a test") != 0)
     failtest("didn't remove chars");
 
-  cstr_destroy(&l.txt);
+  line_destroy(&l);
   buffer_free(v);
 
   if (marks_count() > 1)
@@ -449,18 +448,18 @@ void test_buffer_14()
   //struct line_t* pl;
   BUFFER v = buffer_alloc("", BUF_FLG_INTERNAL, 0, default_profile);
 
-  cstr_initstr(&l.txt, "This is a test");
+  line_initstr(&l, "This is a test");
   l.flags = 0;
   buffer_appendline(v, &l);
 
-  cstr_assignstr(&l.txt, "This is also a test");
+  line_assignstr(&l, "This is also a test");
   buffer_appendline(v, &l);
 
   buffer_upperchars(v, 1, 0, 4);
   if (strcmp(buffer_getbufptr(v, 1), "THIS is also a test") != 0)
     failtest("didn't uppercase");
 
-  cstr_destroy(&l.txt);
+  line_destroy(&l);
   buffer_free(v);
 
   if (marks_count() > 1)
@@ -479,18 +478,18 @@ void test_buffer_15()
   //struct line_t* pl;
   BUFFER v = buffer_alloc("", BUF_FLG_INTERNAL, 0, default_profile);
 
-  cstr_initstr(&l.txt, "This is a test");
+  line_initstr(&l, "This is a test");
   l.flags = 0;
   buffer_appendline(v, &l);
 
-  cstr_assignstr(&l.txt, "This is also a test");
+  line_assignstr(&l, "This is also a test");
   buffer_appendline(v, &l);
 
   buffer_lowerchars(v, 1, 0, 4);
   if (strcmp(buffer_getbufptr(v, 1), "this is also a test") != 0)
     failtest("didn't lowercase");
 
-  cstr_destroy(&l.txt);
+  line_destroy(&l);
   buffer_free(v);
 
   if (marks_count() > 1)
@@ -509,17 +508,17 @@ void test_buffer_16()
   BUFFER v = buffer_alloc("", BUF_FLG_INTERNAL, 0, default_profile);
   BUFFER u = buffer_alloc("", BUF_FLG_INTERNAL, 0, default_profile);
 
-  cstr_initstr(&l.txt, "This is a test");
+  line_initstr(&l, "This is a test");
   l.flags = 0;
   buffer_appendline(v, &l);
 
-  cstr_assignstr(&l.txt, "This is also a test");
+  line_assignstr(&l, "This is also a test");
   buffer_appendline(v, &l);
 
-  cstr_assignstr(&l.txt, "As is this");
+  line_assignstr(&l, "As is this");
   buffer_appendline(u, &l);
 
-  cstr_assignstr(&l.txt, "And this too");
+  line_assignstr(&l, "And this too");
   buffer_appendline(u, &l);
 
   if (buffer_count(v) != 2)
@@ -544,7 +543,7 @@ void test_buffer_16()
   if (strcmp(buffer_getbufptr(v, 3), "This is also a test") != 0)
     failtest("second line didn't copy correctly\n");
 
-  cstr_destroy(&l.txt);
+  line_destroy(&l);
   buffer_free(u);
   buffer_free(v);
 
@@ -822,3 +821,1264 @@ void test_buffer_21()
 }
 
 
+
+
+// test buffer_load into a mapped buffer, and editing mapped lines
+void test_buffer_22()
+{
+  TRACE_ENTER;
+  cstr t1filename;
+  cstr_initstr(&t1filename, "t1.txt");
+
+  BUFFER v = buffer_alloc("", BUF_FLG_INTERNAL, 0, default_profile);
+  POE_ERR err = buffer_load(v, &t1filename, 1);
+  if (err != POE_ERR_OK)
+    failtest("error %d loading t1.txt", err);
+
+  BUFFER w = buffer_alloc("", BUF_FLG_INTERNAL|BUF_FLG_MAPPED, 0, default_profile);
+  err = buffer_load(w, &t1filename, 1);
+  if (err != POE_ERR_OK)
+    failtest("error %d loading t1.txt mapped", err);
+
+  if (!buffer_tstflags(w, BUF_FLG_MAPPED))
+    failtest("t1.txt wasn't mapped");
+  if (!buffer_tstlineflags(w, 0, LINE_FLG_MAPPED))
+    failtest("first line of t1.txt wasn't mapped");
+
+  // check the line contents
+  if (buffer_count(v) != buffer_count(w))
+    failtest("t1.txt has %d lines, mapped t1.txt has %d lines",
+             buffer_count(v), buffer_count(w));
+  int i, n = buffer_count(v);
+  for (i = 0; i < n; i++) {
+    if (buffer_line_length(v, i) != buffer_line_length(w, i))
+      failtest("line %d is %d chars long, but %d chars long mapped",
+               i, buffer_line_length(v, i), buffer_line_length(w, i));
+    if (strcmp(buffer_getbufptr(v, i), buffer_getbufptr(w, i)) != 0)
+      failtest("line %d different when mapped", i);
+  }
+
+  // editing a mapped line gives it its own copy
+  buffer_insertstrn(w, 0, 0, "xyz", 3, true);
+  if (buffer_tstlineflags(w, 0, LINE_FLG_MAPPED))
+    failtest("edited line is still mapped");
+  if (strncmp(buffer_getbufptr(w, 0), "xyzFour score", 13) != 0)
+    failtest("edited line is '%s'", buffer_getbufptr(w, 0));
+  if (strcmp(buffer_getbufptr(w, 1), buffer_getbufptr(v, 1)) != 0)
+    failtest("second line changed by edit of first");
+
+  // copies out of a mapped buffer are owned
+  BUFFER x = buffer_alloc("", BUF_FLG_INTERNAL, 0, default_profile);
+  buffer_copyinsertlines(x, 0, w, 1, 2, false);
+  buffer_free(w);
+  if (strcmp(buffer_getbufptr(x, 0), buffer_getbufptr(v, 1)) != 0)
+    failtest("copied line didn't survive freeing the mapped buffer");
+
+  buffer_free(v);
+  buffer_free(x);
+  cstr_destroy(&t1filename);
+
+  if (marks_count() > 1)
+    failtest("%d unfreed marks", marks_count());
+  if (buffers_count() != 0)
+    failtest("%d unfreed buffers", buffers_count());
+  TRACE_EXIT;
+}
+
+
+void test_buffer_23()
+{
+  TRACE_ENTER;
+  char tmp[32];
+  BUFFER v = buffer_alloc("", BUF_FLG_INTERNAL, 0, default_profile);
+
+  // enough lines to split leaves and interior nodes, inserted at
+  // the front so every insert lands in the first leaf
+  int i, n = 20000;
+  for (i = n-1; i >= 0; i--) {
+    buffer_insertblanklines(v, 0, 1, false);
+    snprintf(tmp, sizeof(tmp), "line %05d", i);
+    buffer_setstrn(v, 0, 0, tmp, strlen(tmp), false);
+  }
+  if (buffer_count(v) != n)
+    failtest("expected %d lines, got %d", n, buffer_count(v));
+  for (i = 0; i < n; i++) {
+    snprintf(tmp, sizeof(tmp), "line %05d", i);
+    if (strncmp(buffer_getbufptr(v, i), tmp, strlen(tmp)) != 0)
+      failtest("line %d is '%s'", i, buffer_getbufptr(v, i));
+  }
+
+  // remove a range spanning several leaves, then every other line
+  buffer_removelines(v, 1000, 5000, false);
+  if (buffer_count(v) != n-5000)
+    failtest("expected %d lines after removal, got %d", n-5000, buffer_count(v));
+  for (i = 0; i < buffer_count(v); i++)
+    buffer_removelines(v, i, 1, false);
+  for (i = 0; i < buffer_count(v); i++) {
+    int expect = 2*i+1;
+    if (expect >= 1000)
+      expect += 5000;
+    snprintf(tmp, sizeof(tmp), "line %05d", expect);
+    if (strncmp(buffer_getbufptr(v, i), tmp, strlen(tmp)) != 0)
+      failtest("line %d is '%s', expected '%s'", i, buffer_getbufptr(v, i), tmp);
+  }
+
+  buffer_removelines(v, 0, buffer_count(v), false);
+  if (buffer_count(v) != 0)
+    failtest("%d lines left after removing all", buffer_count(v));
+
+  buffer_free(v);
+  if (marks_count() > 1)
+    failtest("%d unfreed marks", marks_count());
+  if (buffers_count() != 0)
+    failtest("%d unfreed buffers", buffers_count());
+  TRACE_EXIT;
+}
+
+
+// The old character at a time blank compression, to check buffer_save
+// against.
+void _test_buffer_24_expect(cstr* dst, const char* s, tabstops* tabs)
+{
+  int j, col = 0, len = strlen(s), seenquotes = 0;
+  for (j = 0; j < len; j++) {
+    char c = s[j];
+    if (c == ' ' && (seenquotes&1) == 0) {
+      int nextcol = tabs_next(tabs, col);
+      int runlen = strspn(s+j, " ");
+      if (runlen > 2 && runlen >= nextcol-col) {
+        cstr_append(dst, '\t');
+        col = nextcol;
+        j = nextcol-1;
+      }
+      else {
+        cstr_appendct(dst, ' ', runlen);
+        col += runlen;
+        j += runlen-1;
+      }
+    }
+    else {
+      if (c == '"')
+        seenquotes++;
+      cstr_append(dst, c);
+      col++;
+    }
+  }
+}
+
+
+// test buffer_save blank compression and replacing the old file
+void test_buffer_24()
+{
+  TRACE_ENTER;
+  BUFFER v = buffer_alloc("", BUF_FLG_INTERNAL, 0, default_profile);
+  tabstops tabs;
+  tabs_init(&tabs, 0, default_profile->tabexpand_size, NULL);
+  cstr expect, line;
+  cstr_init(&expect, 1024);
+  cstr_init(&line, 1024);
+
+  srand(24);
+  int i, j, n = 300;
+  buffer_insertblanklines(v, 0, n, false);
+  for (i = 0; i < n; i++) {
+    cstr_clear(&line);
+    // a few lines long enough to skip the staging buffer
+    int len = (i % 50 == 7) ? 9000 + rand() % 100 : rand() % 120;
+    for (j = 0; j < len; j++) {
+      int r = rand() % 10;
+      cstr_append(&line, r < 5 ? ' ' : r == 5 ? '"' : 'a' + r);
+    }
+    buffer_setstrn(v, i, 0, cstr_getbufptr(&line), len, false);
+    _test_buffer_24_expect(&expect, buffer_getbufptr(v, i), &tabs);
+    if (i < n-1)
+      cstr_append(&expect, '\n');
+  }
+
+  // write it twice, so the second save replaces an existing file
+  cstr save_filename;
+  cstr_initstr(&save_filename, "t1_save3.txt");
+  unlink("t1_save3.txt");
+  POE_ERR err = buffer_save(v, &save_filename, true);
+  if (err != POE_ERR_OK)
+    failtest("error %d saving t1_save3.txt", err);
+  chmod("t1_save3.txt", 0640);
+  err = buffer_save(v, &save_filename, true);
+  if (err != POE_ERR_OK)
+    failtest("error %d saving t1_save3.txt again", err);
+
+  struct stat st;
+  if (stat("t1_save3.txt", &st) != 0)
+    failtest("t1_save3.txt is missing");
+  else if ((st.st_mode & 0777) != 0640)
+    failtest("t1_save3.txt mode is %o, expected 640", st.st_mode & 0777);
+
+  FILE* f = fopen("t1_save3.txt", "r");
+  if (f == NULL)
+    failtest("can't open t1_save3.txt");
+  else {
+    char* got = malloc(cstr_count(&expect) + 2);
+    size_t ngot = fread(got, 1, cstr_count(&expect) + 2, f);
+    fclose(f);
+    if (ngot != (size_t)cstr_count(&expect))
+      failtest("saved %d bytes, expected %d", (int)ngot, cstr_count(&expect));
+    else if (memcmp(got, cstr_getbufptr(&expect), ngot) != 0)
+      failtest("saved text differs from the expected text");
+    free(got);
+  }
+
+  // and nothing left lying around
+  DIR* dir = opendir(".");
+  struct dirent* ent;
+  while (dir != NULL && (ent = readdir(dir)) != NULL) {
+    if (strncmp(ent->d_name, "t1_save3.txt.", 13) == 0)
+      failtest("temp file %s left behind", ent->d_name);
+  }
+  if (dir != NULL)
+    closedir(dir);
+
+  unlink("t1_save3.txt");
+  buffer_free(v);
+  tabs_destroy(&tabs);
+  cstr_destroy(&expect);
+  cstr_destroy(&line);
+  cstr_destroy(&save_filename);
+
+  if (marks_count() > 1)
+    failtest("%d unfreed marks", marks_count());
+  if (buffers_count() != 0)
+    failtest("%d unfreed buffers", buffers_count());
+  TRACE_EXIT;
+}
+
+
+// test buffer_search against cstr_find/cstr_findi, in both directions
+void test_buffer_25()
+{
+  TRACE_ENTER;
+  const char* pats[] = { "a", "ab", "aba", "Ab", "bAAb", "abcab", "zz" };
+  BUFFER v = buffer_alloc("", BUF_FLG_INTERNAL, 0, default_profile);
+  char tmp[64];
+  int i, j, n = 40;
+
+  srand(25);
+  buffer_insertblanklines(v, 0, n, false);
+  for (i = 0; i < n; i++) {
+    int len = rand() % 40;
+    for (j = 0; j < len; j++)
+      tmp[j] = "abcAB"[rand() % 5];
+    buffer_setstrn(v, i, 0, tmp, len, false);
+  }
+
+  int p, exact, dir, row, col;
+  for (p = 0; p < (int)(sizeof(pats)/sizeof(pats[0])); p++) {
+    cstr pat;
+    cstr_initstr(&pat, pats[p]);
+    for (exact = 0; exact < 2; exact++) {
+      srchpat sp;
+      srchpat_init(&sp, &pat, exact);
+      for (dir = -1; dir <= 1; dir += 2) {
+        for (row = 0; row < n; row += 3) {
+          for (col = 0; col < 45; col += 4) {
+            // the old line at a time search
+            int xrow = row, xcol = col, xend;
+            bool xfound = false;
+            while (!xfound && xrow >= 0 && xrow < n) {
+              cstr line;
+              cstr_initstr(&line, buffer_getbufptr(v, xrow));
+              int k = (exact ? cstr_find : cstr_findi)(&line, xcol, &pat, dir);
+              cstr_destroy(&line);
+              if (k >= 0) {
+                xcol = k;
+                xfound = true;
+              }
+              else {
+                xrow += dir;
+                xcol = dir > 0 ? 0 : INT_MAX;
+              }
+            }
+            xend = xcol + cstr_count(&pat);
+
+            int frow = row, fcol = col, fend = col;
+            bool found = buffer_search(v, &frow, &fcol, &fend, &sp, dir) == POE_ERR_OK;
+            if (found != xfound || (found && (frow != xrow || fcol != xcol || fend != xend)))
+              failtest("'%s' exact %d dir %d from %d,%d: got %d %d,%d expected %d %d,%d",
+                       pats[p], exact, dir, row, col, found, frow, fcol, xfound, xrow, xcol);
+          }
+        }
+      }
+      srchpat_destroy(&sp);
+    }
+    cstr_destroy(&pat);
+  }
+
+  buffer_free(v);
+  if (buffers_count() != 0)
+    failtest("%d unfreed buffers", buffers_count());
+  TRACE_EXIT;
+}
+
+
+// test searching a buffer big enough to be split across the worker
+// pool, with matches in several chunks
+void test_buffer_26()
+{
+  TRACE_ENTER;
+  BUFFER v = buffer_alloc("", BUF_FLG_INTERNAL, 0, default_profile);
+  int i, n = 150000;
+  int planted[] = { 5, 8191, 8192, 40000, 40001, 99999, 149999 };
+  int nplanted = sizeof(planted)/sizeof(planted[0]);
+  char tmp[64];
+
+  buffer_insertblanklines(v, 0, n, false);
+  for (i = 0; i < n; i++) {
+    snprintf(tmp, sizeof(tmp), "line %d of the test", i);
+    buffer_setstrn(v, i, 0, tmp, strlen(tmp), false);
+  }
+  for (i = 0; i < nplanted; i++)
+    buffer_insertstrn(v, planted[i], 3, "NEEDLExNEEDLE", 13, false);
+
+  cstr pat;
+  cstr_initstr(&pat, "needle");
+  srchpat sp;
+  srchpat_init(&sp, &pat, false);
+
+  // every match, in order
+  struct vec_t hits;
+  vec_init(&hits, 16, sizeof(struct srchhit_t));
+  int ct = buffer_search_all(v, &sp, &hits);
+  if (ct != 2*nplanted || vec_count(&hits) != 2*nplanted)
+    failtest("found %d matches (%d positions), expected %d", ct, vec_count(&hits), 2*nplanted);
+  for (i = 0; i < vec_count(&hits) && i < 2*nplanted; i++) {
+    struct srchhit_t* hit = vec_get(&hits, i);
+    if (hit->row != planted[i/2] || hit->col != ((i&1) ? 10 : 3))
+      failtest("match %d at %d,%d", i, hit->row, hit->col);
+  }
+  vec_destroy(&hits);
+
+  // the first match in either direction from a few places
+  int starts[] = { 0, 6, 8191, 20000, 40001, 120000, 149999 };
+  int s;
+  for (s = 0; s < (int)(sizeof(starts)/sizeof(starts[0])); s++) {
+    int row = starts[s], col = 5, endcol = 5;
+    int xrow = -1, xcol = -1;
+    for (i = 0; i < nplanted && xrow < 0; i++) {
+      if (planted[i] > row || (planted[i] == row && col <= 10)) {
+        xrow = planted[i];
+        xcol = (planted[i] == row) ? 10 : 3;
+      }
+    }
+    POE_ERR err = buffer_search(v, &row, &col, &endcol, &sp, 1);
+    if ((err == POE_ERR_OK) != (xrow >= 0) || (xrow >= 0 && (row != xrow || col != xcol || endcol != xcol+6)))
+      failtest("forward from %d: err %d at %d,%d, expected %d,%d", starts[s], err, row, col, xrow, xcol);
+
+    row = starts[s];
+    col = 5;
+    xrow = -1;
+    for (i = nplanted-1; i >= 0 && xrow < 0; i--) {
+      if (planted[i] < row || (planted[i] == row && col > 3)) {
+        xrow = planted[i];
+        xcol = (planted[i] == row) ? 3 : 10;
+      }
+    }
+    err = buffer_search(v, &row, &col, &endcol, &sp, -1);
+    if ((err == POE_ERR_OK) != (xrow >= 0) || (xrow >= 0 && (row != xrow || col != xcol)))
+      failtest("backward from %d: err %d at %d,%d, expected %d,%d", starts[s], err, row, col, xrow, xcol);
+  }
+
+  srchpat_destroy(&sp);
+  cstr_destroy(&pat);
+  buffer_free(v);
+  if (buffers_count() != 0)
+    failtest("%d unfreed buffers", buffers_count());
+  TRACE_EXIT;
+}
+
+
+// The whole buffer as one string, lines separated by newlines.
+char* _test_buffer_27_text(BUFFER v)
+{
+  TRACE_ENTER;
+  cstr txt;
+  cstr_init(&txt, 256);
+  int i, n = buffer_count(v);
+  for (i = 0; i < n; i++) {
+    cstr_appendm(&txt, buffer_line_length(v, i), buffer_getbufptr(v, i));
+    cstr_append(&txt, '\n');
+  }
+  char* rval = strlsave(cstr_getbufptr(&txt), cstr_count(&txt));
+  cstr_destroy(&txt);
+  TRACE_RETURN(rval);
+}
+
+
+// test undo/redo through the edit journal
+void test_buffer_27()
+{
+  TRACE_ENTER;
+  BUFFER v = buffer_alloc("", 0, 0, default_profile);
+  int i, g, row, col;
+  char tmp[64];
+  char* states[16];
+  int nstates = 0;
+
+  buffer_insertblanklines(v, 0, 3, false);
+  buffer_setstrn(v, 0, 0, "the first line", 14, false);
+  buffer_setstrn(v, 1, 0, "   second line   ", 17, false);
+  buffer_setstrn(v, 2, 0, "third", 5, false);
+  journal_clear(buffer_journal(v));
+  states[nstates++] = _test_buffer_27_text(v);
+
+  // one group of edits per step, remembering the text after each
+  for (g = 0; g < 10; g++) {
+    journal_next_group();
+    switch (g) {
+    case 0:
+      for (i = 0; i < 5; i++)
+        buffer_insert(v, 0, 4+i, "xyzzy"[i], true);
+      break;
+    case 1:
+      buffer_removechars(v, 0, 0, 4, true);
+      buffer_removechar(v, 2, 4, true);
+      break;
+    case 2:
+      buffer_setstrn(v, 2, 10, "past the end", 12, true);
+      buffer_setcharct(v, 1, 15, '*', 6);
+      break;
+    case 3:
+      buffer_splitline(v, 0, 5, true);
+      buffer_joinline(v, 2, true);
+      break;
+    case 4:
+      buffer_trimleft(v, 2, true);
+      buffer_trimright(v, 2, true);
+      buffer_upperchars(v, 1, 0, 3);
+      break;
+    case 5:
+      buffer_insertblanklines(v, 1, 100000, true);
+      for (i = 1; i <= 100000; i += 997) {
+        snprintf(tmp, sizeof(tmp), "filler %d", i);
+        buffer_insertstrn(v, i, 0, tmp, strlen(tmp), true);
+      }
+      break;
+    case 6:
+      buffer_removelines(v, 1, 100000, true);
+      break;
+    case 7:
+      buffer_copyinsertlines(v, 0, v, 1, 2, true);
+      break;
+    case 8:
+      buffer_insertct(v, 3, 2, '-', 3, true);
+      buffer_lowerchars(v, 3, 0, 100);
+      break;
+    case 9:
+      buffer_appendline(v, buffer_get(v, 0));
+      buffer_removelines(v, 0, 1, true);
+      break;
+    }
+    states[nstates++] = _test_buffer_27_text(v);
+  }
+
+  // all the way back, one group at a time, then all the way forward
+  for (g = nstates-2; g >= 0; g--) {
+    if (journal_undo(v, &row, &col) != POE_ERR_OK)
+      failtest("undo %d failed", g);
+    char* t = _test_buffer_27_text(v);
+    if (strcmp(t, states[g]) != 0)
+      failtest("undo %d: '%.40s' != '%.40s'", g, t, states[g]);
+    free(t);
+  }
+  if (journal_undo(v, &row, &col) != POE_ERR_NOTHING_TO_UNDO)
+    failtest("undo past the start");
+  for (g = 1; g < nstates; g++) {
+    if (journal_redo(v, &row, &col) != POE_ERR_OK)
+      failtest("redo %d failed", g);
+    char* t = _test_buffer_27_text(v);
+    if (strcmp(t, states[g]) != 0)
+      failtest("redo %d: '%.40s' != '%.40s'", g, t, states[g]);
+    free(t);
+  }
+  if (journal_redo(v, &row, &col) != POE_ERR_NOTHING_TO_REDO)
+    failtest("redo past the end");
+
+  // a new edit after an undo can't be redone over
+  journal_undo(v, &row, &col);
+  journal_next_group();
+  buffer_insert(v, 0, 0, '!', true);
+  if (journal_redo(v, &row, &col) != POE_ERR_NOTHING_TO_REDO)
+    failtest("redo after a new edit");
+  journal_undo(v, &row, &col);
+  char* t = _test_buffer_27_text(v);
+  if (strcmp(t, states[nstates-2]) != 0)
+    failtest("undo of new edit: '%.40s' != '%.40s'", t, states[nstates-2]);
+  free(t);
+
+  // the oldest groups go once the journal is over its limit
+  size_t oldlimit = journal_get_limit();
+  journal_set_limit(4096);
+  for (g = 0; g < 200; g++) {
+    journal_next_group();
+    buffer_insertstrn(v, 0, 0, "0123456789", 10, true);
+  }
+  if (journal_bytes(buffer_journal(v)) > 4096)
+    failtest("journal is %d bytes", (int)journal_bytes(buffer_journal(v)));
+  for (g = 0; journal_undo(v, &row, &col) == POE_ERR_OK; g++)
+    ;
+  if (g == 0 || g >= 200)
+    failtest("%d groups kept", g);
+  journal_set_limit(oldlimit);
+
+  for (i = 0; i < nstates; i++)
+    free(states[i]);
+  buffer_free(v);
+  if (buffers_count() != 0)
+    failtest("%d unfreed buffers", buffers_count());
+  TRACE_EXIT;
+}
+
+
+// several replacements in a line at once
+void test_buffer_28()
+{
+  TRACE_ENTER;
+  BUFFER v = buffer_alloc("", 0, 0, default_profile);
+  enum marktype typ;
+  int l1, c1, l2, c2, row, col;
+
+  buffer_insertblanklines(v, 0, 2, false);
+  buffer_insertstrn(v, 0, 0, "aa foo bb foo cc", 16, false);
+  buffer_insertstrn(v, 1, 0, "foo", 3, false);
+  journal_clear(buffer_journal(v));
+  MARK m = mark_alloc(0);
+  mark_place(m, Marktype_Char, v, 0, 14);
+  mark_place(m, Marktype_Char, v, 1, 1);
+
+  journal_next_group();
+  struct bufedit_t edits[] = {
+    { 0, 0, ">", 1 },
+    { 3, 3, "quux", 4 },
+    { 10, 3, "", 0 },
+  };
+  buffer_replacechars(v, 0, edits, 3, true);
+  const char* s = buffer_getbufptr(v, 0);
+  if (strcmp(s, ">aa quux bb  cc") != 0)
+    failtest("line is '%s'", s);
+  mark_get_bounds(m, &typ, &l1, &c1, &l2, &c2);
+  if (l1 != 0 || c1 != 13 || l2 != 1 || c2 != 1)
+    failtest("mark at %d,%d-%d,%d, expected 0,13-1,1", l1, c1, l2, c2);
+
+  // the whole change is one step to undo
+  if (journal_undo(v, &row, &col) != POE_ERR_OK)
+    failtest("undo failed");
+  s = buffer_getbufptr(v, 0);
+  if (strcmp(s, "aa foo bb foo cc") != 0)
+    failtest("undone line is '%s'", s);
+  if (journal_undo(v, &row, &col) != POE_ERR_NOTHING_TO_UNDO)
+    failtest("more than one undo");
+
+  mark_unmark(m);
+  mark_free(m);
+  buffer_free(v);
+  if (buffers_count() != 0)
+    failtest("%d unfreed buffers", buffers_count());
+  TRACE_EXIT;
+}
+
+
+// test buffer_compact after editing a loaded file
+void test_buffer_29()
+{
+  TRACE_ENTER;
+  BUFFER v = buffer_alloc("", BUF_FLG_INTERNAL, 0, default_profile);
+  cstr t1filename;
+  cstr_initstr(&t1filename, "t1.txt");
+  if (buffer_load(v, &t1filename, 1) != POE_ERR_OK)
+    failtest("error loading t1.txt");
+  int linect = buffer_count(v);
+  cstr lastline;
+  cstr_initstr(&lastline, buffer_getbufptr(v, linect-1));
+
+  buffer_insertstrn(v, 0, 0, ">>", 2, false);
+  buffer_removelines(v, 1, 1, false);
+  buffer_compact(v);
+
+  const char* s = buffer_getbufptr(v, 0);
+  if (strcmp(s, ">>Four score and seven years ago our fathers brought forth on this continent") != 0)
+    failtest("first line is '%s'", s);
+  s = buffer_getbufptr(v, 1);
+  if (strcmp(s, "that all men are created equal.") != 0)
+    failtest("second line is '%s'", s);
+  if (buffer_count(v) != linect-1)
+    failtest("%d lines, expected %d", buffer_count(v), linect-1);
+  if (cstr_comparestr(&lastline, buffer_getbufptr(v, linect-2)) != 0)
+    failtest("last line is '%s'", buffer_getbufptr(v, linect-2));
+
+  // and the compacted lines can still be edited
+  buffer_removechars(v, 0, 0, 2, false);
+  s = buffer_getbufptr(v, 0);
+  if (strncmp(s, "Four", 4) != 0)
+    failtest("edited first line is '%s'", s);
+
+  cstr_destroy(&lastline);
+  cstr_destroy(&t1filename);
+  buffer_free(v);
+  TRACE_EXIT;
+}
+
+
+// short lines live in the line itself: editing across that limit,
+// both ways, and splitting a short line keep the text intact
+void test_buffer_30()
+{
+  TRACE_ENTER;
+  BUFFER v = buffer_alloc("", BUF_FLG_INTERNAL, 0, default_profile);
+  buffer_appendblanklines(v, 1);
+  if (buffer_line_length(v, 0) != 0 || strcmp(buffer_getbufptr(v, 0), "") != 0)
+    failtest("blank line is '%s'", buffer_getbufptr(v, 0));
+
+  buffer_insertstrn(v, 0, 0, "abc", 3, false);
+  buffer_insertstrn(v, 0, 3, "defghijklmnop", 13, false);
+  if (strcmp(buffer_getbufptr(v, 0), "abcdefghijklmnop") != 0)
+    failtest("grown line is '%s'", buffer_getbufptr(v, 0));
+  buffer_removechars(v, 0, 2, 12, false);
+  if (strcmp(buffer_getbufptr(v, 0), "abop") != 0)
+    failtest("shrunk line is '%s'", buffer_getbufptr(v, 0));
+  buffer_insertct(v, 0, 2, '-', 40, false);
+  buffer_removechars(v, 0, 3, 38, false);
+  if (strcmp(buffer_getbufptr(v, 0), "ab--op") != 0)
+    failtest("regrown line is '%s'", buffer_getbufptr(v, 0));
+
+  // the tail of a short line is copied to a line of its own
+  buffer_splitline(v, 0, 3, false);
+  if (buffer_count(v) != 2)
+    failtest("%d lines after split", buffer_count(v));
+  if (strcmp(buffer_getbufptr(v, 0), "ab-") != 0 || strcmp(buffer_getbufptr(v, 1), "-op") != 0)
+    failtest("split lines are '%s' '%s'", buffer_getbufptr(v, 0), buffer_getbufptr(v, 1));
+
+  // overlaying a line with part of itself
+  buffer_copyoverlaychars(v, 1, 2, v, 1, 0, 3, false);
+  if (strncmp(buffer_getbufptr(v, 1), "-o-op", 5) != 0)
+    failtest("overlaid line is '%s'", buffer_getbufptr(v, 1));
+
+  buffer_free(v);
+  TRACE_EXIT;
+}
+
+
+// the offset of line, the slow way
+int64_t _test_buffer_31_offset(BUFFER v, int line)
+{
+  int64_t off = 0;
+  int i;
+  for (i = 0; i < line; i++)
+    off += buffer_line_length(v, i) + 1;
+  return off;
+}
+
+
+// byte offsets of lines stay right through inserts, removes, splits
+// and joins, in a buffer big enough to have a tree of several levels
+void test_buffer_31()
+{
+  TRACE_ENTER;
+  BUFFER v = buffer_alloc("", BUF_FLG_INTERNAL, 0, default_profile);
+  int i, step;
+  char text[64];
+  for (i = 0; i < 20000; i++) {
+    int n = snprintf(text, sizeof(text), "line %d%.*s", i, i % 23, "abcdefghijklmnopqrstuvw");
+    buffer_appendblanklines(v, 1);
+    buffer_insertstrn(v, i, 0, text, n, false);
+  }
+  srand(31);
+  for (step = 0; step < 400; step++) {
+    int row = rand() % (buffer_count(v) - 1);
+    switch (step % 6) {
+    case 0: buffer_insertstrn(v, row, 2, "inserted", 8, false); break;
+    case 1: buffer_removechars(v, row, 1, 5, false); break;
+    case 2: buffer_splitline(v, row, 3, false); break;
+    case 3: buffer_joinline(v, row, false); break;
+    case 4: buffer_insertblanklines(v, row, 1 + rand() % 300, false); break;
+    case 5: buffer_removelines(v, row, 1 + rand() % 300, false); break;
+    }
+    int line = rand() % buffer_count(v);
+    int64_t off = _test_buffer_31_offset(v, line);
+    if (buffer_line_offset(v, line) != off)
+      failtest("step %d: line %d at %lld, expected %lld", step, line,
+               (long long)buffer_line_offset(v, line), (long long)off);
+    int col, len = buffer_line_length(v, line);
+    int found = buffer_find_offset(v, off + len/2, &col);
+    if (found != line || col != len/2)
+      failtest("step %d: offset %lld found at %d,%d, expected %d,%d", step,
+               (long long)(off + len/2), found, col, line, len/2);
+  }
+  int last = buffer_count(v) - 1;
+  int64_t size = _test_buffer_31_offset(v, last) + buffer_line_length(v, last);
+  if (buffer_size(v) != size)
+    failtest("size %lld, expected %lld", (long long)buffer_size(v), (long long)size);
+  int col;
+  if (buffer_find_offset(v, size + 100, &col) != last || col != buffer_line_length(v, last))
+    failtest("offset past the end isn't at the end of the last line");
+  buffer_free(v);
+  TRACE_EXIT;
+}
+
+
+// loading in the background gives the same lines as loading all at
+// once, and a load that's still going can't be changed or saved
+void test_buffer_32()
+{
+  TRACE_ENTER;
+  FILE* f = fopen("t1_big.txt", "w");
+  if (f == NULL)
+    failtest("can't create t1_big.txt");
+  int i, n = 200000;
+  for (i = 0; i < n; i++)
+    fprintf(f, "line %d%s%.*s%s", i, i % 7 == 0 ? "\t" : " ", i % 23,
+            "abcdefghijklmnopqrstuvw", i == n-1 ? "" : i % 5 == 0 ? "\r\n" : "\n");
+  fclose(f);
+
+  cstr filename;
+  cstr_initstr(&filename, "t1_big.txt");
+  BUFFER w = buffer_alloc("", BUF_FLG_INTERNAL, 0, default_profile);
+  if (buffer_load(w, &filename, 1) != POE_ERR_OK)
+    failtest("can't load t1_big.txt");
+  if (buffer_loading(w))
+    failtest("loaded in the background with async loading off");
+
+  // not internal, so its edits are journaled
+  buffer_set_load_async(true);
+  BUFFER v = buffer_alloc("", 0, 0, default_profile);
+  if (buffer_load(v, &filename, 1) != POE_ERR_OK)
+    failtest("can't load t1_big.txt in the background");
+  if (buffer_count(v) == 0)
+    failtest("nothing loaded before buffer_load returned");
+  buffer_load_wait(v);
+  if (buffer_loading(v) || buffer_tstflags(v, BUF_FLG_DIRTY|BUF_FLG_PARTIAL))
+    failtest("load didn't finish cleanly");
+  if (buffer_count(v) != buffer_count(w))
+    failtest("loaded %d lines, expected %d", buffer_count(v), buffer_count(w));
+  for (i = 0; i < n; i++) {
+    if (strcmp(buffer_getbufptr(v, i), buffer_getbufptr(w, i)) != 0
+        || buffer_tstlineflags(v, i, LINE_FLG_CR|LINE_FLG_LF) != buffer_tstlineflags(w, i, LINE_FLG_CR|LINE_FLG_LF))
+      failtest("line %d is '%s', expected '%s'", i, buffer_getbufptr(v, i), buffer_getbufptr(w, i));
+  }
+
+  // Start over and interfere with the load, if it's still going.
+  if (buffer_load(v, &filename, 1) != POE_ERR_OK)
+    failtest("can't load t1_big.txt in the background again");
+  if (buffer_loading(v)) {
+    journal_next_group();
+    buffer_insertstrn(v, 0, 0, "xyz", 3, false);
+    if (!buffers_load_revoke_edits())
+      failtest("edit of a loading buffer wasn't revoked");
+    if (strcmp(buffer_getbufptr(v, 0), buffer_getbufptr(w, 0)) != 0)
+      failtest("line 0 is '%s' after the edit was revoked", buffer_getbufptr(v, 0));
+    if (buffer_save(v, NULL, false) != POE_ERR_STILL_LOADING)
+      failtest("saved a buffer that's still loading");
+  }
+  buffer_load_cancel(v);
+  if (buffer_loading(v))
+    failtest("still loading after the load was cancelled");
+  if (buffer_tstflags(v, BUF_FLG_PARTIAL)) {
+    if (buffer_count(v) >= buffer_count(w))
+      failtest("cancelled load has all %d lines", buffer_count(v));
+    if (buffer_save(v, NULL, false) != POE_ERR_PARTIAL_FILE)
+      failtest("saved part of a file over the whole of it");
+  }
+  buffer_set_load_async(false);
+
+  unlink("t1_big.txt");
+  buffer_free(v);
+  buffer_free(w);
+  cstr_destroy(&filename);
+  TRACE_EXIT;
+}
+
+
+void test_buffer_33()
+{
+  TRACE_ENTER;
+  const char* names[] = { "t1.txt", "t1_rdonly.txt", "t1_missing.txt", "t1.txt" };
+  int i, j, n = sizeof(names) / sizeof(names[0]);
+  cstr filenames[4];
+  cstr* pfilenames[4];
+  BUFFER bufs[4];
+  POE_ERR errs[4];
+  for (i = 0; i < n; i++) {
+    cstr_initstr(&filenames[i], names[i]);
+    pfilenames[i] = &filenames[i];
+    bufs[i] = buffer_alloc("", 0, 0, default_profile);
+  }
+  buffers_load_many(n, bufs, pfilenames, true, errs);
+  if (errs[0] != POE_ERR_OK || errs[1] != POE_ERR_OK || errs[3] != POE_ERR_OK)
+    failtest("loading failed: %d %d %d", errs[0], errs[1], errs[3]);
+  if (errs[2] != POE_ERR_FILE_NOT_FOUND)
+    failtest("loading a missing file gave %d", errs[2]);
+  if (!buffer_tstflags(bufs[1], BUF_FLG_RDONLY) || buffer_tstflags(bufs[0], BUF_FLG_RDONLY))
+    failtest("read-only flags are wrong");
+
+  // named in the order given
+  char name[256];
+  snprintf(name, sizeof(name), "%s<2>", buffer_name(bufs[0]));
+  if (strcmp(buffer_name(bufs[3]), name) != 0)
+    failtest("second t1.txt is named '%s', expected '%s'", buffer_name(bufs[3]), name);
+
+  // the same lines as loading them one at a time
+  for (i = 0; i < n; i++) {
+    if (i == 2)
+      continue;
+    BUFFER v = buffer_alloc("", 0, 0, default_profile);
+    if (buffer_load(v, &filenames[i], true) != POE_ERR_OK)
+      failtest("can't load %s", names[i]);
+    if (buffer_count(v) != buffer_count(bufs[i]))
+      failtest("%s has %d lines, expected %d", names[i], buffer_count(bufs[i]), buffer_count(v));
+    for (j = 0; j < buffer_count(v); j++) {
+      if (strcmp(buffer_getbufptr(v, j), buffer_getbufptr(bufs[i], j)) != 0)
+        failtest("%s line %d is '%s', expected '%s'", names[i], j,
+                 buffer_getbufptr(bufs[i], j), buffer_getbufptr(v, j));
+    }
+    buffer_free(v);
+  }
+
+  for (i = 0; i < n; i++) {
+    buffer_free(bufs[i]);
+    cstr_destroy(&filenames[i]);
+  }
+  TRACE_EXIT;
+}
+
+
+// Loads fname the way buffer_load did before it read in blocks, a
+// character at a time, and checks v holds the same lines.
+void _test_buffer_check_load(BUFFER v, const char* fname, bool tabexpand)
+{
+  TRACE_ENTER;
+  FILE* f = fopen(fname, "r");
+  if (f == NULL)
+    failtest("can't open %s", fname);
+  tabstops tabs;
+  tabs_init(&tabs, 0, default_profile->tabexpand_size, NULL);
+  cstr str;
+  cstr_init(&str, 256);
+  int row = 0, col = 0, seenquotes = 0, c;
+  while (!feof(f)) {
+    c = fgetc(f);
+    while (c != '\n' && c != '\r' && !feof(f)) {
+      if (c == '"' || c == '\'')
+        seenquotes++;
+      if (c == '\t' && ((seenquotes&1) == 0) && tabexpand) {
+        int nextcol = tabs_next(&tabs, col);
+        cstr_appendct(&str, ' ', nextcol-col);
+        col = nextcol;
+      }
+      else {
+        cstr_append(&str, (char)c);
+        col++;
+      }
+      c = fgetc(f);
+    }
+    int flags = 0;
+    if (c == '\r') {
+      c = fgetc(f);
+      flags |= LINE_FLG_CR;
+      if (c == '\n')
+        flags |= LINE_FLG_LF;
+      else
+        ungetc(c, f);
+    }
+    else if (c == '\n') {
+      flags |= LINE_FLG_LF;
+    }
+    if (!feof(f) || cstr_count(&str) > 0) {
+      if (row >= buffer_count(v))
+        failtest("%s: only %d lines loaded", fname, buffer_count(v));
+      if (strcmp(buffer_getbufptr(v, row), cstr_getbufptr(&str)) != 0)
+        failtest("%s: line %d is '%s', expected '%s'", fname, row,
+                 buffer_getbufptr(v, row), cstr_getbufptr(&str));
+      int vflags = (buffer_tstlineflags(v, row, LINE_FLG_CR) ? LINE_FLG_CR : 0)
+                   | (buffer_tstlineflags(v, row, LINE_FLG_LF) ? LINE_FLG_LF : 0);
+      if (vflags != flags)
+        failtest("%s: line %d has flags %x, expected %x", fname, row, vflags, flags);
+      row++;
+      col = 0;
+      seenquotes = 0;
+      cstr_clear(&str);
+    }
+  }
+  // an empty file still gets its one empty line
+  if (buffer_count(v) != max(row, 1))
+    failtest("%s: loaded %d lines, expected %d", fname, buffer_count(v), row);
+  cstr_destroy(&str);
+  tabs_destroy(&tabs);
+  fclose(f);
+  TRACE_EXIT;
+}
+
+
+void test_buffer_34()
+{
+  TRACE_ENTER;
+  const char* fixtures[] = {
+    "",
+    "one line, no end",
+    "lf\nlines\n",
+    "cr\rlines\r",
+    "crlf\r\nlines\r\n",
+    "mixed\r\nends\rhere\nand\n\rthere",
+    "trailing empty line\n\n",
+    "trailing cr on an empty line\n\r",
+    "lone cr at the end\r",
+    "\ttab\tat the start\n  mid\tline\t\n",
+    "\"in\tquotes\"\tout\t'in\there'\t\"odd\tquote\n\tnext\tline\n",
+  };
+  int i, n = sizeof(fixtures) / sizeof(fixtures[0]);
+  cstr filename;
+  cstr_initstr(&filename, "t1_fixture.txt");
+  BUFFER v = buffer_alloc("", BUF_FLG_INTERNAL, 0, default_profile);
+  for (i = 0; i < n; i++) {
+    FILE* f = fopen("t1_fixture.txt", "w");
+    if (f == NULL)
+      failtest("can't create t1_fixture.txt");
+    fputs(fixtures[i], f);
+    fclose(f);
+    int tabexpand;
+    for (tabexpand = 0; tabexpand <= 1; tabexpand++) {
+      if (buffer_load(v, &filename, tabexpand) != POE_ERR_OK)
+        failtest("can't load fixture %d", i);
+      _test_buffer_check_load(v, "t1_fixture.txt", tabexpand);
+    }
+  }
+  unlink("t1_fixture.txt");
+  buffer_free(v);
+  cstr_destroy(&filename);
+  TRACE_EXIT;
+}
+
+
+// Writes ordinary lines up to offset target.
+void _test_buffer_fill(FILE* f, int64_t* poff, int64_t target, int* pi)
+{
+  TRACE_ENTER;
+  while (*poff < target) {
+    int room = (int)(target - *poff);
+    if (room > 40) {
+      int i = (*pi)++;
+      *poff += fprintf(f, "%d\t\"q\tq\" %.*s%s", i, i % 17, "abcdefghijklmnopq", i % 3 == 0 ? "\r\n" : "\n");
+    }
+    else {
+      *poff += fprintf(f, "%.*s\n", room-1, "xxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxx");
+    }
+  }
+  TRACE_EXIT;
+}
+
+
+// The background loader reads the file in blocks of 64K, then 128K,
+// 256K, ...  A line ending split across blocks has to come out the
+// same as anywhere else.
+void test_buffer_35()
+{
+  TRACE_ENTER;
+  FILE* f = fopen("t1_blocks.txt", "w");
+  if (f == NULL)
+    failtest("can't create t1_blocks.txt");
+  int64_t off = 0;
+  int i = 0;
+  // a CRLF split by the first boundary
+  _test_buffer_fill(f, &off, 65536-1, &i);
+  off += fprintf(f, "\r\n");
+  // a lone CR ending the second block
+  _test_buffer_fill(f, &off, 65536+131072-1, &i);
+  off += fprintf(f, "\rnext");
+  // a CR ending the third, and a CRLF starting the fourth
+  _test_buffer_fill(f, &off, 65536+131072+262144-1, &i);
+  off += fprintf(f, "\r\r\n");
+  _test_buffer_fill(f, &off, 5*1024*1024, &i);
+  fprintf(f, "no end");
+  fclose(f);
+
+  cstr filename;
+  cstr_initstr(&filename, "t1_blocks.txt");
+  BUFFER v = buffer_alloc("", 0, 0, default_profile);
+  buffer_set_load_async(true);
+  if (buffer_load(v, &filename, true) != POE_ERR_OK)
+    failtest("can't load t1_blocks.txt");
+  buffer_load_wait(v);
+  buffer_set_load_async(false);
+  _test_buffer_check_load(v, "t1_blocks.txt", true);
+
+  unlink("t1_blocks.txt");
+  buffer_free(v);
+  cstr_destroy(&filename);
+  TRACE_EXIT;
+}
+
+
+// Another program can truncate a file the buffer has mapped.  Reading
+// the lines past the cut mustn't crash, and the buffer has to find
+// out it's no longer the whole file.
+void test_buffer_36()
+{
+  TRACE_ENTER;
+  FILE* f = fopen("t1_mapped.txt", "w");
+  if (f == NULL)
+    failtest("can't create t1_mapped.txt");
+  int i;
+  for (i = 0; i < 4000; i++)
+    fprintf(f, "%06d the quick brown fox jumps over the lazy dog\n", i);
+  fclose(f);
+
+  cstr filename;
+  cstr_initstr(&filename, "t1_mapped.txt");
+  BUFFER v = buffer_alloc("", BUF_FLG_MAPPED, 0, default_profile);
+  if (buffer_load(v, &filename, false) != POE_ERR_OK)
+    failtest("can't load t1_mapped.txt");
+  if (!buffer_tstflags(v, BUF_FLG_MAPPED))
+    failtest("t1_mapped.txt wasn't mapped");
+  if (buffers_check_maps())
+    failtest("nothing has been cut short yet");
+  int len;
+  const char* s = buffer_getlineptr(v, 3999, &len);
+  if (len != 50 || strncmp(s, "003999 the", 10) != 0)
+    failtest("last line is '%.*s'", len, s);
+
+  if (truncate("t1_mapped.txt", 0) != 0)
+    failtest("can't truncate t1_mapped.txt");
+  int64_t total = 0;
+  for (i = 0; i < buffer_count(v); i++) {
+    s = buffer_getlineptr(v, i, &len);
+    int j;
+    for (j = 0; j < len; j++)
+      total += s[j];
+  }
+  if (total < 0)
+    failtest("negative text");
+  if (!buffers_check_maps())
+    failtest("the cut wasn't noticed");
+  if (!buffer_tstflags(v, BUF_FLG_PARTIAL))
+    failtest("buffer wasn't marked partial");
+  if (buffers_check_maps())
+    failtest("the cut was reported twice");
+  buffer_clrflags(v, BUF_FLG_PARTIAL);
+
+  unlink("t1_mapped.txt");
+  buffer_free(v);
+  cstr_destroy(&filename);
+  TRACE_EXIT;
+}
+
+
+// Saving a file with another hard link overwrites it in place, so
+// the other name still sees the new text.  The buffer here borrows
+// its lines from the file it's overwriting.
+void test_buffer_37()
+{
+  TRACE_ENTER;
+  FILE* f = fopen("t1_linked.txt", "w");
+  if (f == NULL)
+    failtest("can't create t1_linked.txt");
+  int i;
+  for (i = 0; i < 2000; i++)
+    fprintf(f, "line %04d of a file with two names\n", i);
+  fclose(f);
+  unlink("t1_linked2.txt");
+  if (link("t1_linked.txt", "t1_linked2.txt") != 0)
+    failtest("can't link t1_linked.txt");
+  struct stat st1, st2;
+  stat("t1_linked.txt", &st1);
+
+  cstr filename;
+  cstr_initstr(&filename, "t1_linked.txt");
+  BUFFER v = buffer_alloc("", BUF_FLG_MAPPED, 0, default_profile);
+  if (buffer_load(v, &filename, false) != POE_ERR_OK)
+    failtest("can't load t1_linked.txt");
+  buffer_setstrn(v, 0, 0, "LINE", 4, false);
+  POE_ERR err = buffer_save(v, &filename, false);
+  if (err != POE_ERR_OK)
+    failtest("error %d saving t1_linked.txt", err);
+
+  if (stat("t1_linked.txt", &st2) != 0 || st2.st_ino != st1.st_ino)
+    failtest("t1_linked.txt was replaced rather than overwritten");
+  cstr_assignstr(&filename, "t1_linked2.txt");
+  BUFFER w = buffer_alloc("", 0, 0, default_profile);
+  if (buffer_load(w, &filename, false) != POE_ERR_OK)
+    failtest("can't load t1_linked2.txt");
+  if (buffer_count(w) != 2000)
+    failtest("t1_linked2.txt has %d lines, expected 2000", buffer_count(w));
+  for (i = 0; i < buffer_count(w); i++) {
+    char expect[64];
+    snprintf(expect, sizeof expect, "%s %04d of a file with two names", i == 0 ? "LINE" : "line", i);
+    if (strcmp(buffer_getbufptr(w, i), expect) != 0)
+      failtest("line %d is '%s', expected '%s'", i, buffer_getbufptr(w, i), expect);
+  }
+  if (buffers_check_maps())
+    failtest("saving cut the buffer's own file short");
+
+  unlink("t1_linked.txt");
+  unlink("t1_linked2.txt");
+  buffer_free(v);
+  buffer_free(w);
+  cstr_destroy(&filename);
+  TRACE_EXIT;
+}
+
+
+// Offsets count the bytes in the file, so lines whose tabs were
+// expanded on load are still found where they were read.  The file
+// mixes line ends and has no LF at the end.
+void test_buffer_38()
+{
+  TRACE_ENTER;
+  static const char* ends[] = { "\n", "\r\n", "\r", "\n" };
+  int nlines = 3000;
+  int64_t* starts = malloc((nlines+1) * sizeof(int64_t));
+  FILE* f = fopen("t1_tabbed.txt", "w");
+  if (f == NULL)
+    failtest("can't create t1_tabbed.txt");
+  int64_t off = 0;
+  int i;
+  for (i = 0; i < nlines; i++) {
+    char text[64];
+    int n = snprintf(text, sizeof text, "%d\t\"in\tquotes\"%.*s\tend", i, i % 5, "\t\t\t\t\t");
+    const char* end = i < nlines-1 ? ends[i % 4] : "";
+    starts[i] = off;
+    fputs(text, f);
+    fputs(end, f);
+    off += n + strlen(end);
+  }
+  starts[nlines] = off;
+  fclose(f);
+
+  cstr filename;
+  cstr_initstr(&filename, "t1_tabbed.txt");
+  BUFFER v = buffer_alloc("", 0, 0, default_profile);
+  if (buffer_load(v, &filename, true) != POE_ERR_OK)
+    failtest("can't load t1_tabbed.txt");
+  if (buffer_count(v) != nlines)
+    failtest("t1_tabbed.txt has %d lines, expected %d", buffer_count(v), nlines);
+  if (strncmp(buffer_getbufptr(v, 7), "7       \"in\tquotes\"", 19) != 0)
+    failtest("line 7's tabs weren't expanded: '%s'", buffer_getbufptr(v, 7));
+  if (buffer_size(v) != starts[nlines])
+    failtest("size %lld, expected %lld", (long long)buffer_size(v), (long long)starts[nlines]);
+  for (i = 0; i < nlines; i++) {
+    if (buffer_line_offset(v, i) != starts[i])
+      failtest("line %d at %lld, expected %lld", i,
+               (long long)buffer_line_offset(v, i), (long long)starts[i]);
+    int col;
+    if (buffer_find_offset(v, starts[i] + 1, &col) != i || col != 1)
+      failtest("offset %lld found at %d,%d, expected %d,1", (long long)starts[i] + 1,
+               buffer_find_offset(v, starts[i] + 1, &col), col, i);
+    if (buffer_char_offset(v, i, 1) != starts[i] + 1)
+      failtest("line %d col 1 at %lld", i, (long long)buffer_char_offset(v, i, 1));
+  }
+  if (buffer_char_offset(v, nlines, 0) != starts[nlines])
+    failtest("the end of the buffer isn't at the end of the file");
+
+  // compacting moves the text, but not where it was in the file
+  buffer_compact(v);
+  for (i = 0; i < nlines; i++) {
+    if (buffer_line_offset(v, i) != starts[i])
+      failtest("after compacting, line %d at %lld, expected %lld", i,
+               (long long)buffer_line_offset(v, i), (long long)starts[i]);
+  }
+
+  // an edited line counts as it is now
+  int len = buffer_line_length(v, 1000);
+  buffer_insertstrn(v, 1000, 0, "x", 1, false);
+  int64_t grew = len + 1 - (starts[1001] - starts[1000] - strlen(ends[1000 % 4]));
+  if (buffer_line_offset(v, 1001) != starts[1001] + grew)
+    failtest("after an edit line 1001 at %lld, expected %lld",
+             (long long)buffer_line_offset(v, 1001), (long long)(starts[1001] + grew));
+  if (buffer_line_offset(v, 1000) != starts[1000])
+    failtest("the edit moved its own line");
+
+  unlink("t1_tabbed.txt");
+  buffer_free(v);
+  cstr_destroy(&filename);
+  free(starts);
+  TRACE_EXIT;
+}
+
+
+// Compacting a buffer that's still loading leaves alone the text its
+// untaken lines are still in.
+void test_buffer_39()
+{
+  TRACE_ENTER;
+  FILE* f = fopen("t1_compact.txt", "w");
+  if (f == NULL)
+    failtest("can't create t1_compact.txt");
+  int i, n = 600000;
+  for (i = 0; i < n; i++)
+    fprintf(f, "line %d of a file compacted while it loads\n", i);
+  fclose(f);
+
+  cstr filename;
+  cstr_initstr(&filename, "t1_compact.txt");
+  buffer_set_load_async(true);
+  BUFFER v = buffer_alloc("", 0, 0, default_profile);
+  if (buffer_load(v, &filename, false) != POE_ERR_OK)
+    failtest("can't load t1_compact.txt in the background");
+  while (buffers_load_poll() >= 0)
+    buffer_compact(v);
+  buffer_set_load_async(false);
+  if (buffer_count(v) != n)
+    failtest("loaded %d lines, expected %d", buffer_count(v), n);
+  for (i = 0; i < n; i++) {
+    char expect[64];
+    snprintf(expect, sizeof expect, "line %d of a file compacted while it loads", i);
+    if (strcmp(buffer_getbufptr(v, i), expect) != 0)
+      failtest("line %d is '%s', expected '%s'", i, buffer_getbufptr(v, i), expect);
+  }
+
+  unlink("t1_compact.txt");
+  buffer_free(v);
+  cstr_destroy(&filename);
+  TRACE_EXIT;
+}
+
+
+// leaves junk where the next call's locals will be
+void _test_buffer_40_scribble(void)
+{
+  volatile char junk[512];
+  int i;
+  for (i = 0; i < (int)sizeof(junk); i++)
+    junk[i] = (char)0xa5;
+}
+
+
+// A line rewritten by several edits at once, as CHANGE * does, counts
+// as its new text, and the lines after it move by the difference.
+void test_buffer_40()
+{
+  TRACE_ENTER;
+  BUFFER v = buffer_alloc("", BUF_FLG_INTERNAL, 0, default_profile);
+  int i;
+  for (i = 0; i < 5000; i++) {
+    char text[64];
+    int n = snprintf(text, sizeof text, "the cat sat on the mat, line %d", i);
+    buffer_appendblanklines(v, 1);
+    buffer_insertstrn(v, i, 0, text, n, false);
+    buffer_setlineflags(v, i, LINE_FLG_LF);
+  }
+  struct bufedit_t edits[] = {
+    { 4, 3, "tiger", 5 }, { 8, 3, "lay", 3 }, { 19, 3, "welcome mat", 11 }
+  };
+  for (i = 0; i < 5000; i += 7) {
+    _test_buffer_40_scribble();
+    buffer_replacechars(v, i, edits, 3, true);
+  }
+  int64_t off = 0;
+  for (i = 0; i < 5000; i++) {
+    if (buffer_line_offset(v, i) != off)
+      failtest("line %d at %lld, expected %lld", i, (long long)buffer_line_offset(v, i), (long long)off);
+    off += buffer_line_length(v, i) + 1;
+  }
+  if (strncmp(buffer_getbufptr(v, 7), "the tiger lay on the welcome mat,", 33) != 0)
+    failtest("line 7 is '%s'", buffer_getbufptr(v, 7));
+  if (buffer_size(v) != off)
+    failtest("size %lld, expected %lld", (long long)buffer_size(v), (long long)off);
+  buffer_free(v);
+  TRACE_EXIT;
+}
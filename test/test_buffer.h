@@ -20,5 +20,24 @@ void test_buffer_18(void);
 void test_buffer_19(void);
 void test_buffer_20(void);
 void test_buffer_21(void);
+void test_buffer_22(void);
+void test_buffer_23(void);
 
 
+void test_buffer_24(void);
+void test_buffer_25(void);
+void test_buffer_26(void);
+void test_buffer_27(void);
+void test_buffer_28(void);
+void test_buffer_29(void);
+void test_buffer_30(void);
+void test_buffer_31(void);
+void test_buffer_32(void);
+void test_buffer_33(void);
+void test_buffer_34(void);
+void test_buffer_35(void);
+void test_buffer_36(void);
+void test_buffer_37(void);
+void test_buffer_38(void);
+void test_buffer_39(void);
+void test_buffer_40(void);
@@ -0,0 +1,80 @@
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "trace.h"
+#include "events.h"
+#include "testing.h"
+#include "logging.h"
+
+
+//
+// events tests
+//
+int _test_events_calls = 0;
+
+void _test_events_handler(int fd, void* arg)
+{
+  TRACE_ENTER;
+  char c;
+  if (read(fd, &c, 1) == 1)
+    _test_events_calls += *(int*)arg;
+  TRACE_EXIT;
+}
+
+
+void test_events_1()
+{
+  TRACE_ENTER;
+  init_events();
+  int in[2], other[2];
+  if (pipe(in) != 0 || pipe(other) != 0)
+    failtest("can't make pipes");
+  int weight = 1;
+  events_watch(other[0], _test_events_handler, &weight);
+
+  // nothing has happened, so it just times out
+  if (events_wait(in[0], 0) || _test_events_calls != 0)
+    failtest("woke up with nothing to wake it");
+
+  // a wakeup gets it going, and doesn't stay pending
+  time_t start = time(NULL);
+  events_wake();
+  events_wake();
+  if (events_wait(in[0], 5000) || _test_events_calls != 0)
+    failtest("wakeup looked like input");
+  if (time(NULL) - start > 2)
+    failtest("wakeup didn't wake it");
+  if (events_wait(in[0], 0))
+    failtest("wakeup was left in the pipe");
+
+  // watched descriptors get their handler called
+  if (write(other[1], "x", 1) != 1)
+    failtest("can't write to the pipe");
+  if (events_wait(in[0], 5000) || _test_events_calls != 1)
+    failtest("handler called %d times", _test_events_calls);
+
+  // and input says so
+  if (write(in[1], "x", 1) != 1)
+    failtest("can't write to the pipe");
+  if (!events_wait(in[0], 5000))
+    failtest("input wasn't noticed");
+
+  // nothing is called once it's unwatched
+  events_unwatch(other[0]);
+  if (write(other[1], "x", 1) != 1)
+    failtest("can't write to the pipe");
+  events_wait(-1, 0);
+  if (_test_events_calls != 1)
+    failtest("unwatched handler was called");
+
+  close(in[0]);
+  close(in[1]);
+  close(other[0]);
+  close(other[1]);
+  close_events();
+  TRACE_EXIT;
+}
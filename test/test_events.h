@@ -0,0 +1 @@
+void test_events_1(void);
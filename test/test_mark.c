@@ -11,6 +11,11 @@
 #include "cstr.h"
 #include "bufid.h"
 #include "mark.h"
+#include "tabstops.h"
+#include "margins.h"
+#include "key_interp.h"
+#include "buffer.h"
+#include "editor_globals.h"
 
 #include "testing.h"
 
@@ -1298,3 +1303,291 @@ void test_mark_39()
     failtest("%d unfreed marks", marks_count());
   TRACE_EXIT;
 }
+
+
+// Checks the indexed hit tests against testing every mark by hand,
+// before and after the marks are moved by an edit.
+void test_mark_40()
+{
+  TRACE_ENTER;
+  BUFFER buf = (BUFFER)1, other = (BUFFER)2;
+  enum marktype typs[] = { Marktype_Line, Marktype_Char, Marktype_Block };
+  MARK marks[60];
+  int i, pass, row, col;
+
+  srand(40);
+  for (i = 0; i < 60; i++) {
+    marks[i] = mark_alloc(0);
+    int l1 = rand() % 50, c1 = rand() % 20;
+    mark_place(marks[i], typs[i%3], (i%7 == 0) ? other : buf, l1, c1);
+    mark_place(marks[i], typs[i%3], (i%7 == 0) ? other : buf, l1 + rand() % 10, rand() % 20);
+  }
+
+  for (pass = 0; pass < 2; pass++) {
+    for (row = 0; row < 70; row++) {
+      MARK lexp = MARK_NULL, lnew = MARK_NULL;
+      for (i = 0; i < 60; i++) {
+        if (mark_hittest_line(marks[i], buf, row, 0, 0)) {
+          if (lexp == MARK_NULL)
+            lexp = marks[i];
+          lnew = marks[i];
+        }
+      }
+      if (marks_hittest_line(buf, row, 0, 0) != lexp)
+        failtest("pass %d: wrong first mark for line %d", pass, row);
+      if (marks_hittest_line_newest(buf, row, 0, 0) != lnew)
+        failtest("pass %d: wrong newest mark for line %d", pass, row);
+      for (col = 0; col < 25; col++) {
+        MARK pexp = MARK_NULL;
+        for (i = 0; i < 60 && pexp == MARK_NULL; i++) {
+          if (mark_hittest_point(marks[i], buf, row, col, 0, 0))
+            pexp = marks[i];
+        }
+        if (marks_hittest_point(buf, row, col, 0, 0) != pexp)
+          failtest("pass %d: wrong mark for point %d,%d", pass, row, col);
+      }
+    }
+    marks_upd_insertedlines(buf, 20, 5);
+    marks_upd_split(buf, 30, 4);
+  }
+
+  for (i = 0; i < 60; i++)
+    mark_free(marks[i]);
+  if (marks_count() > 1)
+    failtest("%d unfreed marks", marks_count());
+  TRACE_EXIT;
+}
+
+
+// Batched updates should leave the marks where applying them one at
+// a time would have.
+void test_mark_41()
+{
+  TRACE_ENTER;
+  BUFFER direct = (BUFFER)1, batched = (BUFFER)2;
+  enum marktype typs[] = { Marktype_Line, Marktype_Char };
+  MARK a[10], b[10];
+  int i, j;
+
+  srand(41);
+  for (i = 0; i < 10; i++) {
+    int l1 = rand() % 30, c1 = rand() % 20, l2 = l1 + rand() % 6, c2 = rand() % 20;
+    a[i] = mark_alloc(0);
+    b[i] = mark_alloc(0);
+    mark_place(a[i], typs[i%2], direct, l1, c1);
+    mark_place(a[i], typs[i%2], direct, l2, c2);
+    mark_place(b[i], typs[i%2], batched, l1, c1);
+    mark_place(b[i], typs[i%2], batched, l2, c2);
+  }
+
+  marks_begin_batch(batched);
+  for (j = 0; j < 200; j++) {
+    int line = rand() % 40, col = rand() % 20, n = 1 + rand() % 5;
+    BUFFER bufs[] = { direct, batched };
+    int k;
+    for (k = 0; k < 2; k++) {
+      switch (j % 5) {
+      case 0: marks_upd_insertedlines(bufs[k], line, n); break;
+      case 1: marks_upd_insertedchars(bufs[k], line, col, n); break;
+      case 2: marks_upd_removedchars(bufs[k], line, col, n); break;
+      case 3: marks_upd_split(bufs[k], line, col); break;
+      case 4: marks_upd_join(bufs[k], line, col); break;
+      }
+    }
+    // looking at a mark mid-batch brings it up to date
+    if (j == 100) {
+      int l1, c1, l2, c2;
+      mark_get_start(b[3], &l1, &c1);
+      mark_get_start(a[3], &l2, &c2);
+      if (l1 != l2 || c1 != c2)
+        failtest("mark 3 is at %d,%d mid-batch, expected %d,%d", l1, c1, l2, c2);
+    }
+  }
+  marks_end_batch(batched);
+
+  for (i = 0; i < 10; i++) {
+    enum marktype ta, tb;
+    int al1, ac1, al2, ac2, bl1, bc1, bl2, bc2;
+    mark_get_bounds(a[i], &ta, &al1, &ac1, &al2, &ac2);
+    mark_get_bounds(b[i], &tb, &bl1, &bc1, &bl2, &bc2);
+    if (ta != tb || al1 != bl1 || ac1 != bc1 || al2 != bl2 || ac2 != bc2)
+      failtest("mark %d is (%d,%d %d,%d) batched, expected (%d,%d %d,%d)",
+               i, bl1, bc1, bl2, bc2, al1, ac1, al2, ac2);
+  }
+
+  for (i = 0; i < 10; i++) {
+    mark_free(a[i]);
+    mark_free(b[i]);
+  }
+  if (marks_count() > 1)
+    failtest("%d unfreed marks", marks_count());
+  TRACE_EXIT;
+}
+
+
+// The column spans for a line should cover exactly the points the
+// marks hit.
+void test_mark_42()
+{
+  TRACE_ENTER;
+  BUFFER buf = (BUFFER)1, other = (BUFFER)2;
+  enum marktype typs[] = { Marktype_Line, Marktype_Char, Marktype_Block };
+  MARK marks[40];
+  struct vec_t spans;
+  int i, k, row, col;
+
+  vec_init(&spans, 4, sizeof(struct markspan_t));
+  srand(42);
+  for (i = 0; i < 40; i++) {
+    marks[i] = mark_alloc((i%5 == 0) ? MARK_FLG_VISIBLE : 0);
+    int l1 = rand() % 30, c1 = rand() % 20;
+    mark_place(marks[i], typs[i%3], (i%7 == 0) ? other : buf, l1, c1);
+    mark_place(marks[i], typs[i%3], (i%7 == 0) ? other : buf, l1 + rand() % 5, rand() % 20);
+  }
+
+  for (row = 0; row < 40; row++) {
+    vec_clear(&spans);
+    int n = marks_line_spans(buf, row, MARK_FLG_VISIBLE, 0, &spans);
+    if (n != vec_count(&spans))
+      failtest("line %d: returned %d spans, appended %d", row, n, vec_count(&spans));
+    for (col = 0; col < 30; col++) {
+      bool exp = false, got = false;
+      for (i = 0; i < 40; i++)
+        exp = exp || mark_hittest_point(marks[i], buf, row, col, MARK_FLG_VISIBLE, 0);
+      for (k = 0; k < vec_count(&spans); k++) {
+        struct markspan_t* span = vec_get(&spans, k);
+        got = got || (col >= span->c1 && col <= span->c2);
+      }
+      if (exp != got)
+        failtest("line %d col %d: expected %d, got %d", row, col, exp, got);
+    }
+  }
+
+  for (i = 0; i < 40; i++)
+    mark_free(marks[i]);
+  vec_destroy(&spans);
+  if (marks_count() > 1)
+    failtest("%d unfreed marks", marks_count());
+  TRACE_EXIT;
+}
+
+
+// Same as test_mark_41 but with every kind of update, including the
+// line removals that look at the buffer, and enough marks and updates
+// for the batch to both move marks by its line map and give it up.
+void test_mark_43()
+{
+  TRACE_ENTER;
+  BUFFER direct = buffer_alloc("", BUF_FLG_INTERNAL, 0, default_profile);
+  BUFFER batched = buffer_alloc("", BUF_FLG_INTERNAL, 0, default_profile);
+  buffer_insertblanklines(direct, 0, 100, false);
+  buffer_insertblanklines(batched, 0, 100, false);
+  enum marktype typs[] = { Marktype_Line, Marktype_Char, Marktype_Block };
+  int nupds[] = { 10, 150, 3000 };
+  MARK a[150], b[150];
+  int i, j, r;
+
+  srand(43);
+  for (r = 0; r < 3; r++) {
+    for (i = 0; i < 150; i++) {
+      int l1 = rand() % 60, c1 = rand() % 20, l2 = l1 + rand() % 6, c2 = rand() % 20;
+      enum marktype typ = typs[i%3];
+      if (i % 10 == 9) {
+        // bookmarks stay put when their text goes
+        typ = (i % 20 == 9) ? Marktype_Line : Marktype_Char;
+        a[i] = mark_alloc(MARK_FLG_BOOKMARK);
+        b[i] = mark_alloc(MARK_FLG_BOOKMARK);
+        mark_bookmark(a[i], typ, direct, l1, c1);
+        mark_bookmark(b[i], typ, batched, l1, c1);
+        continue;
+      }
+      a[i] = mark_alloc(0);
+      b[i] = mark_alloc(0);
+      mark_place(a[i], typ, direct, l1, c1);
+      mark_place(a[i], typ, direct, l2, c2);
+      mark_place(b[i], typ, batched, l1, c1);
+      mark_place(b[i], typ, batched, l2, c2);
+    }
+
+    marks_begin_batch(batched);
+    for (j = 0; j < nupds[r]; j++) {
+      int line = rand() % 70, col = rand() % 20, n = 1 + rand() % 5;
+      int lead = rand() % 10, trail = rand() % 10, nl = rand() % 3;
+      BUFFER bufs[] = { direct, batched };
+      int k;
+      for (k = 0; k < 2; k++) {
+        switch (j % 10) {
+        case 0: marks_upd_insertedlines(bufs[k], line, n); break;
+        case 1: marks_upd_insertedchars(bufs[k], line, col, n); break;
+        case 2: marks_upd_removedchars(bufs[k], line, col, n); break;
+        case 3: marks_upd_split(bufs[k], line, col); break;
+        case 4: marks_upd_join(bufs[k], line, col); break;
+        case 5: marks_upd_removedlines(bufs[k], line, n); break;
+        case 6: marks_upd_insertedcharblk(bufs[k], line, col, nl, lead, trail); break;
+        case 7: marks_upd_removedcharblk(bufs[k], line, col, nl, lead, trail); break;
+        case 8: marks_upd_removedlines(bufs[k], line, 1); break;
+        case 9: marks_upd_insertedlines(bufs[k], line, 1); break;
+        }
+      }
+    }
+    marks_end_batch(batched);
+
+    for (i = 0; i < 150; i++) {
+      enum marktype ta, tb;
+      int al1, ac1, al2, ac2, bl1, bc1, bl2, bc2;
+      mark_get_bounds(a[i], &ta, &al1, &ac1, &al2, &ac2);
+      mark_get_bounds(b[i], &tb, &bl1, &bc1, &bl2, &bc2);
+      if (ta != tb || (ta != Marktype_None && (al1 != bl1 || ac1 != bc1 || al2 != bl2 || ac2 != bc2)))
+        failtest("round %d mark %d is %d (%d,%d %d,%d) batched, expected %d (%d,%d %d,%d)",
+                 r, i, tb, bl1, bc1, bl2, bc2, ta, al1, ac1, al2, ac2);
+    }
+    for (i = 0; i < 150; i++) {
+      mark_free(a[i]);
+      mark_free(b[i]);
+    }
+  }
+
+  buffer_free(direct);
+  buffer_free(batched);
+  if (marks_count() > 1)
+    failtest("%d unfreed marks", marks_count());
+  TRACE_EXIT;
+}
+
+
+// A mark set in the middle of a batch is where it was put, and only
+// the updates that come after it move it.
+void test_mark_44()
+{
+  TRACE_ENTER;
+  BUFFER buf = buffer_alloc("", BUF_FLG_INTERNAL, 0, default_profile);
+  buffer_insertblanklines(buf, 0, 100, false);
+  MARK other = mark_alloc(0);
+  mark_place(other, Marktype_Line, buf, 50, 0);
+  MARK m = mark_alloc(0);
+  MARK bm = mark_alloc(MARK_FLG_BOOKMARK);
+
+  marks_begin_batch(buf);
+  marks_upd_insertedlines(buf, 0, 5);
+  mark_start(m, Marktype_Line, buf, 20, 0);
+  mark_bookmark(bm, Marktype_Char, buf, 30, 4);
+  marks_upd_insertedlines(buf, 25, 2);
+  marks_end_batch(buf);
+
+  enum marktype typ;
+  int l1, c1, l2, c2;
+  mark_get_bounds(m, &typ, &l1, &c1, &l2, &c2);
+  if (typ != Marktype_Line || l1 != 20 || l2 != 20)
+    failtest("mark started at line 20 is at %d-%d", l1, l2);
+  if (mark_get_bookmark(bm, Marktype_Char, &l1, &c1) != POE_ERR_OK || l1 != 32 || c1 != 4)
+    failtest("bookmark set at 30,4 is at %d,%d, expected 32,4", l1, c1);
+  mark_get_bounds(other, &typ, &l1, &c1, &l2, &c2);
+  if (l1 != 57)
+    failtest("mark at 50 before the batch is at %d, expected 57", l1);
+
+  mark_free(m);
+  mark_free(bm);
+  mark_free(other);
+  buffer_free(buf);
+  TRACE_EXIT;
+}
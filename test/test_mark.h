@@ -38,3 +38,8 @@ void test_mark_36(void);
 void test_mark_37(void);
 void test_mark_38(void);
 void test_mark_39(void);
+void test_mark_40(void);
+void test_mark_41(void);
+void test_mark_42(void);
+void test_mark_43(void);
+void test_mark_44(void);
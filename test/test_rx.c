@@ -0,0 +1,206 @@
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+
+#include "trace.h"
+#include "poe_err.h"
+#include "utils.h"
+#include "vec.h"
+#include "rx.h"
+#include "testing.h"
+
+
+// finding matches, both ways
+void test_rx_1()
+{
+  TRACE_ENTER;
+  struct {
+    const char* pat;
+    bool exact;
+    const char* text;
+    int from;             // forward from here, and backward from before
+    int start, end;       // expected forward match, or -1
+    int rstart;           // expected backward match start, or -1
+  } cases[] = {
+    { "abc",          true,  "xxabcxxabc",   0,  2,  5, -1 },
+    { "abc",          true,  "xxabcxxabc",   3,  7, 10,  2 },
+    { "ABC",          false, "xxabc",        0,  2,  5, -1 },
+    { "ABC",          true,  "xxabc",        0, -1, -1, -1 },
+    { "a+",           true,  "baaab",        0,  1,  4, -1 },
+    { "abcd|c",       true,  "abcd",         0,  0,  4, -1 },
+    { "x*",           true,  "abc",          1,  1,  1,  0 },
+    { "^ab",          true,  "abab",         0,  0,  2, -1 },
+    { "^ab",          true,  "abab",         1, -1, -1,  0 },
+    { "ab$",          true,  "abab",         0,  2,  4, -1 },
+    { "^$",           true,  "",             0,  0,  0, -1 },
+    { "[0-9]+",       true,  "ab 123 c",     0,  3,  6, -1 },
+    { "[^a-c ]+",     true,  "ab 123 c",     0,  3,  6, -1 },
+    { "\\d\\d?",      true,  "a12345",       2,  2,  4,  1 },
+    { "\\w+\\s\\w+",  true,  "-- one two",   0,  3, 10, -1 },
+    { "a{2,3}",       true,  "aaaa",         0,  0,  3, -1 },
+    { "a{2}b",        true,  "aaab",         0,  1,  4, -1 },
+    { "(ab|a)(c|bcd)", true, "xabcd",        0,  1,  5, -1 },
+    { "[]x]",         true,  "ab]",          0,  2,  3, -1 },
+    { "a.c",          true,  "a c abc",      1,  4,  7,  0 },
+    { "\\.",          true,  "a.b",          0,  1,  2, -1 },
+    { "colou?r",      false, "the COLOR",    0,  4,  9, -1 },
+  };
+  int i;
+  for (i = 0; i < (int)(sizeof(cases)/sizeof(cases[0])); i++) {
+    struct rx_t* rx;
+    const char* s = cases[i].text;
+    int n = strlen(s);
+    POE_ERR err = rx_compile(&rx, cases[i].pat, strlen(cases[i].pat), cases[i].exact);
+    if (err != POE_ERR_OK) {
+      failtest("%s didn't compile", cases[i].pat);
+      continue;
+    }
+    int end = -1;
+    int start = rx_find(rx, s, n, cases[i].from, &end);
+    if (start != cases[i].start || (start >= 0 && end != cases[i].end))
+      failtest("%s in \"%s\" from %d: %d-%d, expected %d-%d", cases[i].pat, s, cases[i].from,
+               start, end, cases[i].start, cases[i].end);
+    start = rx_rfind(rx, s, n, cases[i].from, &end);
+    if (start != cases[i].rstart)
+      failtest("%s in \"%s\" before %d: %d, expected %d", cases[i].pat, s, cases[i].from,
+               start, cases[i].rstart);
+    rx_free(rx);
+  }
+  TRACE_EXIT;
+}
+
+
+// capture groups
+void test_rx_2()
+{
+  TRACE_ENTER;
+  struct rx_t* rx;
+  const char* s = "set width=120 height=4";
+  int n = strlen(s);
+  int caps[2*(RX_MAXGROUPS+1)];
+  rx_compile(&rx, "(\\w+)=(\\d+)", 11, true);
+  if (rx_ngroups(rx) != 2)
+    failtest("%d groups, expected 2", rx_ngroups(rx));
+  int end, start = rx_find(rx, s, n, 0, &end);
+  if (start != 4 || end != 13)
+    failtest("match at %d-%d, expected 4-13", start, end);
+  else if (!rx_captures(rx, s, n, start, end, caps))
+    failtest("no captures");
+  else if (caps[2] != 4 || caps[3] != 9 || caps[4] != 10 || caps[5] != 13)
+    failtest("groups %d-%d %d-%d", caps[2], caps[3], caps[4], caps[5]);
+  start = rx_find(rx, s, n, end, &end);
+  if (start != 14 || end != 22)
+    failtest("second match at %d-%d, expected 14-22", start, end);
+  rx_free(rx);
+
+  // a group that takes no part in the match
+  s = "ac";
+  rx_compile(&rx, "a(b)?(c)", 8, true);
+  start = rx_find(rx, s, 2, 0, &end);
+  if (start != 0 || !rx_captures(rx, s, 2, start, end, caps))
+    failtest("a(b)?(c) didn't match");
+  else if (caps[2] != -1 || caps[4] != 1 || caps[5] != 2)
+    failtest("groups %d-%d %d-%d", caps[2], caps[3], caps[4], caps[5]);
+  rx_free(rx);
+  TRACE_EXIT;
+}
+
+
+// bad patterns, and patterns that would take a backtracking matcher
+// forever
+void test_rx_3()
+{
+  TRACE_ENTER;
+  const char* bad[] = { "(ab", "ab)", "*a", "a|+", "[abc", "a{3,2}", "x{2000}" };
+  int i;
+  struct rx_t* rx;
+  for (i = 0; i < (int)(sizeof(bad)/sizeof(bad[0])); i++) {
+    if (rx_compile(&rx, bad[i], strlen(bad[i]), true) != POE_ERR_BAD_REGEX) {
+      failtest("%s compiled", bad[i]);
+      rx_free(rx);
+    }
+  }
+
+  int n = 200000;
+  char* s = malloc(n);
+  memset(s, 'a', n);
+  const char* slow[] = { "(a*)*b", "(a|aa)*c", "(a+)+$x", "(.*)(.*)(.*)(.*)z" };
+  for (i = 0; i < (int)(sizeof(slow)/sizeof(slow[0])); i++) {
+    int end;
+    rx_compile(&rx, slow[i], strlen(slow[i]), true);
+    if (rx_find(rx, s, n, 0, &end) != -1)
+      failtest("%s matched", slow[i]);
+    rx_free(rx);
+  }
+
+  // captures over a long match
+  int caps[2*(RX_MAXGROUPS+1)];
+  rx_compile(&rx, "(a*)(a*)", 8, true);
+  int end, start = rx_find(rx, s, n, 0, &end);
+  if (start != 0 || end != n)
+    failtest("(a*)(a*) matched %d-%d", start, end);
+  else if (!rx_captures(rx, s, n, start, end, caps) || caps[3] != n || caps[4] != n)
+    failtest("groups %d-%d %d-%d", caps[2], caps[3], caps[4], caps[5]);
+  rx_free(rx);
+  free(s);
+  TRACE_EXIT;
+}
+
+
+// finding every match in a line at once gives the same matches as
+// finding them one after another, and doesn't rescan the line for
+// each one
+void test_rx_4()
+{
+  TRACE_ENTER;
+  const char* pats[] = { "a", "a*", "x*", "ab|b", "^a", "a$", "[ab]+", "(a|ab)(c|bcd)", "\\w+", "" };
+  const char* texts[] = { "", "a", "abcabcd", "baab aab  ab", "aaaa", "xyz", "abcdabcbcd ab a" };
+  struct vec_t matches;
+  vec_init(&matches, 16, sizeof(struct rxmatch_t));
+  int i, j, from;
+  for (i = 0; i < (int)(sizeof(pats)/sizeof(pats[0])); i++) {
+    struct rx_t* rx;
+    if (rx_compile(&rx, pats[i], strlen(pats[i]), true) != POE_ERR_OK)
+      failtest("%s didn't compile", pats[i]);
+    for (j = 0; j < (int)(sizeof(texts)/sizeof(texts[0])); j++) {
+      const char* s = texts[j];
+      int n = strlen(s);
+      for (from = 0; from <= n+1; from++) {
+        vec_clear(&matches);
+        // something already there has to be left alone
+        struct rxmatch_t before = { -5, -5 };
+        vec_append(&matches, &before);
+        int nfound = rx_find_all(rx, s, n, from, &matches);
+        const struct rxmatch_t* m = vec_getbufptr(&matches);
+        if (nfound != vec_count(&matches) - 1 || m[0].start != -5)
+          failtest("%s in '%s' from %d: found %d, vec has %d", pats[i], s, from, nfound, vec_count(&matches));
+        int k = 1, at = from, start, end;
+        while (at <= n && (start = rx_find(rx, s, n, at, &end)) >= 0) {
+          if (k > nfound || m[k].start != start || m[k].end != end)
+            failtest("%s in '%s' from %d: match %d should be %d-%d", pats[i], s, from, k, start, end);
+          k++;
+          at = max(end, start+1);
+        }
+        if (k != nfound + 1)
+          failtest("%s in '%s' from %d: %d matches, expected %d", pats[i], s, from, nfound, k-1);
+      }
+    }
+    rx_free(rx);
+  }
+
+  // a long line full of matches
+  int n = 500000;
+  char* s = malloc(n);
+  memset(s, 'a', n);
+  struct rx_t* rx;
+  rx_compile(&rx, "a", 1, true);
+  vec_clear(&matches);
+  if (rx_find_all(rx, s, n, 0, &matches) != n)
+    failtest("found %d of %d matches", vec_count(&matches), n);
+  rx_free(rx);
+  free(s);
+  vec_destroy(&matches);
+  TRACE_EXIT;
+}
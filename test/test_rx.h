@@ -0,0 +1,5 @@
+
+void test_rx_1(void);
+void test_rx_2(void);
+void test_rx_3(void);
+void test_rx_4(void);
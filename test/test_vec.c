@@ -511,3 +511,25 @@ void test_vec_9()
   vec_destroy(&v);
 }
 
+
+
+void test_vec_10()
+{
+  struct vec_t* v = vec_alloc(2, sizeof(struct XXX));
+  if (vec_capacity(v) != 2) {
+	failtest("capacity %d != 2", vec_capacity(v));
+  }
+
+  struct XXX a[3] = {{1}, {2}, {3}};
+  int i;
+  for (i = 0; i < 3; i++)
+	vec_append(v, &a[i]);
+  for (i = 0; i < 3; i++) {
+	struct XXX* b = (struct XXX*)vec_get(v, i);
+	if (b->i != a[i].i) {
+	  failtest("vec[%d] %d != %d", i, b->i, a[i].i);
+	}
+  }
+
+  vec_free(v);
+}
@@ -18,5 +18,6 @@ void test_vec_6(void);
 void test_vec_7(void);
 void test_vec_8(void);
 void test_vec_9(void);
+void test_vec_10(void);
 
 